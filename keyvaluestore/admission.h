@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/*
+ * Admission control for one class of requests (Gets or writes)
+ *
+ * A request is rejected right away if maxInFlight requests of its class are
+ * already being served. Requests that have to queue are also rejected once
+ * the queue stands, the way CoDel decides to drop: the delay of the queue
+ * they would join (how long its head has waited) is checked on admission,
+ * and after it has stayed above target for a whole interval, requests are
+ * rejected until it is below target again. A burst that drains within the
+ * interval gets through; a standing queue is kept to about what arrives
+ * within target plus an interval instead of growing until every client's
+ * latency collapses. Rejected requests never join the queue, so it drains at
+ * the rate the server can serve.
+ */
+class AdmissionController {
+public:
+    // 0 for maxInFlight or targetUs turns that check off
+    AdmissionController(size_t maxInFlight, uint64_t targetUs, uint64_t intervalMs = 100)
+        : maxInFlight(maxInFlight), target(targetUs * 1000), interval(intervalMs * 1000000) {}
+
+    /*
+     * Admit a request that would join a queue whose head has waited
+     * queueDelayNs; false if it has to be rejected, otherwise release() has
+     * to follow once it is done
+     */
+    bool admit(uint64_t queueDelayNs = 0) {
+        if (maxInFlight > 0 &&
+                inFlight.fetch_add(1, std::memory_order_relaxed) >= maxInFlight) {
+            inFlight.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (standing(queueDelayNs)) {
+            if (maxInFlight > 0) {
+                inFlight.fetch_sub(1, std::memory_order_relaxed);
+            }
+            return false;
+        }
+        return true;
+    }
+
+    void release() {
+        if (maxInFlight > 0) {
+            inFlight.fetch_sub(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Only counted with a bound on them
+    size_t requestsInFlight() const {
+        return inFlight.load(std::memory_order_relaxed);
+    }
+
+    // Whether requests are being rejected for the queue's delay
+    bool overloaded() const {
+        uint64_t above = firstAbove.load(std::memory_order_relaxed);
+        return above != 0 && now() >= above;
+    }
+
+private:
+    size_t maxInFlight;
+    // in ns
+    uint64_t target;
+    uint64_t interval;
+
+    std::atomic<size_t> inFlight{0};
+    // now() at which a delay that has been above target since then makes
+    // the queue a standing one, 0 while it is below target
+    std::atomic<uint64_t> firstAbove{0};
+
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Whether a queue delay of delayNs is part of a standing queue
+    bool standing(uint64_t delayNs) {
+        if (target == 0) {
+            return false;
+        }
+        uint64_t above = firstAbove.load(std::memory_order_relaxed);
+        if (delayNs < target) {
+            if (above != 0) {
+                firstAbove.store(0, std::memory_order_relaxed);
+            }
+            return false;
+        }
+        uint64_t t = now();
+        if (above == 0) {
+            firstAbove.compare_exchange_strong(above, t + interval, std::memory_order_relaxed);
+            return false;
+        }
+        return t >= above;
+    }
+};
@@ -0,0 +1,215 @@
+#include <chrono>
+#include <cstdlib>
+#include <experimental/filesystem>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unistd.h> // getopt
+#include <vector>
+
+#include "crc32c.h"
+#include "logstorage.h"
+
+using namespace std;
+
+/*
+ * Measures what the per-record CRC32C costs on the append path
+ * Reports the raw CRC32C speed (CRC instruction and table fallback) and then
+ * appends num_records records with LogStorage::write, syncing every
+ * records_per_sync records, next to a writer that appends the same bytes in
+ * the legacy layout without a checksum. Best of runs.
+ */
+
+struct ConfigOptions {
+    uint64_t num_records = 1000000;
+    int key_size = 128;
+    int value_size = 512;
+    // 0 syncs once at the end
+    int records_per_sync = 128;
+    int runs = 3;
+    string dir = "/tmp/append_bench";
+};
+
+void PrintUsage () {
+    cerr << "Usage: ./append_bench [-n num_records=1000000] [-k key_size=128] "
+        << "[-v val_size=512] [-b records_per_sync=128] [-r runs=3] "
+        << "[-d dir=/tmp/append_bench]" << endl;
+}
+
+void GeneratePaddedStr(string& s, uint64_t i, int padding) {
+    string i_str = to_string(i);
+    s.clear();
+    if ((int) i_str.size() < padding) {
+        s.append(padding-i_str.size(), '0');
+    }
+    s.append(i_str.data(), i_str.size());
+}
+
+bool GetInputArgs(int argc, char **argv, ConfigOptions& options) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:k:v:b:r:d:")) != -1) {
+        switch (opt) {
+            case 'n':
+                options.num_records = atoll(optarg);
+                break;
+            case 'k':
+                options.key_size = atoi(optarg);
+                break;
+            case 'v':
+                options.value_size = atoi(optarg);
+                break;
+            case 'b':
+                options.records_per_sync = atoi(optarg);
+                break;
+            case 'r':
+                options.runs = atoi(optarg);
+                break;
+            case 'd':
+                options.dir = string(optarg);
+                break;
+            default:
+                PrintUsage();
+                return false;
+        }
+    }
+    return options.num_records > 0 && options.runs > 0;
+}
+
+// Appends records the way LogStorage did before records had a checksum
+class LegacyWriter {
+private:
+    ofstream out;
+    int syncFd;
+
+public:
+    LegacyWriter(const string& path)
+        : out(path, ofstream::out | ofstream::app | ofstream::binary) {
+        syncFd = open(path.c_str(), O_WRONLY | O_APPEND);
+    }
+
+    ~LegacyWriter() {
+        close(syncFd);
+    }
+
+    bool write(const string& key, const string& value) {
+        size_t keySize = key.size();
+        size_t valueSize = value.size();
+        out.write((char *)(&keySize), sizeof(size_t));
+        out.write((char *)(&valueSize), sizeof(size_t));
+        out.write(key.data(), keySize);
+        out.write(value.data(), valueSize);
+        return out.good();
+    }
+
+    bool sync() {
+        return out.flush() && fdatasync(syncFd) == 0;
+    }
+};
+
+// GB/s of fn over record-sized buffers
+template <class F>
+double MeasureCrc(const ConfigOptions& options, F fn) {
+    string record(LogFormat::kRecordHeaderSize + options.key_size + options.value_size, 'x');
+    uint64_t bytes = 0;
+    uint32_t crc = 0;
+    auto start = chrono::steady_clock::now();
+    double secs = 0;
+    while (secs < 0.5) {
+        for (int i = 0; i < 10000; i++) {
+            record[i % record.size()] = (char) crc;
+            crc = fn(record.data(), record.size());
+        }
+        bytes += 10000 * record.size();
+        secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+    // keep the compiler from dropping the loop: crc counts as used
+    asm volatile("" : : "r"(crc));
+    return bytes / 1e9 / secs;
+}
+
+// Seconds to append all records with writer
+template <class W>
+double Append(const ConfigOptions& options, W& writer) {
+    string key, value;
+    auto start = chrono::steady_clock::now();
+    for (uint64_t i = 0; i < options.num_records; i++) {
+        GeneratePaddedStr(key, i, options.key_size);
+        GeneratePaddedStr(value, i, options.value_size);
+        if (!writer.write(key, value)) {
+            cerr << "Write failed!" << endl;
+            exit(1);
+        }
+        if (options.records_per_sync > 0 &&
+                i % options.records_per_sync == (uint64_t) options.records_per_sync - 1) {
+            writer.sync();
+        }
+    }
+    writer.sync();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// LogStorage::write with the signature Append expects
+struct LogWriter {
+    LogStorage log;
+    value_location loc;
+
+    LogWriter(const string& path) : log(path, 1ULL << 40) {}
+
+    bool write(const string& key, const string& value) {
+        return log.write(key, value, loc);
+    }
+
+    bool sync() {
+        return log.sync();
+    }
+};
+
+int main (int argc, char **argv)
+{
+    ConfigOptions options;
+    if (!GetInputArgs(argc, argv, options)) {
+        PrintUsage();
+        return 1;
+    }
+
+    cout << "CRC32C over " << LogFormat::kRecordHeaderSize + options.key_size +
+            options.value_size << " byte records:" << endl;
+    if (Crc32c::hardware()) {
+        cout << "Hardware: " << MeasureCrc(options, Crc32c::value) << " GB/s" << endl;
+    } else {
+        cout << "Hardware: not supported by this CPU" << endl;
+    }
+    cout << "Software: " << MeasureCrc(options, [](const char* data, size_t n) {
+        return Crc32c::extendSoftware(0, data, n);
+    }) << " GB/s" << endl;
+
+    namespace fs = std::experimental::filesystem;
+    double best_legacy = 1e30, best_log = 1e30;
+    for (int run = 0; run < options.runs; run++) {
+        fs::remove_all(options.dir);
+        fs::create_directories(options.dir);
+        {
+            LegacyWriter writer(options.dir + "/legacy");
+            best_legacy = min(best_legacy, Append(options, writer));
+        }
+        {
+            LogWriter writer(options.dir + "/log");
+            best_log = min(best_log, Append(options, writer));
+        }
+    }
+    fs::remove_all(options.dir);
+
+    double mb = options.num_records *
+                LogStorage::recordSize(options.key_size, options.value_size) / 1e6;
+    cout << "Append of " << options.num_records << " records, "
+         << (options.records_per_sync > 0 ? "sync every " +
+             to_string(options.records_per_sync) + " records" : string("one sync"))
+         << ", best of " << options.runs << " runs:" << endl;
+    cout << "No checksum: " << mb / best_legacy << " MB/s, "
+         << options.num_records / best_legacy << " records/s" << endl;
+    cout << "CRC32C:      " << mb / best_log << " MB/s, "
+         << options.num_records / best_log << " records/s" << endl;
+    cout << "Overhead: " << (best_log / best_legacy - 1) * 100 << "%" << endl;
+    return 0;
+}
@@ -0,0 +1,582 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.h"
+#include "crc32c.h"
+#include "groupcommit.h"
+#include "keyindex.h"
+#include "logstorage.h"
+#include "tbb/blocked_range.h"
+#include "tbb/concurrent_hash_map.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+
+/*
+ * Periodic checkpoints of kv_store so that startup only replays the log tail
+ *
+ * A checkpoint is cut at a segment boundary: the active segment is sealed on
+ * the writer thread, so every record in segments before the cut seq is
+ * reflected in the map and every later Set goes to a segment at or after the
+ * cut. Sets continue while the key index is walked; the checkpoint holds the
+ * entries whose record lies before the cut and keys written after the cut are
+ * restored by replaying the log from the cut.
+ *
+ * With values in memory the checkpoint stores the values and the segments
+ * before the cut are deleted. With values on disk it stores where each value
+ * lives (seq, generation, offset), the log stays the home of the values and
+ * compaction keeps reclaiming it; a checkpoint that refers to a generation
+ * that has since been compacted is ignored on startup.
+ *
+ * File layout of <log path>.checkpoint.<cut seq>:
+ *   header: magic, format, cut seq, number of entries
+ *   blocks: entries sorted by key; an entry is keySize (u32), valueSize (u32),
+ *           the value's record flags (u32), its expiry time (u64, only with
+ *           LogFormat::kExpires), its version (u64, only with
+ *           LogFormat::kVersioned), the key and either the value or the
+ *           value's seq, gen and offset
+ *   footer: referenced segments (seq, gen), block offsets, the CRC32C of
+ *           each block (u32), counts, magic
+ * Blocks are loaded in parallel. A file with a block that fails its checksum
+ * or holds entries that do not exactly fill it is not used. Checkpoints from
+ * before values had flags (magic KVCKPT1) have no flags field and are still
+ * loaded, as are those from before expiry (KVCKPT2), which have no expiring
+ * entries, those from before versions (KVCKPT3) and those from before block
+ * checksums (KVCKPT4), which are only checked for their structure.
+ */
+class Checkpointer {
+public:
+    typedef tbb::concurrent_hash_map<std::string, kv_pair> hashtable;
+
+private:
+    enum Format : uint32_t {
+        kValues = 0,
+        kLocations = 1,
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t format;
+        uint32_t reserved;
+        uint64_t cutSeq;
+        uint64_t numEntries;
+    };
+
+    struct Trailer {
+        uint64_t numSegments;
+        uint64_t numBlocks;
+        uint64_t numEntries;
+        char magic[8];
+    };
+
+    struct SegmentRef {
+        uint64_t seq;
+        uint64_t gen;
+    };
+
+    // KVCKPT<version>
+    static constexpr const char* kHeaderMagic = "KVCKPT5";
+    static const size_t kMagicPrefixSize = 6;
+    static const char kOldestVersion = '1';
+    // first version with block checksums in the footer
+    static const char kChecksumVersion = '5';
+    static constexpr const char* kTrailerMagic = "KVCKEND";
+    static const uint64_t kBlockSize = 1 << 20;
+
+    LogStorage& log;
+    GroupCommitLog& groupCommit;
+    hashtable& kvStore;
+    const KeyIndex& keyIndex;
+    bool valuesOnDisk;
+    uint64_t everyBytes;
+    uint64_t lastBytesWritten = 0;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::thread checkpointThread;
+
+    std::atomic<uint64_t> numCheckpoints{0};
+    std::atomic<uint64_t> lastEntries{0};
+    std::atomic<uint64_t> lastMillis{0};
+
+    static std::string checkpointPath(const std::string& logFile, uint64_t seq) {
+        std::ostringstream os;
+        os << logFile << ".checkpoint." << std::setw(6) << std::setfill('0') << seq;
+        return os.str();
+    }
+
+    // Checkpoints of logFile, newest first
+    static std::vector<std::pair<uint64_t, std::string>> listCheckpoints(
+            const std::string& logFile) {
+        namespace fs = std::experimental::filesystem;
+        fs::path logPath(logFile);
+        std::string prefix = logPath.filename().string() + ".checkpoint.";
+        auto dir = logPath.parent_path().empty() ? fs::path(".") : logPath.parent_path();
+
+        std::vector<std::pair<uint64_t, std::string>> result;
+        for (auto& entry : fs::directory_iterator(dir)) {
+            std::string name = entry.path().filename().string();
+            if (name.compare(0, prefix.size(), prefix) != 0) {
+                continue;
+            }
+            std::string suffix = name.substr(prefix.size());
+            if (suffix.empty() ||
+                    suffix.find_first_not_of("0123456789") != std::string::npos) {
+                // e.g. a checkpoint that was being written when we crashed
+                fs::remove(entry.path());
+                continue;
+            }
+            result.push_back({std::stoull(suffix), entry.path().string()});
+        }
+        std::sort(result.rbegin(), result.rend());
+        return result;
+    }
+
+    template <typename T>
+    static void put(std::ofstream& out, const T& v) {
+        out.write((const char*) &v, sizeof(T));
+    }
+
+    template <typename T>
+    static void append(std::string& s, const T& v) {
+        s.append((const char*) &v, sizeof(T));
+    }
+
+    template <typename T>
+    static T get(const char* p) {
+        T v;
+        memcpy(&v, p, sizeof(T));
+        return v;
+    }
+
+    bool writeCheckpoint() {
+        std::lock_guard<std::mutex> maintenance(log.maintenanceMutex());
+        auto startTime = std::chrono::steady_clock::now();
+
+        uint64_t cutSeq = 0;
+        groupCommit.runExclusive([&] { cutSeq = log.sealActive(); });
+
+        std::string path = checkpointPath(log.path(), cutSeq);
+        std::string tmpPath = path + ".tmp";
+        std::ofstream out(tmpPath, std::ofstream::out | std::ofstream::binary
+                                   | std::ofstream::trunc);
+        Header header = {};
+        strncpy(header.magic, kHeaderMagic, sizeof(header.magic));
+        header.format = valuesOnDisk ? kLocations : kValues;
+        header.cutSeq = cutSeq;
+        put(out, header);
+
+        std::vector<uint64_t> blocks;
+        std::vector<uint32_t> blockCrcs;
+        std::map<uint64_t, uint64_t> segmentGens;
+        uint64_t offset = sizeof(Header);
+        uint64_t blockBegin = offset;
+        uint32_t blockCrc = 0;
+        uint64_t numEntries = 0;
+        std::string value;
+        std::string entry;
+        blocks.push_back(offset);
+
+        KeyIndex::Cursor cursor(keyIndex);
+        std::string key;
+        while (cursor.next(key)) {
+            value_location loc;
+            {
+                hashtable::const_accessor a;
+                if (!kvStore.find(a, key) || expired(a->second.loc)) {
+                    continue;
+                }
+                loc = a->second.loc;
+                if (!valuesOnDisk) {
+                    value = a->second.value;
+                }
+            }
+            // Records at or after the cut are replayed from the log anyway
+            auto segment = loc.segment == kNoSegment ? nullptr : log.findSegment(loc.segment);
+            if (segment && segment->seq >= cutSeq) {
+                continue;
+            }
+            if (valuesOnDisk && !segment) {
+                continue;
+            }
+
+            if (offset - blockBegin >= kBlockSize) {
+                blockBegin = offset;
+                blocks.push_back(offset);
+                blockCrcs.push_back(blockCrc);
+                blockCrc = 0;
+            }
+            entry.clear();
+            append(entry, (uint32_t) key.size());
+            append(entry, (uint32_t) loc.length);
+            append(entry, loc.flags);
+            if (loc.flags & LogFormat::kExpires) {
+                append(entry, loc.expiresAt);
+            }
+            if (loc.flags & LogFormat::kVersioned) {
+                append(entry, loc.version);
+            }
+            entry.append(key);
+            if (valuesOnDisk) {
+                append(entry, segment->seq);
+                append(entry, segment->gen);
+                append(entry, loc.offset);
+                segmentGens[segment->seq] = segment->gen;
+            }
+            out.write(entry.data(), entry.size());
+            blockCrc = Crc32c::extend(blockCrc, entry.data(), entry.size());
+            offset += entry.size();
+            if (!valuesOnDisk) {
+                out.write(value.data(), value.size());
+                blockCrc = Crc32c::extend(blockCrc, value.data(), value.size());
+                offset += value.size();
+            }
+            numEntries++;
+        }
+        blockCrcs.push_back(blockCrc);
+
+        for (auto& g : segmentGens) {
+            put(out, SegmentRef{g.first, g.second});
+        }
+        for (auto b : blocks) {
+            put(out, b);
+        }
+        for (auto crc : blockCrcs) {
+            put(out, crc);
+        }
+        Trailer trailer = {};
+        trailer.numSegments = segmentGens.size();
+        trailer.numBlocks = blocks.size();
+        trailer.numEntries = numEntries;
+        strncpy(trailer.magic, kTrailerMagic, sizeof(trailer.magic));
+        put(out, trailer);
+        header.numEntries = numEntries;
+        out.seekp(0);
+        put(out, header);
+        out.flush();
+
+        int fd = open(tmpPath.c_str(), O_WRONLY);
+        bool ok = out.good() && fd >= 0 && fdatasync(fd) == 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+        out.close();
+        if (!ok) {
+            std::cerr << "[checkpoint] Writing " << path << " failed\n";
+            std::experimental::filesystem::remove(tmpPath);
+            return false;
+        }
+        std::experimental::filesystem::rename(tmpPath, path);
+        LogStorage::syncDir(path);
+        log.setCheckpointSeq(cutSeq);
+
+        // The new checkpoint supersedes older ones and, with values in memory,
+        // the log before the cut
+        for (auto& c : listCheckpoints(log.path())) {
+            if (c.first < cutSeq) {
+                std::experimental::filesystem::remove(c.second);
+            }
+        }
+        if (!valuesOnDisk) {
+            log.dropSegmentsBefore(cutSeq);
+        }
+
+        auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - startTime).count();
+        numCheckpoints++;
+        lastEntries = numEntries;
+        lastMillis = millis;
+        std::cout << "[checkpoint] Wrote " << numEntries << " entries to " << path
+                  << " in " << millis << " ms" << std::endl;
+        return true;
+    }
+
+    void run() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                cv.wait_for(lk, std::chrono::seconds(1), [this] { return stopping; });
+                if (stopping) {
+                    return;
+                }
+            }
+            uint64_t written = log.bytesWritten();
+            if (written - lastBytesWritten >= everyBytes) {
+                lastBytesWritten = written;
+                writeCheckpoint();
+            }
+        }
+    }
+
+    /*
+     * Load one checkpoint file into kvStore
+     * Returns false, leaving kvStore empty, if it is incomplete, corrupt or
+     * cannot be used with the current log and storage mode
+     */
+    static bool loadFile(const std::string& path, LogStorage& log,
+                         hashtable& kvStore, bool valuesOnDisk) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        uint64_t size = std::experimental::filesystem::file_size(path);
+        if (size < sizeof(Header) + sizeof(Trailer)) {
+            close(fd);
+            return false;
+        }
+        void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        madvise(p, size, MADV_WILLNEED);
+        const char* data = (const char*) p;
+        std::unique_ptr<void, std::function<void(void*)>> unmap(
+                p, [size](void* p) { munmap(p, size); });
+
+        Header header = get<Header>(data);
+        Trailer trailer = get<Trailer>(data + size - sizeof(Trailer));
+        char version = header.magic[kMagicPrefixSize];
+        bool hasFlags = version > kOldestVersion;
+        bool hasChecksums = version >= kChecksumVersion;
+        // Bounds the counts, so that the footer size cannot overflow
+        bool countsFit = trailer.numSegments < size && trailer.numBlocks < size;
+        uint64_t footerSize = !countsFit ? size :
+                sizeof(Trailer) + trailer.numSegments * sizeof(SegmentRef) +
+                trailer.numBlocks * (sizeof(uint64_t) + (hasChecksums ? sizeof(uint32_t) : 0));
+        if (strncmp(header.magic, kHeaderMagic, kMagicPrefixSize) != 0 ||
+                version < kOldestVersion || version > kHeaderMagic[kMagicPrefixSize] ||
+                header.magic[kMagicPrefixSize + 1] != '\0' ||
+                strncmp(trailer.magic, kTrailerMagic, sizeof(trailer.magic)) != 0 ||
+                header.numEntries != trailer.numEntries ||
+                footerSize > size - sizeof(Header)) {
+            std::cerr << "[checkpoint] " << path << " is incomplete\n";
+            return false;
+        }
+        if (header.format != (valuesOnDisk ? kLocations : kValues)) {
+            std::cerr << "[checkpoint] " << path << " was written in the other "
+                      << "storage mode\n";
+            return false;
+        }
+
+        const char* footer = data + size - footerSize;
+        uint64_t dataEnd = size - footerSize;
+
+        // Every segment the checkpoint points into must still be the same file
+        std::vector<std::shared_ptr<LogSegment>> segments;
+        for (uint64_t i = 0; i < trailer.numSegments; i++) {
+            SegmentRef ref = get<SegmentRef>(footer + i * sizeof(SegmentRef));
+            if (!segments.empty() && ref.seq <= segments.back()->seq) {
+                std::cerr << "[checkpoint] " << path << " is corrupt\n";
+                return false;
+            }
+            auto segment = log.findSegmentBySeq(ref.seq);
+            if (!segment || segment->gen != ref.gen) {
+                std::cerr << "[checkpoint] " << path << " refers to a log segment "
+                          << "that has since been compacted\n";
+                return false;
+            }
+            segments.push_back(segment);
+        }
+        const char* footerBlocks = footer + trailer.numSegments * sizeof(SegmentRef);
+        std::vector<uint64_t> blocks(trailer.numBlocks);
+        memcpy(blocks.data(), footerBlocks, trailer.numBlocks * sizeof(uint64_t));
+        std::vector<uint32_t> checksums(hasChecksums ? trailer.numBlocks : 0);
+        memcpy(checksums.data(), footerBlocks + trailer.numBlocks * sizeof(uint64_t),
+               checksums.size() * sizeof(uint32_t));
+        blocks.push_back(dataEnd);
+        // The blocks have to split up everything between header and footer
+        bool blocksFit = trailer.numBlocks > 0 ? blocks[0] >= sizeof(Header) :
+                                                 dataEnd == sizeof(Header);
+        for (uint64_t b = 0; b < trailer.numBlocks; b++) {
+            blocksFit = blocksFit && blocks[b] <= blocks[b + 1];
+        }
+        if (!blocksFit) {
+            std::cerr << "[checkpoint] " << path << " is corrupt\n";
+            return false;
+        }
+
+        // Decodes the entries of block b into kvStore; false if one of them
+        // does not fit into the block or points into no referenced segment
+        auto loadBlock = [&](size_t b, std::vector<int64_t>& live, uint64_t& maxVersion,
+                             uint64_t& numEntries) {
+            const char* q = data + blocks[b];
+            const char* end = data + blocks[b + 1];
+            if (hasChecksums && Crc32c::value(q, end - q) != checksums[b]) {
+                return false;
+            }
+            while (q < end) {
+                uint64_t fixedSize = 2*sizeof(uint32_t) + (hasFlags ? sizeof(uint32_t) : 0);
+                if ((uint64_t) (end - q) < fixedSize) {
+                    return false;
+                }
+                uint32_t keySize = get<uint32_t>(q);
+                uint32_t valueSize = get<uint32_t>(q + sizeof(uint32_t));
+                uint32_t flags = hasFlags ? get<uint32_t>(q + 2*sizeof(uint32_t)) : 0;
+                q += fixedSize;
+                uint64_t restSize = (flags & LogFormat::kExpires ? sizeof(uint64_t) : 0) +
+                                    (flags & LogFormat::kVersioned ? sizeof(uint64_t) : 0) +
+                                    keySize + (valuesOnDisk ? 3*sizeof(uint64_t) : valueSize);
+                if ((uint64_t) (end - q) < restSize) {
+                    return false;
+                }
+                uint64_t expiresAt = 0;
+                if (flags & LogFormat::kExpires) {
+                    expiresAt = get<uint64_t>(q);
+                    q += sizeof(uint64_t);
+                }
+                uint64_t version = 0;
+                if (flags & LogFormat::kVersioned) {
+                    version = get<uint64_t>(q);
+                    q += sizeof(uint64_t);
+                    maxVersion = std::max(maxVersion, version);
+                }
+
+                const char* key = q;
+                q += keySize;
+                if (valuesOnDisk) {
+                    uint64_t seq = get<uint64_t>(q);
+                    uint64_t offset = get<uint64_t>(q + 2*sizeof(uint64_t));
+                    q += 3*sizeof(uint64_t);
+                    // segments are sorted by seq
+                    size_t i = std::lower_bound(segments.begin(), segments.end(), seq,
+                            [](const std::shared_ptr<LogSegment>& s, uint64_t seq) {
+                                return s->seq < seq;
+                            }) - segments.begin();
+                    if (i == segments.size() || segments[i]->seq != seq ||
+                            offset + valueSize > segments[i]->size) {
+                        return false;
+                    }
+                    hashtable::accessor a;
+                    kvStore.insert(a, std::string(key, keySize));
+                    a->second.loc = {segments[i]->id, offset, valueSize, flags, expiresAt,
+                                     version};
+                    live[i] += LogStorage::recordSize(keySize, valueSize, flags);
+                } else {
+                    hashtable::accessor a;
+                    kvStore.insert(a, std::string(key, keySize));
+                    a->second.value.assign(q, valueSize);
+                    a->second.loc = {kNoSegment, 0, valueSize, flags, expiresAt, version};
+                    q += valueSize;
+                }
+                numEntries++;
+            }
+            return true;
+        };
+
+        kvStore.rehash(header.numEntries);
+        tbb::enumerable_thread_specific<std::vector<int64_t>> liveBytes(
+                std::vector<int64_t>(segments.size(), 0));
+        tbb::enumerable_thread_specific<uint64_t> maxVersions(0);
+        tbb::enumerable_thread_specific<uint64_t> entryCounts(0);
+        std::atomic<bool> ok{true};
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, trailer.numBlocks, 1),
+                [&](const tbb::blocked_range<size_t>& range) {
+            for (size_t b = range.begin(); b != range.end() && ok; b++) {
+                if (!loadBlock(b, liveBytes.local(), maxVersions.local(),
+                               entryCounts.local())) {
+                    ok = false;
+                }
+            }
+        });
+
+        uint64_t numEntries = 0;
+        for (uint64_t n : entryCounts) {
+            numEntries += n;
+        }
+        if (!ok || numEntries != header.numEntries) {
+            // Parts of it may have been loaded already
+            kvStore.clear();
+            std::cerr << "[checkpoint] " << path << " is corrupt\n";
+            return false;
+        }
+        for (size_t i = 0; i < segments.size(); i++) {
+            for (auto& live : liveBytes) {
+                segments[i]->liveBytes += live[i];
+            }
+        }
+        for (uint64_t maxVersion : maxVersions) {
+            log.noteVersion(maxVersion);
+        }
+        return true;
+    }
+
+public:
+    Checkpointer(LogStorage& log, GroupCommitLog& groupCommit, hashtable& kvStore,
+                 const KeyIndex& keyIndex, bool valuesOnDisk, uint64_t everyBytes)
+        : log(log), groupCommit(groupCommit), kvStore(kvStore), keyIndex(keyIndex),
+          valuesOnDisk(valuesOnDisk), everyBytes(everyBytes) {
+        checkpointThread = std::thread(&Checkpointer::run, this);
+    }
+
+    ~Checkpointer() {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            stopping = true;
+        }
+        cv.notify_one();
+        checkpointThread.join();
+    }
+
+    // Write a checkpoint now instead of after everyBytes more of log
+    bool checkpoint() {
+        return writeCheckpoint();
+    }
+
+    /*
+     * Load the newest usable checkpoint of the log into kvStore
+     * Returns the seq from which the log has to be replayed, 0 for all of it
+     */
+    static uint64_t load(LogStorage& log, hashtable& kvStore, bool valuesOnDisk) {
+        auto startTime = std::chrono::steady_clock::now();
+        for (auto& c : listCheckpoints(log.path())) {
+            if (!loadFile(c.second, log, kvStore, valuesOnDisk)) {
+                kvStore.clear();
+                continue;
+            }
+            if (!valuesOnDisk) {
+                // Left over if we crashed right after writing the checkpoint
+                log.dropSegmentsBefore(c.first);
+            }
+            log.setCheckpointSeq(c.first);
+            std::ostringstream os;
+            os << "[checkpoint] Loaded " << kvStore.size() << " entries from "
+               << c.second << " in " << std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - startTime).count()
+               << " ms\n";
+            std::cout << os.str() << std::flush;
+            return c.first;
+        }
+
+        // Without a checkpoint the whole log must still be there
+        auto segments = log.segmentsBySeq();
+        if (!valuesOnDisk && !listCheckpoints(log.path()).empty()) {
+            std::cerr << "[checkpoint] No usable checkpoint, replaying the log "
+                      << "from segment " << segments.front()->seq << std::endl;
+        }
+        return 0;
+    }
+
+    void printStats(std::ostream& os) {
+        os << "[checkpoint] checkpoints: " << numCheckpoints.load()
+           << ", last: " << lastEntries.load() << " entries in "
+           << lastMillis.load() << " ms" << std::endl;
+    }
+};
@@ -18,30 +18,98 @@
 
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <grpcpp/grpcpp.h>
+#include <grpcpp/support/client_interceptor.h>
 
+#include "hashring.h"
 #include "keyvaluestore.grpc.pb.h"
+#include "readcache.h"
+#include "tracing.h"
 
 using ::google::protobuf::Empty;
 using grpc::Channel;
+using grpc::ChannelArguments;
+using grpc::ClientAsyncReader;
+using grpc::ClientAsyncResponseReader;
 using grpc::ClientContext;
 using grpc::ClientReader;
+using grpc::ClientWriter;
+using grpc::CompletionQueue;
 using grpc::Status;
 using keyvaluestore::KeyValueStore;
+using keyvaluestore::BulkLoadChunk;
+using keyvaluestore::BulkLoadSummary;
+using keyvaluestore::CompareAndSetRequest;
+using keyvaluestore::GetResult;
+using keyvaluestore::IncrementRequest;
+using keyvaluestore::Invalidation;
 using keyvaluestore::KVPair;
+using keyvaluestore::MultiGetRequest;
+using keyvaluestore::MultiGetResponse;
+using keyvaluestore::MultiSetRequest;
 using keyvaluestore::Request;
 using keyvaluestore::Response;
+using keyvaluestore::ScanRequest;
+using keyvaluestore::StatsResponse;
+using keyvaluestore::TraceSampling;
+using keyvaluestore::WriteResult;
+
+// RPCs of the calling thread that a server turned away with RESOURCE_EXHAUSTED
+inline uint64_t& ShedCalls() {
+  static thread_local uint64_t calls = 0;
+  return calls;
+}
+
+/*
+ * Print why an RPC failed, from a server if it is named. Calls a server turned
+ * away to shed load are only counted in ShedCalls(): they are expected under
+ * overload, and printing each would only slow the client down further.
+ */
+inline void ReportFailure(const Status& status, const std::string& from = "") {
+  if (status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED) {
+    ShedCalls()++;
+    return;
+  }
+  std::cout << status.error_code() << ": " << status.error_message();
+  if (!from.empty()) {
+    std::cout << " from " << from;
+  }
+  std::cout << std::endl;
+  std::cout << "RPC failed" << std::endl;
+}
 
 class KeyValueStoreClient {
  public:
   KeyValueStoreClient(std::shared_ptr<Channel> channel)
       : stub_(KeyValueStore::NewStub(channel)) {}
 
+  // Value of key, empty if it does not exist
   std::string Get(const std::string& key) {
+    std::string value;
+    Get(key, &value);
+    return value;
+  }
+
+  // false if key does not exist or the RPC failed
+  bool Get(const std::string& key, std::string* value) {
+    if (cache_ && cache_->lookup(key, *value)) {
+      return true;
+    }
+    uint64_t version = cache_ ? cache_->version(key) : 0;
     // Context for the client. It could be used to convey extra information to
     // the server and/or tweak certain RPC behaviors.
     ClientContext context;
@@ -52,34 +120,125 @@ class KeyValueStoreClient {
     Status status = stub_->Get(&context, request, &response);
     if (status.ok()) {
       //std::cout << key << " : " << response.value() << "\n";
-      return response.value();
+      *value = std::move(*response.mutable_value());
+      if (cache_ && response.found()) {
+        cache_->insert(key, *value, version, response.ttl_ms());
+      }
+      return response.found();
     } else {
-      std::cout << status.error_code() << ": " << status.error_message()
-                << std::endl;
-      std::cout << "RPC failed" << std::endl;
-      return std::string();
+      ReportFailure(status);
+      value->clear();
+      return false;
     }
   }
 
-  bool Set(const std::string& key, const std::string& value) {
+  // Like Get, but also returns the value's version and never uses the cache
+  bool Get(const std::string& key, std::string* value, uint64_t* version) {
+    ClientContext context;
+    Request request;
+    request.set_key(key);
+    Response response;
+
+    Status status = stub_->Get(&context, request, &response);
+    if (!status.ok()) {
+      ReportFailure(status);
+      value->clear();
+      return false;
+    }
+    *value = std::move(*response.mutable_value());
+    *version = response.version();
+    return response.found();
+  }
+
+  // With ttl_ms > 0 the pair expires ttl_ms milliseconds from now
+  bool Set(const std::string& key, const std::string& value, uint64_t ttl_ms = 0) {
     // Context for the client. It could be used to convey extra information to
     // the server and/or tweak certain RPC behaviors.
     ClientContext context;
     KVPair request;
     request.set_key(key);
     request.set_value(value);
+    request.set_ttl_ms(ttl_ms);
     Empty response;
 
     Status status = stub_->Set(&context, request, &response);
+    if (cache_) {
+      cache_->invalidate(key);
+    }
     if (status.ok()) {
       //std::cout << key << " inserted successfully.\n";
       return true;
     } else {
-      std::cout << status.error_code() << ": " << status.error_message()
-                << std::endl;
-      std::cout << "RPC failed" << std::endl;
+      ReportFailure(status);
+      return false;
+    }
+  }
+
+  bool Delete(const std::string& key) {
+    ClientContext context;
+    Request request;
+    request.set_key(key);
+    Empty response;
+
+    Status status = stub_->Delete(&context, request, &response);
+    if (cache_) {
+      cache_->invalidate(key);
+    }
+    if (!status.ok()) {
+      ReportFailure(status);
+      return false;
+    }
+    return true;
+  }
+
+  // Values of keys in one round trip; found[i] tells whether keys[i] exists
+  bool MultiGet(const std::vector<std::string>& keys,
+                std::vector<std::string>* values, std::vector<bool>* found) {
+    ClientContext context;
+    MultiGetRequest request;
+    for (const auto& key : keys) {
+      request.add_keys(key);
+    }
+    MultiGetResponse response;
+
+    values->clear();
+    found->clear();
+    Status status = stub_->MultiGet(&context, request, &response);
+    if (!status.ok()) {
+      ReportFailure(status);
       return false;
     }
+    for (auto& result : *response.mutable_results()) {
+      values->push_back(std::move(*result.mutable_value()));
+      found->push_back(result.found());
+    }
+    return true;
+  }
+
+  // Sets all pairs with a single log append and sync on the server
+  bool MultiSet(const std::vector<std::pair<std::string, std::string>>& pairs,
+                uint64_t ttl_ms = 0) {
+    ClientContext context;
+    MultiSetRequest request;
+    for (const auto& p : pairs) {
+      KVPair* pair = request.add_pairs();
+      pair->set_key(p.first);
+      pair->set_value(p.second);
+      pair->set_ttl_ms(ttl_ms);
+    }
+    Empty response;
+
+    Status status = stub_->MultiSet(&context, request, &response);
+    if (cache_) {
+      for (const auto& p : pairs) {
+        cache_->invalidate(p.first);
+      }
+    }
+    if (!status.ok()) {
+      ReportFailure(status);
+      return false;
+    }
+    return true;
   }
 
   std::vector<std::string> GetPrefix(const std::string& prefixKey) {
@@ -101,15 +260,1014 @@ class KeyValueStoreClient {
     if (status.ok()) {
       std::cout << prefixKey << ": Prefix Key. Got the list of all expected values successfully.\n";
     } else {
-      std::cout << status.error_code() << ": " << status.error_message()
-                << std::endl;
-      std::cout << "RPC failed" << std::endl;
+      ReportFailure(status);
     }
 
     return values;
   }
- 
+
+  // Scans [startKey, endKey) in key order, at most limit pairs (0 for all).
+  // resumeToken is set if the scan stopped at limit; passing it back
+  // continues the scan after the last returned key.
+  std::vector<std::pair<std::string, std::string>> Scan(
+      const std::string& startKey, const std::string& endKey, uint32_t limit,
+      std::string* resumeToken) {
+    ClientContext context;
+    ScanRequest request;
+    request.set_start_key(startKey);
+    request.set_end_key(endKey);
+    request.set_limit(limit);
+    request.set_resume_token(*resumeToken);
+    std::unique_ptr<ClientReader<Response> > reader(
+        stub_->Scan(&context, request));
+    Response response;
+
+    std::vector<std::pair<std::string, std::string>> pairs;
+    resumeToken->clear();
+    while (reader->Read(&response)) {
+      pairs.emplace_back(response.key(), response.value());
+      *resumeToken = response.resume_token();
+    }
+    Status status = reader->Finish();
+    if (!status.ok()) {
+      ReportFailure(status);
+      resumeToken->clear();
+    }
+    return pairs;
+  }
+
+  // Server metrics since its startup
+  bool Stats(StatsResponse* response) {
+    ClientContext context;
+    Empty request;
+
+    Status status = stub_->Stats(&context, request, response);
+    if (!status.ok()) {
+      ReportFailure(status);
+      return false;
+    }
+    return true;
+  }
+
+  // Make a follower stop replicating and take writes
+  bool Promote() {
+    ClientContext context;
+    Empty request, response;
+
+    Status status = stub_->Promote(&context, request, &response);
+    if (!status.ok()) {
+      ReportFailure(status);
+      return false;
+    }
+    return true;
+  }
+
+  // Make the server trace one in every sample_every requests (0 for only the
+  // tagged ones); previous, if given, is set to what it traced before
+  bool SetTraceSampling(uint32_t sample_every, uint32_t* previous = nullptr) {
+    ClientContext context;
+    TraceSampling request, response;
+    request.set_sample_every(sample_every);
+
+    Status status = stub_->SetTraceSampling(&context, request, &response);
+    if (!status.ok()) {
+      ReportFailure(status);
+      return false;
+    }
+    if (previous) {
+      *previous = response.sample_every();
+    }
+    return true;
+  }
+
+  /*
+   * Atomic updates, each one round trip and one log record on the server
+   * false if the RPC failed; otherwise result->applied() tells whether the
+   * condition held, and result has the key's version (and its value if the
+   * update was not applied)
+   */
+  // Set key to value if its value is expected
+  bool CompareAndSet(const std::string& key, const std::string& expected,
+                     const std::string& value, WriteResult* result, uint64_t ttl_ms = 0) {
+    CompareAndSetRequest request;
+    request.set_expected_value(expected);
+    return SendCompareAndSet(key, value, ttl_ms, &request, result);
+  }
+
+  // Set key to value if its version is expected_version
+  bool CompareAndSet(const std::string& key, uint64_t expected_version,
+                     const std::string& value, WriteResult* result, uint64_t ttl_ms = 0) {
+    CompareAndSetRequest request;
+    request.set_expected_version(expected_version);
+    return SendCompareAndSet(key, value, ttl_ms, &request, result);
+  }
+
+  // Add delta to the decimal int64 at key; result->counter() is the sum
+  bool Increment(const std::string& key, int64_t delta, WriteResult* result) {
+    IncrementRequest request;
+    request.set_key(key);
+    request.set_delta(delta);
+    return Update(key, result, [this, &request](ClientContext* context, WriteResult* result) {
+      return stub_->Increment(context, request, result);
+    });
+  }
+
+  bool Append(const std::string& key, const std::string& value, WriteResult* result,
+              uint64_t ttl_ms = 0) {
+    KVPair request = MakePair(key, value, ttl_ms);
+    return Update(key, result, [this, &request](ClientContext* context, WriteResult* result) {
+      return stub_->Append(context, request, result);
+    });
+  }
+
+  bool SetIfAbsent(const std::string& key, const std::string& value, WriteResult* result,
+                   uint64_t ttl_ms = 0) {
+    KVPair request = MakePair(key, value, ttl_ms);
+    return Update(key, result, [this, &request](ClientContext* context, WriteResult* result) {
+      return stub_->SetIfAbsent(context, request, result);
+    });
+  }
+
+  /*
+   * Serve Gets from cache, which can be shared by several clients
+   * The client's own writes invalidate their keys; writes of other clients
+   * only do so through a CacheInvalidator or the cache's lease.
+   */
+  void SetCache(std::shared_ptr<ReadCache> cache) {
+    cache_ = cache;
+  }
 
  private:
+  static KVPair MakePair(const std::string& key, const std::string& value, uint64_t ttl_ms) {
+    KVPair pair;
+    pair.set_key(key);
+    pair.set_value(value);
+    pair.set_ttl_ms(ttl_ms);
+    return pair;
+  }
+
+  bool SendCompareAndSet(const std::string& key, const std::string& value, uint64_t ttl_ms,
+                         CompareAndSetRequest* request, WriteResult* result) {
+    request->set_key(key);
+    request->set_value(value);
+    request->set_ttl_ms(ttl_ms);
+    return Update(key, result, [this, request](ClientContext* context, WriteResult* result) {
+      return stub_->CompareAndSet(context, *request, result);
+    });
+  }
+
+  // Run one of the atomic update RPCs
+  template <class Rpc>
+  bool Update(const std::string& key, WriteResult* result, Rpc rpc) {
+    ClientContext context;
+    Status status = rpc(&context, result);
+    if (cache_) {
+      cache_->invalidate(key);
+    }
+    if (!status.ok()) {
+      ReportFailure(status);
+      return false;
+    }
+    return true;
+  }
+
   std::unique_ptr<KeyValueStore::Stub> stub_;
+  std::shared_ptr<ReadCache> cache_;
+};
+
+/*
+ * Keeps a ReadCache coherent with the server's writes
+ * A background thread holds a Subscribe stream open and invalidates the keys
+ * it reports. The cache only takes new entries while the stream is up: it is
+ * cleared and stops accepting them when the stream breaks, and the thread
+ * subscribes again after a short pause.
+ */
+class CacheInvalidator {
+ public:
+  CacheInvalidator(std::shared_ptr<Channel> channel, std::shared_ptr<ReadCache> cache)
+      : stub_(KeyValueStore::NewStub(channel)), cache_(cache) {
+    cache_->clear(false);
+    thread_ = std::thread(&CacheInvalidator::Run, this);
+  }
+
+  ~CacheInvalidator() {
+    {
+      std::lock_guard<std::mutex> lk(mtx_);
+      stopping_ = true;
+      if (context_) {
+        context_->TryCancel();
+      }
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  // Wait up to timeout for the subscription; false if it is not up
+  bool WaitForSubscription(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lk(mtx_);
+    return cv_.wait_for(lk, timeout, [this] { return subscribed_; });
+  }
+
+  // Times the stream was (re)established
+  uint64_t Subscriptions() const {
+    return subscriptions_;
+  }
+
+ private:
+  void Run() {
+    while (true) {
+      ClientContext context;
+      {
+        std::lock_guard<std::mutex> lk(mtx_);
+        if (stopping_) {
+          return;
+        }
+        context_ = &context;
+      }
+      std::unique_ptr<ClientReader<Invalidation>> reader(
+          stub_->Subscribe(&context, Empty()));
+      Invalidation invalidation;
+      bool first = true;
+      while (reader->Read(&invalidation)) {
+        if (first) {
+          // Values read before now may have missed their invalidations
+          cache_->clear(true);
+          subscriptions_++;
+          first = false;
+          std::lock_guard<std::mutex> lk(mtx_);
+          subscribed_ = true;
+          cv_.notify_all();
+        }
+        if (invalidation.reset()) {
+          cache_->clear(true);
+        }
+        for (const auto& key : invalidation.keys()) {
+          cache_->invalidate(key);
+        }
+      }
+      reader->Finish();
+      cache_->clear(false);
+      std::unique_lock<std::mutex> lk(mtx_);
+      context_ = nullptr;
+      subscribed_ = false;
+      cv_.wait_for(lk, std::chrono::milliseconds(100), [this] { return stopping_; });
+    }
+  }
+
+  std::unique_ptr<KeyValueStore::Stub> stub_;
+  std::shared_ptr<ReadCache> cache_;
+  std::thread thread_;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  ClientContext* context_ = nullptr;
+  bool stopping_ = false;
+  bool subscribed_ = false;
+  std::atomic<uint64_t> subscriptions_{0};
+};
+
+/*
+ * A BulkLoad stream to every node of a ring
+ * Add() sends each pair to the node of its key, a chunk of about kChunkBytes
+ * at a time, so that the streams carry few and large messages. Finish() ends
+ * the streams and sums up the summaries of the nodes. Made by
+ * RoutingClient::BulkLoad().
+ */
+class BulkLoadStream {
+ public:
+  static const size_t kChunkBytes = 256 << 10;
+
+  // stubs by node index, null for nodes that are not on ring
+  BulkLoadStream(const HashRing& ring, const std::vector<KeyValueStore::Stub*>& stubs,
+                 uint64_t expected_pairs, uint64_t ttl_ms, ReadCache* cache)
+      : ring_(ring), nodes_(stubs.size()), ttl_ms_(ttl_ms), cache_(cache) {
+    size_t num_nodes = std::count_if(stubs.begin(), stubs.end(),
+                                     [](KeyValueStore::Stub* stub) { return stub; });
+    for (size_t i = 0; i < stubs.size(); i++) {
+      if (!stubs[i]) {
+        continue;
+      }
+      Node& node = nodes_[i];
+      node.writer = stubs[i]->BulkLoad(&node.context, &node.summary);
+      // the keys spread evenly enough for sizing tables
+      node.chunk.set_expected_pairs(expected_pairs / num_nodes);
+    }
+  }
+
+  // false once the stream of key's node has broken; Finish() tells why
+  bool Add(const std::string& key, const std::string& value) {
+    if (cache_) {
+      cache_->invalidate(key);
+    }
+    size_t i = ring_.nodeFor(key);
+    Node& node = nodes_[i];
+    KVPair* pair = node.chunk.add_pairs();
+    pair->set_key(key);
+    pair->set_value(value);
+    pair->set_ttl_ms(ttl_ms_);
+    node.bytes += key.size() + value.size();
+    return node.bytes < kChunkBytes || Send(node);
+  }
+
+  // Send what is left and wait for the nodes to commit it; false if any failed
+  bool Finish(BulkLoadSummary* summary) {
+    summary->Clear();
+    bool ok = true;
+    for (size_t i = 0; i < nodes_.size(); i++) {
+      Node& node = nodes_[i];
+      if (!node.writer) {
+        continue;
+      }
+      if (node.chunk.pairs_size() > 0) {
+        Send(node);
+      }
+      node.writer->WritesDone();
+      Status status = node.writer->Finish();
+      if (!status.ok()) {
+        ReportFailure(status, ring_.name(i));
+        ok = false;
+        continue;
+      }
+      summary->set_pairs(summary->pairs() + node.summary.pairs());
+      summary->set_bytes(summary->bytes() + node.summary.bytes());
+      summary->set_buffers(summary->buffers() + node.summary.buffers());
+      summary->set_duration_ms(std::max(summary->duration_ms(), node.summary.duration_ms()));
+    }
+    return ok;
+  }
+
+ private:
+  struct Node {
+    ClientContext context;
+    std::unique_ptr<ClientWriter<BulkLoadChunk>> writer;
+    BulkLoadChunk chunk;
+    size_t bytes = 0;
+    BulkLoadSummary summary;
+  };
+
+  bool Send(Node& node) {
+    bool ok = node.writer->Write(node.chunk);
+    // keeps the pairs allocated for the next chunk
+    node.chunk.Clear();
+    node.bytes = 0;
+    return ok;
+  }
+
+  const HashRing& ring_;
+  std::vector<Node> nodes_;
+  uint64_t ttl_ms_;
+  ReadCache* cache_;
+};
+
+/*
+ * Client of several servers (nodes) that each hold a part of the keys
+ * Keys are placed on the nodes with a HashRing, and a call on a key goes to
+ * the node that owns it. MultiGet and MultiSet send one request to every node
+ * involved, all of them in flight at once, and GetPrefix and Scan read the
+ * streams of all nodes at once and merge them in key order. With a single node
+ * every call is passed on to its KeyValueStoreClient. Nodes must not be added
+ * or removed while calls are made.
+ */
+class RoutingClient {
+ public:
+  RoutingClient(size_t virtual_nodes = HashRing::kDefaultVirtualNodes)
+      : ring_(virtual_nodes) {}
+
+  // Put a node on the ring under name, e.g. its address; returns its index
+  size_t AddNode(const std::string& name, std::shared_ptr<Channel> channel) {
+    size_t node = ring_.addNode(name);
+    clients_.emplace_back(new KeyValueStoreClient(channel));
+    clients_.back()->SetCache(cache_);
+    stubs_.push_back(KeyValueStore::NewStub(channel));
+    nodes_.push_back(node);
+    return node;
+  }
+
+  // Take a node off the ring; its keys go to the remaining nodes
+  void RemoveNode(size_t node) {
+    if (!ring_.contains(node)) {
+      return;
+    }
+    ring_.removeNode(node);
+    nodes_.erase(std::remove(nodes_.begin(), nodes_.end(), node), nodes_.end());
+  }
+
+  // Indexes of the nodes on the ring
+  const std::vector<size_t>& Nodes() const {
+    return nodes_;
+  }
+
+  const HashRing& Ring() const {
+    return ring_;
+  }
+
+  // Client of one node, e.g. for its Stats
+  KeyValueStoreClient& Node(size_t node) {
+    return *clients_[node];
+  }
+
+  std::string Get(const std::string& key) {
+    return Route(key).Get(key);
+  }
+
+  bool Get(const std::string& key, std::string* value) {
+    return Route(key).Get(key, value);
+  }
+
+  bool Get(const std::string& key, std::string* value, uint64_t* version) {
+    return Route(key).Get(key, value, version);
+  }
+
+  bool Set(const std::string& key, const std::string& value, uint64_t ttl_ms = 0) {
+    return Route(key).Set(key, value, ttl_ms);
+  }
+
+  bool Delete(const std::string& key) {
+    return Route(key).Delete(key);
+  }
+
+  bool CompareAndSet(const std::string& key, const std::string& expected,
+                     const std::string& value, WriteResult* result, uint64_t ttl_ms = 0) {
+    return Route(key).CompareAndSet(key, expected, value, result, ttl_ms);
+  }
+
+  bool CompareAndSet(const std::string& key, uint64_t expected_version,
+                     const std::string& value, WriteResult* result, uint64_t ttl_ms = 0) {
+    return Route(key).CompareAndSet(key, expected_version, value, result, ttl_ms);
+  }
+
+  bool Increment(const std::string& key, int64_t delta, WriteResult* result) {
+    return Route(key).Increment(key, delta, result);
+  }
+
+  bool Append(const std::string& key, const std::string& value, WriteResult* result,
+              uint64_t ttl_ms = 0) {
+    return Route(key).Append(key, value, result, ttl_ms);
+  }
+
+  bool SetIfAbsent(const std::string& key, const std::string& value, WriteResult* result,
+                   uint64_t ttl_ms = 0) {
+    return Route(key).SetIfAbsent(key, value, result, ttl_ms);
+  }
+
+  bool MultiGet(const std::vector<std::string>& keys,
+                std::vector<std::string>* values, std::vector<bool>* found) {
+    if (nodes_.size() == 1) {
+      return clients_[nodes_[0]]->MultiGet(keys, values, found);
+    }
+    std::vector<MultiGetRequest> requests(clients_.size());
+    // positions[node][j] is the index in keys of the node's j-th key
+    std::vector<std::vector<size_t>> positions(clients_.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+      size_t node = ring_.nodeFor(keys[i]);
+      requests[node].add_keys(keys[i]);
+      positions[node].push_back(i);
+    }
+    std::vector<MultiGetResponse> responses(clients_.size());
+    values->assign(keys.size(), std::string());
+    found->assign(keys.size(), false);
+    if (!FanOut(&KeyValueStore::Stub::PrepareAsyncMultiGet, requests, &responses)) {
+      values->clear();
+      found->clear();
+      return false;
+    }
+    for (size_t node = 0; node < responses.size(); node++) {
+      auto& results = *responses[node].mutable_results();
+      for (int j = 0; j < results.size() && j < (int) positions[node].size(); j++) {
+        (*values)[positions[node][j]] = std::move(*results[j].mutable_value());
+        (*found)[positions[node][j]] = results[j].found();
+      }
+    }
+    return true;
+  }
+
+  // One MultiSet per node; each node applies its part atomically
+  bool MultiSet(const std::vector<std::pair<std::string, std::string>>& pairs,
+                uint64_t ttl_ms = 0) {
+    if (nodes_.size() == 1) {
+      return clients_[nodes_[0]]->MultiSet(pairs, ttl_ms);
+    }
+    std::vector<MultiSetRequest> requests(clients_.size());
+    for (const auto& p : pairs) {
+      KVPair* pair = requests[ring_.nodeFor(p.first)].add_pairs();
+      pair->set_key(p.first);
+      pair->set_value(p.second);
+      pair->set_ttl_ms(ttl_ms);
+    }
+    std::vector<Empty> responses(clients_.size());
+    bool ok = FanOut(&KeyValueStore::Stub::PrepareAsyncMultiSet, requests, &responses);
+    if (cache_) {
+      for (const auto& p : pairs) {
+        cache_->invalidate(p.first);
+      }
+    }
+    return ok;
+  }
+
+  // Load about expected_pairs pairs into the nodes, see BulkLoadStream
+  std::unique_ptr<BulkLoadStream> BulkLoad(uint64_t expected_pairs, uint64_t ttl_ms = 0) {
+    std::vector<KeyValueStore::Stub*> stubs(stubs_.size(), nullptr);
+    for (size_t node : nodes_) {
+      stubs[node] = stubs_[node].get();
+    }
+    return std::unique_ptr<BulkLoadStream>(
+        new BulkLoadStream(ring_, stubs, expected_pairs, ttl_ms, cache_.get()));
+  }
+
+  std::vector<std::string> GetPrefix(const std::string& prefixKey) {
+    if (nodes_.size() == 1) {
+      return clients_[nodes_[0]]->GetPrefix(prefixKey);
+    }
+    Request request;
+    request.set_key(prefixKey);
+    std::vector<std::string> values;
+    bool more;
+    bool ok = MergeStreams(
+        [&request](KeyValueStore::Stub* stub, ClientContext* context) {
+          return stub->GetPrefix(context, request);
+        },
+        [&values](Response& response) {
+          values.push_back(std::move(*response.mutable_value()));
+          return true;
+        },
+        &more);
+    if (ok) {
+      std::cout << prefixKey << ": Prefix Key. Got the list of all expected values successfully.\n";
+    }
+    return values;
+  }
+
+  // See KeyValueStoreClient::Scan; every node scans up to limit pairs
+  std::vector<std::pair<std::string, std::string>> Scan(
+      const std::string& startKey, const std::string& endKey, uint32_t limit,
+      std::string* resumeToken) {
+    if (nodes_.size() == 1) {
+      return clients_[nodes_[0]]->Scan(startKey, endKey, limit, resumeToken);
+    }
+    ScanRequest request;
+    request.set_start_key(startKey);
+    request.set_end_key(endKey);
+    request.set_limit(limit);
+    request.set_resume_token(*resumeToken);
+    std::vector<std::pair<std::string, std::string>> pairs;
+    // a node that stopped at limit may have more pairs than it sent
+    bool node_stopped = false;
+    bool more = false;
+    bool ok = MergeStreams(
+        [&request](KeyValueStore::Stub* stub, ClientContext* context) {
+          return stub->Scan(context, request);
+        },
+        [&pairs, &node_stopped, limit](Response& response) {
+          node_stopped = !response.resume_token().empty();
+          pairs.emplace_back(std::move(*response.mutable_key()),
+                             std::move(*response.mutable_value()));
+          return limit == 0 || pairs.size() < limit;
+        },
+        &more);
+    resumeToken->clear();
+    if (ok && limit > 0 && pairs.size() == limit && (more || node_stopped)) {
+      *resumeToken = pairs.back().first;
+    }
+    return pairs;
+  }
+
+  // See KeyValueStoreClient::SetCache; shared by the clients of all nodes
+  void SetCache(std::shared_ptr<ReadCache> cache) {
+    cache_ = cache;
+    for (auto& client : clients_) {
+      client->SetCache(cache);
+    }
+  }
+
+ private:
+  template <class ResponseT, class RequestT>
+  using PrepareFn = std::unique_ptr<ClientAsyncResponseReader<ResponseT>> (
+      KeyValueStore::Stub::*)(ClientContext*, const RequestT&, CompletionQueue*);
+
+  KeyValueStoreClient& Route(const std::string& key) {
+    return *clients_[ring_.nodeFor(key)];
+  }
+
+  /*
+   * Send the non-empty requests[node] to their nodes, all at once, and wait
+   * for the responses; false if any of them failed
+   */
+  template <class RequestT, class ResponseT>
+  bool FanOut(PrepareFn<ResponseT, RequestT> prepare,
+              const std::vector<RequestT>& requests, std::vector<ResponseT>* responses) {
+    size_t n = requests.size();
+    CompletionQueue cq;
+    std::unique_ptr<ClientContext[]> contexts(new ClientContext[n]);
+    std::vector<std::unique_ptr<ClientAsyncResponseReader<ResponseT>>> readers(n);
+    std::vector<Status> statuses(n);
+    size_t pending = 0;
+    for (size_t node = 0; node < n; node++) {
+      if (requests[node].ByteSizeLong() == 0) {
+        continue;
+      }
+      readers[node] = (stubs_[node].get()->*prepare)(&contexts[node], requests[node], &cq);
+      readers[node]->StartCall();
+      readers[node]->Finish(&(*responses)[node], &statuses[node], &statuses[node]);
+      pending++;
+    }
+    bool ok = true;
+    for (; pending > 0; pending--) {
+      void* tag;
+      bool cq_ok;
+      cq.Next(&tag, &cq_ok);
+      Status& status = *static_cast<Status*>(tag);
+      if (!cq_ok || !status.ok()) {
+        ReportFailure(status, ring_.name(&status - &statuses[0]));
+        ok = false;
+      }
+    }
+    cq.Shutdown();
+    void* tag;
+    bool cq_ok;
+    while (cq.Next(&tag, &cq_ok)) {
+    }
+    return ok;
+  }
+
+  /*
+   * Open a stream on every node with open(stub, context) and pass the
+   * responses to visit in key order until it returns false; more is then set
+   * if a stream had responses left. Returns false if a stream failed.
+   */
+  template <class Open, class Visit>
+  bool MergeStreams(Open open, Visit visit, bool* more) {
+    size_t n = nodes_.size();
+    std::unique_ptr<ClientContext[]> contexts(new ClientContext[n]);
+    std::vector<std::unique_ptr<ClientReader<Response>>> readers;
+    for (size_t i = 0; i < n; i++) {
+      readers.push_back(open(stubs_[nodes_[i]].get(), &contexts[i]));
+    }
+    // the next response of every stream; heap holds the streams that have one
+    std::vector<Response> heads(n);
+    std::vector<size_t> heap;
+    auto later = [&heads](size_t a, size_t b) { return heads[a].key() > heads[b].key(); };
+    for (size_t i = 0; i < n; i++) {
+      if (readers[i]->Read(&heads[i])) {
+        heap.push_back(i);
+      }
+    }
+    std::make_heap(heap.begin(), heap.end(), later);
+    *more = false;
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end(), later);
+      size_t i = heap.back();
+      heap.pop_back();
+      if (!visit(heads[i])) {
+        *more = !heap.empty() || readers[i]->Read(&heads[i]);
+        break;
+      }
+      if (readers[i]->Read(&heads[i])) {
+        heap.push_back(i);
+        std::push_heap(heap.begin(), heap.end(), later);
+      }
+    }
+    bool ok = true;
+    for (size_t i = 0; i < n; i++) {
+      if (*more) {
+        contexts[i].TryCancel();
+      }
+      Status status = readers[i]->Finish();
+      if (!status.ok() && !(*more && status.error_code() == grpc::StatusCode::CANCELLED)) {
+        ReportFailure(status, ring_.name(nodes_[i]));
+        ok = false;
+      }
+    }
+    return ok;
+  }
+
+  HashRing ring_;
+  // by node index, also for nodes that were removed
+  std::vector<std::unique_ptr<KeyValueStoreClient>> clients_;
+  std::vector<std::unique_ptr<KeyValueStore::Stub>> stubs_;
+  std::vector<size_t> nodes_;
+  std::shared_ptr<ReadCache> cache_;
+};
+
+/*
+ * Tags the calls that a Tracer samples with a trace id, under which the server
+ * traces them too, and records a span of each of them from when it is sent
+ * until its status arrives
+ */
+class TracingInterceptor : public grpc::experimental::Interceptor {
+ public:
+  TracingInterceptor(grpc::experimental::ClientRpcInfo* info, Tracer* tracer)
+      : info_(info), tracer_(tracer), trace_id_(tracer->sample()) {}
+
+  void Intercept(grpc::experimental::InterceptorBatchMethods* methods) override {
+    using grpc::experimental::InterceptionHookPoints;
+    if (trace_id_ != 0 && methods->QueryInterceptionHookPoint(
+                              InterceptionHookPoints::PRE_SEND_INITIAL_METADATA)) {
+      char id[17];
+      snprintf(id, sizeof(id), "%llx", (unsigned long long) trace_id_);
+      auto metadata = methods->GetSendInitialMetadata();
+      metadata->emplace(Tracer::kTraceIdHeader, id);
+      metadata->emplace(Tracer::kSentAtHeader, std::to_string(
+          std::chrono::duration_cast<std::chrono::microseconds>(
+              std::chrono::system_clock::now().time_since_epoch()).count()));
+      start_ = Tracer::now();
+    }
+    if (trace_id_ != 0 && methods->QueryInterceptionHookPoint(
+                              InterceptionHookPoints::POST_RECV_STATUS)) {
+      // the method's full name, e.g. /keyvaluestore.KeyValueStore/Get
+      tracer_->record(info_->method(), trace_id_, start_, Tracer::now());
+    }
+    methods->Proceed();
+  }
+
+ private:
+  grpc::experimental::ClientRpcInfo* info_;
+  Tracer* tracer_;
+  uint64_t trace_id_;
+  uint64_t start_ = 0;
+};
+
+class TracingInterceptorFactory : public grpc::experimental::ClientInterceptorFactoryInterface {
+ public:
+  TracingInterceptorFactory(Tracer* tracer) : tracer_(tracer) {}
+
+  grpc::experimental::Interceptor* CreateClientInterceptor(
+      grpc::experimental::ClientRpcInfo* info) override {
+    return new TracingInterceptor(info, tracer_);
+  }
+
+ private:
+  Tracer* tracer_;
+};
+
+/*
+ * Channels to target that each use their own connection; with a tracer, the
+ * calls it samples are traced
+ */
+inline std::vector<std::shared_ptr<Channel>> CreateChannelPool(
+    const std::string& target, int num_channels, Tracer* tracer = nullptr) {
+  std::vector<std::shared_ptr<Channel>> channels;
+  for (int i = 0; i < num_channels; i++) {
+    ChannelArguments args;
+    // Channels with identical arguments would share one subchannel
+    args.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    if (!tracer) {
+      channels.push_back(grpc::CreateCustomChannel(
+          target, grpc::InsecureChannelCredentials(), args));
+      continue;
+    }
+    std::vector<std::unique_ptr<grpc::experimental::ClientInterceptorFactoryInterface>>
+        interceptors;
+    interceptors.emplace_back(new TracingInterceptorFactory(tracer));
+    channels.push_back(grpc::experimental::CreateCustomChannelWithInterceptors(
+        target, grpc::InsecureChannelCredentials(), args, std::move(interceptors)));
+  }
+  return channels;
+}
+
+/*
+ * Asynchronous client: calls are started with a callback and complete on a
+ * CompletionQueue that is drained by Poll() on the owning thread, so one
+ * thread can keep many calls in flight. Calls are spread round-robin over
+ * the given channels, or, with a HashRing, go to the channels of the node that
+ * owns their key.
+ */
+class AsyncKeyValueStoreClient {
+ public:
+  // found is false for keys that do not exist
+  typedef std::function<void(bool ok, bool found, const std::string& value)> GetCallback;
+  typedef std::function<void(bool ok)> SetCallback;
+  typedef std::function<void(bool ok, size_t num_pairs)> ScanCallback;
+
+  AsyncKeyValueStoreClient(const std::vector<std::shared_ptr<Channel>>& channels)
+      : stubs_(1), next_stub_(1, 0) {
+    for (auto& channel : channels) {
+      stubs_[0].push_back(KeyValueStore::NewStub(channel));
+    }
+  }
+
+  // node_channels[node] are the channels of the ring's node with that index
+  AsyncKeyValueStoreClient(
+      const HashRing& ring,
+      const std::vector<std::vector<std::shared_ptr<Channel>>>& node_channels)
+      : ring_(ring), stubs_(node_channels.size()), next_stub_(node_channels.size(), 0) {
+    for (size_t node = 0; node < node_channels.size(); node++) {
+      for (auto& channel : node_channels[node]) {
+        stubs_[node].push_back(KeyValueStore::NewStub(channel));
+      }
+    }
+  }
+
+  ~AsyncKeyValueStoreClient() {
+    while (outstanding_ > 0 && Poll()) {
+    }
+    cq_.Shutdown();
+    void* tag;
+    bool ok;
+    while (cq_.Next(&tag, &ok)) {
+    }
+  }
+
+  // Served from the cache, if set and holding key, before Get returns
+  void Get(const std::string& key, GetCallback done) {
+    if (cache_ && cache_->lookup(key, cached_)) {
+      done(true, true, cached_);
+      return;
+    }
+    std::shared_ptr<ReadCache> cache = cache_;
+    uint64_t version = cache ? cache->version(key) : 0;
+    auto call = new UnaryCall<Response>([done, cache, key, version](bool ok,
+                                                                    Response& response) {
+      if (ok && cache && response.found()) {
+        cache->insert(key, response.value(), version, response.ttl_ms());
+      }
+      done(ok, response.found(), response.value());
+    });
+    Request request;
+    request.set_key(key);
+    call->Start(NextStub(key)->PrepareAsyncGet(&call->context, request, &cq_));
+    outstanding_++;
+  }
+
+  void Set(const std::string& key, const std::string& value, uint64_t ttl_ms,
+           SetCallback done) {
+    std::shared_ptr<ReadCache> cache = cache_;
+    auto call = new UnaryCall<Empty>([done, cache, key](bool ok, Empty&) {
+      if (cache) {
+        cache->invalidate(key);
+      }
+      done(ok);
+    });
+    KVPair request;
+    request.set_key(key);
+    request.set_value(value);
+    request.set_ttl_ms(ttl_ms);
+    call->Start(NextStub(key)->PrepareAsyncSet(&call->context, request, &cq_));
+    outstanding_++;
+  }
+
+  /*
+   * Scan of up to limit pairs from startKey on
+   * With a ring every node scans up to limit pairs, and done gets the number
+   * of pairs of the merged scan once all of them are back.
+   */
+  void Scan(const std::string& startKey, uint32_t limit, ScanCallback done) {
+    ScanRequest request;
+    request.set_start_key(startKey);
+    request.set_limit(limit);
+    std::vector<size_t> nodes;
+    for (size_t node = 0; node < stubs_.size(); node++) {
+      if (!stubs_[node].empty() && (ring_.empty() || ring_.contains(node))) {
+        nodes.push_back(node);
+      }
+    }
+    auto merged = std::make_shared<ScanFanOut>();
+    merged->remaining = nodes.size();
+    for (size_t node : nodes) {
+      auto call = new ScanCall([merged, limit, done](bool ok, size_t num_pairs) {
+        merged->ok = merged->ok && ok;
+        merged->num_pairs += num_pairs;
+        if (--merged->remaining == 0) {
+          done(merged->ok, limit > 0 ? std::min<size_t>(limit, merged->num_pairs)
+                                     : merged->num_pairs);
+        }
+      });
+      call->merged = merged;
+      call->reader = NextStub(node)->PrepareAsyncScan(&call->context, request, &cq_);
+      call->reader->StartCall(call);
+    }
+    outstanding_++;
+  }
+
+  /*
+   * Wait until deadline for a call to complete and run its callback
+   * Returns false if nothing completed in time
+   */
+  bool Poll(std::chrono::system_clock::time_point deadline =
+                std::chrono::system_clock::time_point::max()) {
+    while (true) {
+      void* tag;
+      bool ok;
+      if (cq_.AsyncNext(&tag, &ok, deadline) != CompletionQueue::GOT_EVENT) {
+        return false;
+      }
+      auto call = static_cast<AsyncCall*>(tag);
+      if (call->Proceed(ok)) {
+        bool completed = call->Completed();
+        delete call;
+        if (completed) {
+          outstanding_--;
+          return true;
+        }
+      }
+    }
+  }
+
+  size_t Outstanding() const {
+    return outstanding_;
+  }
+
+  // Serve Gets from cache, see KeyValueStoreClient::SetCache
+  void SetCache(std::shared_ptr<ReadCache> cache) {
+    cache_ = cache;
+  }
+
+ private:
+  struct AsyncCall {
+    ClientContext context;
+    virtual ~AsyncCall() {}
+    // Handle a completion; true once the call is done
+    virtual bool Proceed(bool ok) = 0;
+    // Whether the done call completed its operation, false for all but the
+    // last of the calls an operation fans out to
+    virtual bool Completed() const {
+      return true;
+    }
+  };
+
+  template <class ResponseT>
+  struct UnaryCall : AsyncCall {
+    std::function<void(bool, ResponseT&)> done;
+    std::unique_ptr<ClientAsyncResponseReader<ResponseT>> reader;
+    ResponseT response;
+    Status status;
+
+    UnaryCall(std::function<void(bool, ResponseT&)> done) : done(done) {}
+
+    void Start(std::unique_ptr<ClientAsyncResponseReader<ResponseT>> r) {
+      reader = std::move(r);
+      reader->StartCall();
+      reader->Finish(&response, &status, this);
+    }
+
+    bool Proceed(bool ok) override {
+      if (status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED) {
+        ShedCalls()++;
+      }
+      done(ok && status.ok(), response);
+      return true;
+    }
+  };
+
+  struct ScanFanOut {
+    size_t remaining = 0;
+    size_t num_pairs = 0;
+    bool ok = true;
+  };
+
+  struct ScanCall : AsyncCall {
+    ScanCallback done;
+    std::shared_ptr<ScanFanOut> merged;
+    std::unique_ptr<ClientAsyncReader<Response>> reader;
+    Response response;
+    Status status;
+    size_t num_pairs = 0;
+    bool started = false;
+    bool finishing = false;
+
+    ScanCall(ScanCallback done) : done(done) {}
+
+    bool Proceed(bool ok) override {
+      if (finishing) {
+        if (status.error_code() == grpc::StatusCode::RESOURCE_EXHAUSTED) {
+          ShedCalls()++;
+        }
+        done(status.ok(), num_pairs);
+        return true;
+      }
+      if (ok) {
+        // Started, or read a pair: read the next one
+        num_pairs += started;
+        started = true;
+        reader->Read(&response, this);
+      } else {
+        finishing = true;
+        reader->Finish(&status, this);
+      }
+      return false;
+    }
+
+    bool Completed() const override {
+      return merged->remaining == 0;
+    }
+  };
+
+  // Next stub of the node that owns key
+  KeyValueStore::Stub* NextStub(const std::string& key) {
+    return NextStub(ring_.empty() ? 0 : ring_.nodeFor(key));
+  }
+
+  KeyValueStore::Stub* NextStub(size_t node) {
+    next_stub_[node] = (next_stub_[node] + 1) % stubs_[node].size();
+    return stubs_[node][next_stub_[node]].get();
+  }
+
+  // empty to send everything to the stubs of node 0
+  HashRing ring_;
+  // by node index
+  std::vector<std::vector<std::unique_ptr<KeyValueStore::Stub>>> stubs_;
+  std::vector<size_t> next_stub_;
+  CompletionQueue cq_;
+  size_t outstanding_ = 0;
+  std::shared_ptr<ReadCache> cache_;
+  // value of a cache hit, kept with its capacity between Gets
+  std::string cached_;
 };
@@ -1,6 +1,44 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Segment id of values that are not in any log segment
+const uint32_t kNoSegment = UINT32_MAX;
+
+// Where a value lives in the log
+struct value_location {
+  uint32_t segment;
+  uint64_t offset;
+  uint32_t length;
+  // LogFormat record flags of the value, e.g. whether it is compressed
+  uint32_t flags;
+  // wall_clock_ms() at which the value expires, 0 for never
+  uint64_t expiresAt;
+  // Version of the key's value (LogFormat::kVersioned), 0 for values written
+  // before records had versions
+  uint64_t version;
+};
+
 struct kv_pair {
-  std::string key;
+  // Only populated when values are kept in memory
   std::string value;
+  value_location loc;
 };
+
+// Milliseconds since the Unix epoch; expiry times survive restarts
+inline uint64_t wall_clock_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Microseconds since the Unix epoch, a floor for new versions
+inline uint64_t wall_clock_us() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline bool expired(const value_location& loc) {
+  return loc.expiresAt != 0 && loc.expiresAt <= wall_clock_ms();
+}
@@ -0,0 +1,296 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "logstorage.h"
+
+/*
+ * Token bucket used to cap the I/O bandwidth of background work
+ * A rate of 0 disables the limit
+ */
+class RateLimiter {
+private:
+    uint64_t bytesPerSec;
+    double available = 0;
+    std::chrono::steady_clock::time_point last;
+
+public:
+    RateLimiter(uint64_t bytesPerSec)
+        : bytesPerSec(bytesPerSec), last(std::chrono::steady_clock::now()) {}
+
+    void acquire(uint64_t bytes) {
+        if (bytesPerSec == 0) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        available += std::chrono::duration<double>(now - last).count() * bytesPerSec;
+        // allow bursts of at most 100ms worth of I/O
+        available = std::min(available, bytesPerSec / 10.0);
+        last = now;
+        available -= bytes;
+        if (available < 0) {
+            std::this_thread::sleep_for(
+                    std::chrono::duration<double>(-available / bytesPerSec));
+        }
+    }
+};
+
+/*
+ * Background compaction of sealed log segments
+ *
+ * A segment whose fraction of dead bytes (records superseded by a later Set)
+ * passes minGarbage is rewritten with only its live records, in their original
+ * order, and installed as the next generation of the same seq. Since the copy
+ * keeps the segment's position in the log, replaying the log after a crash
+ * still yields the newest version of every key.
+ *
+ * The last record of a deleted key, a tombstone or a value that has expired,
+ * is copied as a tombstone for as long as older segments may still hold
+ * records of the key; only compaction of the oldest segment drops it. With
+ * checkpoints the oldest segment is one before the newest checkpoint's cut,
+ * since the segments from the cut on are replayed over the checkpoint.
+ */
+class Compactor {
+public:
+    // Does the map still point at loc for key?
+    typedef std::function<bool(const std::string& key,
+                               const value_location& loc)> IsLiveFn;
+    // Point key at to if it still points at from; false if it moved on
+    typedef std::function<bool(const std::string& key, const value_location& from,
+                               const value_location& to)> RelocateFn;
+    // Is key in the map?
+    typedef std::function<bool(const std::string& key)> HasKeyFn;
+
+private:
+    struct MovedRecord {
+        std::string key;
+        value_location from;
+        value_location to;
+    };
+
+    LogStorage& log;
+    IsLiveFn isLive;
+    RelocateFn relocate;
+    HasKeyFn hasKey;
+    double minGarbage;
+    RateLimiter limiter;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::thread compactorThread;
+
+    // segments that failed their checksums, never picked again
+    std::unordered_set<uint32_t> corrupt;
+
+    std::atomic<uint64_t> segmentsCompacted{0};
+    std::atomic<uint64_t> bytesReclaimed{0};
+
+    double garbageRatio(const LogSegment& segment) {
+        uint64_t size = segment.size;
+        if (size == 0) {
+            return 1;
+        }
+        int64_t live = std::max<int64_t>(segment.liveBytes, 0);
+        return 1 - (double) live / size;
+    }
+
+    bool writeRecord(std::ofstream& out, const std::string& key,
+                     const std::string& value, uint32_t flags, uint64_t expiresAt,
+                     uint64_t version) {
+        char header[LogFormat::kMaxRecordHeaderSize];
+        if (!LogFormat::encodeRecordHeader(header, key, value, flags, expiresAt, version)) {
+            return false;
+        }
+        out.write(header, LogFormat::headerSize(flags));
+        out.write(key.data(), key.size());
+        out.write(value.data(), value.size());
+        return out.good();
+    }
+
+    // Neither a segment before this one nor a checkpoint can hold records
+    // that a tombstone masks
+    bool isOldest(const LogSegment& segment) {
+        auto bySeq = log.segmentsBySeq();
+        uint64_t checkpointSeq = log.lastCheckpointSeq();
+        return !bySeq.empty() && bySeq.front()->seq == segment.seq &&
+               (checkpointSeq == 0 || segment.seq < checkpointSeq);
+    }
+
+    bool compact(std::shared_ptr<LogSegment> segment) {
+        uint64_t oldSize = segment->size;
+        // tombstones do not count as live bytes
+        bool oldest = isOldest(*segment);
+
+        if (segment->liveBytes <= 0 && oldest) {
+            // Nothing in the segment is referenced anymore
+            log.dropSegment(segment, true);
+            bytesReclaimed += oldSize;
+            segmentsCompacted++;
+            return true;
+        }
+
+        std::string compactedPath = segment->path + ".compact";
+        std::ofstream out(compactedPath, std::ofstream::out | std::ofstream::binary
+                                         | std::ofstream::trunc);
+        std::vector<MovedRecord> moved;
+        // The copy is always in the current format, which migrates segments
+        // written in an older one
+        char header[LogFormat::kSegmentHeaderSize];
+        LogFormat::encodeSegmentHeader(header);
+        out.write(header, sizeof(header));
+        uint64_t newOffset = sizeof(header);
+        uint64_t tombstoneBytes = 0;
+        bool ok = true;
+
+        uint64_t scanned = LogStorage::scanSegment(*segment, false,
+                [&](std::string& key, std::string& value, const value_location& loc) {
+            limiter.acquire(LogStorage::recordSize(key.size(), loc.length, loc.flags));
+            if (!ok) {
+                return;
+            }
+            if (!isLive(key, loc)) {
+                bool endsKey = (loc.flags & LogFormat::kTombstone) || expired(loc);
+                if (!endsKey || oldest || hasKey(key)) {
+                    return;
+                }
+                // keeps the version, which the next write of the key must exceed
+                uint32_t flags = LogFormat::kTombstone | (loc.flags & LogFormat::kVersioned);
+                if (!writeRecord(out, key, std::string(), flags, 0, loc.version)) {
+                    ok = false;
+                }
+                newOffset += LogStorage::recordSize(key.size(), 0, flags);
+                tombstoneBytes += LogStorage::recordSize(key.size(), 0, flags);
+                return;
+            }
+            if (!log.read(loc, value) ||
+                    !writeRecord(out, key, value, loc.flags, loc.expiresAt, loc.version)) {
+                ok = false;
+                return;
+            }
+            limiter.acquire(LogStorage::recordSize(key.size(), loc.length, loc.flags));
+            newOffset += LogFormat::headerSize(loc.flags) + key.size();
+            moved.push_back({key, loc, {0, newOffset, loc.length, loc.flags, loc.expiresAt,
+                                        loc.version}});
+            newOffset += loc.length;
+        });
+        if (scanned < oldSize) {
+            // Dropping the segment would lose the records after a bad one
+            std::cerr << "[compaction] " << segment->path << " has a corrupt record at offset "
+                      << scanned << ", not compacting it\n";
+            corrupt.insert(segment->id);
+            ok = false;
+        }
+        if (ok && moved.empty() && tombstoneBytes == 0) {
+            // Nothing worth keeping after all
+            out.close();
+            std::experimental::filesystem::remove(compactedPath);
+            log.dropSegment(segment, true);
+            bytesReclaimed += oldSize;
+            segmentsCompacted++;
+            return true;
+        }
+
+        out.flush();
+        int fd = open(compactedPath.c_str(), O_WRONLY);
+        ok = ok && out.good() && fd >= 0 && fdatasync(fd) == 0;
+        if (fd >= 0) {
+            close(fd);
+        }
+        out.close();
+        if (!ok) {
+            std::cerr << "[compaction] Compacting " << segment->path << " failed\n";
+            std::experimental::filesystem::remove(compactedPath);
+            return false;
+        }
+
+        // Install the copy, then move map entries over to the new segment.
+        // Gets that raced with the swap still read from the old descriptor.
+        auto compacted = log.replaceSegment(segment, compactedPath);
+        // Kept tombstones count as live here, or the copy would look like
+        // garbage right away and be compacted over and over
+        compacted->liveBytes += tombstoneBytes;
+        for (auto& m : moved) {
+            m.to.segment = compacted->id;
+            if (relocate(m.key, m.from, m.to)) {
+                compacted->liveBytes +=
+                    LogStorage::recordSize(m.key.size(), m.to.length, m.to.flags);
+            }
+        }
+        log.dropSegment(segment, true);
+
+        bytesReclaimed += oldSize - compacted->size;
+        segmentsCompacted++;
+        std::cout << "[compaction] " << segment->path << ": " << oldSize
+                  << " -> " << compacted->size << " bytes" << std::endl;
+        return true;
+    }
+
+    void run() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                cv.wait_for(lk, std::chrono::seconds(1), [this] { return stopping; });
+                if (stopping) {
+                    return;
+                }
+            }
+
+            compactOnce();
+        }
+    }
+
+public:
+    Compactor(LogStorage& log, IsLiveFn isLive, RelocateFn relocate, HasKeyFn hasKey,
+              double minGarbage, uint64_t bytesPerSec)
+        : log(log), isLive(isLive), relocate(relocate), hasKey(hasKey),
+          minGarbage(minGarbage), limiter(bytesPerSec) {
+        compactorThread = std::thread(&Compactor::run, this);
+    }
+
+    ~Compactor() {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            stopping = true;
+        }
+        cv.notify_one();
+        compactorThread.join();
+    }
+
+    /*
+     * Compact the sealed segment with the most garbage, if one has at least
+     * minGarbage; the background thread does this once a second
+     * Returns false if no segment was compacted
+     */
+    bool compactOnce() {
+        // Pick the sealed segment with the most garbage
+        std::shared_ptr<LogSegment> victim;
+        double victimGarbage = minGarbage;
+        std::lock_guard<std::mutex> lk(log.maintenanceMutex());
+        for (auto& segment : log.sealedSegments()) {
+            double garbage = garbageRatio(*segment);
+            if (garbage >= victimGarbage && !corrupt.count(segment->id)) {
+                victim = segment;
+                victimGarbage = garbage;
+            }
+        }
+        return victim && compact(victim);
+    }
+
+    void printStats(std::ostream& os) {
+        os << "[compaction] segments compacted: " << segmentsCompacted.load()
+           << ", bytes reclaimed: " << bytesReclaimed.load() << std::endl;
+    }
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <zlib.h>
+
+/*
+ * Value compression for the log and the hash map
+ *
+ * A compressed value is its uncompressed size (u32, little-endian) followed by
+ * a raw deflate stream at level 1, the fastest zlib level. Each thread keeps
+ * one deflate and one inflate stream and resets them between values, so
+ * compressing a value does not allocate zlib state.
+ */
+class ValueCompressor {
+private:
+    static const size_t kSizeBytes = 4;
+
+    struct Streams {
+        z_stream deflater;
+        z_stream inflater;
+
+        Streams() {
+            memset(&deflater, 0, sizeof(deflater));
+            memset(&inflater, 0, sizeof(inflater));
+            deflateInit2(&deflater, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+            inflateInit2(&inflater, -15);
+        }
+
+        ~Streams() {
+            deflateEnd(&deflater);
+            inflateEnd(&inflater);
+        }
+    };
+
+    static Streams& streams() {
+        static thread_local Streams streams;
+        return streams;
+    }
+
+public:
+    /*
+     * Compress value into out
+     * Returns false, leaving out unspecified, if that does not save at least
+     * an eighth of the value; such values are better stored as they are.
+     */
+    static bool compress(const std::string& value, std::string& out) {
+        size_t limit = value.size() - value.size() / 8;
+        if (value.size() > UINT32_MAX || limit <= kSizeBytes) {
+            return false;
+        }
+        z_stream& z = streams().deflater;
+        deflateReset(&z);
+        out.resize(limit);
+        uint32_t size = value.size();
+        for (size_t i = 0; i < kSizeBytes; i++) {
+            out[i] = (char) (size >> (8 * i));
+        }
+        z.next_in = (Bytef*) value.data();
+        z.avail_in = value.size();
+        z.next_out = (Bytef*) &out[kSizeBytes];
+        z.avail_out = limit - kSizeBytes;
+        // Z_STREAM_END only if the whole stream fit below the limit
+        if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+            return false;
+        }
+        out.resize(limit - z.avail_out);
+        return true;
+    }
+
+    // Inverse of compress(); false if data is not a valid compressed value
+    static bool decompress(const char* data, size_t n, std::string& value) {
+        if (n < kSizeBytes) {
+            return false;
+        }
+        uint32_t size = 0;
+        for (size_t i = 0; i < kSizeBytes; i++) {
+            size |= (uint32_t) (uint8_t) data[i] << (8 * i);
+        }
+        z_stream& z = streams().inflater;
+        inflateReset(&z);
+        value.resize(size);
+        z.next_in = (Bytef*) data + kSizeBytes;
+        z.avail_in = n - kSizeBytes;
+        z.next_out = (Bytef*) &value[0];
+        z.avail_out = size;
+        return inflate(&z, Z_FINISH) == Z_STREAM_END && z.avail_out == 0;
+    }
+
+    static bool decompress(const std::string& data, std::string& value) {
+        return decompress(data.data(), data.size(), value);
+    }
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+/*
+ * CRC32C (Castagnoli), as used by iSCSI, ext4 and LevelDB
+ *
+ * Uses the SSE4.2 crc32 instruction on x86-64 and the ARMv8 CRC32 extension on
+ * aarch64 when the CPU has them, checked once at startup, and falls back to a
+ * slicing-by-8 table implementation otherwise. All three give the same result.
+ */
+class Crc32c {
+private:
+    static const uint32_t kPoly = 0x82f63b78; // reversed Castagnoli polynomial
+
+    struct Tables {
+        uint32_t t[8][256];
+
+        Tables() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t crc = i;
+                for (int j = 0; j < 8; j++) {
+                    crc = (crc >> 1) ^ (kPoly & (0 - (crc & 1)));
+                }
+                t[0][i] = crc;
+            }
+            for (uint32_t i = 0; i < 256; i++) {
+                for (int k = 1; k < 8; k++) {
+                    t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+                }
+            }
+        }
+    };
+
+    static const Tables& tables() {
+        static const Tables tables;
+        return tables;
+    }
+
+    typedef uint32_t (*ExtendFn)(uint32_t crc, const char* data, size_t n);
+
+#if defined(__x86_64__)
+    __attribute__((target("sse4.2")))
+    static uint32_t extendHardware(uint32_t crc, const char* data, size_t n) {
+        uint64_t c = ~crc;
+        for (; n >= 8; n -= 8, data += 8) {
+            uint64_t v;
+            memcpy(&v, data, 8);
+            c = _mm_crc32_u64(c, v);
+        }
+        uint32_t c32 = c;
+        for (; n > 0; n--, data++) {
+            c32 = _mm_crc32_u8(c32, *data);
+        }
+        return ~c32;
+    }
+
+    static bool hasHardware() {
+        return __builtin_cpu_supports("sse4.2");
+    }
+#elif defined(__aarch64__)
+    __attribute__((target("+crc")))
+    static uint32_t extendHardware(uint32_t crc, const char* data, size_t n) {
+        crc = ~crc;
+        for (; n >= 8; n -= 8, data += 8) {
+            uint64_t v;
+            memcpy(&v, data, 8);
+            crc = __crc32cd(crc, v);
+        }
+        for (; n > 0; n--, data++) {
+            crc = __crc32cb(crc, *data);
+        }
+        return ~crc;
+    }
+
+    static bool hasHardware() {
+        return getauxval(AT_HWCAP) & HWCAP_CRC32;
+    }
+#else
+    static uint32_t extendHardware(uint32_t crc, const char* data, size_t n) {
+        return extendSoftware(crc, data, n);
+    }
+
+    static bool hasHardware() {
+        return false;
+    }
+#endif
+
+    static ExtendFn choose() {
+        return hasHardware() ? extendHardware : extendSoftware;
+    }
+
+public:
+    /*
+     * CRC of data appended to data whose CRC is crc
+     * Pass 0 to start a new checksum
+     */
+    static uint32_t extend(uint32_t crc, const char* data, size_t n) {
+        static const ExtendFn fn = choose();
+        return fn(crc, data, n);
+    }
+
+    static uint32_t value(const char* data, size_t n) {
+        return extend(0, data, n);
+    }
+
+    // Table-driven version, also used when the CPU has no CRC32C instruction
+    static uint32_t extendSoftware(uint32_t crc, const char* data, size_t n) {
+        const Tables& tb = tables();
+        const uint8_t* p = (const uint8_t*) data;
+        crc = ~crc;
+        for (; n >= 8; n -= 8, p += 8) {
+            uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24);
+            crc = tb.t[7][lo & 0xff] ^ tb.t[6][(lo >> 8) & 0xff] ^
+                  tb.t[5][(lo >> 16) & 0xff] ^ tb.t[4][lo >> 24] ^
+                  tb.t[3][p[4]] ^ tb.t[2][p[5]] ^ tb.t[1][p[6]] ^ tb.t[0][p[7]];
+        }
+        for (; n > 0; n--, p++) {
+            crc = (crc >> 8) ^ tb.t[0][(crc ^ *p) & 0xff];
+        }
+        return ~crc;
+    }
+
+    // Does extend() use a CRC instruction?
+    static bool hardware() {
+        return choose() == extendHardware;
+    }
+};
@@ -0,0 +1,469 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "logstorage.h"
+#include "metrics.h"
+
+/*
+ * Group-commit writer in front of LogStorage.
+ *
+ * Callers of commit() are queued and a single writer thread drains the queue
+ * in batches: it appends every record of the batch, issues one sync for the
+ * whole batch, applies the records to the in-memory map in log order and then
+ * acks all waiters together. Every record gets a new version of its key as it
+ * is appended (LogFormat::kVersioned), unless it comes with one.
+ *
+ * A read-modify-write commits a ResolveFn instead of a record, which computes
+ * the record on the writer thread right before it would be appended. Every
+ * write of a key goes through the writer of its shard, so nothing can change
+ * the key between resolve and append.
+ *
+ * A commit made while its thread serves a traced request (see TraceScope)
+ * gets spans for its wait in the queue and for the append, sync and apply of
+ * its batch.
+ */
+class GroupCommitLog {
+public:
+    // Applies a durable record to the in-memory map (called in log order)
+    typedef std::function<void(const std::string& key, const std::string& value,
+                               const value_location& loc)> ApplyFn;
+    // Called on the writer thread once an asynchronous commit is durable
+    // (ok) or has failed
+    typedef std::function<void(bool ok)> DoneFn;
+
+    // A record to commit; points at strings owned by the caller
+    struct Record {
+        const std::string* key;
+        const std::string* value;
+        // LogFormat::RecordFlags of the value
+        uint32_t flags;
+        // stored with LogFormat::kExpires
+        uint64_t expiresAt;
+        // version of the key to write, 0 for a new one
+        uint64_t version;
+    };
+
+    /*
+     * The latest record of a key appended earlier in the same batch: durable
+     * with the batch, but not applied to the map yet
+     */
+    struct Pending {
+        const std::string* value;
+        value_location loc;
+    };
+
+    /*
+     * Computes the record of a read-modify-write from the key's current value,
+     * which is pending's if there is a pending record and the map's otherwise.
+     * record comes with its key and the version it is written with; returns
+     * false to leave the record out.
+     */
+    typedef std::function<bool(Record& record, const Pending* pending)> ResolveFn;
+
+    // Batch size histogram buckets: 1, 2-3, 4-7, ..., >= 2^(kBuckets-1)
+    static const int kBuckets = 11;
+
+private:
+    struct Writer {
+        // appended back to back to one segment and applied together
+        const Record* records = nullptr;
+        size_t numRecords = 0;
+        Record single;
+        std::vector<Record> owned;
+        // set for a read-modify-write of single
+        ResolveFn resolve;
+        // set for work that runs on the writer thread between two batches
+        const std::function<void()>* exclusive = nullptr;
+        // set for commitAsync(), which owns the Writer
+        DoneFn onDone;
+        // ServerMetrics::now() when queued
+        uint64_t enqueued = 0;
+        // trace of the request that committed, 0 if it is not traced
+        uint64_t traceId = 0;
+        bool ok = false;
+        bool done = false;
+    };
+
+    LogStorage& log;
+    ApplyFn apply;
+    size_t maxBatch;
+    std::chrono::microseconds maxWait;
+    ServerMetrics* metrics;
+
+    std::mutex mtx;
+    // signalled when writers are queued (or on shutdown)
+    std::condition_variable pending;
+    // signalled when a batch has been committed
+    std::condition_variable committed;
+    std::deque<Writer*> queue;
+    // enqueued of the writer at the head of the queue, 0 while it is empty
+    std::atomic<uint64_t> headEnqueued{0};
+    bool stopping = false;
+    std::thread writerThread;
+
+    // Stats, only updated by the writer thread
+    std::atomic<uint64_t> numBatches{0};
+    std::atomic<uint64_t> numRecords{0};
+    std::atomic<uint64_t> maxBatchSeen{0};
+    std::atomic<uint64_t> syncMicros{0};
+    std::atomic<uint64_t> batchSizeHist[kBuckets];
+
+    static int bucketFor(size_t batchSize) {
+        int b = 0;
+        while (batchSize > 1 && b < kBuckets - 1) {
+            batchSize >>= 1;
+            b++;
+        }
+        return b;
+    }
+
+    void recordBatch(size_t batchSize, uint64_t syncUs) {
+        numBatches.fetch_add(1, std::memory_order_relaxed);
+        numRecords.fetch_add(batchSize, std::memory_order_relaxed);
+        syncMicros.fetch_add(syncUs, std::memory_order_relaxed);
+        batchSizeHist[bucketFor(batchSize)].fetch_add(1, std::memory_order_relaxed);
+        if (batchSize > maxBatchSeen.load(std::memory_order_relaxed)) {
+            maxBatchSeen.store(batchSize, std::memory_order_relaxed);
+        }
+    }
+
+    // Latest record of key among the first n appended records of the batch
+    static bool findPending(const std::vector<const Record*>& appended,
+                            const std::vector<value_location>& locs, size_t n,
+                            const std::string& key, Pending& pending) {
+        while (n-- > 0) {
+            if (appended[n] && *appended[n]->key == key) {
+                pending = {appended[n]->value, locs[n]};
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Span of h from start until now for every traced writer of batch
+    void traceBatch(const std::vector<Writer*>& batch, ServerMetrics::Histogram h,
+                    uint64_t start, size_t batchRecords) {
+        for (auto w : batch) {
+            if (w->traceId) {
+                metrics->trace(h, w->traceId, start, "batch_records", batchRecords);
+            }
+        }
+    }
+
+    void run() {
+        std::vector<Writer*> batch;
+        std::vector<Writer*> callbacks;
+        // the records appended, null where a resolve left its record out
+        std::vector<const Record*> appended;
+        batch.reserve(maxBatch);
+
+        while (true) {
+            std::unique_lock<std::mutex> lk(mtx);
+            pending.wait(lk, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                break; // stopping and fully drained
+            }
+            if (queue.front()->exclusive) {
+                Writer* w = queue.front();
+                queue.pop_front();
+                headEnqueued = queue.empty() ? 0 : queue.front()->enqueued;
+                lk.unlock();
+                (*w->exclusive)();
+                lk.lock();
+                w->ok = w->done = true;
+                lk.unlock();
+                committed.notify_all();
+                continue;
+            }
+            // Give concurrent Sets a chance to join a batch that is not full yet
+            if (maxWait.count() > 0 && queue.size() < maxBatch && !stopping) {
+                pending.wait_for(lk, maxWait, [this] {
+                    return stopping || queue.size() >= maxBatch;
+                });
+            }
+            // maxBatch caps the records in a batch, but a writer with more
+            // records than that still goes out as a batch of its own
+            size_t batchRecords = 0;
+            while (!queue.empty() && !queue.front()->exclusive &&
+                   (batch.empty() ||
+                    batchRecords + queue.front()->numRecords <= maxBatch)) {
+                batchRecords += queue.front()->numRecords;
+                batch.push_back(queue.front());
+                queue.pop_front();
+            }
+            headEnqueued = queue.empty() ? 0 : queue.front()->enqueued;
+            lk.unlock();
+            bool traced = false;
+            if (metrics) {
+                for (auto w : batch) {
+                    metrics->record(ServerMetrics::kCommitQueueWait, w->enqueued, w->traceId);
+                    traced |= w->traceId != 0;
+                }
+            }
+
+            std::vector<value_location> locs(batchRecords);
+            appended.assign(batchRecords, nullptr);
+            bool writeOk = true;
+            size_t n = 0;
+            uint64_t appendBytes = 0;
+            uint64_t appendStart = ServerMetrics::now();
+            for (size_t i = 0; i < batch.size() && writeOk; i++) {
+                for (size_t j = 0; j < batch[i]->numRecords; j++, n++) {
+                    Writer* w = batch[i];
+                    if (w->resolve) {
+                        TraceScope scope(w->traceId);
+                        w->single.version = log.nextVersion();
+                        Pending pending;
+                        bool found = findPending(appended, locs, n, *w->single.key, pending);
+                        if (!w->resolve(w->single, found ? &pending : nullptr)) {
+                            continue;
+                        }
+                    }
+                    const Record& r = w->records[j];
+                    uint32_t flags = r.flags | LogFormat::kVersioned;
+                    uint64_t version = r.version ? r.version : log.nextVersion();
+                    if (!log.write(*r.key, *r.value, locs[n], j == 0, flags, r.expiresAt,
+                                   version)) {
+                        writeOk = false;
+                        break;
+                    }
+                    appended[n] = &r;
+                    appendBytes += LogStorage::recordSize(r.key->size(), r.value->size(),
+                                                          flags);
+                }
+            }
+            if (metrics) {
+                metrics->record(ServerMetrics::kLogAppend, appendStart);
+                metrics->add(ServerMetrics::kLogAppendBytes, appendBytes);
+                metrics->add(ServerMetrics::kLogAppendRecords, n);
+                if (traced) {
+                    traceBatch(batch, ServerMetrics::kLogAppend, appendStart, batchRecords);
+                }
+            }
+
+            uint64_t syncStart = ServerMetrics::now();
+            bool syncOk = log.sync();
+            uint64_t syncUs = (ServerMetrics::now() - syncStart) / 1000;
+            if (metrics) {
+                metrics->record(ServerMetrics::kLogSync, syncStart);
+                if (traced) {
+                    traceBatch(batch, ServerMetrics::kLogSync, syncStart, batchRecords);
+                }
+            }
+
+            // Records are only visible once they are durable. A failed write
+            // leaves the stream in a bad state, so fail the rest of the batch.
+            if (writeOk && syncOk) {
+                uint64_t applyStart = ServerMetrics::now();
+                n = 0;
+                for (size_t i = 0; i < batch.size(); i++) {
+                    // the map lock waits of a traced commit are spans of its trace
+                    TraceScope scope(batch[i]->traceId);
+                    for (size_t j = 0; j < batch[i]->numRecords; j++, n++) {
+                        if (appended[n]) {
+                            apply(*appended[n]->key, *appended[n]->value, locs[n]);
+                        }
+                    }
+                    batch[i]->ok = true;
+                }
+                if (metrics) {
+                    metrics->record(ServerMetrics::kApply, applyStart);
+                    if (traced) {
+                        traceBatch(batch, ServerMetrics::kApply, applyStart, batchRecords);
+                    }
+                }
+            }
+            recordBatch(batchRecords, syncUs);
+
+            // A blocking committer may return (and free its Writer) as soon
+            // as done is set, so pick out the asynchronous ones first
+            lk.lock();
+            for (auto w : batch) {
+                if (w->onDone) {
+                    callbacks.push_back(w);
+                } else {
+                    w->done = true;
+                }
+            }
+            lk.unlock();
+            committed.notify_all();
+            for (auto w : callbacks) {
+                w->onDone(w->ok);
+                delete w;
+            }
+            callbacks.clear();
+            batch.clear();
+        }
+    }
+
+    // Called with mtx held
+    void push(Writer* w) {
+        if (queue.empty()) {
+            headEnqueued = w->enqueued;
+        }
+        queue.push_back(w);
+    }
+
+    void enqueue(Writer* w) {
+        w->enqueued = ServerMetrics::now();
+        w->traceId = Tracer::current();
+        std::lock_guard<std::mutex> lk(mtx);
+        push(w);
+        pending.notify_one();
+    }
+
+    // Queue w and block until the writer thread is done with it
+    bool wait(Writer& w) {
+        w.enqueued = ServerMetrics::now();
+        w.traceId = Tracer::current();
+        std::unique_lock<std::mutex> lk(mtx);
+        push(&w);
+        pending.notify_one();
+        committed.wait(lk, [&w] { return w.done; });
+        return w.ok;
+    }
+
+public:
+    // metrics may be null
+    GroupCommitLog(LogStorage& log, ApplyFn apply, size_t maxBatch,
+                   uint64_t maxWaitUs, ServerMetrics* metrics = nullptr)
+        : log(log), apply(apply), maxBatch(maxBatch > 0 ? maxBatch : 1),
+          maxWait(maxWaitUs), metrics(metrics) {
+        for (auto& b : batchSizeHist) {
+            b.store(0);
+        }
+        writerThread = std::thread(&GroupCommitLog::run, this);
+    }
+
+    ~GroupCommitLog() {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            stopping = true;
+        }
+        pending.notify_one();
+        writerThread.join();
+    }
+
+    /*
+     * Append record to the log and wait until the batch containing it has
+     * been synced and applied. Returns false if the write or sync failed.
+     */
+    bool commit(const Record& record) {
+        Writer w;
+        w.single = record;
+        w.records = &w.single;
+        w.numRecords = 1;
+        return wait(w);
+    }
+
+    /*
+     * Like commit() for several records, which are appended back to back to
+     * the same segment and made durable by the same sync
+     */
+    bool commit(const std::vector<Record>& records) {
+        if (records.empty()) {
+            return true;
+        }
+        Writer w;
+        w.records = records.data();
+        w.numRecords = records.size();
+        return wait(w);
+    }
+
+    /*
+     * Like commit(), but returns right away and calls done on the writer
+     * thread instead. The strings records point at must stay valid until then.
+     */
+    void commitAsync(std::vector<Record> records, DoneFn done) {
+        if (records.empty()) {
+            done(true);
+            return;
+        }
+        Writer* w = new Writer;
+        w->owned = std::move(records);
+        w->records = w->owned.data();
+        w->numRecords = w->owned.size();
+        w->onDone = std::move(done);
+        enqueue(w);
+    }
+
+    void commitAsync(const Record& record, DoneFn done) {
+        Writer* w = new Writer;
+        w->single = record;
+        w->records = &w->single;
+        w->numRecords = 1;
+        w->onDone = std::move(done);
+        enqueue(w);
+    }
+
+    /*
+     * Read-modify-write of key: waits like commit() for the record that
+     * resolve computes. Also returns true if resolve left the record out.
+     */
+    bool commit(const std::string& key, ResolveFn resolve) {
+        Writer w;
+        w.single = {&key, nullptr, 0, 0, 0};
+        w.records = &w.single;
+        w.numRecords = 1;
+        w.resolve = std::move(resolve);
+        return wait(w);
+    }
+
+    // Like commit() with resolve, but answers on the writer thread like commitAsync()
+    void commitAsync(const std::string& key, ResolveFn resolve, DoneFn done) {
+        Writer* w = new Writer;
+        w->single = {&key, nullptr, 0, 0, 0};
+        w->records = &w->single;
+        w->numRecords = 1;
+        w->resolve = std::move(resolve);
+        w->onDone = std::move(done);
+        enqueue(w);
+    }
+
+    /*
+     * Run fn on the writer thread once every Set queued before it has been
+     * applied, with no Set running concurrently
+     */
+    void runExclusive(const std::function<void()>& fn) {
+        Writer w;
+        w.exclusive = &fn;
+        wait(w);
+    }
+
+    /*
+     * How long the oldest queued commit has been waiting for the writer, 0 if
+     * none is; grows while the writer cannot keep up
+     */
+    uint64_t queueDelay() const {
+        uint64_t head = headEnqueued.load(std::memory_order_relaxed);
+        uint64_t now = ServerMetrics::now();
+        return head != 0 && now > head ? now - head : 0;
+    }
+
+    void printStats(std::ostream& os) {
+        uint64_t batches = numBatches.load();
+        uint64_t records = numRecords.load();
+        os << "[group commit] batches: " << batches
+           << ", records: " << records
+           << ", avg batch: " << (batches ? (double) records / batches : 0)
+           << ", max batch: " << maxBatchSeen.load()
+           << ", avg sync: " << (batches ? (double) syncMicros.load() / batches : 0)
+           << " us" << std::endl;
+        os << "[group commit] batch size histogram:";
+        for (int b = 0; b < kBuckets; b++) {
+            os << " " << (1 << b) << (b == kBuckets - 1 ? "+" : "")
+               << ":" << batchSizeHist[b].load();
+        }
+        os << std::endl;
+    }
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Consistent hashing of keys onto nodes
+ *
+ * Every node owns virtualNodes points on a ring of 64-bit hashes, at the
+ * hashes of "<node name>#<i>", and a key belongs to the node of the first
+ * point at or after the key's hash (wrapping around). Adding a node only takes
+ * the keys that fall just before its points, about 1/N of them, and removing
+ * one hands its keys to the nodes of the following points. A node keeps its
+ * index for as long as it is on the ring.
+ */
+class HashRing {
+public:
+    static const size_t kDefaultVirtualNodes = 128;
+
+private:
+    size_t virtualNodes;
+    std::vector<std::string> nodes;
+    std::vector<bool> present;
+    // (hash, node index), sorted by hash
+    std::vector<std::pair<uint64_t, size_t>> points;
+
+    void sortPoints() {
+        std::sort(points.begin(), points.end());
+    }
+
+public:
+    HashRing(size_t virtualNodes = kDefaultVirtualNodes)
+        : virtualNodes(std::max<size_t>(1, virtualNodes)) {}
+
+    // FNV-1a with the MurmurHash3 finalizer, so that similar keys spread out
+    static uint64_t hash(const std::string& s) {
+        uint64_t h = 14695981039346656037ULL;
+        for (unsigned char c : s) {
+            h = (h ^ c) * 1099511628211ULL;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // Put name on the ring; returns its index
+    size_t addNode(const std::string& name) {
+        size_t node = nodes.size();
+        nodes.push_back(name);
+        present.push_back(true);
+        for (size_t i = 0; i < virtualNodes; i++) {
+            points.emplace_back(hash(name + "#" + std::to_string(i)), node);
+        }
+        sortPoints();
+        return node;
+    }
+
+    // Take node off the ring; its keys go to the other nodes
+    void removeNode(size_t node) {
+        if (node >= nodes.size() || !present[node]) {
+            return;
+        }
+        present[node] = false;
+        points.erase(std::remove_if(points.begin(), points.end(),
+                                    [node](const std::pair<uint64_t, size_t>& p) {
+                                        return p.second == node;
+                                    }),
+                     points.end());
+    }
+
+    // Index of the node that owns key; the ring must not be empty
+    size_t nodeFor(const std::string& key) const {
+        if (points.size() == virtualNodes) {
+            return points.front().second;
+        }
+        auto it = std::lower_bound(points.begin(), points.end(),
+                                   std::make_pair(hash(key), (size_t) 0));
+        return it == points.end() ? points.front().second : it->second;
+    }
+
+    const std::string& name(size_t node) const {
+        return nodes[node];
+    }
+
+    bool contains(size_t node) const {
+        return node < nodes.size() && present[node];
+    }
+
+    // Indexes handed out so far, including removed nodes
+    size_t capacity() const {
+        return nodes.size();
+    }
+
+    bool empty() const {
+        return points.empty();
+    }
+};
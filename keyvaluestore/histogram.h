@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Log-bucketed latency histogram in the style of HdrHistogram
+ *
+ * Values below 2^kSubBits get a bucket each; above that every power of two is
+ * split into 2^(kSubBits-1) linear sub-buckets, so a value is reported with a
+ * relative error below 2^-(kSubBits-1) (~1.6%) over the whole uint64_t range.
+ * Recording is a shift and an increment; histograms of several threads are
+ * combined with merge().
+ */
+class LatencyHistogram {
+private:
+    static const int kSubBits = 7;
+    static const uint64_t kSubCount = 1 << kSubBits;
+    static const uint64_t kHalfCount = kSubCount / 2;
+    static const int kNumBuckets = (64 - kSubBits + 1) * kHalfCount + kHalfCount;
+
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t minValue = UINT64_MAX;
+    uint64_t maxValue = 0;
+    double sum = 0;
+
+    static int indexFor(uint64_t v) {
+        if (v < kSubCount) {
+            return v;
+        }
+        int shift = 63 - __builtin_clzll(v) - kSubBits + 1;
+        return shift * kHalfCount + (v >> shift);
+    }
+
+    // Smallest and largest value that land in bucket index
+    static uint64_t lowestIn(int index) {
+        if (index < (int) kSubCount) {
+            return index;
+        }
+        int shift = index / kHalfCount - 1;
+        return (uint64_t) (index - shift * kHalfCount) << shift;
+    }
+
+    static uint64_t highestIn(int index) {
+        if (index < (int) kSubCount) {
+            return index;
+        }
+        int shift = index / kHalfCount - 1;
+        return lowestIn(index) + ((uint64_t) 1 << shift) - 1;
+    }
+
+public:
+    LatencyHistogram() : counts(kNumBuckets, 0) {}
+
+    void record(uint64_t value) {
+        counts[indexFor(value)]++;
+        total++;
+        sum += value;
+        minValue = std::min(minValue, value);
+        maxValue = std::max(maxValue, value);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (int i = 0; i < kNumBuckets; i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        minValue = std::min(minValue, other.minValue);
+        maxValue = std::max(maxValue, other.maxValue);
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    uint64_t min() const {
+        return total ? minValue : 0;
+    }
+
+    uint64_t max() const {
+        return maxValue;
+    }
+
+    double mean() const {
+        return total ? sum / total : 0;
+    }
+
+    /*
+     * Value below which a fraction q (0..1) of the recorded values fall,
+     * reported as the middle of its bucket and clamped to [min, max]
+     */
+    uint64_t percentile(double q) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, (uint64_t) (q * total + 0.5));
+        uint64_t seen = 0;
+        for (int i = 0; i < kNumBuckets; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                uint64_t mid = lowestIn(i) + (highestIn(i) - lowestIn(i)) / 2;
+                return std::max(minValue, std::min(maxValue, mid));
+            }
+        }
+        return maxValue;
+    }
+};
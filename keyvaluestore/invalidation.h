@@ -0,0 +1,143 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Fan-out of changed keys to clients that cache values
+ *
+ * The log writer publishes every key it applies. Each subscriber has its own
+ * queue of pending keys that its Subscribe stream drains in messages of up to
+ * kMaxKeysPerMessage keys. A subscriber that falls more than kMaxPendingKeys
+ * behind loses its queue and is told to drop its whole cache instead, so a slow
+ * client costs bounded memory. With no subscribers publishing is one atomic
+ * load.
+ */
+class InvalidationHub {
+public:
+    static const size_t kMaxPendingKeys = 100000;
+    static const size_t kMaxKeysPerMessage = 1024;
+
+    class Subscriber {
+    private:
+        friend class InvalidationHub;
+
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::vector<std::string> pending;
+        bool overflowed = false;
+        // notify is due on the next publish
+        bool armed = false;
+        // called instead of waking wait() when keys arrive for an armed subscriber
+        std::function<void()> notify;
+
+        void push(const std::string& key) {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (overflowed) {
+                return;
+            }
+            if (pending.size() == kMaxPendingKeys) {
+                overflowed = true;
+                std::vector<std::string>().swap(pending);
+            } else {
+                pending.push_back(key);
+            }
+            if (armed) {
+                armed = false;
+                notify();
+            }
+            cv.notify_one();
+        }
+
+        // With mtx held
+        bool takeLocked(std::vector<std::string>& keys, bool& reset) {
+            keys.clear();
+            reset = overflowed;
+            overflowed = false;
+            size_t n = std::min(pending.size(), kMaxKeysPerMessage);
+            keys.assign(std::make_move_iterator(pending.end() - n),
+                        std::make_move_iterator(pending.end()));
+            pending.resize(pending.size() - n);
+            return reset || n > 0;
+        }
+
+    public:
+        /*
+         * Move the next batch of keys into keys; reset is set if keys were
+         * dropped. Returns false if nothing is pending, and then arms notify.
+         */
+        bool take(std::vector<std::string>& keys, bool& reset) {
+            std::lock_guard<std::mutex> lk(mtx);
+            if (takeLocked(keys, reset)) {
+                return true;
+            }
+            armed = notify != nullptr;
+            return false;
+        }
+
+        // take(), waiting up to timeout for keys to arrive
+        bool wait(std::vector<std::string>& keys, bool& reset,
+                  std::chrono::milliseconds timeout) {
+            std::unique_lock<std::mutex> lk(mtx);
+            cv.wait_for(lk, timeout, [this] { return overflowed || !pending.empty(); });
+            return takeLocked(keys, reset);
+        }
+    };
+
+private:
+    std::mutex mtx;
+    std::vector<std::shared_ptr<Subscriber>> subscribers;
+    std::atomic<size_t> numSubscribers{0};
+    std::atomic<uint64_t> numPublished{0};
+
+public:
+    /*
+     * Start queueing published keys for a new subscriber
+     * notify, if given, is called from the publishing thread once keys arrive
+     * after take() found none; otherwise the subscriber polls with wait().
+     */
+    std::shared_ptr<Subscriber> subscribe(std::function<void()> notify = nullptr) {
+        auto subscriber = std::make_shared<Subscriber>();
+        subscriber->notify = notify;
+        std::lock_guard<std::mutex> lk(mtx);
+        subscribers.push_back(subscriber);
+        numSubscribers = subscribers.size();
+        return subscriber;
+    }
+
+    void unsubscribe(const std::shared_ptr<Subscriber>& subscriber) {
+        std::lock_guard<std::mutex> lk(mtx);
+        subscribers.erase(std::remove(subscribers.begin(), subscribers.end(), subscriber),
+                          subscribers.end());
+        numSubscribers = subscribers.size();
+    }
+
+    // key has a new value (or none)
+    void publish(const std::string& key) {
+        if (numSubscribers == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lk(mtx);
+        for (auto& subscriber : subscribers) {
+            subscriber->push(key);
+        }
+        numPublished++;
+    }
+
+    size_t size() const {
+        return numSubscribers;
+    }
+
+    // Keys published while there were subscribers
+    uint64_t published() const {
+        return numPublished;
+    }
+};
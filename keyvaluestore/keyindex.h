@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#define TBB_PREVIEW_CONCURRENT_ORDERED_CONTAINERS 1
+#include "tbb/concurrent_set.h"
+
+/*
+ * Sorted index of the keys of the store, for prefix and range scans
+ *
+ * A tbb::concurrent_set (a skiplist) takes inserts while it is traversed, but
+ * cannot erase concurrently with either. Inserts and every step of a Cursor
+ * therefore share a lock that erase takes exclusively. An erase bumps the
+ * epoch, and a Cursor that sees a new epoch seeks again past the last key it
+ * returned, since its position may have been erased.
+ */
+class KeyIndex {
+private:
+    typedef tbb::concurrent_set<std::string> set_type;
+
+    set_type keys;
+    mutable std::shared_mutex mtx;
+    std::atomic<uint64_t> epoch{0};
+
+public:
+    /*
+     * Walks the index in key order
+     * Keys inserted during the walk may or may not be seen; keys that are
+     * erased may be returned until the erase.
+     */
+    class Cursor {
+    private:
+        const KeyIndex& index;
+        set_type::const_iterator it;
+        uint64_t epoch;
+        // key to seek to on a new epoch; inclusive before the first next()
+        std::string resumeKey;
+        bool inclusive;
+
+        void reposition() {
+            it = inclusive ? index.keys.lower_bound(resumeKey) :
+                             index.keys.upper_bound(resumeKey);
+            epoch = index.epoch;
+        }
+
+    public:
+        Cursor(const KeyIndex& index) : index(index) {
+            seek(std::string());
+        }
+
+        // Continue at the first key >= key
+        void seek(const std::string& key) {
+            std::shared_lock<std::shared_mutex> lk(index.mtx);
+            resumeKey = key;
+            inclusive = true;
+            reposition();
+        }
+
+        // Continue at the first key > key
+        void seekAfter(const std::string& key) {
+            std::shared_lock<std::shared_mutex> lk(index.mtx);
+            resumeKey = key;
+            inclusive = false;
+            reposition();
+        }
+
+        // Copy the next key into key; false at the end of the index
+        bool next(std::string& key) {
+            std::shared_lock<std::shared_mutex> lk(index.mtx);
+            if (epoch != index.epoch) {
+                reposition();
+            }
+            if (it == index.keys.end()) {
+                return false;
+            }
+            key = *it;
+            it++;
+            resumeKey = key;
+            inclusive = false;
+            return true;
+        }
+    };
+
+    void insert(const std::string& key) {
+        std::shared_lock<std::shared_mutex> lk(mtx);
+        keys.insert(key);
+    }
+
+    size_t size() const {
+        return keys.size();
+    }
+
+    /*
+     * Erase the keys of candidates for which gone(key) holds
+     * gone is evaluated with inserts stopped, so a key that is inserted
+     * again concurrently is either kept or inserted after the erase.
+     * Returns the number of keys erased.
+     */
+    template <class Pred>
+    size_t eraseIf(const std::vector<std::string>& candidates, Pred gone) {
+        if (candidates.empty()) {
+            return 0;
+        }
+        std::unique_lock<std::shared_mutex> lk(mtx);
+        size_t erased = 0;
+        for (auto& key : candidates) {
+            if (gone(key)) {
+                erased += keys.unsafe_erase(key);
+            }
+        }
+        if (erased > 0) {
+            epoch++;
+        }
+        return erased;
+    }
+};
@@ -1,3 +1,4 @@
+#include <atomic>
 #include <chrono> 
 #include <thread> 
 #include <random>
@@ -6,26 +7,53 @@
 #include <fstream>
 #include <time.h>       /* time */
 #include <memory>
+#include <sstream>
 #include <unistd.h> // getopt
 #include <vector>
 
 #include "client.h"
+#include "histogram.h"
+#include "workload.h"
 
 using namespace std;
 
 
-unique_ptr<KeyValueStoreClient> client;
+// channels to each server, by its index on the hash ring
+vector<vector<shared_ptr<Channel>>> node_channels;
+// one blocking client per channel of every server, thread i uses
+// clients[i % clients.size()]
+vector<unique_ptr<RoutingClient>> clients;
 //ofstream results ("results.txt");
 
-string *keys;
-string *values;
-char *writes;
-int *updates;
-
-// per-thread read and write latencies
-vector< vector<uint64_t> >r_latencies;
-vector< vector<uint64_t> >w_latencies;
+unique_ptr<Workload> workload;
+unique_ptr<TraceWriter> trace_writer;
+// written pairs expire after this many ms, 0 for never
+uint64_t write_ttl_ms = 0;
+// reads of keys that did not exist, e.g. because they expired
+atomic<uint64_t> read_misses(0);
+// shared by all clients of the run, if enabled
+shared_ptr<ReadCache> read_cache;
+// one per server
+vector<unique_ptr<CacheInvalidator>> cache_invalidators;
+// traces the requests it samples, if enabled
+unique_ptr<Tracer> tracer;
+
+// Op types reported separately, in output order
+const OpType kOpTypes[] = {kRead, kInsert, kUpdate, kScan, kReadModifyWrite};
+const char* kOpNames[] = {"read", "insert", "update", "scan", "read_modify_write"};
+const int kNumOpTypes = 5;
+
+// per-thread latencies in ns, by op type
+vector< vector<LatencyHistogram> > latencies;
+// per-thread ops a server turned away to shed load, by op type; they count
+// towards neither latencies nor ops_per_second
+vector< vector<uint64_t> > rejected;
+// ShedCalls() when the thread last took the rejections of an op
+thread_local uint64_t shed_seen = 0;
 vector<double> throughputs;
+// per-thread ops completed in each second since the benchmark started
+vector< vector<uint64_t> > ops_per_second;
+std::chrono::high_resolution_clock::time_point bench_start;
 
 struct ConfigOptions {
     int threads = 1;
@@ -34,119 +62,143 @@ struct ConfigOptions {
     int num_elems = 0;
     int percent_writes = 0;
     int value_size = 512;
+    // values sizes are uniform in [value_size, max_value_size]
+    int max_value_size = 0;
+    // share of each value that compresses well, the rest is random
+    double compressibility = 1;
     int load = 1;
-    string server_addr;
+    // pairs per MultiSet when loading, 1 to load with Set, 0 with BulkLoad
+    int load_batch = 0;
+    // YCSB core workload a-f, 0 for the -w mix
+    char preset = 0;
+    string distribution = "uniform";
+    double zipf_theta = 0.99;
+    // open loop: total ops/s issued on schedule, 0 for closed loop
+    double target_rate = 0;
+    // record the generated ops to / replay ops from these files
+    string trace_out;
+    string trace_in;
+    // write results as JSON to this file
+    string output_file;
+    // outstanding requests per thread, one run per depth; 0 is synchronous
+    vector<int> depths = {0};
+    // channels (connections) to each server, shared by all threads
+    int num_channels = 1;
+    // points of every server on the hash ring that spreads keys over them
+    int virtual_nodes = HashRing::kDefaultVirtualNodes;
+    // print the server's Stats after the run
+    bool server_stats = false;
+    // promote the server (a follower) to primary before the run
+    bool promote = false;
+    // TTL of the pairs written, 0 for none
+    uint64_t ttl_ms = 0;
+    // client-side read cache size, 0 to disable it
+    uint64_t cache_mb = 0;
+    // cached values are dropped after this long, 0 to rely on invalidations
+    uint64_t cache_lease_ms = 0;
+    // keep the cache coherent with the server's invalidation stream
+    int cache_invalidations = 1;
+    // write the traces of sampled requests to this file, empty for none
+    string chrome_trace;
+    // trace one in this many requests
+    uint32_t trace_sample_every = 1000;
+    // make the servers trace one in this many requests, -1 to leave them as they are
+    int64_t server_trace_sample_every = -1;
+    // keys are spread over all servers
+    vector<string> server_addrs;
     bool Validate () {
-        return ((threads >0) && (num_ops >= 0)
-             && (num_elems >= 0) && (!server_addr.empty()));
+        for (int depth : depths) {
+            if (depth < 0) return false;
+        }
+        return ((threads >0) && (num_ops >= 0) && !depths.empty() && (num_channels > 0)
+             && (num_elems >= 0) && (!server_addrs.empty()) && (virtual_nodes > 0)
+             && zipf_theta > 0 && zipf_theta < 1
+             && compressibility >= 0 && compressibility <= 1 && load_batch >= 0);
     }
 };
 
 void PrintUsage () {
-    cerr << "Usage: ./kvclient -s server_addr:port -e num_elems -n num_ops [-t threads=1] "
-        << "[-v val_size=512] [-w %_writes=0] [-l load_data=1]" << endl;
+    cerr << "Usage: ./kvclient -s server_addr:port[,server_addr:port...] -e num_elems "
+        << "-n num_ops [-t threads=1] [-v val_size=512] [-V max_val_size=val_size] [-C compressibility=1] "
+        << "[-w %_writes=0] "
+        << "[-W ycsb_workload=a..f] [-d distribution=uniform|zipfian|latest|hotspot] "
+        << "[-z zipf_theta=0.99] [-r target_ops_per_sec=0] [-T record_trace_file] "
+        << "[-R replay_trace_file] [-l load_data=1] [-b load_batch=0] "
+        << "[-o json_output_file] [-a queue_depths=0] [-c channels=1] [-x ttl_ms=0] "
+        << "[-k cache_mb=0] [-L cache_lease_ms=0] [-I cache_invalidations=1] "
+        << "[-N virtual_nodes=" << HashRing::kDefaultVirtualNodes << "] "
+        << "[-g chrome_trace_file] [-y trace_sample_every=1000] "
+        << "[-Y server_trace_sample_every] [-S] [-P]" << endl;
 }
 
-void GeneratePaddedStr(string& s, int i, int padding) {
-    string i_str = to_string(i);
-    s.append(padding-i_str.size(), '0');
-    s.append(i_str.data(), i_str.size());
-    // cout << "generated str: " << s << endl;
+// Whether a server has turned away an RPC of the thread since TakeShed()
+bool OpShed() {
+    return ShedCalls() != shed_seen;
 }
 
-void PopulateKeysAndValuesAndOps(const ConfigOptions& options) {
-
-    std::random_device device;
-    int random_seed = device();
-    std::mt19937 generator(random_seed);
-
-    for (int i = 0; i < options.num_elems + options.num_ops; i++) {
-        GeneratePaddedStr(keys[i], i, 128);
-        GeneratePaddedStr(values[i], i, options.value_size);
-    }
-
-    srand (time(NULL));
-    // Populate ops with reads/writes as per write_percent.
-    std::uniform_int_distribution<int> percent_distribution(1, 100);
-    for (int i = 0; i < options.num_ops; i++) {
-        if (percent_distribution(generator) <= options.percent_writes) {
-            if (rand() % 100 < 50)
-                writes[i] = 'w'; // writes
-            else
-                writes[i] = 'u'; // updates
-        }
-        else 
-            writes[i] = 'r';
-    }
-
-    // indices to keys that will be updated
-    srand (time(NULL));
-    for (int i = 0; i < options.num_ops; i++) {
-        updates[i] = rand() % options.num_elems;
-    }
-
-    // Debugging feature
-    if (options.num_ops < 100 && options.num_ops > 0) {
-        cout << "Keys:" << endl;
-        for (int i = 0; i < options.num_ops; i++) {
-            cout << keys[i] << " ";
-        }
-        cout << endl;
-        cout << "Operations:" << endl;
-        for (int i = 0; i < options.num_ops; i++) {
-            cout << writes[i] << " ";
-        }
-        cout << endl;
-    }
+// OpShed(), for the op that is done now
+bool TakeShed() {
+    bool shed = OpShed();
+    shed_seen = ShedCalls();
+    return shed;
 }
 
-void bench(char write, string key, const string& value, int num_elems) {
-    if (write == 'r') {
+void bench(RoutingClient& client, const Operation& op, const string& key) {
+    string value;
+    if (op.type == kRead) {
         // cout << "Read " << key << endl;
-        string resp = client->Get(key);
-        if (resp.empty()) {
-            cerr << "Error reading key: " << key << endl;
+        string resp;
+        if (!client.Get(key, &resp) && !OpShed()) {
+            read_misses++;
         }
 	//Uncomment the following for verification
 	//if(resp.compare(value) != 0)
 	//	cerr << "Get value is incorrect\n";
         // assert((const valueType)(values[0]) == value);
+    } else if (op.type == kScan) {
+        string resume_token;
+        auto pairs = client.Scan(key, "", op.size, &resume_token);
+        if (pairs.empty() && !OpShed()) {
+            cerr << "Error scanning from key: " << key << endl;
+        }
     } else {
-        // We want to insert new keys.
-        // [0..num_elems] already in the map
+        if (op.type == kReadModifyWrite && !client.Get(key, &value) && !OpShed()) {
+            read_misses++;
+        }
+        // Inserts write new keys, [0..num_elems] already in the map
         // cout << "Inserting " << key << endl;
-        if (!client->Set(key, value)) {
+        workload->value(op.key, op.size, value);
+        if (!client.Set(key, value, write_ttl_ms) && !OpShed()) {
             cerr << "Client set failed for key: " << key << endl;
         }
     }
 };
 
-void computeLatency(/*int thread_id,*/ const vector< vector<uint64_t> >& latencies) {
-    
-    //cout << "Sorting latencies..." << endl;
-    // sort(latencies.begin(), latencies.end());
-    // results[thread_id] << "99th percentile latency: "
-    //     << latencies[99*latencies.size()/100] << " us\n";
-
-    // if (latencies.size() % 2 == 0)
-    //     results[thread_id] << "Median latency: " << (latencies[latencies.size()/2-1]
-    //                                  + latencies[latencies.size()/2])/2 << " us\n";
-    // else
-    //     results[thread_id] << "Median latency: " << latencies[latencies.size()/2] << " us\n";
-
-    double avg = 0;
-    uint64_t size = 0;
-    for (auto lat : latencies) {
-        if (lat.empty()) continue;
-        for (auto n : lat) {
-            avg += n;
+int opIndex(OpType type) {
+    for (int i = 0; i < kNumOpTypes; i++) {
+        if (kOpTypes[i] == type) {
+            return i;
         }
-        size += lat.size();
     }
-    if (size == 0) return;
-    avg /= size;
-    // results[thread_id] << "Average latency: " << avg << " us\n";
-    cout << "Average latency: " << avg << " us" << endl;
+    return 0;
+}
+
+LatencyHistogram mergeLatencies(const vector<LatencyHistogram>& latencies) {
+    LatencyHistogram merged;
+    for (auto& h : latencies) {
+        merged.merge(h);
+    }
+    return merged;
+}
+
+void computeLatency(const LatencyHistogram& h) {
+    if (h.count() == 0) return;
+    cout << "Average latency: " << h.mean() / 1000 << " us" << endl;
+    cout << "p50: " << h.percentile(0.5) / 1000.0
+         << " us, p90: " << h.percentile(0.9) / 1000.0
+         << " us, p99: " << h.percentile(0.99) / 1000.0
+         << " us, p99.9: " << h.percentile(0.999) / 1000.0
+         << " us, max: " << h.max() / 1000.0 << " us" << endl;
 }
 
 void computeThroughput(const vector<double>& throughputs) {
@@ -158,49 +210,276 @@ void computeThroughput(const vector<double>& throughputs) {
     cout << "Average throughput: " << avg << " ops/s" << endl;
 }
 
-void ThreadWork(int thread_id, const ConfigOptions& options) {
+vector<uint64_t> mergeOpsPerSecond() {
+    vector<uint64_t> merged;
+    for (auto& thread : ops_per_second) {
+        if (thread.size() > merged.size()) {
+            merged.resize(thread.size(), 0);
+        }
+        for (size_t s = 0; s < thread.size(); s++) {
+            merged[s] += thread[s];
+        }
+    }
+    return merged;
+}
+
+void writeLatencyJson(ostream& out, const char* name, const LatencyHistogram& h) {
+    out << "    \"" << name << "\": {\"count\": " << h.count()
+        << ", \"mean_ns\": " << (uint64_t) h.mean()
+        << ", \"p50_ns\": " << h.percentile(0.5)
+        << ", \"p90_ns\": " << h.percentile(0.9)
+        << ", \"p99_ns\": " << h.percentile(0.99)
+        << ", \"p999_ns\": " << h.percentile(0.999)
+        << ", \"max_ns\": " << h.max() << "}";
+}
+
+void writeJson(const string& path, const ConfigOptions& options, int depth,
+               const vector<LatencyHistogram>& merged, const vector<uint64_t>& merged_rejected,
+               const vector<uint64_t>& per_second) {
+    ofstream out(path);
+    out << "{" << endl;
+    out << "  \"config\": {\"threads\": " << options.threads
+        << ", \"num_elems\": " << options.num_elems
+        << ", \"num_ops\": " << options.num_ops
+        << ", \"workload\": \"" << (options.preset ? string(1, options.preset) : "custom")
+        << "\", \"percent_writes\": " << options.percent_writes
+        << ", \"distribution\": \"" << options.distribution
+        << "\", \"target_rate\": " << options.target_rate
+        << ", \"depth\": " << depth
+        << ", \"servers\": " << options.server_addrs.size()
+        << ", \"channels\": " << options.num_channels
+        << ", \"value_size\": " << options.value_size
+        << ", \"max_value_size\": " << options.max_value_size
+        << ", \"compressibility\": " << options.compressibility
+        << ", \"ttl_ms\": " << options.ttl_ms
+        << ", \"cache_mb\": " << options.cache_mb
+        << ", \"cache_lease_ms\": " << options.cache_lease_ms
+        << ", \"cache_invalidations\": " << options.cache_invalidations << "}," << endl;
+    out << "  \"latency\": {" << endl;
+    for (int t = 0; t < kNumOpTypes; t++) {
+        writeLatencyJson(out, kOpNames[t], merged[t]);
+        out << (t < kNumOpTypes - 1 ? "," : "") << endl;
+    }
+    out << "  }," << endl;
+    double avg = 0;
+    for (auto t : throughputs) {
+        avg += t;
+    }
+    out << "  \"throughput_ops_per_sec\": " << avg / throughputs.size() << "," << endl;
+    out << "  \"read_misses\": " << read_misses << "," << endl;
+    out << "  \"rejected\": {";
+    for (int t = 0; t < kNumOpTypes; t++) {
+        out << (t ? ", " : "") << "\"" << kOpNames[t] << "\": " << merged_rejected[t];
+    }
+    out << "}," << endl;
+    if (read_cache) {
+        ReadCache::Stats cache = read_cache->stats();
+        out << "  \"cache\": {\"hits\": " << cache.hits << ", \"misses\": " << cache.misses
+            << ", \"inserts\": " << cache.inserts << ", \"raced\": " << cache.raced
+            << ", \"evictions\": " << cache.evictions
+            << ", \"invalidations\": " << cache.invalidations
+            << ", \"expirations\": " << cache.expirations
+            << ", \"entries\": " << cache.entries << ", \"bytes\": " << cache.bytes
+            << "}," << endl;
+    }
+    out << "  \"ops_per_second\": [";
+    for (size_t s = 0; s < per_second.size(); s++) {
+        out << (s ? ", " : "") << per_second[s];
+    }
+    out << "]" << endl << "}" << endl;
+    if (!out.good()) {
+        cerr << "Writing " << path << " failed" << endl;
+    }
+}
+
+// Next operation for a thread; false once its part of the trace is replayed
+bool nextOp(Operation& op, std::mt19937_64& generator, TraceReader* trace) {
+    if (trace) {
+        if (!trace->next(op)) {
+            return false;
+        }
+    } else {
+        op = workload->next(generator);
+    }
+    if (trace_writer) {
+        trace_writer->write(op);
+    }
+    return true;
+}
+
+/*
+ * Account for an operation of thread_id that was issued at start and is done
+ * now; shed if a server turned it away
+ */
+void recordOp(int thread_id, const Operation& op, bool replaying,
+              std::chrono::high_resolution_clock::time_point start, bool shed) {
+    // stop clock for measuting latency
+    auto stop = std::chrono::high_resolution_clock::now();
+    if (shed) {
+        rejected[thread_id][opIndex(op.type)]++;
+        return;
+    }
+    if (op.type == kInsert && !replaying) {
+        workload->acknowledge(op.key);
+    }
+
+    auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>
+        (stop-start).count();
+    latencies[thread_id][opIndex(op.type)].record(latency);
+    vector<uint64_t>& completed = ops_per_second[thread_id];
+    size_t second = std::chrono::duration_cast<std::chrono::seconds>
+        (stop-bench_start).count();
+    if (second >= completed.size()) {
+        completed.resize(second + 1, 0);
+    }
+    completed[second]++;
+}
+
+// Issue op on client and call recordOp() from its completion callback
+void benchAsync(AsyncKeyValueStoreClient& client, int thread_id, const Operation& op,
+                const string& key, bool replaying,
+                std::chrono::high_resolution_clock::time_point start) {
+    // Callbacks run on the thread's Poll(), so TakeShed() in one only sees
+    // the RPC that just completed
+    auto done = [thread_id, op, replaying, start](bool shed) {
+        recordOp(thread_id, op, replaying, start, shed);
+    };
+    if (op.type == kRead) {
+        client.Get(key, [key, done](bool ok, bool found, const string& value) {
+            bool shed = TakeShed();
+            if (!ok && !shed) {
+                cerr << "Error reading key: " << key << endl;
+            } else if (ok && !found) {
+                read_misses++;
+            }
+            done(shed);
+        });
+    } else if (op.type == kScan) {
+        client.Scan(key, op.size, [key, done](bool ok, size_t num_pairs) {
+            bool shed = TakeShed();
+            if ((!ok || num_pairs == 0) && !shed) {
+                cerr << "Error scanning from key: " << key << endl;
+            }
+            done(shed);
+        });
+    } else if (op.type == kReadModifyWrite) {
+        // The write goes out once the read is back
+        client.Get(key, [&client, key, op, done](bool ok, bool found,
+                                                 const string& value) {
+            bool read_shed = TakeShed();
+            if (!ok && !read_shed) {
+                cerr << "Error reading key: " << key << endl;
+            } else if (ok && !found) {
+                read_misses++;
+            }
+            string new_value;
+            workload->value(op.key, op.size, new_value);
+            client.Set(key, new_value, write_ttl_ms, [key, done, read_shed](bool ok) {
+                bool shed = TakeShed();
+                if (!ok && !shed) {
+                    cerr << "Client set failed for key: " << key << endl;
+                }
+                done(shed || read_shed);
+            });
+        });
+    } else {
+        string value;
+        workload->value(op.key, op.size, value);
+        client.Set(key, value, write_ttl_ms, [key, done](bool ok) {
+            bool shed = TakeShed();
+            if (!ok && !shed) {
+                cerr << "Client set failed for key: " << key << endl;
+            }
+            done(shed);
+        });
+    }
+}
+
+/*
+ * Run a thread's share of the operations with up to depth of them in flight
+ * (depth > 0, asynchronous client) or one at a time (depth 0, blocking client)
+ */
+void ThreadWork(int thread_id, const ConfigOptions& options, int depth) {
     // results[thread_id] = ofstream(string("results").append(to_string(thread_id)));
     // assert(results[thread_id].good());
 
-    int num_elems = options.num_elems, num_ops = options.num_ops,
-        ops_per_thread = options.ops_per_thread;
+    int ops_per_thread = options.ops_per_thread;
 
-    r_latencies[thread_id].reserve(num_elems + num_ops);
-    w_latencies[thread_id].reserve(num_elems + num_ops);
-    srand (time(NULL));
+    std::random_device device;
+    std::mt19937_64 generator(device() + thread_id);
+    unique_ptr<TraceReader> trace;
+    if (!options.trace_in.empty()) {
+        trace.reset(new TraceReader(options.trace_in, thread_id, options.threads));
+    }
+    RoutingClient& client = *clients[thread_id % clients.size()];
+    unique_ptr<AsyncKeyValueStoreClient> async_client;
+    if (depth > 0) {
+        async_client.reset(new AsyncKeyValueStoreClient(client.Ring(), node_channels));
+        async_client->SetCache(read_cache);
+    }
+    // In open loop mode every thread issues its share of target_rate on a
+    // fixed schedule and latency counts from the scheduled send time, so a
+    // slow response does not hide the requests queued up behind it
+    bool open_loop = options.target_rate > 0;
+    std::chrono::duration<double> interval(
+            open_loop ? options.threads / options.target_rate : 0);
+    auto scheduled = bench_start + std::chrono::duration_cast<
+            std::chrono::high_resolution_clock::duration>(interval * thread_id / options.threads);
 
     // start clock for measuting throughput
     auto start = std::chrono::high_resolution_clock::now();
 
-    uint64_t thread_offset = thread_id*ops_per_thread;
-    for (uint64_t i = 0; i < ops_per_thread; i++) {
-        auto offset = thread_offset+i;
-        auto write = writes[offset];
-        string key, value;
-
-        if (write == 'r' || write == 'u') {
-            // can also use index in updates for random reads
-            key = keys[updates[offset]];
-            value = values[updates[offset]];
-        }
-        else if (write == 'w') {
-            key = keys[num_elems + offset];
-            value = values[num_elems + offset];
+    uint64_t issued = 0;
+    bool exhausted = false;
+    string key;
+    while (true) {
+        // Keep up to depth operations in flight, or just one without a queue
+        size_t window = depth > 0 ? depth : 1;
+        while (!exhausted && (!async_client || async_client->Outstanding() < window)) {
+            if (issued == (uint64_t) ops_per_thread) {
+                exhausted = true;
+                break;
+            }
+            std::chrono::high_resolution_clock::time_point op_start;
+            if (open_loop) {
+                if (async_client && std::chrono::high_resolution_clock::now() < scheduled) {
+                    break;
+                }
+                std::this_thread::sleep_until(scheduled);
+                op_start = scheduled;
+                scheduled += std::chrono::duration_cast<
+                        std::chrono::high_resolution_clock::duration>(interval);
+            } else {
+                // start clock for measuting latency
+                op_start = std::chrono::high_resolution_clock::now();
+            }
+            Operation op;
+            if (!nextOp(op, generator, trace.get())) {
+                exhausted = true;
+                break;
+            }
+            workload->key(op.key, key);
+            issued++;
+            if (async_client) {
+                benchAsync(*async_client, thread_id, op, key, trace != nullptr, op_start);
+            } else {
+                bench(client, op, key);
+                recordOp(thread_id, op, trace != nullptr, op_start, TakeShed());
+            }
         }
-
-        std::chrono::time_point<std::chrono::high_resolution_clock> start, stop;
-        // start clock for measuting latency
-        start = std::chrono::high_resolution_clock::now();
-        bench(write, key, value, num_elems);
-        // stop clock for measuting latency
-        stop = std::chrono::high_resolution_clock::now();
-
-        auto latency = std::chrono::duration_cast<std::chrono::microseconds>
-            (stop-start).count();
-        if (write == 'r') {
-            r_latencies[thread_id].push_back(latency);
+        if (!async_client || async_client->Outstanding() == 0) {
+            if (exhausted) {
+                break;
+            }
+            // Open loop and ahead of schedule
+            std::this_thread::sleep_until(scheduled);
+        } else if (open_loop && !exhausted &&
+                   async_client->Outstanding() < (size_t) depth) {
+            // Wake up for the next scheduled send even if nothing completes
+            async_client->Poll(std::chrono::system_clock::now() +
+                               (scheduled - std::chrono::high_resolution_clock::now()));
         } else {
-            w_latencies[thread_id].push_back(latency);
+            async_client->Poll();
         }
     }
 
@@ -210,58 +489,255 @@ void ThreadWork(int thread_id, const ConfigOptions& options) {
         (stop-start).count();
     //cout << "Latency: " << latency << " ns\n";
     // results[thread_id] << "Throughput: " << (options.num_ops*1E9/latency) << " op/s\n";
-    throughputs[thread_id] = options.num_ops*1E9/latency;
+    throughputs[thread_id] = issued*options.threads*1E9/latency;
 }
 
-void RunBenchmark (const ConfigOptions& options) {
+void LoadData(const ConfigOptions& options) {
+    RoutingClient& client = *clients[0];
+    auto load_start = std::chrono::high_resolution_clock::now();
+    std::mt19937_64 generator(42);
+    vector<pair<string, string>> batch;
+    unique_ptr<BulkLoadStream> bulk;
+    if (options.load_batch == 0) {
+        bulk = client.BulkLoad(options.num_elems, write_ttl_ms);
+    }
+    uint64_t bytes = 0;
+    string key, value;
+    for (int i = 0; i < options.num_elems; i++) {
+        workload->key(i, key);
+        workload->value(i, workload->valueSize(generator), value);
+        bytes += key.size() + value.size();
+        // cout << "Inserting " << key << endl;
+        if (bulk) {
+            if (!bulk->Add(key, value)) {
+                break;
+            }
+            continue;
+        }
+        if (options.load_batch == 1) {
+            if(!client.Set(key, value, write_ttl_ms)) {
+                cerr << "Client set failed for key: " << key << endl;
+            }
+            continue;
+        }
+        batch.emplace_back(key, value);
+        if ((int) batch.size() == options.load_batch || i == options.num_elems - 1) {
+            if (!client.MultiSet(batch, write_ttl_ms)) {
+                cerr << "Client multiset failed for keys: " << batch.front().first
+                     << ".." << batch.back().first << endl;
+            }
+            batch.clear();
+        }
+    }
+    BulkLoadSummary summary;
+    if (bulk && !bulk->Finish(&summary)) {
+        cerr << "Client bulk load failed" << endl;
+    }
+    double load_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::high_resolution_clock::now() - load_start).count();
+    cout << "Load time: " << load_ms << " ms, " << bytes / 1e3 / load_ms << " MB/s" << endl;
+    if (bulk) {
+        cout << "Bulk loaded " << summary.pairs() << " pairs (" << summary.bytes() / 1e6
+             << " MB) in " << summary.buffers() << " buffers, " << summary.duration_ms()
+             << " ms on the servers" << endl;
+    }
+}
 
+// Run the operations at one queue depth and report; returns the merged latencies
+LatencyHistogram RunOps(const ConfigOptions& options, int depth) {
     std::thread workers[options.threads];
-    keys = new string [options.num_elems + options.num_ops]; // was num_ops
-    values = new string [options.num_elems + options.num_ops]; // was num_ops
-    writes = new char [options.num_ops];
-    updates = new int [options.num_ops];
-    // results = unique_ptr<ofstream>(new ofstream);
-    r_latencies.resize(options.threads);
-    w_latencies.resize(options.threads);
-    throughputs.resize(options.threads);
+    latencies.assign(options.threads, vector<LatencyHistogram>(kNumOpTypes));
+    rejected.assign(options.threads, vector<uint64_t>(kNumOpTypes, 0));
+    read_misses = 0;
+    if (read_cache) {
+        read_cache->resetStats();
+    }
+    throughputs.assign(options.threads, 0);
+    ops_per_second.assign(options.threads, vector<uint64_t>());
 
-    PopulateKeysAndValuesAndOps(options);
+    bench_start = std::chrono::high_resolution_clock::now();
+    for (int i=0; i < options.threads; i++) {
+        workers[i] = std::thread(ThreadWork, i, options, depth);
+    }
+    for (int i=0; i < options.threads; i++) {
+        workers[i].join();
+    }
 
-    // initialize kv store
-    if (options.load) {
-        for (int i = 0; i < options.num_elems; i++) {
-            // cout << "Inserting " << keys[i] << endl;
-            // string value_str (value.begin(), value.end());
-            if(!client->Set(keys[i], values[i])) {
-                cerr << "Client set failed for key: " << keys[i] << endl;
+    vector<LatencyHistogram> merged(kNumOpTypes);
+    LatencyHistogram all;
+    for (auto& thread : latencies) {
+        for (int t = 0; t < kNumOpTypes; t++) {
+            merged[t].merge(thread[t]);
+            all.merge(thread[t]);
+        }
+    }
+    vector<uint64_t> per_second = mergeOpsPerSecond();
+    vector<uint64_t> merged_rejected(kNumOpTypes, 0);
+    for (auto& thread : rejected) {
+        for (int t = 0; t < kNumOpTypes; t++) {
+            merged_rejected[t] += thread[t];
+        }
+    }
+
+    if (depth > 0) {
+        cout << "Queue depth: " << depth << endl;
+    }
+    cout << "Read latency: " << endl;
+    computeLatency(merged[opIndex(kRead)]);
+    cout << "Insert latency: " << endl;
+    computeLatency(merged[opIndex(kInsert)]);
+    cout << "Update latency: " << endl;
+    computeLatency(merged[opIndex(kUpdate)]);
+    if (merged[opIndex(kScan)].count() > 0) {
+        cout << "Scan latency: " << endl;
+        computeLatency(merged[opIndex(kScan)]);
+    }
+    if (merged[opIndex(kReadModifyWrite)].count() > 0) {
+        cout << "Read-modify-write latency: " << endl;
+        computeLatency(merged[opIndex(kReadModifyWrite)]);
+    }
+    cout << "Throughput: " << endl;
+    computeThroughput(throughputs);
+    cout << "Ops per second:";
+    for (auto ops : per_second) {
+        cout << " " << ops;
+    }
+    cout << endl;
+    for (int t = 0; t < kNumOpTypes; t++) {
+        cout << "Total " << kOpNames[t] << "s done: " << merged[t].count() << endl;
+    }
+    for (int t = 0; t < kNumOpTypes; t++) {
+        if (merged_rejected[t] > 0) {
+            cout << "Total " << kOpNames[t] << "s rejected by the server: "
+                 << merged_rejected[t] << endl;
+        }
+    }
+    cout << "Reads of missing keys: " << read_misses << endl;
+    if (read_cache) {
+        ReadCache::Stats cache = read_cache->stats();
+        uint64_t lookups = cache.hits + cache.misses;
+        cout << "Cache: " << cache.hits << " hits, " << cache.misses << " misses ("
+             << (lookups ? 100.0 * cache.hits / lookups : 0) << "% hits), "
+             << cache.evictions << " evictions, " << cache.invalidations
+             << " invalidations, " << cache.expirations << " expirations, "
+             << cache.raced << " inserts dropped by races, " << cache.entries
+             << " entries, " << cache.bytes / 1e6 << " MB" << endl;
+    }
+
+    if (!options.output_file.empty()) {
+        string path = options.output_file;
+        if (options.depths.size() > 1) {
+            // results.json -> results.depth4.json
+            size_t dot = path.rfind('.');
+            if (dot == string::npos || path.find('/', dot) != string::npos) {
+                dot = path.size();
             }
+            path.insert(dot, ".depth" + to_string(depth));
         }
+        writeJson(path, options, depth, merged, merged_rejected, per_second);
+    }
+    return all;
+}
+
+void RunBenchmark (const ConfigOptions& options) {
+
+    // results = unique_ptr<ofstream>(new ofstream);
+
+    // initialize kv store
+    if (options.load) {
+        LoadData(options);
     }
     // cout << "done init\n";
 
     // Don't run benchmark if we're only loading data
     if (options.num_ops == 0) return;
 
-    for (int i=0; i < options.threads; i++) {
-        workers[i] = std::thread(ThreadWork, i, options);
+    vector<double> depth_throughput;
+    vector<LatencyHistogram> depth_latency;
+    // share of the ops issued that servers turned away, where the knee shows
+    vector<double> depth_rejected;
+    for (int depth : options.depths) {
+        depth_latency.push_back(RunOps(options, depth));
+        double avg = 0;
+        for (auto t : throughputs) {
+            avg += t;
+        }
+        depth_throughput.push_back(avg / throughputs.size());
+        uint64_t shed = 0;
+        for (auto& thread : rejected) {
+            for (auto r : thread) {
+                shed += r;
+            }
+        }
+        uint64_t issued = depth_latency.back().count() + shed;
+        depth_rejected.push_back(issued ? 100.0 * shed / issued : 0);
     }
-    for (int i=0; i < options.threads; i++) {
-        workers[i].join();
+
+    if (options.depths.size() > 1) {
+        cout << "Scaling with queue depth (0 = synchronous):" << endl;
+        cout << "depth\tops/s\tp50 us\tp99 us\trejected %" << endl;
+        for (size_t i = 0; i < options.depths.size(); i++) {
+            cout << options.depths[i] << "\t" << (uint64_t) depth_throughput[i]
+                 << "\t" << depth_latency[i].percentile(0.5) / 1000.0
+                 << "\t" << depth_latency[i].percentile(0.99) / 1000.0
+                 << "\t" << depth_rejected[i] << endl;
+        }
     }
+}
 
-    // results[thread_id] << "Read latency: " << endl;
-    cout << "Read latency: " << endl;
-    computeLatency(/*thread_id,*/ r_latencies);
-    // results[thread_id] << "Write latency: " << endl;
-    cout << "Write latency: " << endl;
-    computeLatency(/*thread_id,*/ w_latencies);
-    cout << "Throughput: " << endl;
-    computeThroughput(throughputs);
+// How the loaded keys spread over the servers, and how many would move to one more
+void PrintKeyPlacement(const ConfigOptions& options) {
+    const HashRing& ring = clients[0]->Ring();
+    HashRing grown = ring;
+    size_t added = grown.addNode("added-server");
+    vector<uint64_t> keys_per_node(ring.capacity(), 0);
+    uint64_t moved = 0;
+    string key;
+    for (int i = 0; i < options.num_elems; i++) {
+        workload->key(i, key);
+        keys_per_node[ring.nodeFor(key)]++;
+        moved += grown.nodeFor(key) == added;
+    }
+    cout << "Keys per server:";
+    for (size_t node : clients[0]->Nodes()) {
+        cout << " " << ring.name(node) << " " << keys_per_node[node];
+    }
+    cout << endl;
+    if (options.num_elems > 0) {
+        cout << "Keys moved by adding a server: " << 100.0 * moved / options.num_elems
+             << "%" << endl;
+    }
+}
+
+void PrintServerStats(size_t node) {
+    StatsResponse stats;
+    if (!clients[0]->Node(node).Stats(&stats)) {
+        return;
+    }
+    cout << "Server stats";
+    if (clients[0]->Nodes().size() > 1) {
+        cout << " of " << clients[0]->Ring().name(node);
+    }
+    cout << " after " << stats.uptime_ms() / 1000.0 << " s:" << endl;
+    for (auto& l : stats.latencies()) {
+        if (l.count() == 0) continue;
+        cout << "  " << l.name() << ": count " << l.count()
+             << ", mean " << l.mean_ns() / 1000.0
+             << " us, p50 " << l.p50_ns() / 1000.0
+             << " us, p99 " << l.p99_ns() / 1000.0
+             << " us, max " << l.max_ns() / 1000.0 << " us" << endl;
+    }
+    for (auto& c : stats.counters()) {
+        cout << "  " << c.name() << ": " << c.value() << endl;
+    }
+    for (auto& g : stats.gauges()) {
+        cout << "  " << g.name() << ": " << g.value() << endl;
+    }
 }
 
 bool GetInputArgs(int argc, char **argv, ConfigOptions& options) {
     int opt;
-    while ((opt = getopt(argc, argv, "e:n:s:t:v:w:l:")) != -1) {
+    while ((opt = getopt(argc, argv, "e:n:s:t:v:V:C:w:W:d:z:r:T:R:l:b:o:a:c:x:k:L:I:N:g:y:Y:SP")) != -1) {
         switch (opt) {
             case 'e':
                 options.num_elems = atol(optarg);
@@ -269,27 +745,112 @@ bool GetInputArgs(int argc, char **argv, ConfigOptions& options) {
             case 'n':
                 options.num_ops = atol(optarg);
                 break;
-            case 's':
-                options.server_addr = string(optarg);
+            case 's': {
+                // comma separated, e.g. localhost:50051,localhost:50052
+                options.server_addrs.clear();
+                stringstream addrs(optarg);
+                string addr;
+                while (getline(addrs, addr, ',')) {
+                    if (!addr.empty()) {
+                        options.server_addrs.push_back(addr);
+                    }
+                }
                 break;
+            }
             case 't':
                 options.threads = atoi(optarg);
                 break;
             case 'v':
                 options.value_size = atoi(optarg);
                 break;
+            case 'V':
+                options.max_value_size = atoi(optarg);
+                break;
+            case 'C':
+                options.compressibility = atof(optarg);
+                break;
             case 'w':
                 options.percent_writes = atoi(optarg);
                 break;
+            case 'W':
+                options.preset = tolower(optarg[0]);
+                break;
+            case 'd':
+                options.distribution = string(optarg);
+                break;
+            case 'z':
+                options.zipf_theta = atof(optarg);
+                break;
+            case 'r':
+                options.target_rate = atof(optarg);
+                break;
+            case 'T':
+                options.trace_out = string(optarg);
+                break;
+            case 'R':
+                options.trace_in = string(optarg);
+                break;
             case 'l':
                 options.load = atoi(optarg);
                 break;
+            case 'b':
+                options.load_batch = atoi(optarg);
+                break;
+            case 'o':
+                options.output_file = string(optarg);
+                break;
+            case 'a': {
+                // comma separated, e.g. 0,1,4,16
+                options.depths.clear();
+                stringstream depths(optarg);
+                string depth;
+                while (getline(depths, depth, ',')) {
+                    options.depths.push_back(atoi(depth.c_str()));
+                }
+                break;
+            }
+            case 'c':
+                options.num_channels = atoi(optarg);
+                break;
+            case 'x':
+                options.ttl_ms = atoll(optarg);
+                break;
+            case 'k':
+                options.cache_mb = atoll(optarg);
+                break;
+            case 'L':
+                options.cache_lease_ms = atoll(optarg);
+                break;
+            case 'I':
+                options.cache_invalidations = atoi(optarg);
+                break;
+            case 'N':
+                options.virtual_nodes = atoi(optarg);
+                break;
+            case 'S':
+                options.server_stats = true;
+                break;
+            case 'P':
+                options.promote = true;
+                break;
+            case 'g':
+                options.chrome_trace = string(optarg);
+                break;
+            case 'y':
+                options.trace_sample_every = atol(optarg);
+                break;
+            case 'Y':
+                options.server_trace_sample_every = atoll(optarg);
+                break;
             default:
                 PrintUsage();
                 return false;
         }
     }
 
+    if (options.max_value_size < options.value_size) {
+        options.max_value_size = options.value_size;
+    }
     options.ops_per_thread = options.num_ops / options.threads;
     if (options.ops_per_thread * options.threads != options.num_ops) {
         cerr << "Number of operations not divisble by number of threads"
@@ -301,11 +862,41 @@ bool GetInputArgs(int argc, char **argv, ConfigOptions& options) {
 
 void PrintInputArgs(const ConfigOptions& options) {
     cout << "Configuration of current run:" << endl;
+    if (options.server_addrs.size() > 1) {
+        cout << "Servers:" << options.server_addrs.size() << ", virtual nodes:"
+             << options.virtual_nodes << endl;
+    }
     cout << "Percent writes:" << options.percent_writes << "%" << endl;
     cout << "Number of elements:" << options.num_elems << endl;
     cout << "Number of operations:" << options.num_ops << endl;
     cout << "Number of threads:" << options.threads << endl;
-    cout << "Value Size:" << options.value_size << endl;
+    cout << "Value Size:" << options.value_size;
+    if (options.max_value_size > options.value_size) {
+        cout << ".." << options.max_value_size;
+    }
+    cout << ", compressibility:" << options.compressibility << endl;
+    cout << "Workload:" << (options.preset ? string(1, options.preset) : "custom")
+         << ", distribution:" << options.distribution << endl;
+    if (options.target_rate > 0) {
+        cout << "Target rate:" << options.target_rate << " ops/s" << endl;
+    }
+    cout << "Queue depths:";
+    for (int depth : options.depths) {
+        cout << " " << depth;
+    }
+    cout << ", channels:" << options.num_channels << endl;
+    if (options.ttl_ms > 0) {
+        cout << "TTL of writes:" << options.ttl_ms << " ms" << endl;
+    }
+    if (options.cache_mb > 0) {
+        cout << "Read cache:" << options.cache_mb << " MB, lease:"
+             << options.cache_lease_ms << " ms, invalidations:"
+             << (options.cache_invalidations ? "on" : "off") << endl;
+    }
+    if (!options.chrome_trace.empty()) {
+        cout << "Tracing 1 in " << options.trace_sample_every << " requests to "
+             << options.chrome_trace << endl;
+    }
 }
 
 int main (int argc, char **argv)
@@ -321,13 +912,100 @@ int main (int argc, char **argv)
         cerr << "Exiting!" << endl;
         return 1;
     }
-    PrintInputArgs(options);
 
-    client = unique_ptr<KeyValueStoreClient>(new KeyValueStoreClient(
-                grpc::CreateChannel(
-                    options.server_addr, grpc::InsecureChannelCredentials())));
+    WorkloadOptions workload_options;
+    if (options.preset) {
+        if (!workload_options.setPreset(options.preset)) {
+            PrintUsage();
+            cerr << "Exiting!" << endl;
+            return 1;
+        }
+        options.distribution = workload_options.distribution;
+    } else {
+        workload_options.read = 100 - options.percent_writes;
+        workload_options.insert = options.percent_writes / 2.0;
+        workload_options.update = options.percent_writes / 2.0;
+        workload_options.distribution = options.distribution;
+    }
+    workload_options.zipfTheta = options.zipf_theta;
+    workload_options.numKeys = options.num_elems;
+    workload_options.minValueSize = options.value_size;
+    workload_options.maxValueSize = options.max_value_size;
+    workload_options.compressibility = options.compressibility;
+    workload = unique_ptr<Workload>(new Workload(workload_options));
+    if (!options.trace_out.empty()) {
+        trace_writer = unique_ptr<TraceWriter>(new TraceWriter(options.trace_out));
+        if (!trace_writer->good()) {
+            cerr << "Cannot write trace file " << options.trace_out << endl;
+            return 1;
+        }
+    }
+    if (!options.trace_in.empty() && !ifstream(options.trace_in).good()) {
+        cerr << "Cannot read trace file " << options.trace_in << endl;
+        return 1;
+    }
+    PrintInputArgs(options);
+    write_ttl_ms = options.ttl_ms;
+
+    if (!options.chrome_trace.empty()) {
+        tracer = unique_ptr<Tracer>(new Tracer(options.chrome_trace, "kvclient",
+                                               options.trace_sample_every));
+        if (!tracer->good()) {
+            cerr << "Cannot write trace file " << options.chrome_trace << endl;
+            return 1;
+        }
+    }
+    for (auto& addr : options.server_addrs) {
+        node_channels.push_back(CreateChannelPool(addr, options.num_channels, tracer.get()));
+    }
+    for (int i = 0; i < options.num_channels; i++) {
+        clients.emplace_back(new RoutingClient(options.virtual_nodes));
+        for (size_t node = 0; node < node_channels.size(); node++) {
+            clients.back()->AddNode(options.server_addrs[node], node_channels[node][i]);
+        }
+    }
+    if (options.promote) {
+        for (size_t node : clients[0]->Nodes()) {
+            if (!clients[0]->Node(node).Promote()) {
+                return 1;
+            }
+        }
+    }
+    if (options.server_trace_sample_every >= 0) {
+        for (size_t node : clients[0]->Nodes()) {
+            if (!clients[0]->Node(node).SetTraceSampling(options.server_trace_sample_every)) {
+                return 1;
+            }
+        }
+    }
+    if (options.cache_mb > 0) {
+        read_cache = make_shared<ReadCache>(options.cache_mb << 20, options.cache_lease_ms);
+        if (options.cache_invalidations) {
+            for (auto& channels : node_channels) {
+                cache_invalidators.emplace_back(new CacheInvalidator(channels[0], read_cache));
+            }
+            for (auto& invalidator : cache_invalidators) {
+                if (!invalidator->WaitForSubscription(std::chrono::seconds(5))) {
+                    cerr << "Not subscribed to invalidations, the cache stays empty "
+                         << "until the subscription is up" << endl;
+                }
+            }
+        }
+        for (auto& client : clients) {
+            client->SetCache(read_cache);
+        }
+    }
+    if (node_channels.size() > 1) {
+        PrintKeyPlacement(options);
+    }
     RunBenchmark(options);
-    cout << "Total gets done: " << options.num_ops*(1 - (options.percent_writes*1.0)/100.0) <<"\n";
-    cout << "Total sets done: " << options.num_ops*(options.percent_writes*1.0/100.0) <<"\n"; 
+    if (options.server_stats) {
+        for (size_t node : clients[0]->Nodes()) {
+            PrintServerStats(node);
+        }
+    }
+    cache_invalidators.clear();
+    // writes out the last spans
+    tracer.reset();
     return 0;
 }
@@ -16,145 +16,3069 @@
  *
  */
 
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cstdlib>
 #include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
+#include <future>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <sstream>
 #include <string>
 #include <vector>
-#include <mutex>
+#include <thread>
+#include <unistd.h> // getopt
+#include <grpcpp/alarm.h>
 #include <grpcpp/grpcpp.h>
 
 #include "keyvaluestore.grpc.pb.h"
+#include "admission.h"
+#include "checkpoint.h"
+#include "compactor.h"
+#include "compression.h"
+#include "crc32c.h"
+#include "groupcommit.h"
+#include "invalidation.h"
+#include "keyindex.h"
 #include "logstorage.h"
+#include "metrics.h"
+#include "replication.h"
+#include "sweeper.h"
+#include "tracing.h"
 #include "common.h"
 #include "tbb/concurrent_hash_map.h"
+#include "tbb/parallel_for.h"
 
 using ::google::protobuf::Empty;
 using grpc::Server;
+using grpc::ServerAsyncReader;
+using grpc::ServerAsyncResponseWriter;
+using grpc::ServerAsyncWriter;
 using grpc::ServerBuilder;
+using grpc::ServerCompletionQueue;
 using grpc::ServerContext;
+using grpc::ServerReader;
 using grpc::ServerReaderWriter;
 using grpc::ServerWriter;
 using grpc::Status;
 using keyvaluestore::KeyValueStore;
+using keyvaluestore::BulkLoadChunk;
+using keyvaluestore::BulkLoadSummary;
+using keyvaluestore::CompareAndSetRequest;
+using keyvaluestore::GetResult;
+using keyvaluestore::IncrementRequest;
+using keyvaluestore::Invalidation;
 using keyvaluestore::KVPair;
+using keyvaluestore::LatencyStats;
+using keyvaluestore::MultiGetRequest;
+using keyvaluestore::MultiGetResponse;
+using keyvaluestore::MultiSetRequest;
+using keyvaluestore::ReplicateRequest;
+using keyvaluestore::ReplicatedRecord;
+using keyvaluestore::ReplicationBatch;
 using keyvaluestore::Request;
 using keyvaluestore::Response;
+using keyvaluestore::ScanRequest;
+using keyvaluestore::StatValue;
+using keyvaluestore::StatsResponse;
+using keyvaluestore::TraceSampling;
+using keyvaluestore::WriteResult;
 
 typedef std::chrono::high_resolution_clock hrc;
 
 hrc::time_point start, stop;
 
-std::unique_ptr<LogStorage> log;
+struct ServerOptions {
+  std::string log_file;
+  // max number of Sets appended and synced together
+  size_t max_batch = 128;
+  // how long the log writer waits for a batch to fill up
+  uint64_t max_wait_us = 0;
+  // interval for printing group commit stats, 0 to disable
+  int stats_interval_s = 0;
+  // append a JSON snapshot of the Stats RPC to this file every interval
+  std::string stats_file;
+  // keep values on disk and only index their location in kv_store
+  bool values_on_disk = false;
+  // log segments are rotated at this size
+  uint64_t segment_size_mb = 64;
+  // how the log is appended to: ofstream, or direct I/O with io_uring or pwritev
+  LogIo log_io = LogIo::kStream;
+  // compact sealed segments with at least this % of dead bytes, 0 to disable
+  int compact_garbage_pct = 50;
+  // cap on compaction read + write bandwidth, 0 for unlimited
+  uint64_t compaction_rate_mb = 32;
+  // checkpoint kv_store after this many MB of log writes, 0 to disable
+  uint64_t checkpoint_mb = 0;
+  // serve RPCs from completion queues instead of the sync thread pool
+  bool async = false;
+  // number of completion queues and polling threads, 0 for one per core
+  int num_cqs = 0;
+  // compress values of at least this many bytes, 0 to disable
+  size_t compress_min_bytes = 0;
+  // keys per second the sweeper checks for expiry, 0 to disable
+  size_t sweep_keys_per_sec = 100000;
+  // number of shards the keyspace is split into
+  int num_shards = 1;
+  // directories the shard logs are spread over, round robin; empty puts them
+  // next to log_file
+  std::vector<std::string> shard_dirs;
+  std::string listen_address = "0.0.0.0:50051";
+  // MB of recent writes kept for followers, 0 to not serve Replicate
+  size_t replication_buffer_mb = 0;
+  // address of the primary to follow, empty for a primary
+  std::string primary;
+  // reads fail on a follower that is more stale than this, 0 for no bound
+  uint64_t max_staleness_ms = 0;
+  // write sampled request traces to this file, empty to disable tracing
+  std::string trace_file;
+  // trace one in this many requests, 0 for only those clients tagged
+  uint32_t trace_sample_every = 1000;
+  // Gets and writes served at once, more are turned away; 0 for no bound
+  size_t max_reads_in_flight = 0;
+  size_t max_writes_in_flight = 0;
+  // writes are turned away while the commit queue has waited longer than
+  // this for a whole interval, 0 to disable
+  uint64_t write_target_delay_us = 0;
+  uint64_t admission_interval_ms = 100;
+  // gRPC's resource quota: threads and MB of memory it may use, 0 for no bound
+  int max_threads = 0;
+  size_t resource_quota_mb = 0;
+  // concurrent calls per client connection, 0 for gRPC's default
+  int max_concurrent_streams = 0;
+  // threads of the sync server polling for calls, 0 for gRPC's default
+  int min_pollers = 0;
+  int max_pollers = 0;
+};
+
+typedef tbb::concurrent_hash_map<std::string, kv_pair> hashtable; 
+
+/*
+ * A partition of the keyspace
+ * Keys go to shards by their CRC32C. Every shard has its own hash map, key
+ * index and log, with its own writer thread, compactor, checkpointer and
+ * sweeper, so Sets to different shards never wait for each other and the
+ * shard logs can be put on different devices. The setting of a key, the
+ * compaction of a segment and every other change stays within one shard.
+ */
+struct Shard {
+  hashtable kv_store;
+  // Sorted keys of kv_store for prefix and range scans; deleted and expired
+  // keys stay in it until the sweeper gets to them
+  KeyIndex key_index;
+  std::unique_ptr<LogStorage> kv_log;
+  std::unique_ptr<GroupCommitLog> group_commit;
+  std::unique_ptr<Compactor> compactor;
+  std::unique_ptr<Checkpointer> checkpointer;
+  std::unique_ptr<ExpirySweeper> sweeper;
+  RecoveryStats recovery_stats;
+  double checkpoint_load_ms = 0;
+};
+
+std::vector<std::unique_ptr<Shard>> shards;
+// Subscribe streams of clients that cache values
+InvalidationHub invalidations;
+// Writes for followers to replicate, if enabled
+std::unique_ptr<ReplicationFeed> feed;
+// Set while this server is a follower: client writes are refused
+std::atomic<bool> read_only{false};
+
+bool values_on_disk = false;
+size_t compress_min_bytes = 0;
+
+ServerMetrics metrics;
+// Set if requests are traced
+std::unique_ptr<Tracer> tracer;
+// Set if Gets and writes are admitted under a bound
+std::unique_ptr<AdmissionController> read_admission;
+std::unique_ptr<AdmissionController> write_admission;
+double recovery_ms = 0;
+double startup_ms = 0;
+
+Shard& shard_of(const std::string& key) {
+  return *shards[Crc32c::value(key.data(), key.size()) % shards.size()];
+}
+
+bool same_location(const value_location& a, const value_location& b) {
+  return a.segment == b.segment && a.offset == b.offset;
+}
+
+// Drop key if its value has expired; true if key is not in kv_store (anymore)
+bool sweep_key(Shard& shard, const std::string& key) {
+  hashtable::accessor a;
+  if (!shard.kv_store.find(a, key)) {
+    return true;
+  }
+  if (!expired(a->second.loc)) {
+    return false;
+  }
+  shard.kv_log->removeLive(a->second.loc, key.size());
+  shard.kv_store.erase(a);
+  metrics.add(ServerMetrics::kExpiredKeys);
+  return true;
+}
+
+/*
+ * Look up key, false if it is not in the store or has expired
+ * expires_at, if given, is set to the value's expiry time (0 for none) and
+ * version to its version. With stored_flags, value is returned as stored
+ * (maybe compressed) and stored_flags is set to its record flags.
+ */
+bool find_value_in_map(const std::string& key, std::string* value,
+                       uint64_t* expires_at = nullptr, uint32_t* stored_flags = nullptr,
+                       uint64_t* version = nullptr) {
+  Shard& shard = shard_of(key);
+  value_location failed = {(uint32_t) -1, 0, 0, 0, 0, 0};
+  while (true) {
+    hashtable::const_accessor a;
+    uint64_t lookup_start = ServerMetrics::now();
+    bool isPresent = shard.kv_store.find(a, key);
+    metrics.record(ServerMetrics::kMapLookup, lookup_start);
+    if (!isPresent) {
+      metrics.add(ServerMetrics::kGetMisses);
+      break;
+    }
+    if (expired(a->second.loc)) {
+      a.release();
+      sweep_key(shard, key);
+      metrics.add(ServerMetrics::kGetMisses);
+      break;
+    }
+    if (expires_at) {
+      *expires_at = a->second.loc.expiresAt;
+    }
+    if (version) {
+      *version = a->second.loc.version;
+    }
+    // std::cout << "[Server] Found key: " << key
+    //           << ", value: " << a->second.value << std::endl;
+    if (stored_flags) {
+      *stored_flags = a->second.loc.flags;
+    }
+    if (!values_on_disk) {
+      if (!(a->second.loc.flags & LogFormat::kCompressed) || stored_flags) {
+        *value = a->second.value;
+        return true;
+      }
+      if (ValueCompressor::decompress(a->second.value, *value)) {
+        return true;
+      }
+      std::cerr << "Decompressing value for key: " << key << " failed" << std::endl;
+      break;
+    }
+    // Don't hold the bucket lock during the read
+    value_location loc = a->second.loc;
+    a.release();
+    if (same_location(loc, failed)) {
+      std::cerr << "Reading value for key: " << key << " failed" << std::endl;
+      break;
+    }
+    bool compressed = (loc.flags & LogFormat::kCompressed) && !stored_flags;
+    static thread_local std::string stored;
+    uint64_t read_start = ServerMetrics::now();
+    bool read = shard.kv_log->read(loc, compressed ? stored : *value);
+    metrics.record(ServerMetrics::kLogRead, read_start);
+    if (read) {
+      if (!compressed || ValueCompressor::decompress(stored, *value)) {
+        return true;
+      }
+      std::cerr << "Decompressing value for key: " << key << " failed" << std::endl;
+      break;
+    }
+    // The segment was compacted in the meantime, retry with the new location
+    failed = loc;
+  }
+  // std::cout << "[Server] Did not find key: " << key << std::endl;
+  value->clear();
+  return false;
+}
+
+void set_value_in_map(Shard& shard, const std::string& key, const std::string& value,
+                      const value_location& loc) {
+    hashtable::accessor a;
+    uint64_t lock_start = ServerMetrics::now();
+    if (loc.flags & LogFormat::kTombstone) {
+      bool found = shard.kv_store.find(a, key);
+      metrics.record(ServerMetrics::kMapLockWait, lock_start);
+      if (found) {
+        shard.kv_log->removeLive(a->second.loc, key.size());
+        shard.kv_store.erase(a);
+      }
+      a.release();
+      invalidations.publish(key);
+      if (feed) {
+        feed->publish(key, value, loc.flags, loc.expiresAt, loc.version);
+      }
+      return;
+    }
+    bool inserted = shard.kv_store.insert(a, key);
+    metrics.record(ServerMetrics::kMapLockWait, lock_start);
+    if (!inserted) {
+      shard.kv_log->removeLive(a->second.loc, key.size());
+    }
+    if (!values_on_disk) {
+      a->second.value = value;
+    }
+    a->second.loc = loc;
+    shard.kv_log->addLive(loc, key.size());
+    a.release();
+    // Outside the bucket lock: the sweeper looks keys up while it holds the
+    // key index exclusively
+    if (inserted) {
+      shard.key_index.insert(key);
+    }
+    invalidations.publish(key);
+    if (feed) {
+      feed->publish(key, value, loc.flags, loc.expiresAt, loc.version);
+    }
+}
+
+bool is_live_in_map(Shard& shard, const std::string& key, const value_location& loc) {
+    hashtable::const_accessor a;
+    return shard.kv_store.find(a, key) && same_location(a->second.loc, loc);
+}
+
+bool has_key_in_map(Shard& shard, const std::string& key) {
+    hashtable::const_accessor a;
+    return shard.kv_store.find(a, key);
+}
+
+bool relocate_in_map(Shard& shard, const std::string& key, const value_location& from,
+                     const value_location& to) {
+    hashtable::accessor a;
+    if (!shard.kv_store.find(a, key) || !same_location(a->second.loc, from)) {
+      return false;
+    }
+    a->second.loc = to;
+    return true;
+}
+
+// Index the keys recovered into kv_store
+void build_key_index(Shard& shard) {
+  tbb::parallel_for(shard.kv_store.range(), [&shard](const hashtable::range_type& r) {
+    for (auto it = r.begin(); it != r.end(); it++) {
+      shard.key_index.insert(it->first);
+    }
+  });
+}
+
+void get(const Request& request, Response* response) {
+  uint64_t expires_at = 0;
+  uint64_t version = 0;
+  response->set_found(find_value_in_map(request.key(), response->mutable_value(),
+                                        &expires_at, nullptr, &version));
+  response->set_version(version);
+  if (expires_at > 0) {
+    // lets a client cache the value for no longer than it lives
+    uint64_t now = wall_clock_ms();
+    response->set_ttl_ms(expires_at > now ? expires_at - now : 1);
+  }
+}
+
+void multi_get(const MultiGetRequest& request, MultiGetResponse* response) {
+  response->mutable_results()->Reserve(request.keys_size());
+  for (const auto& key : request.keys()) {
+    GetResult* result = response->add_results();
+    result->set_found(find_value_in_map(key, result->mutable_value()));
+  }
+}
+
+/*
+ * Log record for key and value, expiring ttl_ms from now unless it is 0
+ * With compression on, a large enough value is compressed into compressed,
+ * which then has to live until the record is committed. This runs on the RPC
+ * thread so that the log writer only appends.
+ */
+GroupCommitLog::Record make_record(const std::string& key, const std::string& value,
+                                   uint64_t ttl_ms, std::string* compressed) {
+  GroupCommitLog::Record record = {&key, &value, 0, 0, 0};
+  if (ttl_ms > 0) {
+    record.flags |= LogFormat::kExpires;
+    record.expiresAt = wall_clock_ms() + ttl_ms;
+  }
+  if (compress_min_bytes > 0 && value.size() >= compress_min_bytes) {
+    if (ValueCompressor::compress(value, *compressed)) {
+      metrics.add(ServerMetrics::kCompressedValues);
+      metrics.add(ServerMetrics::kCompressInputBytes, value.size());
+      metrics.add(ServerMetrics::kCompressOutputBytes, compressed->size());
+      record.value = compressed;
+      record.flags |= LogFormat::kCompressed;
+    } else {
+      metrics.add(ServerMetrics::kIncompressibleValues);
+    }
+  }
+  return record;
+}
+
+// Tombstone record that deletes key
+GroupCommitLog::Record delete_record(const std::string& key) {
+  static const std::string empty;
+  return {&key, &empty, LogFormat::kTombstone, 0, 0};
+}
+
+/*
+ * Commit records: the records of each shard go out in one append and sync,
+ * all shards at once, and done runs on the writer thread of the shard that
+ * finishes last
+ */
+void commit_by_shard(const std::vector<GroupCommitLog::Record>& records,
+                     GroupCommitLog::DoneFn done) {
+  std::vector<std::vector<GroupCommitLog::Record>> by_shard(shards.size());
+  for (auto& record : records) {
+    const std::string& key = *record.key;
+    by_shard[Crc32c::value(key.data(), key.size()) % shards.size()].push_back(record);
+  }
+  struct Pending {
+    std::atomic<size_t> left;
+    std::atomic<bool> ok{true};
+    GroupCommitLog::DoneFn done;
+  };
+  auto pending = std::make_shared<Pending>();
+  pending->left = std::count_if(by_shard.begin(), by_shard.end(),
+                                [](const std::vector<GroupCommitLog::Record>& records) {
+                                  return !records.empty();
+                                });
+  pending->done = std::move(done);
+  if (pending->left == 0) {
+    pending->done(true);
+    return;
+  }
+  for (size_t i = 0; i < shards.size(); i++) {
+    if (by_shard[i].empty()) {
+      continue;
+    }
+    shards[i]->group_commit->commitAsync(std::move(by_shard[i]), [pending](bool ok) {
+      if (!ok) {
+        pending->ok = false;
+      }
+      if (--pending->left == 0) {
+        pending->done(pending->ok);
+      }
+    });
+  }
+}
+
+// commit_by_shard(), waiting until all records are durable
+bool commit_by_shard(const std::vector<GroupCommitLog::Record>& records) {
+  std::promise<bool> committed;
+  std::future<bool> ok = committed.get_future();
+  commit_by_shard(records, [&committed](bool ok) {
+    committed.set_value(ok);
+  });
+  return ok.get();
+}
+
+// Commit the pairs of a MultiSet; compressed holds the compressed values
+void commit_multi_set(const MultiSetRequest& request, std::vector<std::string>* compressed,
+                      GroupCommitLog::DoneFn done) {
+  std::vector<GroupCommitLog::Record> records;
+  records.reserve(request.pairs_size());
+  compressed->resize(request.pairs_size());
+  for (int i = 0; i < request.pairs_size(); i++) {
+    const KVPair& pair = request.pairs(i);
+    records.push_back(make_record(pair.key(), pair.value(), pair.ttl_ms(),
+                                  &(*compressed)[i]));
+  }
+  commit_by_shard(records, std::move(done));
+}
+
+// Bytes of keys and values a BulkLoad takes in before it commits them
+const size_t kBulkLoadBufferBytes = 8 << 20;
+
+/*
+ * Size the maps of the shards that are still empty for expected_pairs keys
+ * between them. rehash() must not run concurrently with inserts, and inserts
+ * only happen on the log writer, so it runs there; in an empty map it has no
+ * keys to move that a concurrent lookup could be looking at. A map with keys
+ * grows as usual instead.
+ */
+void presize_shards(uint64_t expected_pairs) {
+  size_t per_shard = expected_pairs / shards.size() + 1;
+  for (auto& shard : shards) {
+    Shard* s = shard.get();
+    s->group_commit->runExclusive([s, per_shard] {
+      if (s->kv_store.size() == 0) {
+        s->kv_store.rehash(per_shard);
+      }
+    });
+  }
+}
+
+/*
+ * The pairs of a BulkLoad stream, committed a buffer at a time
+ * Each buffer is sorted by key and goes to the log writers of its shards
+ * with commit_by_shard(), so every shard appends its part in one write and
+ * one sync, and inserts into the key index come in key order. One buffer
+ * can be committing while the next one fills up; a Commit() has to be done
+ * before the next one starts.
+ */
+class BulkLoader {
+ public:
+  // Take the pairs of chunk; true once the buffer is full
+  bool Add(BulkLoadChunk* chunk) {
+    if (start_ns_ == 0) {
+      start_ns_ = ServerMetrics::now();
+      if (chunk->expected_pairs() > 0) {
+        presize_shards(chunk->expected_pairs());
+      }
+    }
+    for (auto& pair : *chunk->mutable_pairs()) {
+      filling_bytes_ += pair.key().size() + pair.value().size();
+      filling_.push_back(std::move(pair));
+    }
+    return filling_bytes_ >= kBulkLoadBufferBytes;
+  }
+
+  bool Empty() const {
+    return filling_.empty();
+  }
+
+  // Commit the buffer; done runs on a log writer once it is durable
+  void Commit(GroupCommitLog::DoneFn done) {
+    committing_.swap(filling_);
+    filling_.clear();
+    summary_.set_pairs(summary_.pairs() + committing_.size());
+    summary_.set_bytes(summary_.bytes() + filling_bytes_);
+    summary_.set_buffers(summary_.buffers() + 1);
+    filling_bytes_ = 0;
+    std::vector<GroupCommitLog::Record> records;
+    records.reserve(committing_.size());
+    compressed_.resize(committing_.size());
+    for (size_t i = 0; i < committing_.size(); i++) {
+      const KVPair& pair = committing_[i];
+      records.push_back(make_record(pair.key(), pair.value(), pair.ttl_ms(), &compressed_[i]));
+    }
+    // stable, so that the last pair of a key in the buffer is the one that stays
+    std::stable_sort(records.begin(), records.end(),
+                     [](const GroupCommitLog::Record& a, const GroupCommitLog::Record& b) {
+                       return *a.key < *b.key;
+                     });
+    size_t pairs = records.size();
+    commit_by_shard(records, [pairs, done](bool ok) {
+      if (ok) {
+        metrics.add(ServerMetrics::kBulkLoadedPairs, pairs);
+      }
+      done(ok);
+    });
+  }
+
+  // The load so far, timed until now
+  void Summarize(BulkLoadSummary* summary) {
+    *summary = summary_;
+    if (start_ns_ != 0) {
+      summary->set_duration_ms((ServerMetrics::now() - start_ns_) / 1000000);
+    }
+  }
+
+ private:
+  std::vector<KVPair> filling_;
+  size_t filling_bytes_ = 0;
+  // the buffer being committed and its compressed values
+  std::vector<KVPair> committing_;
+  std::vector<std::string> compressed_;
+  BulkLoadSummary summary_;
+  uint64_t start_ns_ = 0;
+};
+
+// value as a decimal int64, false if it is not one
+bool parse_int64(const std::string& value, int64_t* n) {
+  if (value.empty() || !(value[0] == '-' || value[0] == '+' || isdigit(value[0]))) {
+    return false;
+  }
+  char* end;
+  errno = 0;
+  long long v = strtoll(value.c_str(), &end, 10);
+  if (errno != 0 || end != value.c_str() + value.size()) {
+    return false;
+  }
+  *n = v;
+  return true;
+}
+
+/*
+ * A CompareAndSet, Increment, Append or SetIfAbsent of one key
+ * The log writer of the key's shard resolves it right before it would append
+ * the record: it checks the condition and computes the new value from the
+ * key's latest value, the one in the map or one in the batch being written,
+ * and nothing else can write the key in between. The outcome goes into the
+ * WriteResult; a condition that does not hold is not an error.
+ */
+class AtomicUpdate {
+ public:
+  void StartCompareAndSet(const CompareAndSetRequest& request, WriteResult* result) {
+    Reset(kCompareAndSetOp, request.key(), result);
+    value_ = &request.value();
+    ttl_ms_ = request.ttl_ms();
+    cas_ = &request;
+  }
+
+  void StartIncrement(const IncrementRequest& request, WriteResult* result) {
+    Reset(kIncrementOp, request.key(), result);
+    delta_ = request.delta();
+  }
+
+  void StartAppend(const KVPair& request, WriteResult* result) {
+    Reset(kAppendOp, request.key(), result);
+    value_ = &request.value();
+    ttl_ms_ = request.ttl_ms();
+  }
+
+  void StartSetIfAbsent(const KVPair& request, WriteResult* result) {
+    Reset(kSetIfAbsentOp, request.key(), result);
+    value_ = &request.value();
+    ttl_ms_ = request.ttl_ms();
+  }
+
+  // Blocks until the update is durable or has been turned down
+  Status Commit() {
+    GroupCommitLog& log = *shard_of(*key_).group_commit;
+    if (!log.commit(*key_, [this](GroupCommitLog::Record& record,
+                                  const GroupCommitLog::Pending* pending) {
+          return Resolve(record, pending);
+        })) {
+      Failed();
+      return Status::CANCELLED;
+    }
+    return status_;
+  }
+
+  // Like Commit(), but done gets the status on the log writer
+  void CommitAsync(std::function<void(const Status&)> done) {
+    GroupCommitLog& log = *shard_of(*key_).group_commit;
+    log.commitAsync(*key_, [this](GroupCommitLog::Record& record,
+                                  const GroupCommitLog::Pending* pending) {
+      return Resolve(record, pending);
+    }, [this, done](bool ok) {
+      if (!ok) {
+        Failed();
+      }
+      done(ok ? status_ : Status::CANCELLED);
+    });
+  }
+
+ private:
+  enum Op { kCompareAndSetOp, kIncrementOp, kAppendOp, kSetIfAbsentOp };
+
+  void Reset(Op op, const std::string& key, WriteResult* result) {
+    op_ = op;
+    key_ = &key;
+    value_ = nullptr;
+    ttl_ms_ = 0;
+    cas_ = nullptr;
+    delta_ = 0;
+    result_ = result;
+    status_ = Status::OK;
+  }
+
+  void Failed() {
+    static const char* names[] = {"CompareAndSet", "Increment", "Append", "SetIfAbsent"};
+    metrics.add(ServerMetrics::kRpcErrors);
+    std::cerr << names[op_] << " for key: " << *key_ << " failed" << std::endl;
+  }
+
+  // The key's latest value into current_, false if it has none
+  bool Current(const GroupCommitLog::Pending* pending, uint64_t* expires_at,
+               uint64_t* version) {
+    if (!pending) {
+      return find_value_in_map(*key_, &current_, expires_at, nullptr, version);
+    }
+    const value_location& loc = pending->loc;
+    if ((loc.flags & LogFormat::kTombstone) || expired(loc)) {
+      return false;
+    }
+    *expires_at = loc.expiresAt;
+    *version = loc.version;
+    if (!(loc.flags & LogFormat::kCompressed)) {
+      current_ = *pending->value;
+      return true;
+    }
+    return ValueCompressor::decompress(*pending->value, current_);
+  }
+
+  // Runs on the log writer; false leaves the record out
+  bool Resolve(GroupCommitLog::Record& record, const GroupCommitLog::Pending* pending) {
+    uint64_t expires_at = 0;
+    uint64_t version = 0;
+    bool found = Current(pending, &expires_at, &version);
+    bool applied = true;
+    const std::string* value = value_;
+    switch (op_) {
+      case kCompareAndSetOp:
+        switch (cas_->expected_case()) {
+          case CompareAndSetRequest::kExpectedValue:
+            applied = found && current_ == cas_->expected_value();
+            break;
+          case CompareAndSetRequest::kExpectedVersion:
+            applied = found && version == cas_->expected_version();
+            break;
+          default:
+            applied = !found;
+            break;
+        }
+        break;
+      case kSetIfAbsentOp:
+        applied = !found;
+        break;
+      case kIncrementOp: {
+        int64_t counter = 0;
+        if (found && !parse_int64(current_, &counter)) {
+          status_ = Status(grpc::StatusCode::FAILED_PRECONDITION,
+                           "value is not a decimal int64");
+          return false;
+        }
+        if (__builtin_add_overflow(counter, delta_, &counter)) {
+          status_ = Status(grpc::StatusCode::OUT_OF_RANGE, "counter would overflow");
+          return false;
+        }
+        new_value_ = std::to_string(counter);
+        value = &new_value_;
+        result_->set_counter(counter);
+        break;
+      }
+      case kAppendOp:
+        new_value_.clear();
+        if (found) {
+          new_value_.swap(current_);
+        }
+        new_value_.append(*value_);
+        value = &new_value_;
+        break;
+    }
+    result_->set_applied(applied);
+    if (!applied) {
+      metrics.add(ServerMetrics::kFailedConditions);
+      result_->set_found(found);
+      if (found) {
+        result_->set_version(version);
+        result_->set_value(current_);
+      }
+      return false;
+    }
+
+    uint64_t new_version = record.version;
+    record = make_record(*key_, *value, ttl_ms_, &compressed_);
+    record.version = new_version;
+    // Increment and Append keep the key's expiry time unless given a new one
+    bool keeps_expiry = op_ == kIncrementOp || op_ == kAppendOp;
+    if (keeps_expiry && ttl_ms_ == 0 && found && expires_at > 0) {
+      record.flags |= LogFormat::kExpires;
+      record.expiresAt = expires_at;
+    }
+    result_->set_found(true);
+    result_->set_version(new_version);
+    return true;
+  }
+
+  Op op_;
+  const std::string* key_;
+  // value to set, or to append
+  const std::string* value_;
+  uint64_t ttl_ms_;
+  const CompareAndSetRequest* cas_;
+  int64_t delta_;
+  WriteResult* result_;
+  Status status_;
+  // The key's current value; the value written by Increment and Append and
+  // the compressed value, which live until the record is committed. All keep
+  // their capacity between updates.
+  std::string current_;
+  std::string new_value_;
+  std::string compressed_;
+};
+
+// Resident set size of the server process
+uint64_t rss_bytes() {
+  std::ifstream statm("/proc/self/statm");
+  uint64_t pages = 0, resident = 0;
+  statm >> pages >> resident;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+void add_stat(google::protobuf::RepeatedPtrField<StatValue>* stats,
+              const char* name, uint64_t value) {
+  StatValue* stat = stats->Add();
+  stat->set_name(name);
+  stat->set_value(value);
+}
+
+void write_stats_json(std::ostream& out, const StatsResponse& response) {
+  out << "{\"uptime_ms\": " << response.uptime_ms() << ", \"latencies\": {";
+  for (int i = 0; i < response.latencies_size(); i++) {
+    const LatencyStats& l = response.latencies(i);
+    out << (i ? ", " : "") << "\"" << l.name() << "\": {\"count\": " << l.count()
+        << ", \"mean_ns\": " << l.mean_ns() << ", \"p50_ns\": " << l.p50_ns()
+        << ", \"p90_ns\": " << l.p90_ns() << ", \"p99_ns\": " << l.p99_ns()
+        << ", \"p999_ns\": " << l.p999_ns() << ", \"max_ns\": " << l.max_ns() << "}";
+  }
+  out << "}";
+  for (auto stats : {std::make_pair("counters", &response.counters()),
+                     std::make_pair("gauges", &response.gauges())}) {
+    out << ", \"" << stats.first << "\": {";
+    for (int i = 0; i < stats.second->size(); i++) {
+      out << (i ? ", " : "") << "\"" << stats.second->Get(i).name() << "\": "
+          << stats.second->Get(i).value();
+    }
+    out << "}";
+  }
+  out << "}" << std::endl;
+}
+
+/*
+ * Walks the key indexes for GetPrefix and Scan
+ * Every shard's index has its own cursor that is kept one key ahead; a heap
+ * of the shards by their next key merges them into key order.
+ */
+class ScanCursor {
+ public:
+  ScanCursor() : heads_(shards.size()) {
+    cursors_.reserve(shards.size());
+    for (auto& shard : shards) {
+      cursors_.emplace_back(shard->key_index);
+    }
+  }
+
+  void StartPrefix(const std::string& prefix) {
+    Reset();
+    prefix_ = prefix;
+    for (auto& cursor : cursors_) {
+      cursor.seek(prefix);
+    }
+    FillHeap();
+  }
+
+  void StartScan(const ScanRequest& request) {
+    Reset();
+    end_key_ = request.end_key();
+    limit_ = request.limit();
+    // The resume token is the last key returned by the previous Scan
+    for (auto& cursor : cursors_) {
+      if (request.resume_token() > request.start_key()) {
+        cursor.seekAfter(request.resume_token());
+      } else {
+        cursor.seek(request.start_key());
+      }
+    }
+    FillHeap();
+  }
+
+  // Fill response with the next pair, false once the scan is done
+  bool Next(Response* response) {
+    if (done_) {
+      return false;
+    }
+    response->Clear();
+    // Skip keys that were deleted or expired but are still in the index
+    do {
+      if (!NextKey(response->mutable_key())) {
+        done_ = true;
+        return false;
+      }
+    } while (!find_value_in_map(response->key(), response->mutable_value()));
+    if (limit_ > 0 && ++count_ == limit_) {
+      done_ = true;
+      if (NextKey(&peek_)) {
+        response->set_resume_token(response->key());
+      }
+    }
+    return true;
+  }
+
+  /*
+   * Next key of the merged indexes, false past the end of the range
+   * Keys that were deleted or have expired may still be returned.
+   */
+  bool NextKey(std::string* key) {
+    if (heap_.empty()) {
+      return false;
+    }
+    std::pop_heap(heap_.begin(), heap_.end(),
+                  [this](size_t a, size_t b) { return Later(a, b); });
+    size_t shard = heap_.back();
+    heap_.pop_back();
+    key->swap(heads_[shard]);
+    Push(shard);
+    return key->compare(0, prefix_.size(), prefix_) == 0 &&
+           (end_key_.empty() || *key < end_key_);
+  }
+
+ private:
+  void Reset() {
+    prefix_.clear();
+    end_key_.clear();
+    limit_ = 0;
+    count_ = 0;
+    done_ = false;
+    heap_.clear();
+  }
+
+  // Min-heap order of shards by their next key
+  bool Later(size_t a, size_t b) const {
+    return heads_[a] > heads_[b];
+  }
+
+  void Push(size_t shard) {
+    if (cursors_[shard].next(heads_[shard])) {
+      heap_.push_back(shard);
+      std::push_heap(heap_.begin(), heap_.end(),
+                     [this](size_t a, size_t b) { return Later(a, b); });
+    }
+  }
+
+  void FillHeap() {
+    for (size_t i = 0; i < cursors_.size(); i++) {
+      Push(i);
+    }
+  }
+
+  std::vector<KeyIndex::Cursor> cursors_;
+  // next key of each shard's cursor
+  std::vector<std::string> heads_;
+  // shards with a next key
+  std::vector<size_t> heap_;
+  std::string prefix_;
+  std::string end_key_;
+  std::string peek_;
+  uint32_t limit_ = 0;
+  uint32_t count_ = 0;
+  bool done_ = false;
+};
+
+// Replication streams send up to this many bytes of records per message
+const size_t kReplicationBatchBytes = 1 << 20;
+// and a heartbeat after this long without writes
+const int kReplicationHeartbeatMs = 100;
+
+/*
+ * The messages of a Replicate stream: a snapshot of the store if the follower
+ * cannot continue from its position, then the records of the feed
+ * The snapshot walks the key indexes in key order while writes go on. Records
+ * published after it started are sent after it, so the follower ends up with
+ * every key's latest value even if the snapshot saw an older or newer one.
+ */
+class ReplicationSource {
+ public:
+  void Start(const ReplicateRequest& request) {
+    lsn_ = request.lsn();
+    snapshotting_ = request.feed_id() != feed->id() || !feed->read(lsn_, 0, entries_);
+    if (snapshotting_) {
+      metrics.add(ServerMetrics::kReplicationSnapshots);
+      lsn_ = feed->lsn();
+      cursor_.StartPrefix(std::string());
+    }
+  }
+
+  // Fill batch with the next records, false if the feed has dropped them
+  bool Next(ReplicationBatch* batch) {
+    batch->Clear();
+    batch->set_feed_id(feed->id());
+    if (snapshotting_) {
+      NextSnapshot(batch);
+    } else {
+      if (!feed->read(lsn_, kReplicationBatchBytes, entries_)) {
+        return false;
+      }
+      for (auto& entry : entries_) {
+        ReplicatedRecord* record = batch->add_records();
+        record->set_key(std::move(entry.key));
+        record->set_value(std::move(entry.value));
+        record->set_flags(entry.flags);
+        record->set_expires_at_ms(entry.expiresAt);
+        record->set_version(entry.version);
+        lsn_ = entry.lsn;
+      }
+    }
+    if (!snapshotting_) {
+      batch->set_lsn(lsn_);
+    }
+    batch->set_primary_lsn(feed->lsn());
+    return true;
+  }
+
+  // Position of the follower once it has applied what was sent
+  uint64_t lsn() const {
+    return lsn_;
+  }
+
+  bool snapshotting() const {
+    return snapshotting_;
+  }
+
+ private:
+  void NextSnapshot(ReplicationBatch* batch) {
+    batch->set_snapshot(true);
+    size_t bytes = 0;
+    uint32_t flags;
+    uint64_t expires_at;
+    uint64_t version;
+    while (bytes < kReplicationBatchBytes) {
+      if (!cursor_.NextKey(&key_)) {
+        batch->set_snapshot_done(true);
+        snapshotting_ = false;
+        return;
+      }
+      if (!find_value_in_map(key_, &value_, &expires_at, &flags, &version)) {
+        continue;
+      }
+      ReplicatedRecord* record = batch->add_records();
+      record->set_key(key_);
+      record->set_value(value_);
+      record->set_flags(flags);
+      record->set_expires_at_ms(expires_at);
+      record->set_version(version);
+      bytes += key_.size() + value_.size();
+    }
+  }
+
+  ScanCursor cursor_;
+  std::vector<ReplicationFeed::Entry> entries_;
+  std::string key_;
+  std::string value_;
+  uint64_t lsn_ = 0;
+  bool snapshotting_ = false;
+};
+
+/*
+ * Replicates a primary into this server's shards
+ * A thread keeps a Replicate stream open and commits the records it receives
+ * through the shards' log writers, so the follower has a log of its own and
+ * can be promoted or restarted as a primary. Its position in the primary's
+ * feed is saved in <log file>.replica after every applied batch (at most once
+ * a second), to continue from there after a restart; applying a few records
+ * again is harmless. A snapshot is diffed against the keys the follower has,
+ * in key order: keys the snapshot skips are deleted, and keys whose value is
+ * already the same are not written again.
+ */
+class Follower {
+ public:
+  Follower(const std::string& primary, const std::string& position_file)
+      : primary_(primary), position_file_(position_file) {
+    std::ifstream in(position_file_);
+    uint64_t feed_id = 0, lsn = 0;
+    if (in >> feed_id >> lsn) {
+      feed_id_ = feed_id;
+      applied_lsn_ = lsn;
+    }
+    thread_ = std::thread(&Follower::Run, this);
+  }
+
+  ~Follower() {
+    Stop();
+  }
+
+  // Stop replicating; returns once no more records are applied
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lk(mtx_);
+      if (stopping_) {
+        return;
+      }
+      stopping_ = true;
+      if (context_) {
+        context_->TryCancel();
+      }
+    }
+    cv_.notify_one();
+    thread_.join();
+    SavePosition();
+  }
+
+  uint64_t applied_lsn() const {
+    return applied_lsn_;
+  }
+
+  uint64_t lag_records() const {
+    uint64_t applied = applied_lsn_;
+    uint64_t primary = primary_lsn_;
+    return primary > applied ? primary - applied : 0;
+  }
+
+  // Time since the follower was last known to have everything the primary
+  // had, UINT64_MAX if it never was
+  uint64_t staleness_ms() const {
+    uint64_t caught_up = caught_up_ms_;
+    if (caught_up == 0) {
+      return UINT64_MAX;
+    }
+    uint64_t now = ServerMetrics::now() / 1000000;
+    return now > caught_up ? now - caught_up : 0;
+  }
+
+  bool connected() const {
+    return connected_;
+  }
+
+ private:
+  void Run() {
+    auto stub = KeyValueStore::NewStub(
+        grpc::CreateChannel(primary_, grpc::InsecureChannelCredentials()));
+    while (true) {
+      grpc::ClientContext context;
+      {
+        std::lock_guard<std::mutex> lk(mtx_);
+        if (stopping_) {
+          return;
+        }
+        context_ = &context;
+      }
+      Status status = Stream(stub.get(), &context);
+      connected_ = false;
+      {
+        std::unique_lock<std::mutex> lk(mtx_);
+        context_ = nullptr;
+        if (stopping_) {
+          return;
+        }
+        std::cerr << "[follower] Replicating from " << primary_ << " stopped: "
+                  << status.error_message() << ", retrying" << std::endl;
+        cv_.wait_for(lk, std::chrono::seconds(1), [this] { return stopping_; });
+      }
+    }
+  }
+
+  Status Stream(KeyValueStore::Stub* stub, grpc::ClientContext* context) {
+    ReplicateRequest request;
+    request.set_feed_id(feed_id_);
+    request.set_lsn(applied_lsn_);
+    auto reader = stub->Replicate(context, request);
+    ReplicationBatch batch;
+    bool in_snapshot = false;
+    while (reader->Read(&batch)) {
+      if (!connected_) {
+        connected_ = true;
+        std::cout << "[follower] Replicating from " << primary_
+                  << (batch.snapshot() ? ", loading a snapshot" : "") << std::endl;
+      }
+      if (batch.snapshot() && !in_snapshot) {
+        in_snapshot = true;
+        own_keys_.reset(new ScanCursor);
+        own_keys_->StartPrefix(std::string());
+        own_valid_ = own_keys_->NextKey(&own_key_);
+      }
+      if (!Apply(batch)) {
+        context->TryCancel();
+        break;
+      }
+      primary_lsn_ = batch.primary_lsn();
+      if (in_snapshot && !batch.snapshot_done()) {
+        continue;
+      }
+      in_snapshot = false;
+      feed_id_ = batch.feed_id();
+      applied_lsn_ = batch.lsn();
+      if (applied_lsn_ == primary_lsn_) {
+        caught_up_ms_ = ServerMetrics::now() / 1000000;
+      }
+      uint64_t now = ServerMetrics::now() / 1000000;
+      if (batch.snapshot_done() || now - saved_ms_ >= 1000) {
+        SavePosition();
+        saved_ms_ = now;
+      }
+    }
+    own_keys_.reset();
+    return reader->Finish();
+  }
+
+  // Commit the records of batch and, in a snapshot, delete the keys it skips
+  bool Apply(const ReplicationBatch& batch) {
+    std::vector<GroupCommitLog::Record> records;
+    deleted_.clear();
+    for (const auto& record : batch.records()) {
+      if (batch.snapshot()) {
+        DeleteOwnKeysBefore(&record.key());
+        if (Unchanged(record)) {
+          continue;
+        }
+      }
+      // keeps the primary's version, so that a promoted follower accepts
+      // the versions clients have seen
+      records.push_back({&record.key(), &record.value(), record.flags(),
+                         record.expires_at_ms(), record.version()});
+    }
+    if (batch.snapshot_done()) {
+      DeleteOwnKeysBefore(nullptr);
+    }
+    for (auto& key : deleted_) {
+      records.push_back(delete_record(key));
+    }
+    if (!commit_by_shard(records)) {
+      std::cerr << "[follower] Committing " << records.size() << " records failed"
+                << std::endl;
+      return false;
+    }
+    metrics.add(ServerMetrics::kReplicatedRecords, records.size());
+    return true;
+  }
+
+  // Delete the keys of this server before key (all remaining ones if null)
+  void DeleteOwnKeysBefore(const std::string* key) {
+    while (own_valid_ && (!key || own_key_ <= *key)) {
+      if ((!key || own_key_ < *key) && has_key_in_map(shard_of(own_key_), own_key_)) {
+        deleted_.push_back(own_key_);
+      }
+      own_valid_ = own_keys_->NextKey(&own_key_);
+    }
+  }
+
+  // Whether this server has the value of record already
+  bool Unchanged(const ReplicatedRecord& record) {
+    uint64_t expires_at;
+    uint32_t flags;
+    uint64_t version;
+    return has_key_in_map(shard_of(record.key()), record.key()) &&
+           find_value_in_map(record.key(), &value_, &expires_at, &flags, &version) &&
+           flags == record.flags() && expires_at == record.expires_at_ms() &&
+           version == record.version() && value_ == record.value();
+  }
+
+  void SavePosition() {
+    std::string tmp = position_file_ + ".tmp";
+    {
+      std::ofstream out(tmp);
+      out << feed_id_.load() << " " << applied_lsn_.load() << std::endl;
+      if (!out.good()) {
+        return;
+      }
+    }
+    std::rename(tmp.c_str(), position_file_.c_str());
+  }
+
+  const std::string primary_;
+  const std::string position_file_;
+  std::thread thread_;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  bool stopping_ = false;
+  // the stream in progress, to cancel it on Stop
+  grpc::ClientContext* context_ = nullptr;
+
+  std::atomic<uint64_t> feed_id_{0};
+  std::atomic<uint64_t> applied_lsn_{0};
+  std::atomic<uint64_t> primary_lsn_{0};
+  // ServerMetrics::now() in ms when applied_lsn_ last reached primary_lsn_
+  std::atomic<uint64_t> caught_up_ms_{0};
+  std::atomic<bool> connected_{false};
+  uint64_t saved_ms_ = 0;
+
+  // Walk of this server's keys during a snapshot
+  std::unique_ptr<ScanCursor> own_keys_;
+  std::string own_key_;
+  bool own_valid_ = false;
+  std::vector<std::string> deleted_;
+  std::string value_;
+};
+
+std::unique_ptr<Follower> follower;
+// Reads fail on a follower that is more stale than this, 0 for no bound
+uint64_t max_staleness_ms = 0;
+
+// Refuse client writes on a follower
+bool refuse_write(Status* status) {
+  if (!read_only) {
+    return false;
+  }
+  metrics.add(ServerMetrics::kRejectedWrites);
+  *status = Status(grpc::StatusCode::FAILED_PRECONDITION,
+                   "read-only follower, write to the primary or promote it");
+  return true;
+}
+
+// Refuse reads on a follower that is behind its staleness bound
+bool refuse_read(Status* status) {
+  if (!read_only || max_staleness_ms == 0 || !follower ||
+      follower->staleness_ms() <= max_staleness_ms) {
+    return false;
+  }
+  metrics.add(ServerMetrics::kStaleReads);
+  *status = Status(grpc::StatusCode::UNAVAILABLE, "follower is too stale");
+  return true;
+}
+
+/*
+ * Admission of a Get or a write: holds its place among the requests in
+ * flight until Release() or the end of its scope. A request turned away gets
+ * RESOURCE_EXHAUSTED at once, which clients can retry later or elsewhere.
+ */
+class Admission {
+ public:
+  ~Admission() {
+    Release();
+  }
+
+  // Admit a Get or MultiGet; false with status set if it is turned away
+  bool Read(Status* status) {
+    return Admit(read_admission.get(), 0, ServerMetrics::kShedReads, status);
+  }
+
+  // Admit a write of key, judged by the commit queue of its shard
+  bool Write(const std::string& key, Status* status) {
+    uint64_t delay = write_admission ? shard_of(key).group_commit->queueDelay() : 0;
+    return Admit(write_admission.get(), delay, ServerMetrics::kShedWrites, status);
+  }
+
+  // Admit a write of keys of any shard, judged by the slowest queue
+  bool Write(Status* status) {
+    uint64_t delay = 0;
+    if (write_admission) {
+      for (auto& shard : shards) {
+        delay = std::max(delay, shard->group_commit->queueDelay());
+      }
+    }
+    return Admit(write_admission.get(), delay, ServerMetrics::kShedWrites, status);
+  }
+
+  void Release() {
+    if (controller_) {
+      controller_->release();
+      controller_ = nullptr;
+    }
+  }
+
+ private:
+  bool Admit(AdmissionController* controller, uint64_t queue_delay,
+             ServerMetrics::Counter shed, Status* status) {
+    if (!controller) {
+      return true;
+    }
+    if (!controller->admit(queue_delay)) {
+      metrics.add(shed);
+      *status = Status(grpc::StatusCode::RESOURCE_EXHAUSTED, "server is overloaded");
+      return false;
+    }
+    controller_ = controller;
+    return true;
+  }
+
+  AdmissionController* controller_ = nullptr;
+};
+
+// Make a follower take writes
+void promote() {
+  if (follower) {
+    follower->Stop();
+  }
+  if (read_only.exchange(false)) {
+    std::cout << "Promoted to primary" << std::endl;
+  }
+}
+
+// Change the trace sample rate; response gets the previous one
+Status set_trace_sampling(const TraceSampling& request, TraceSampling* response) {
+  if (!tracer) {
+    return Status(grpc::StatusCode::FAILED_PRECONDITION,
+                  "tracing is off, start the server with a trace file");
+  }
+  response->set_sample_every(tracer->sampleEvery());
+  tracer->setSampleEvery(request.sample_every());
+  return Status::OK;
+}
+
+/*
+ * Trace id of a call that has just arrived: the one the client tagged it with,
+ * a new one if it is sampled, or 0. A tagged call gets a span for the time
+ * since the client sent it, which it spent on the network and in gRPC's queues.
+ */
+uint64_t start_trace(const ServerContext* context) {
+  if (!tracer) {
+    return 0;
+  }
+  const auto& metadata = context->client_metadata();
+  auto id = metadata.find(Tracer::kTraceIdHeader);
+  if (id == metadata.end()) {
+    return tracer->sample();
+  }
+  uint64_t trace_id = strtoull(std::string(id->second.data(), id->second.size()).c_str(),
+                               nullptr, 16);
+  auto sent = metadata.find(Tracer::kSentAtHeader);
+  if (trace_id != 0 && sent != metadata.end()) {
+    uint64_t sent_at = tracer->fromWallClockUs(
+        strtoull(std::string(sent->second.data(), sent->second.size()).c_str(), nullptr, 10));
+    uint64_t now = ServerMetrics::now();
+    // not if the client's clock is ahead of ours
+    if (sent_at < now) {
+      tracer->record("sent_to_handler", trace_id, sent_at, now);
+    }
+  }
+  return trace_id;
+}
+
+/*
+ * A call of the sync server: times it into its histogram and, if it is traced,
+ * makes its trace the thread's current one until the handler returns
+ */
+class RpcScope {
+ public:
+  RpcScope(const ServerContext* context, ServerMetrics::Histogram histogram)
+      : trace_(start_trace(context)), timer_(&metrics, histogram) {}
+
+ private:
+  // outlives timer_, whose time is the call's span
+  TraceScope trace_;
+  ScopedTimer timer_;
+};
+
+void fill_stats(StatsResponse* response) {
+  ServerMetrics::Snapshot snapshot = metrics.snapshot();
+  response->set_uptime_ms(std::chrono::duration_cast<std::chrono::milliseconds>(
+        hrc::now() - start).count());
+  for (int h = 0; h < ServerMetrics::kNumHistograms; h++) {
+    const LatencyHistogram& histogram = snapshot.histograms[h];
+    LatencyStats* latency = response->add_latencies();
+    latency->set_name(ServerMetrics::name((ServerMetrics::Histogram) h));
+    latency->set_count(histogram.count());
+    latency->set_mean_ns(histogram.mean());
+    latency->set_p50_ns(histogram.percentile(0.5));
+    latency->set_p90_ns(histogram.percentile(0.9));
+    latency->set_p99_ns(histogram.percentile(0.99));
+    latency->set_p999_ns(histogram.percentile(0.999));
+    latency->set_max_ns(histogram.max());
+  }
+  for (int c = 0; c < ServerMetrics::kNumCounters; c++) {
+    add_stat(response->mutable_counters(),
+             ServerMetrics::name((ServerMetrics::Counter) c), snapshot.counters[c]);
+  }
+  // Sums over the shards, except for times and passes (the slowest shard)
+  uint64_t hashtable_size = 0, key_index_size = 0, log_bytes_written = 0;
+  uint64_t log_segments = 0, recovery_records = 0, recovery_bytes = 0;
+  uint64_t sweeper_passes = UINT64_MAX, swept_keys = 0;
+  double checkpoint_load_ms = 0;
+  for (auto& shard : shards) {
+    hashtable_size += shard->kv_store.size();
+    key_index_size += shard->key_index.size();
+    log_bytes_written += shard->kv_log->bytesWritten();
+    log_segments += shard->kv_log->segmentsBySeq().size();
+    recovery_records += shard->recovery_stats.records;
+    recovery_bytes += shard->recovery_stats.bytes;
+    checkpoint_load_ms = std::max(checkpoint_load_ms, shard->checkpoint_load_ms);
+    if (shard->sweeper) {
+      sweeper_passes = std::min(sweeper_passes, shard->sweeper->passes());
+      swept_keys += shard->sweeper->removed();
+    }
+  }
+  auto gauges = response->mutable_gauges();
+  add_stat(gauges, "shards", shards.size());
+  add_stat(gauges, "hashtable_size", hashtable_size);
+  add_stat(gauges, "key_index_size", key_index_size);
+  add_stat(gauges, "log_bytes_written", log_bytes_written);
+  add_stat(gauges, "log_segments", log_segments);
+  add_stat(gauges, "recovery_records", recovery_records);
+  add_stat(gauges, "recovery_bytes", recovery_bytes);
+  add_stat(gauges, "recovery_ms", recovery_ms);
+  add_stat(gauges, "checkpoint_load_ms", checkpoint_load_ms);
+  add_stat(gauges, "startup_ms", startup_ms);
+  add_stat(gauges, "rss_bytes", rss_bytes());
+  add_stat(gauges, "sweeper_passes", sweeper_passes == UINT64_MAX ? 0 : sweeper_passes);
+  add_stat(gauges, "swept_keys", swept_keys);
+  add_stat(gauges, "invalidation_subscribers", invalidations.size());
+  add_stat(gauges, "invalidations_published", invalidations.published());
+  if (feed) {
+    add_stat(gauges, "replication_lsn", feed->lsn());
+    add_stat(gauges, "replication_followers", feed->followers());
+    add_stat(gauges, "replication_buffer_bytes", feed->bufferedBytes());
+  }
+  add_stat(gauges, "read_only", read_only);
+  if (read_admission) {
+    add_stat(gauges, "reads_in_flight", read_admission->requestsInFlight());
+  }
+  if (write_admission) {
+    add_stat(gauges, "writes_in_flight", write_admission->requestsInFlight());
+    add_stat(gauges, "writes_overloaded", write_admission->overloaded());
+  }
+  if (tracer) {
+    add_stat(gauges, "trace_sample_every", tracer->sampleEvery());
+    add_stat(gauges, "trace_spans", tracer->spans());
+    add_stat(gauges, "trace_dropped_spans", tracer->droppedSpans());
+  }
+  if (read_only && follower) {
+    add_stat(gauges, "replication_connected", follower->connected());
+    add_stat(gauges, "replication_applied_lsn", follower->applied_lsn());
+    add_stat(gauges, "replication_lag_records", follower->lag_records());
+    // UINT64_MAX until the follower has caught up once
+    add_stat(gauges, "replication_staleness_ms", follower->staleness_ms());
+  }
+}
+
+// Logic and data behind the server's behavior.
+class KeyValueStoreServiceImpl final : public KeyValueStore::Service{
+
+  Status Get(ServerContext* context, const Request* request,
+             Response* response) override {
+    RpcScope rpc(context, ServerMetrics::kGetRpc);
+    // std::cout << "[Server] Get" << std::endl;
+    Status status;
+    Admission admission;
+    if (refuse_read(&status) || !admission.Read(&status)) {
+      return status;
+    }
+    get(*request, response);
+    return Status::OK;
+  }
+
+  Status Set(ServerContext* context, const KVPair* kvPair,
+             Empty* response) override {
+    RpcScope rpc(context, ServerMetrics::kSetRpc);
+    //std::cout << "[Server] Setting key: " << kvPair->key()
+    //          << ", value: " << kvPair->value() << std::endl;
+    // std::cout << "[Server] Set" << std::endl;
+    Status status;
+    Admission admission;
+    if (refuse_write(&status) || !admission.Write(kvPair->key(), &status)) {
+      return status;
+    }
+
+    // Blocks until the log writer has synced the batch containing this Set
+    // and applied it to kv_store
+    std::string compressed;
+    GroupCommitLog::Record record = make_record(kvPair->key(), kvPair->value(),
+                                                kvPair->ttl_ms(), &compressed);
+    if (!shard_of(kvPair->key()).group_commit->commit(record)) {
+        metrics.add(ServerMetrics::kRpcErrors);
+        std::cerr << "Set for key: " << kvPair->key() << " failed" << std::endl;
+        return Status::CANCELLED;
+    }
+    return Status::OK;
+  }
+
+  Status Delete(ServerContext* context, const Request* request,
+                Empty* response) override {
+    RpcScope rpc(context, ServerMetrics::kDeleteRpc);
+    Status status;
+    Admission admission;
+    if (refuse_write(&status) || !admission.Write(request->key(), &status)) {
+      return status;
+    }
+    // Durable once it returns, like a Set
+    if (!shard_of(request->key()).group_commit->commit(delete_record(request->key()))) {
+        metrics.add(ServerMetrics::kRpcErrors);
+        std::cerr << "Delete for key: " << request->key() << " failed" << std::endl;
+        return Status::CANCELLED;
+    }
+    return Status::OK;
+  }
+
+  Status MultiGet(ServerContext* context, const MultiGetRequest* request,
+                  MultiGetResponse* response) override {
+    RpcScope rpc(context, ServerMetrics::kMultiGetRpc);
+    Status status;
+    Admission admission;
+    if (refuse_read(&status) || !admission.Read(&status)) {
+      return status;
+    }
+    multi_get(*request, response);
+    return Status::OK;
+  }
+
+  Status MultiSet(ServerContext* context, const MultiSetRequest* request,
+                  Empty* response) override {
+    RpcScope rpc(context, ServerMetrics::kMultiSetRpc);
+    Status status;
+    Admission admission;
+    if (refuse_write(&status) || !admission.Write(&status)) {
+      return status;
+    }
+    // The pairs of each shard go out in one append and become durable with
+    // one sync
+    std::vector<std::string> compressed;
+    std::promise<bool> committed;
+    std::future<bool> ok = committed.get_future();
+    commit_multi_set(*request, &compressed, [&committed](bool ok) {
+      committed.set_value(ok);
+    });
+    if (!ok.get()) {
+        metrics.add(ServerMetrics::kRpcErrors);
+        std::cerr << "MultiSet of " << request->pairs_size() << " pairs failed"
+                  << std::endl;
+        return Status::CANCELLED;
+    }
+    return Status::OK;
+  }
+
+  Status GetPrefix(ServerContext* context, const Request* request, ServerWriter<Response>* writer) override {
+    RpcScope rpc(context, ServerMetrics::kGetPrefixRpc);
+    Status status;
+    if (refuse_read(&status)) {
+      return status;
+    }
+    ScanCursor cursor;
+    cursor.StartPrefix(request->key());
+    Response response;
+    while (cursor.Next(&response) && writer->Write(response)) {
+    }
+    return Status::OK;
+  }
+
+  Status Scan(ServerContext* context, const ScanRequest* request,
+              ServerWriter<Response>* writer) override {
+    RpcScope rpc(context, ServerMetrics::kScanRpc);
+    Status status;
+    if (refuse_read(&status)) {
+      return status;
+    }
+    ScanCursor cursor;
+    cursor.StartScan(*request);
+    Response response;
+    while (cursor.Next(&response) && writer->Write(response)) {
+    }
+    return Status::OK;
+  }
+
+  Status Stats(ServerContext* context, const Empty* request,
+               StatsResponse* response) override {
+    RpcScope rpc(context, ServerMetrics::kStatsRpc);
+    fill_stats(response);
+    return Status::OK;
+  }
+
+  Status Subscribe(ServerContext* context, const Empty* request,
+                   ServerWriter<Invalidation>* writer) override {
+    ScopedTimer timer(&metrics, ServerMetrics::kSubscribeRpc);
+    auto subscriber = invalidations.subscribe();
+    Invalidation invalidation;
+    std::vector<std::string> keys;
+    bool reset;
+    // The empty first message tells the client it is subscribed
+    bool ok = writer->Write(invalidation);
+    while (ok && !context->IsCancelled()) {
+      if (!subscriber->wait(keys, reset, std::chrono::milliseconds(500))) {
+        continue;
+      }
+      invalidation.Clear();
+      invalidation.set_reset(reset);
+      for (auto& key : keys) {
+        invalidation.add_keys(std::move(key));
+      }
+      ok = writer->Write(invalidation);
+    }
+    invalidations.unsubscribe(subscriber);
+    return Status::OK;
+  }
+
+  Status Replicate(ServerContext* context, const ReplicateRequest* request,
+                   ServerWriter<ReplicationBatch>* writer) override {
+    ScopedTimer timer(&metrics, ServerMetrics::kReplicateRpc);
+    if (!feed) {
+      return Status(grpc::StatusCode::FAILED_PRECONDITION,
+                    "replication is off, start the primary with -j");
+    }
+    auto waiter = feed->watch(nullptr);
+    ReplicationSource source;
+    source.Start(*request);
+    ReplicationBatch batch;
+    Status status;
+    bool ok = true;
+    while (ok && !context->IsCancelled()) {
+      // A batch without records is a heartbeat
+      if (!source.snapshotting()) {
+        feed->wait(source.lsn(), std::chrono::milliseconds(kReplicationHeartbeatMs));
+      }
+      if (!source.Next(&batch)) {
+        status = Status(grpc::StatusCode::ABORTED, "follower fell behind the feed");
+        break;
+      }
+      ok = writer->Write(batch);
+    }
+    feed->unwatch(waiter);
+    return status;
+  }
+
+  Status Promote(ServerContext* context, const Empty* request,
+                 Empty* response) override {
+    RpcScope rpc(context, ServerMetrics::kPromoteRpc);
+    promote();
+    return Status::OK;
+  }
+
+  Status SetTraceSampling(ServerContext* context, const TraceSampling* request,
+                          TraceSampling* response) override {
+    RpcScope rpc(context, ServerMetrics::kSetTraceSamplingRpc);
+    return set_trace_sampling(*request, response);
+  }
+
+  // Reads the next buffer while the previous one is committed
+  Status BulkLoad(ServerContext* context, ServerReader<BulkLoadChunk>* reader,
+                  BulkLoadSummary* response) override {
+    ScopedTimer timer(&metrics, ServerMetrics::kBulkLoadRpc);
+    Status status;
+    Admission admission;
+    if (refuse_write(&status) || !admission.Write(&status)) {
+      return status;
+    }
+    BulkLoader loader;
+    BulkLoadChunk chunk;
+    std::future<bool> committed;
+    auto commit = [&loader, &committed] {
+      auto promise = std::make_shared<std::promise<bool>>();
+      committed = promise->get_future();
+      loader.Commit([promise](bool ok) {
+        promise->set_value(ok);
+      });
+    };
+    bool ok = true;
+    while (ok && reader->Read(&chunk)) {
+      if (loader.Add(&chunk)) {
+        ok = !committed.valid() || committed.get();
+        if (ok) {
+          commit();
+        }
+      }
+    }
+    if (ok && committed.valid()) {
+      ok = committed.get();
+    }
+    if (ok && !loader.Empty()) {
+      commit();
+      ok = committed.get();
+    }
+    if (!ok) {
+      // a buffer that is still committing refers to loader
+      if (committed.valid()) {
+        committed.wait();
+      }
+      metrics.add(ServerMetrics::kRpcErrors);
+      std::cerr << "BulkLoad failed" << std::endl;
+      return Status::CANCELLED;
+    }
+    loader.Summarize(response);
+    return Status::OK;
+  }
+
+  // Block until the log writer has resolved the update and, if it wrote a
+  // record, synced it
+  Status CompareAndSet(ServerContext* context, const CompareAndSetRequest* request,
+                       WriteResult* response) override {
+    RpcScope rpc(context, ServerMetrics::kCompareAndSetRpc);
+    Status status;
+    Admission admission;
+    if (refuse_write(&status) || !admission.Write(request->key(), &status)) {
+      return status;
+    }
+    AtomicUpdate update;
+    update.StartCompareAndSet(*request, response);
+    return update.Commit();
+  }
+
+  Status Increment(ServerContext* context, const IncrementRequest* request,
+                   WriteResult* response) override {
+    RpcScope rpc(context, ServerMetrics::kIncrementRpc);
+    Status status;
+    Admission admission;
+    if (refuse_write(&status) || !admission.Write(request->key(), &status)) {
+      return status;
+    }
+    AtomicUpdate update;
+    update.StartIncrement(*request, response);
+    return update.Commit();
+  }
+
+  Status Append(ServerContext* context, const KVPair* request,
+                WriteResult* response) override {
+    RpcScope rpc(context, ServerMetrics::kAppendRpc);
+    Status status;
+    Admission admission;
+    if (refuse_write(&status) || !admission.Write(request->key(), &status)) {
+      return status;
+    }
+    AtomicUpdate update;
+    update.StartAppend(*request, response);
+    return update.Commit();
+  }
+
+  Status SetIfAbsent(ServerContext* context, const KVPair* request,
+                     WriteResult* response) override {
+    RpcScope rpc(context, ServerMetrics::kSetIfAbsentRpc);
+    Status status;
+    Admission admission;
+    if (refuse_write(&status) || !admission.Write(request->key(), &status)) {
+      return status;
+    }
+    AtomicUpdate update;
+    update.StartSetIfAbsent(*request, response);
+    return update.Commit();
+  }
+
+};
+
+/*
+ * Asynchronous server: a number of completion queues, each polled by its own
+ * thread. Every RPC in flight is served by a CallData. Once its call has
+ * finished a CallData goes back to its queue's pool and serves a later call of
+ * the same method; requests and responses are allocated on a per-CallData
+ * arena that is reset (keeping its first block) between calls.
+ */
+enum AsyncMethod {
+  kGet, kSet, kGetPrefix, kScan, kMultiGet, kMultiSet, kStats, kDelete,
+  kSubscribe, kReplicate, kPromote, kCompareAndSet, kIncrement, kAppend, kSetIfAbsent,
+  kSetTraceSampling, kBulkLoad, kNumAsyncMethods
+};
+
+// Latency histogram of each method
+const ServerMetrics::Histogram kRpcHistogram[kNumAsyncMethods] = {
+  ServerMetrics::kGetRpc, ServerMetrics::kSetRpc, ServerMetrics::kGetPrefixRpc,
+  ServerMetrics::kScanRpc, ServerMetrics::kMultiGetRpc, ServerMetrics::kMultiSetRpc,
+  ServerMetrics::kStatsRpc, ServerMetrics::kDeleteRpc, ServerMetrics::kSubscribeRpc,
+  ServerMetrics::kReplicateRpc, ServerMetrics::kPromoteRpc,
+  ServerMetrics::kCompareAndSetRpc, ServerMetrics::kIncrementRpc, ServerMetrics::kAppendRpc,
+  ServerMetrics::kSetIfAbsentRpc, ServerMetrics::kSetTraceSamplingRpc,
+  ServerMetrics::kBulkLoadRpc,
+};
+
+class CallData;
+
+struct ServerQueue {
+  KeyValueStore::AsyncService* service;
+  std::unique_ptr<ServerCompletionQueue> cq;
+  std::vector<std::unique_ptr<CallData>> calls;
+  // CallData waiting for a new call to serve, by method
+  std::vector<CallData*> idle[kNumAsyncMethods];
+};
+
+class CallData {
+ public:
+  CallData(ServerQueue* queue, AsyncMethod method)
+      : queue_(queue), method_(method),
+        arena_(arena_block_, sizeof(arena_block_)) {}
+  virtual ~CallData() {}
+
+  // Ask for the next call of this method
+  void Listen() {
+    context_.reset(new ServerContext);
+    arena_.Reset();
+    state_ = LISTEN;
+    RequestCall();
+  }
+
+  // The operation this CallData was waiting for has completed
+  void Proceed(bool ok) {
+    switch (state_) {
+      case LISTEN:
+        if (!ok) {
+          return; // the queue is shutting down
+        }
+        start_ns_ = ServerMetrics::now();
+        // Streams are not traced, like in the sync server: everything they
+        // do for as long as they are open would be part of their trace
+        trace_id_ = method_ == kSubscribe || method_ == kReplicate || method_ == kBulkLoad
+                        ? 0 : start_trace(context_.get());
+        // Keep a CallData listening while this one is busy
+        ListenFor(queue_, method_);
+        state_ = PROCESS;
+        {
+          TraceScope scope(trace_id_);
+          Start();
+        }
+        break;
+      case PROCESS: {
+        TraceScope scope(trace_id_);
+        Resume(ok);
+        break;
+      }
+      case FINISH:
+        admission_.Release();
+        metrics.record(kRpcHistogram[method_], start_ns_, trace_id_);
+        queue_->idle[method_].push_back(this);
+        break;
+    }
+  }
+
+  static void ListenFor(ServerQueue* queue, AsyncMethod method);
+
+ protected:
+  enum CallState { LISTEN, PROCESS, FINISH };
+
+  virtual void RequestCall() = 0;
+  // A call has arrived
+  virtual void Start() = 0;
+  // An operation started by Start or an earlier Resume has completed
+  virtual void Resume(bool ok) {}
+
+  template <class T>
+  T* Create() {
+    return google::protobuf::Arena::CreateMessage<T>(&arena_);
+  }
+
+  ServerQueue* queue_;
+  AsyncMethod method_;
+  CallState state_ = LISTEN;
+  // ServerMetrics::now() when the call arrived
+  uint64_t start_ns_ = 0;
+  // trace of the call, 0 if it is not traced
+  uint64_t trace_id_ = 0;
+  // released once the call is finished
+  Admission admission_;
+  std::unique_ptr<ServerContext> context_;
+  char arena_block_[4096];
+  google::protobuf::Arena arena_;
+};
+
+class GetCall final : public CallData {
+ public:
+  GetCall(ServerQueue* queue) : CallData(queue, kGet) {}
+
+ private:
+  void RequestCall() override {
+    request_ = Create<Request>();
+    responder_.reset(new ServerAsyncResponseWriter<Response>(context_.get()));
+    queue_->service->RequestGet(context_.get(), request_, responder_.get(),
+                                queue_->cq.get(), queue_->cq.get(), this);
+  }
+
+  void Start() override {
+    state_ = FINISH;
+    Status status;
+    if (refuse_read(&status) || !admission_.Read(&status)) {
+      responder_->FinishWithError(status, this);
+      return;
+    }
+    Response* response = Create<Response>();
+    get(*request_, response);
+    responder_->Finish(*response, Status::OK, this);
+  }
+
+  Request* request_;
+  std::unique_ptr<ServerAsyncResponseWriter<Response>> responder_;
+};
+
+class SetCall final : public CallData {
+ public:
+  SetCall(ServerQueue* queue) : CallData(queue, kSet) {}
+
+ private:
+  void RequestCall() override {
+    request_ = Create<KVPair>();
+    responder_.reset(new ServerAsyncResponseWriter<Empty>(context_.get()));
+    queue_->service->RequestSet(context_.get(), request_, responder_.get(),
+                                queue_->cq.get(), queue_->cq.get(), this);
+  }
 
-typedef tbb::concurrent_hash_map<std::string, kv_pair> hashtable; 
+  void Start() override {
+    state_ = FINISH;
+    Status status;
+    if (refuse_write(&status) || !admission_.Write(request_->key(), &status)) {
+      responder_->FinishWithError(status, this);
+      return;
+    }
+    // Answered from the log writer once the batch holding the Set is durable
+    GroupCommitLog::Record record = make_record(request_->key(), request_->value(),
+                                                request_->ttl_ms(), &compressed_);
+    shard_of(request_->key()).group_commit->commitAsync(record, [this](bool ok) {
+      if (!ok) {
+        metrics.add(ServerMetrics::kRpcErrors);
+        std::cerr << "Set for key: " << request_->key() << " failed" << std::endl;
+      }
+      responder_->Finish(response_, ok ? Status::OK : Status::CANCELLED, this);
+    });
+  }
 
-hashtable kv_store;
+  KVPair* request_;
+  // the compressed value, kept with its capacity between calls
+  std::string compressed_;
+  Empty response_;
+  std::unique_ptr<ServerAsyncResponseWriter<Empty>> responder_;
+};
 
-std::mutex mtx;
+/*
+ * CompareAndSet, Increment, Append and SetIfAbsent, answered from the log
+ * writer once it has resolved the update and synced its record
+ */
+template <class RequestType>
+class AtomicUpdateCall : public CallData {
+ protected:
+  AtomicUpdateCall(ServerQueue* queue, AsyncMethod method) : CallData(queue, method) {}
 
-std::string get_value_from_map(const std::string& key) {
-  hashtable::const_accessor a;
-  bool isPresent = kv_store.find(a, key);
-  if (isPresent) {
-      // std::cout << "[Server] Found key: " << key
-      //           << ", value: " << a->second.value << std::endl;
-      return a->second.value;
+  void RequestCall() override {
+    request_ = Create<RequestType>();
+    responder_.reset(new ServerAsyncResponseWriter<WriteResult>(context_.get()));
+    RequestUpdate();
   }
-  a.release();
-  // std::cout << "[Server] Did not find key: " << key << std::endl;
-  return std::string("");
-}
 
-void set_value_in_map(const std::string& key, const std::string& value) {
-    hashtable::accessor a;
-    kv_store.insert(a, key);
-    a->second = /*kv*/ {key, value};
-    a.release();
-}
+  void Start() override {
+    state_ = FINISH;
+    Status status;
+    if (refuse_write(&status) || !admission_.Write(request_->key(), &status)) {
+      responder_->FinishWithError(status, this);
+      return;
+    }
+    response_ = Create<WriteResult>();
+    StartUpdate();
+    update_.CommitAsync([this](const Status& status) {
+      if (status.ok()) {
+        responder_->Finish(*response_, status, this);
+      } else {
+        responder_->FinishWithError(status, this);
+      }
+    });
+  }
 
-// Logic and data behind the server's behavior.
-class KeyValueStoreServiceImpl final : public KeyValueStore::Service{
+  // Ask for the next call of the method
+  virtual void RequestUpdate() = 0;
+  // Fill in update_ from request_
+  virtual void StartUpdate() = 0;
 
-  Status Get(ServerContext* context, const Request* request,
-             Response* response) override {
-    // std::cout << "[Server] Get" << std::endl;
-    auto value = get_value_from_map(request->key());
-    response->set_value(value);
-    return Status::OK;
+  RequestType* request_;
+  WriteResult* response_;
+  AtomicUpdate update_;
+  std::unique_ptr<ServerAsyncResponseWriter<WriteResult>> responder_;
+};
+
+class CompareAndSetCall final : public AtomicUpdateCall<CompareAndSetRequest> {
+ public:
+  CompareAndSetCall(ServerQueue* queue) : AtomicUpdateCall(queue, kCompareAndSet) {}
+
+ private:
+  void RequestUpdate() override {
+    queue_->service->RequestCompareAndSet(context_.get(), request_, responder_.get(),
+                                          queue_->cq.get(), queue_->cq.get(), this);
   }
 
-  Status Set(ServerContext* context, const KVPair* kvPair,
-             Empty* response) override {
-    //std::cout << "[Server] Setting key: " << kvPair->key()
-    //          << ", value: " << kvPair->value() << std::endl;
-    mtx.lock();
-    // std::cout << "[Server] Set" << std::endl;
+  void StartUpdate() override {
+    update_.StartCompareAndSet(*request_, response_);
+  }
+};
 
-    if (log->write(kvPair->key() , kvPair->value()) == -1) {
-        std::cerr << "Set for key: " << kvPair->key() << " failed" << std::endl;
-        return Status::CANCELLED;
+class IncrementCall final : public AtomicUpdateCall<IncrementRequest> {
+ public:
+  IncrementCall(ServerQueue* queue) : AtomicUpdateCall(queue, kIncrement) {}
+
+ private:
+  void RequestUpdate() override {
+    queue_->service->RequestIncrement(context_.get(), request_, responder_.get(),
+                                      queue_->cq.get(), queue_->cq.get(), this);
+  }
+
+  void StartUpdate() override {
+    update_.StartIncrement(*request_, response_);
+  }
+};
+
+class AppendCall final : public AtomicUpdateCall<KVPair> {
+ public:
+  AppendCall(ServerQueue* queue) : AtomicUpdateCall(queue, kAppend) {}
+
+ private:
+  void RequestUpdate() override {
+    queue_->service->RequestAppend(context_.get(), request_, responder_.get(),
+                                   queue_->cq.get(), queue_->cq.get(), this);
+  }
+
+  void StartUpdate() override {
+    update_.StartAppend(*request_, response_);
+  }
+};
+
+class SetIfAbsentCall final : public AtomicUpdateCall<KVPair> {
+ public:
+  SetIfAbsentCall(ServerQueue* queue) : AtomicUpdateCall(queue, kSetIfAbsent) {}
+
+ private:
+  void RequestUpdate() override {
+    queue_->service->RequestSetIfAbsent(context_.get(), request_, responder_.get(),
+                                        queue_->cq.get(), queue_->cq.get(), this);
+  }
+
+  void StartUpdate() override {
+    update_.StartSetIfAbsent(*request_, response_);
+  }
+};
+
+class DeleteCall final : public CallData {
+ public:
+  DeleteCall(ServerQueue* queue) : CallData(queue, kDelete) {}
+
+ private:
+  void RequestCall() override {
+    request_ = Create<Request>();
+    responder_.reset(new ServerAsyncResponseWriter<Empty>(context_.get()));
+    queue_->service->RequestDelete(context_.get(), request_, responder_.get(),
+                                   queue_->cq.get(), queue_->cq.get(), this);
+  }
+
+  void Start() override {
+    state_ = FINISH;
+    Status status;
+    if (refuse_write(&status) || !admission_.Write(request_->key(), &status)) {
+      responder_->FinishWithError(status, this);
+      return;
     }
-    // Flush explicitly to ensure persistence
-    log->getOutStream()->flush();
+    Shard& shard = shard_of(request_->key());
+    shard.group_commit->commitAsync(delete_record(request_->key()), [this](bool ok) {
+      if (!ok) {
+        metrics.add(ServerMetrics::kRpcErrors);
+        std::cerr << "Delete for key: " << request_->key() << " failed" << std::endl;
+      }
+      responder_->Finish(response_, ok ? Status::OK : Status::CANCELLED, this);
+    });
+  }
 
-    set_value_in_map(kvPair->key(), kvPair->value());
-    mtx.unlock();
-    return Status::OK;
+  Request* request_;
+  Empty response_;
+  std::unique_ptr<ServerAsyncResponseWriter<Empty>> responder_;
+};
+
+class MultiGetCall final : public CallData {
+ public:
+  MultiGetCall(ServerQueue* queue) : CallData(queue, kMultiGet) {}
+
+ private:
+  void RequestCall() override {
+    request_ = Create<MultiGetRequest>();
+    responder_.reset(new ServerAsyncResponseWriter<MultiGetResponse>(context_.get()));
+    queue_->service->RequestMultiGet(context_.get(), request_, responder_.get(),
+                                     queue_->cq.get(), queue_->cq.get(), this);
   }
 
-  Status GetPrefix(ServerContext* context, const Request* request, ServerWriter<Response>* writer) override {
-    std::string prefixKey = request->key();	 
-    for(hashtable::iterator it = kv_store.begin(); it != kv_store.end(); it++) {
-      Response response;
-      if(it->first.find(prefixKey) == 0) {
-         response.set_value(it->second.value);
-         writer->Write(response);
-      }
-    } 
-    return Status::OK;
+  void Start() override {
+    state_ = FINISH;
+    Status status;
+    if (refuse_read(&status) || !admission_.Read(&status)) {
+      responder_->FinishWithError(status, this);
+      return;
+    }
+    MultiGetResponse* response = Create<MultiGetResponse>();
+    multi_get(*request_, response);
+    responder_->Finish(*response, Status::OK, this);
+  }
+
+  MultiGetRequest* request_;
+  std::unique_ptr<ServerAsyncResponseWriter<MultiGetResponse>> responder_;
+};
+
+class MultiSetCall final : public CallData {
+ public:
+  MultiSetCall(ServerQueue* queue) : CallData(queue, kMultiSet) {}
+
+ private:
+  void RequestCall() override {
+    request_ = Create<MultiSetRequest>();
+    responder_.reset(new ServerAsyncResponseWriter<Empty>(context_.get()));
+    queue_->service->RequestMultiSet(context_.get(), request_, responder_.get(),
+                                     queue_->cq.get(), queue_->cq.get(), this);
+  }
+
+  void Start() override {
+    state_ = FINISH;
+    Status status;
+    if (refuse_write(&status) || !admission_.Write(&status)) {
+      responder_->FinishWithError(status, this);
+      return;
+    }
+    commit_multi_set(*request_, &compressed_, [this](bool ok) {
+      if (!ok) {
+        metrics.add(ServerMetrics::kRpcErrors);
+        std::cerr << "MultiSet of " << request_->pairs_size() << " pairs failed"
+                  << std::endl;
+      }
+      responder_->Finish(response_, ok ? Status::OK : Status::CANCELLED, this);
+    });
+  }
+
+  MultiSetRequest* request_;
+  std::vector<std::string> compressed_;
+  Empty response_;
+  std::unique_ptr<ServerAsyncResponseWriter<Empty>> responder_;
+};
+
+class StatsCall final : public CallData {
+ public:
+  StatsCall(ServerQueue* queue) : CallData(queue, kStats) {}
+
+ private:
+  void RequestCall() override {
+    request_ = Create<Empty>();
+    responder_.reset(new ServerAsyncResponseWriter<StatsResponse>(context_.get()));
+    queue_->service->RequestStats(context_.get(), request_, responder_.get(),
+                                  queue_->cq.get(), queue_->cq.get(), this);
+  }
+
+  void Start() override {
+    StatsResponse* response = Create<StatsResponse>();
+    fill_stats(response);
+    state_ = FINISH;
+    responder_->Finish(*response, Status::OK, this);
+  }
+
+  Empty* request_;
+  std::unique_ptr<ServerAsyncResponseWriter<StatsResponse>> responder_;
+};
+
+/*
+ * Streams invalidations to a subscriber
+ * Keys published while no Write is in flight wake the call up with an alarm
+ * on its queue, so the Writes are issued from the polling thread and at most
+ * one operation (a Write or the alarm) is pending at a time.
+ */
+class SubscribeCall final : public CallData {
+ public:
+  SubscribeCall(ServerQueue* queue) : CallData(queue, kSubscribe) {}
+
+ private:
+  void RequestCall() override {
+    request_ = Create<Empty>();
+    response_ = Create<Invalidation>();
+    writer_.reset(new ServerAsyncWriter<Invalidation>(context_.get()));
+    queue_->service->RequestSubscribe(context_.get(), request_, writer_.get(),
+                                      queue_->cq.get(), queue_->cq.get(), this);
+  }
+
+  void Start() override {
+    subscriber_ = invalidations.subscribe([this] {
+      alarm_.Set(queue_->cq.get(), gpr_now(GPR_CLOCK_MONOTONIC), this);
+    });
+    // The empty first message tells the client it is subscribed
+    writer_->Write(*response_, this);
+  }
+
+  void Resume(bool ok) override {
+    bool reset;
+    if (ok && !subscriber_->take(keys_, reset)) {
+      return; // armed: the next published key sets the alarm
+    }
+    if (!ok) {
+      invalidations.unsubscribe(subscriber_);
+      subscriber_.reset();
+      state_ = FINISH;
+      writer_->Finish(Status::OK, this);
+      return;
+    }
+    response_->Clear();
+    response_->set_reset(reset);
+    for (auto& key : keys_) {
+      response_->add_keys(std::move(key));
+    }
+    writer_->Write(*response_, this);
+  }
+
+  Empty* request_;
+  Invalidation* response_;
+  std::unique_ptr<ServerAsyncWriter<Invalidation>> writer_;
+  std::shared_ptr<InvalidationHub::Subscriber> subscriber_;
+  std::vector<std::string> keys_;
+  grpc::Alarm alarm_;
+};
+
+/*
+ * Streams a ReplicationSource to a follower
+ * When the feed has nothing new the call sets an alarm for the next
+ * heartbeat, which the next publish cancels to send its records right away.
+ * The waiter is disarmed before the alarm is set again, so the publishing
+ * thread never cancels an alarm that is being set.
+ */
+class ReplicateCall final : public CallData {
+ public:
+  ReplicateCall(ServerQueue* queue) : CallData(queue, kReplicate) {}
+
+ private:
+  void RequestCall() override {
+    request_ = Create<ReplicateRequest>();
+    response_ = Create<ReplicationBatch>();
+    writer_.reset(new ServerAsyncWriter<ReplicationBatch>(context_.get()));
+    queue_->service->RequestReplicate(context_.get(), request_, writer_.get(),
+                                      queue_->cq.get(), queue_->cq.get(), this);
+  }
+
+  void Start() override {
+    if (!feed) {
+      state_ = FINISH;
+      writer_->Finish(Status(grpc::StatusCode::FAILED_PRECONDITION,
+                             "replication is off, start the primary with -j"), this);
+      return;
+    }
+    waiter_ = feed->watch([this] { alarm_.Cancel(); });
+    source_.Start(*request_);
+    Send(true);
+  }
+
+  void Resume(bool ok) override {
+    if (waiting_) {
+      // The alarm went off (a heartbeat is due) or was cancelled by a publish
+      waiting_ = false;
+      feed->disarm(waiter_);
+      Send(ok);
+      return;
+    }
+    if (!ok) {
+      Finish(Status::OK);
+      return;
+    }
+    Send(false);
+  }
+
+  // Write the next batch; an empty one only if heartbeat is set
+  void Send(bool heartbeat) {
+    if (!source_.Next(response_)) {
+      Finish(Status(grpc::StatusCode::ABORTED, "follower fell behind the feed"));
+      return;
+    }
+    if (!heartbeat && !response_->snapshot() && response_->records_size() == 0) {
+      waiting_ = true;
+      alarm_.Set(queue_->cq.get(),
+                 gpr_time_add(gpr_now(GPR_CLOCK_MONOTONIC),
+                              gpr_time_from_millis(kReplicationHeartbeatMs, GPR_TIMESPAN)),
+                 this);
+      if (!feed->arm(waiter_, source_.lsn())) {
+        alarm_.Cancel();
+      }
+      return;
+    }
+    writer_->Write(*response_, this);
+  }
+
+  void Finish(const Status& status) {
+    feed->unwatch(waiter_);
+    waiter_.reset();
+    state_ = FINISH;
+    writer_->Finish(status, this);
+  }
+
+  ReplicateRequest* request_;
+  ReplicationBatch* response_;
+  std::unique_ptr<ServerAsyncWriter<ReplicationBatch>> writer_;
+  ReplicationSource source_;
+  std::shared_ptr<ReplicationFeed::Waiter> waiter_;
+  bool waiting_ = false;
+  grpc::Alarm alarm_;
+};
+
+class PromoteCall final : public CallData {
+ public:
+  PromoteCall(ServerQueue* queue) : CallData(queue, kPromote) {}
+
+ private:
+  void RequestCall() override {
+    request_ = Create<Empty>();
+    responder_.reset(new ServerAsyncResponseWriter<Empty>(context_.get()));
+    queue_->service->RequestPromote(context_.get(), request_, responder_.get(),
+                                    queue_->cq.get(), queue_->cq.get(), this);
+  }
+
+  void Start() override {
+    promote();
+    state_ = FINISH;
+    responder_->Finish(response_, Status::OK, this);
+  }
+
+  Empty* request_;
+  Empty response_;
+  std::unique_ptr<ServerAsyncResponseWriter<Empty>> responder_;
+};
+
+class SetTraceSamplingCall final : public CallData {
+ public:
+  SetTraceSamplingCall(ServerQueue* queue) : CallData(queue, kSetTraceSampling) {}
+
+ private:
+  void RequestCall() override {
+    request_ = Create<TraceSampling>();
+    responder_.reset(new ServerAsyncResponseWriter<TraceSampling>(context_.get()));
+    queue_->service->RequestSetTraceSampling(context_.get(), request_, responder_.get(),
+                                             queue_->cq.get(), queue_->cq.get(), this);
+  }
+
+  void Start() override {
+    state_ = FINISH;
+    TraceSampling* response = Create<TraceSampling>();
+    Status status = set_trace_sampling(*request_, response);
+    if (status.ok()) {
+      responder_->Finish(*response, status, this);
+    } else {
+      responder_->FinishWithError(status, this);
+    }
+  }
+
+  TraceSampling* request_;
+  std::unique_ptr<ServerAsyncResponseWriter<TraceSampling>> responder_;
+};
+
+/*
+ * BulkLoad, with a Read and a buffer commit in flight at once
+ * Reads complete on the queue's thread and commits on a log writer, so both
+ * go through Advance(), which starts whatever can go next under mtx_.
+ */
+class BulkLoadCall final : public CallData {
+ public:
+  BulkLoadCall(ServerQueue* queue) : CallData(queue, kBulkLoad) {}
+
+ private:
+  void RequestCall() override {
+    reader_.reset(new ServerAsyncReader<BulkLoadSummary, BulkLoadChunk>(context_.get()));
+    queue_->service->RequestBulkLoad(context_.get(), reader_.get(),
+                                     queue_->cq.get(), queue_->cq.get(), this);
+  }
+
+  void Start() override {
+    Status status;
+    if (refuse_write(&status) || !admission_.Write(&status)) {
+      state_ = FINISH;
+      reader_->FinishWithError(status, this);
+      return;
+    }
+    loader_.reset(new BulkLoader);
+    reading_ = committing_ = full_ = eof_ = failed_ = false;
+    std::lock_guard<std::mutex> lk(mtx_);
+    Advance();
+  }
+
+  // A Read has completed, or failed at the end of the stream
+  void Resume(bool ok) override {
+    std::lock_guard<std::mutex> lk(mtx_);
+    reading_ = false;
+    if (!ok) {
+      eof_ = true;
+    } else {
+      full_ = loader_->Add(&chunk_);
+    }
+    Advance();
+  }
+
+  void Committed(bool ok) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    committing_ = false;
+    failed_ |= !ok;
+    Advance();
+  }
+
+  // Called with mtx_ held
+  void Advance() {
+    if (failed_ || (eof_ && !committing_ && loader_->Empty())) {
+      if (reading_ || committing_) {
+        return;
+      }
+      state_ = FINISH;
+      if (failed_) {
+        metrics.add(ServerMetrics::kRpcErrors);
+        std::cerr << "BulkLoad failed" << std::endl;
+        reader_->FinishWithError(Status::CANCELLED, this);
+      } else {
+        loader_->Summarize(&response_);
+        reader_->Finish(response_, Status::OK, this);
+      }
+      return;
+    }
+    if ((full_ || eof_) && !committing_ && !loader_->Empty()) {
+      full_ = false;
+      committing_ = true;
+      loader_->Commit([this](bool ok) {
+        Committed(ok);
+      });
+    }
+    if (!eof_ && !full_ && !reading_) {
+      reading_ = true;
+      reader_->Read(&chunk_, this);
+    }
+  }
+
+  std::unique_ptr<ServerAsyncReader<BulkLoadSummary, BulkLoadChunk>> reader_;
+  // not on the arena, which is kept small between calls
+  BulkLoadChunk chunk_;
+  BulkLoadSummary response_;
+  std::unique_ptr<BulkLoader> loader_;
+  std::mutex mtx_;
+  bool reading_;
+  bool committing_;
+  // the buffer is full and waits for the previous one to be committed
+  bool full_;
+  bool eof_;
+  bool failed_;
+};
+
+// Streams the pairs of a ScanCursor with one Write in flight at a time
+class StreamCall : public CallData {
+ public:
+  StreamCall(ServerQueue* queue, AsyncMethod method) : CallData(queue, method) {}
+
+ protected:
+  void RequestStream() {
+    response_ = Create<Response>();
+    writer_.reset(new ServerAsyncWriter<Response>(context_.get()));
+  }
+
+  void Resume(bool ok) override {
+    if (ok && cursor_.Next(response_)) {
+      writer_->Write(*response_, this);
+    } else {
+      state_ = FINISH;
+      writer_->Finish(Status::OK, this);
+    }
+  }
+
+  // Finish the call right away if it has to be refused
+  bool Refused() {
+    Status status;
+    if (!refuse_read(&status)) {
+      return false;
+    }
+    state_ = FINISH;
+    writer_->Finish(status, this);
+    return true;
+  }
+
+  ScanCursor cursor_;
+  Response* response_;
+  std::unique_ptr<ServerAsyncWriter<Response>> writer_;
+};
+
+class GetPrefixCall final : public StreamCall {
+ public:
+  GetPrefixCall(ServerQueue* queue) : StreamCall(queue, kGetPrefix) {}
+
+ private:
+  void RequestCall() override {
+    RequestStream();
+    request_ = Create<Request>();
+    queue_->service->RequestGetPrefix(context_.get(), request_, writer_.get(),
+                                      queue_->cq.get(), queue_->cq.get(), this);
+  }
+
+  void Start() override {
+    if (Refused()) {
+      return;
+    }
+    cursor_.StartPrefix(request_->key());
+    Resume(true);
+  }
+
+  Request* request_;
+};
+
+class ScanCall final : public StreamCall {
+ public:
+  ScanCall(ServerQueue* queue) : StreamCall(queue, kScan) {}
+
+ private:
+  void RequestCall() override {
+    RequestStream();
+    request_ = Create<ScanRequest>();
+    queue_->service->RequestScan(context_.get(), request_, writer_.get(),
+                                 queue_->cq.get(), queue_->cq.get(), this);
+  }
+
+  void Start() override {
+    if (Refused()) {
+      return;
+    }
+    cursor_.StartScan(*request_);
+    Resume(true);
   }
 
+  ScanRequest* request_;
 };
 
-void RunServer(const std::string& logFile) {
-  std::string server_address("0.0.0.0:50051");
+void CallData::ListenFor(ServerQueue* queue, AsyncMethod method) {
+  CallData* call;
+  if (!queue->idle[method].empty()) {
+    call = queue->idle[method].back();
+    queue->idle[method].pop_back();
+  } else {
+    switch (method) {
+      case kGet:
+        call = new GetCall(queue);
+        break;
+      case kSet:
+        call = new SetCall(queue);
+        break;
+      case kGetPrefix:
+        call = new GetPrefixCall(queue);
+        break;
+      case kScan:
+        call = new ScanCall(queue);
+        break;
+      case kMultiGet:
+        call = new MultiGetCall(queue);
+        break;
+      case kStats:
+        call = new StatsCall(queue);
+        break;
+      case kDelete:
+        call = new DeleteCall(queue);
+        break;
+      case kSubscribe:
+        call = new SubscribeCall(queue);
+        break;
+      case kReplicate:
+        call = new ReplicateCall(queue);
+        break;
+      case kPromote:
+        call = new PromoteCall(queue);
+        break;
+      case kCompareAndSet:
+        call = new CompareAndSetCall(queue);
+        break;
+      case kIncrement:
+        call = new IncrementCall(queue);
+        break;
+      case kAppend:
+        call = new AppendCall(queue);
+        break;
+      case kSetIfAbsent:
+        call = new SetIfAbsentCall(queue);
+        break;
+      case kSetTraceSampling:
+        call = new SetTraceSamplingCall(queue);
+        break;
+      case kBulkLoad:
+        call = new BulkLoadCall(queue);
+        break;
+      default:
+        call = new MultiSetCall(queue);
+        break;
+    }
+    queue->calls.emplace_back(call);
+  }
+  call->Listen();
+}
+
+void PollQueue(ServerQueue* queue) {
+  for (int m = 0; m < kNumAsyncMethods; m++) {
+    CallData::ListenFor(queue, (AsyncMethod) m);
+  }
+  void* tag;
+  bool ok;
+  while (queue->cq->Next(&tag, &ok)) {
+    static_cast<CallData*>(tag)->Proceed(ok);
+  }
+}
+
+void PrintStats(int interval_s, const std::string& stats_file) {
+  while (true) {
+    std::this_thread::sleep_for(std::chrono::seconds(interval_s));
+    if (!stats_file.empty()) {
+      StatsResponse response;
+      fill_stats(&response);
+      std::ofstream out(stats_file, std::ofstream::app);
+      write_stats_json(out, response);
+      if (!out.good()) {
+        std::cerr << "Writing stats to " << stats_file << " failed" << std::endl;
+      }
+    }
+    for (size_t i = 0; i < shards.size(); i++) {
+      if (shards.size() > 1) {
+        std::cout << "[shard " << i << "]" << std::endl;
+      }
+      shards[i]->group_commit->printStats(std::cout);
+      if (shards[i]->compactor) {
+        shards[i]->compactor->printStats(std::cout);
+      }
+      if (shards[i]->checkpointer) {
+        shards[i]->checkpointer->printStats(std::cout);
+      }
+    }
+  }
+}
+
+// Log of shard i: log_file itself without sharding, else <log_file>.shard<i>,
+// in the (i % number of directories)th shard directory if there are any
+std::string shard_log_path(const ServerOptions& options, int i) {
+  namespace fs = std::experimental::filesystem;
+  if (options.num_shards == 1) {
+    return options.log_file;
+  }
+  fs::path path(options.log_file + ".shard" + std::to_string(i));
+  if (options.shard_dirs.empty()) {
+    return path.string();
+  }
+  fs::path dir(options.shard_dirs[i % options.shard_dirs.size()]);
+  fs::create_directories(dir);
+  return (dir / path.filename()).string();
+}
+
+/*
+ * Keys map to shards by hash, so a log has to be opened with the number of
+ * shards it was written with. That number is kept in <log_file>.shards; a log
+ * without it was written before sharding, by a single shard.
+ */
+bool check_shard_count(const ServerOptions& options) {
+  namespace fs = std::experimental::filesystem;
+  std::string count_file = options.log_file + ".shards";
+  int written = 0;
+  if (std::ifstream(count_file) >> written) {
+    if (written != options.num_shards) {
+      std::cerr << options.log_file << " was written by " << written
+                << " shards, start the server with -n " << written << std::endl;
+      return false;
+    }
+    return true;
+  }
+  if (options.num_shards > 1) {
+    fs::path log(options.log_file);
+    bool unsharded = fs::is_regular_file(log) && fs::file_size(log) > 0;
+    std::string prefix = log.filename().string() + ".";
+    auto dir = log.parent_path().empty() ? fs::path(".") : log.parent_path();
+    for (auto& entry : fs::directory_iterator(dir)) {
+      std::string name = entry.path().filename().string();
+      unsharded |= name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0 &&
+                   isdigit(name[prefix.size()]);
+    }
+    if (unsharded) {
+      std::cerr << options.log_file << " was written without sharding, "
+                << "start the server with -n 1" << std::endl;
+      return false;
+    }
+  }
+  std::ofstream out(count_file);
+  out << options.num_shards << std::endl;
+  if (!out.good()) {
+    std::cerr << "Writing " << count_file << " failed" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+// Open the log of shard i and recover its map from checkpoint and log
+void recover_shard(const ServerOptions& options, int i) {
+  Shard& shard = *shards[i];
+  shard.kv_log = std::unique_ptr<LogStorage>(new LogStorage(
+        shard_log_path(options, i), options.segment_size_mb << 20, options.log_io));
+  auto load_start = hrc::now();
+  uint64_t replay_from = Checkpointer::load(*shard.kv_log, shard.kv_store, values_on_disk);
+  shard.checkpoint_load_ms = std::chrono::duration<double, std::milli>(
+        hrc::now() - load_start).count();
+  shard.recovery_stats = shard.kv_log->readAll(shard.kv_store, !values_on_disk, replay_from);
+  build_key_index(shard);
+}
+
+// Start the writer and background threads of a recovered shard
+void start_shard(const ServerOptions& options, Shard& shard) {
+  Shard* s = &shard;
+  shard.group_commit = std::unique_ptr<GroupCommitLog>(new GroupCommitLog(
+        *shard.kv_log,
+        [s](const std::string& key, const std::string& value, const value_location& loc) {
+          set_value_in_map(*s, key, value, loc);
+        },
+        options.max_batch, options.max_wait_us, &metrics));
+  if (options.compact_garbage_pct > 0) {
+    shard.compactor = std::unique_ptr<Compactor>(new Compactor(
+          *shard.kv_log,
+          [s](const std::string& key, const value_location& loc) {
+            return is_live_in_map(*s, key, loc);
+          },
+          [s](const std::string& key, const value_location& from, const value_location& to) {
+            return relocate_in_map(*s, key, from, to);
+          },
+          [s](const std::string& key) { return has_key_in_map(*s, key); },
+          options.compact_garbage_pct / 100.0,
+          options.compaction_rate_mb << 20));
+  }
+  if (options.checkpoint_mb > 0) {
+    shard.checkpointer = std::unique_ptr<Checkpointer>(new Checkpointer(
+          *shard.kv_log, *shard.group_commit, shard.kv_store, shard.key_index,
+          values_on_disk, options.checkpoint_mb << 20));
+  }
+  if (options.sweep_keys_per_sec > 0) {
+    shard.sweeper = std::unique_ptr<ExpirySweeper>(new ExpirySweeper(
+          shard.key_index, [s](const std::string& key) { return sweep_key(*s, key); },
+          std::max<size_t>(1, options.sweep_keys_per_sec / shards.size())));
+  }
+}
+
+void RunServer(const ServerOptions& options) {
+  std::string server_address(options.listen_address);
   KeyValueStoreServiceImpl service;
+  KeyValueStore::AsyncService async_service;
+  std::vector<ServerQueue> queues;
 
   ServerBuilder builder;
   // Listen on the given address without any authentication mechanism.
   builder.AddListeningPort(server_address, grpc::InsecureServerCredentials());
-  // Register "service" as the instance through which we'll communicate with
-  // clients. In this case, it corresponds to an *synchronous* service.
-  builder.RegisterService(&service);
+  if (options.max_threads > 0 || options.resource_quota_mb > 0) {
+    grpc::ResourceQuota quota("kvserver");
+    if (options.max_threads > 0) {
+      quota.SetMaxThreads(options.max_threads);
+    }
+    if (options.resource_quota_mb > 0) {
+      quota.Resize(options.resource_quota_mb << 20);
+    }
+    builder.SetResourceQuota(quota);
+  }
+  if (options.max_concurrent_streams > 0) {
+    builder.AddChannelArgument(GRPC_ARG_MAX_CONCURRENT_STREAMS,
+                               options.max_concurrent_streams);
+  }
+  if (options.min_pollers > 0) {
+    builder.SetSyncServerOption(ServerBuilder::SyncServerOption::MIN_POLLERS,
+                                options.min_pollers);
+  }
+  if (options.max_pollers > 0) {
+    builder.SetSyncServerOption(ServerBuilder::SyncServerOption::MAX_POLLERS,
+                                options.max_pollers);
+  }
+  if (options.async) {
+    int num_cqs = options.num_cqs > 0 ? options.num_cqs
+                                      : std::max(1u, std::thread::hardware_concurrency());
+    builder.RegisterService(&async_service);
+    queues.resize(num_cqs);
+    for (auto& queue : queues) {
+      queue.service = &async_service;
+      queue.cq = builder.AddCompletionQueue();
+    }
+  } else {
+    // Register "service" as the instance through which we'll communicate with
+    // clients. In this case, it corresponds to an *synchronous* service.
+    builder.RegisterService(&service);
+  }
 
   // Initialize Log and in-memory cache
   // Do this before assembling server
-  log = std::unique_ptr<LogStorage>(new LogStorage(logFile));
-  log->readAll(kv_store);
+  values_on_disk = options.values_on_disk;
+  compress_min_bytes = options.compress_min_bytes;
+  if (!options.trace_file.empty()) {
+    tracer.reset(new Tracer(options.trace_file, "kvserver", options.trace_sample_every));
+    if (!tracer->good()) {
+      std::cerr << "Cannot write trace file " << options.trace_file << std::endl;
+      exit(1);
+    }
+    metrics.setTracer(tracer.get());
+  }
+  if (options.max_reads_in_flight > 0) {
+    read_admission.reset(new AdmissionController(options.max_reads_in_flight, 0));
+  }
+  if (options.max_writes_in_flight > 0 || options.write_target_delay_us > 0) {
+    write_admission.reset(new AdmissionController(options.max_writes_in_flight,
+                                                  options.write_target_delay_us,
+                                                  options.admission_interval_ms));
+  }
+  if (options.replication_buffer_mb > 0) {
+    feed.reset(new ReplicationFeed(options.replication_buffer_mb << 20));
+  }
+  if (!check_shard_count(options)) {
+    exit(1);
+  }
+  for (int i = 0; i < options.num_shards; i++) {
+    shards.emplace_back(new Shard);
+  }
+  // Shards recover in parallel, each with all cores
+  auto recovery_start = hrc::now();
+  tbb::parallel_for(0, options.num_shards, [&options](int i) {
+    recover_shard(options, i);
+  });
+  recovery_ms = std::chrono::duration<double, std::milli>(
+        hrc::now() - recovery_start).count();
+  if (shards.size() > 1) {
+    size_t pairs = 0;
+    for (auto& shard : shards) {
+      pairs += shard->kv_store.size();
+    }
+    std::cout << "Recovered " << pairs << " kv pairs in " << shards.size()
+              << " shards in " << recovery_ms << " ms" << std::endl;
+  }
+  for (auto& shard : shards) {
+    start_shard(options, *shard);
+  }
 
   // Finally assemble the server.
   std::unique_ptr<Server> server(builder.BuildAndStart());
+  if (!server) {
+    std::cerr << "Could not listen on " << server_address << std::endl;
+    exit(1);
+  }
+  if (!options.primary.empty()) {
+    read_only = true;
+    max_staleness_ms = options.max_staleness_ms;
+    follower.reset(new Follower(options.primary, options.log_file + ".replica"));
+  }
   stop = hrc::now();
+  startup_ms = std::chrono::duration<double, std::milli>(stop-start).count();
+
+  std::cout << "Startup time: " << startup_ms << " ms" << std::endl;
+  std::cout << "Server listening on " << server_address
+            << (options.async ? " (async, " + std::to_string(queues.size()) + " queues)"
+                              : " (sync)")
+            << (options.primary.empty() ? "" : ", following " + options.primary)
+            << ", log io " << logIoName(shards[0]->kv_log->io()) << std::endl;
+  if (read_admission || write_admission) {
+    std::cout << "Admission: " << options.max_reads_in_flight << " Gets and "
+              << options.max_writes_in_flight << " writes in flight, write target delay "
+              << options.write_target_delay_us << " us over "
+              << options.admission_interval_ms << " ms (0 is unbounded)" << std::endl;
+  }
+
+  if (options.stats_interval_s > 0) {
+    std::thread(PrintStats, options.stats_interval_s, options.stats_file).detach();
+  }
 
-  std::cout << "Startup time: " << std::chrono::duration<double, std::milli>(
-            stop-start).count() << " ms" << std::endl;
-  std::cout << "Server listening on " << server_address << std::endl;
+  std::vector<std::thread> pollers;
+  for (auto& queue : queues) {
+    pollers.emplace_back(PollQueue, &queue);
+  }
 
   // Wait for the server to shutdown. Note that some other thread must be
   // responsible for shutting down the server for this call to ever return.
   server->Wait();
+  for (auto& queue : queues) {
+    queue.cq->Shutdown();
+  }
+  for (auto& poller : pollers) {
+    poller.join();
+  }
+}
+
+void PrintUsage() {
+  std::cerr << "Usage: ./kvserver [-n num_shards=1] [-d shard_dir,...] "
+            << "[-b max_batch=128] [-w max_wait_us=0] "
+            << "[-i stats_interval_s=0] [-f stats_file] [-m storage_mode=mem|disk] "
+            << "[-s segment_size_mb=64] [-o log_io=stream|uring|pwritev] "
+            << "[-c compact_garbage_pct=50] "
+            << "[-r compaction_rate_mb=32] [-k checkpoint_mb=0] "
+            << "[-a server_mode=sync|async] [-q num_cqs=cores] "
+            << "[-z compress_min_bytes=0] [-e sweep_keys_per_sec=100000] "
+            << "[-p listen_address=0.0.0.0:50051] [-j replication_buffer_mb=0] "
+            << "[-u primary_address] [-t max_staleness_ms=0] "
+            << "[-g trace_file] [-y trace_sample_every=1000] "
+            << "[-A max_reads_in_flight,max_writes_in_flight=0,0] "
+            << "[-D write_target_delay_us[,interval_ms=100]=0] "
+            << "[-T max_threads=0] [-M resource_quota_mb=0] "
+            << "[-S max_concurrent_streams=0] [-P min_pollers,max_pollers=0,0] "
+            << "<path to log file>\n";
+}
+
+// "a,b" into a and b; b can be left out if it is optional
+template <class A, class B>
+bool parse_pair(const std::string& arg, A* a, B* b, bool b_optional) {
+  size_t comma = arg.find(',');
+  if (comma == std::string::npos && !b_optional) {
+    return false;
+  }
+  *a = atol(arg.substr(0, comma).c_str());
+  if (comma != std::string::npos) {
+    *b = atol(arg.substr(comma + 1).c_str());
+  }
+  return true;
+}
+
+bool GetInputArgs(int argc, char** argv, ServerOptions& options) {
+  int opt;
+  while ((opt = getopt(argc, argv, "n:d:b:w:i:f:m:s:o:c:r:k:a:q:z:e:p:j:u:t:g:y:A:D:T:M:S:P:")) != -1) {
+    switch (opt) {
+      case 'n':
+        options.num_shards = atoi(optarg);
+        break;
+      case 'd': {
+        std::stringstream dirs(optarg);
+        std::string dir;
+        while (std::getline(dirs, dir, ',')) {
+          options.shard_dirs.push_back(dir);
+        }
+        break;
+      }
+      case 'b':
+        options.max_batch = atol(optarg);
+        break;
+      case 'w':
+        options.max_wait_us = atol(optarg);
+        break;
+      case 'i':
+        options.stats_interval_s = atoi(optarg);
+        break;
+      case 'f':
+        options.stats_file = std::string(optarg);
+        break;
+      case 'm':
+        if (std::string(optarg) == "disk") {
+          options.values_on_disk = true;
+        } else if (std::string(optarg) != "mem") {
+          return false;
+        }
+        break;
+      case 's':
+        options.segment_size_mb = atol(optarg);
+        break;
+      case 'o':
+        if (!parseLogIo(optarg, options.log_io)) {
+          return false;
+        }
+        break;
+      case 'c':
+        options.compact_garbage_pct = atoi(optarg);
+        break;
+      case 'r':
+        options.compaction_rate_mb = atol(optarg);
+        break;
+      case 'k':
+        options.checkpoint_mb = atol(optarg);
+        break;
+      case 'a':
+        if (std::string(optarg) == "async") {
+          options.async = true;
+        } else if (std::string(optarg) != "sync") {
+          return false;
+        }
+        break;
+      case 'q':
+        options.num_cqs = atoi(optarg);
+        break;
+      case 'z':
+        options.compress_min_bytes = atol(optarg);
+        break;
+      case 'e':
+        options.sweep_keys_per_sec = atol(optarg);
+        break;
+      case 'p':
+        options.listen_address = std::string(optarg);
+        break;
+      case 'j':
+        options.replication_buffer_mb = atol(optarg);
+        break;
+      case 'u':
+        options.primary = std::string(optarg);
+        break;
+      case 't':
+        options.max_staleness_ms = atol(optarg);
+        break;
+      case 'g':
+        options.trace_file = std::string(optarg);
+        break;
+      case 'y':
+        options.trace_sample_every = atol(optarg);
+        break;
+      case 'A':
+        if (!parse_pair(optarg, &options.max_reads_in_flight,
+                        &options.max_writes_in_flight, false)) {
+          return false;
+        }
+        break;
+      case 'D':
+        if (!parse_pair(optarg, &options.write_target_delay_us,
+                        &options.admission_interval_ms, true)) {
+          return false;
+        }
+        break;
+      case 'T':
+        options.max_threads = atoi(optarg);
+        break;
+      case 'M':
+        options.resource_quota_mb = atol(optarg);
+        break;
+      case 'S':
+        options.max_concurrent_streams = atoi(optarg);
+        break;
+      case 'P':
+        if (!parse_pair(optarg, &options.min_pollers, &options.max_pollers, false)) {
+          return false;
+        }
+        break;
+      default:
+        return false;
+    }
+  }
+  if (optind != argc - 1 || options.num_shards < 1) {
+    return false;
+  }
+  if (!options.stats_file.empty() && options.stats_interval_s == 0) {
+    options.stats_interval_s = 10;
+  }
+  options.log_file = std::string(argv[optind]);
+  return true;
 }
 
 int main(int argc, char** argv) {
-  if (argc != 2) {
-    std::cerr << "Usage: ./kvserver <path to log file>\n";
+  ServerOptions options;
+  if (!GetInputArgs(argc, argv, options)) {
+    PrintUsage();
     return 1;
   }
   start = hrc::now();
-  RunServer(std::string(argv[1]));
+  RunServer(options);
 
   return 0;
 }
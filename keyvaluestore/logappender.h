@@ -0,0 +1,655 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define KV_HAVE_IO_URING 1
+#endif
+
+// How the active segment of the log is written
+enum class LogIo {
+    // std::ofstream, flushed and fdatasync'ed by sync()
+    kStream,
+    // O_DIRECT from aligned buffers, writes and syncs submitted through
+    // io_uring; falls back to kPwritev where io_uring is unavailable
+    kUring,
+    // O_DIRECT from aligned buffers, written with pwritev and fdatasync
+    kPwritev,
+};
+
+inline bool parseLogIo(const std::string& name, LogIo& io) {
+    if (name == "stream") {
+        io = LogIo::kStream;
+    } else if (name == "uring") {
+        io = LogIo::kUring;
+    } else if (name == "pwritev") {
+        io = LogIo::kPwritev;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline const char* logIoName(LogIo io) {
+    switch (io) {
+        case LogIo::kUring:
+            return "uring";
+        case LogIo::kPwritev:
+            return "pwritev";
+        default:
+            return "stream";
+    }
+}
+
+/*
+ * Appends bytes to the end of one log segment
+ * Appended bytes reach the file by flush() and the device by sync(); only
+ * then may they be read back through another descriptor.
+ */
+class LogAppender {
+public:
+    virtual ~LogAppender() {}
+
+    // Start appending to the file at path, which holds size bytes of records
+    virtual bool open(const std::string& path, uint64_t size) = 0;
+    virtual bool append(const char* data, size_t n) = 0;
+    virtual bool flush() = 0;
+    // flush() and force the file's data to the device
+    virtual bool sync() = 0;
+    // Stop appending; space reserved past the appended bytes is given back
+    virtual void close() = 0;
+    // The LogIo actually in use
+    virtual LogIo io() const = 0;
+};
+
+// The original append path: an ofstream plus a descriptor for fdatasync
+class StreamAppender : public LogAppender {
+private:
+    std::ofstream out;
+    // ofstream has no fsync
+    int syncFd = -1;
+
+public:
+    ~StreamAppender() {
+        close();
+    }
+
+    // Appending mode finds the end of the file by itself
+    bool open(const std::string& path, uint64_t /* size */) override {
+        out.clear();
+        out.open(path, std::ofstream::out | std::ofstream::app | std::ofstream::binary);
+        syncFd = ::open(path.c_str(), O_WRONLY | O_APPEND);
+        return out.good() && syncFd >= 0;
+    }
+
+    bool append(const char* data, size_t n) override {
+        return (bool) out.write(data, n);
+    }
+
+    bool flush() override {
+        if (!out.flush()) {
+            std::cerr << "Flush failed!\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool sync() override {
+        if (!flush()) {
+            return false;
+        }
+        if (fdatasync(syncFd) != 0) {
+            std::cerr << "fdatasync failed!\n";
+            return false;
+        }
+        return true;
+    }
+
+    void close() override {
+        if (out.is_open()) {
+            out.close();
+        }
+        if (syncFd >= 0) {
+            ::close(syncFd);
+            syncFd = -1;
+        }
+    }
+
+    LogIo io() const override {
+        return LogIo::kStream;
+    }
+};
+
+#ifdef KV_HAVE_IO_URING
+/*
+ * Minimal io_uring on the raw system calls, for a single thread
+ * Entries are prepared with next(), handed to the kernel by submit() and
+ * their completions collected with reap().
+ */
+class IoUring {
+private:
+    int ringFd = -1;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = (io_uring_sqe*) MAP_FAILED;
+    size_t sqesSize = 0;
+    unsigned entries = 0;
+
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    io_uring_cqe* cqes;
+    // entries prepared, and how many of them the kernel has taken
+    unsigned prepared = 0;
+    unsigned submitted = 0;
+
+public:
+    ~IoUring() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqesSize);
+        }
+        if (cqRing != MAP_FAILED && cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        if (sqRing != MAP_FAILED) {
+            munmap(sqRing, sqRingSize);
+        }
+        if (ringFd >= 0) {
+            ::close(ringFd);
+        }
+    }
+
+    // false if the kernel does not support io_uring or does not allow it
+    bool init(unsigned numEntries) {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ringFd = syscall(__NR_io_uring_setup, numEntries, &p);
+        if (ringFd < 0) {
+            return false;
+        }
+        entries = p.sq_entries;
+        sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) {
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        }
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED) {
+            return false;
+        }
+        cqRing = singleMap ? sqRing :
+                 mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            return false;
+        }
+        sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*) mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+        char* sq = (char*) sqRing;
+        char* cq = (char*) cqRing;
+        sqHead = (unsigned*) (sq + p.sq_off.head);
+        sqTail = (unsigned*) (sq + p.sq_off.tail);
+        sqMask = (unsigned*) (sq + p.sq_off.ring_mask);
+        sqArray = (unsigned*) (sq + p.sq_off.array);
+        cqHead = (unsigned*) (cq + p.cq_off.head);
+        cqTail = (unsigned*) (cq + p.cq_off.tail);
+        cqMask = (unsigned*) (cq + p.cq_off.ring_mask);
+        cqes = (io_uring_cqe*) (cq + p.cq_off.cqes);
+        prepared = submitted = *sqTail;
+        return true;
+    }
+
+    // A cleared entry to fill in, nullptr if the submission queue is full
+    io_uring_sqe* next() {
+        if (prepared - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= entries) {
+            return nullptr;
+        }
+        unsigned index = prepared & *sqMask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        prepared++;
+        return sqe;
+    }
+
+    // Hand the prepared entries to the kernel and wait for waitFor completions
+    bool submit(unsigned waitFor = 0) {
+        __atomic_store_n(sqTail, prepared, __ATOMIC_RELEASE);
+        while (true) {
+            int n = syscall(__NR_io_uring_enter, ringFd, prepared - submitted, waitFor,
+                            waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (n >= 0) {
+                submitted += n;
+                return true;
+            }
+            if (errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+    // Take the oldest completion, false if there is none
+    bool reap(uint64_t& userData, int& res) {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        const io_uring_cqe& cqe = cqes[head & *cqMask];
+        userData = cqe.user_data;
+        res = cqe.res;
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+#endif
+
+/*
+ * Appends through the kernel's direct I/O path, bypassing the page cache
+ *
+ * Appends are copied into kNumBuffers aligned buffers of kBufferSize. A full
+ * buffer is written out while the next one fills: with io_uring its write is
+ * submitted right away and completes in the background, so several appends are
+ * in flight from one thread; with pwritev full buffers queue up and go out in
+ * one system call once the next buffer is needed or on flush. flush() also
+ * writes the last partial block, padded with zeros, and the next flush writes
+ * that block again with more records in it. The file is preallocated with
+ * fallocate ahead of the writes, so recovery finds zeros past the last record.
+ * Files on file systems without O_DIRECT (e.g. tmpfs) are written the same
+ * way through the page cache.
+ */
+class DirectAppender : public LogAppender {
+public:
+    static const size_t kAlignment = 4096;
+    static const size_t kBufferSize = 1 << 20;
+    static const int kNumBuffers = 4;
+    static const uint64_t kMaxPreallocateBytes = 64 << 20;
+
+private:
+    struct Buffer {
+        char* data = nullptr;
+        // file offset of data[0], a multiple of kAlignment
+        uint64_t offset = 0;
+        // bytes appended, and how many of them have been written to the file
+        size_t size = 0;
+        size_t written = 0;
+        // full and queued for pwritev, or being written through io_uring
+        bool pending = false;
+        struct iovec iov;
+    };
+
+    Buffer buffers[kNumBuffers];
+    // the buffer being filled; the pending ones come after it, oldest first
+    int current = 0;
+    int fd = -1;
+    // file size reserved with fallocate, or found when the file was opened
+    uint64_t reserved = 0;
+    uint64_t preallocateBytes;
+    bool canPreallocate = true;
+    bool failed = false;
+    bool useRing;
+#ifdef KV_HAVE_IO_URING
+    std::unique_ptr<IoUring> ring;
+    // user_data of the fsync entry, the buffers use their index
+    static const uint64_t kSyncTag = kNumBuffers;
+    int inFlight = 0;
+#endif
+
+    static size_t alignDown(size_t n) {
+        return n / kAlignment * kAlignment;
+    }
+
+    static size_t alignUp(size_t n) {
+        return alignDown(n + kAlignment - 1);
+    }
+
+    uint64_t end() const {
+        return buffers[current].offset + buffers[current].size;
+    }
+
+    // Extend the file's reservation to cover writes up to offset
+    void reserve(uint64_t offset) {
+        if (!canPreallocate || offset <= reserved) {
+            return;
+        }
+        uint64_t length = std::max(preallocateBytes, offset - reserved);
+        if (fallocate(fd, 0, reserved, length) != 0) {
+            // e.g. not supported by the file system, or out of space, which
+            // the writes themselves report
+            canPreallocate = false;
+            return;
+        }
+        reserved += length;
+    }
+
+    // The aligned part of b that has not been written yet, up to alignUp(b.size)
+    struct iovec unwritten(Buffer& b) {
+        size_t from = alignDown(b.written);
+        size_t to = alignUp(b.size);
+        if (to > b.size) {
+            memset(b.data + b.size, 0, to - b.size);
+        }
+        b.iov.iov_base = b.data + from;
+        b.iov.iov_len = to - from;
+        return b.iov;
+    }
+
+    bool pwriteAll(struct iovec* iov, int n, uint64_t offset) {
+        size_t total = 0;
+        for (int i = 0; i < n; i++) {
+            total += iov[i].iov_len;
+        }
+        reserve(offset + total);
+        ssize_t done = pwritev(fd, iov, n, offset);
+        if (done != (ssize_t) total) {
+            std::cerr << "Log write of " << total << " bytes at offset " << offset
+                      << " failed: " << (done < 0 ? strerror(errno) : "short write") << "\n";
+            failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    // pwritev: write the queued buffers, and with tail the current one, in one call
+    bool writeQueued(bool tail) {
+        struct iovec iov[kNumBuffers];
+        Buffer* included[kNumBuffers];
+        int n = 0;
+        uint64_t offset = 0;
+        for (int i = 1; i <= kNumBuffers; i++) {
+            Buffer& b = buffers[(current + i) % kNumBuffers];
+            bool isCurrent = i == kNumBuffers;
+            if (isCurrent ? !tail || b.size == b.written : !b.pending) {
+                continue;
+            }
+            iov[n] = unwritten(b);
+            included[n] = &b;
+            if (n++ == 0) {
+                offset = b.offset + alignDown(b.written);
+            }
+        }
+        if (n > 0 && !pwriteAll(iov, n, offset)) {
+            return false;
+        }
+        // only what went out: a buffer left out stays pending
+        for (int i = 0; i < n; i++) {
+            included[i]->written = included[i]->size;
+            included[i]->pending = false;
+        }
+        return true;
+    }
+
+#ifdef KV_HAVE_IO_URING
+    // Submit the write of buffer i's unwritten part
+    bool submitWrite(int i) {
+        Buffer& b = buffers[i];
+        unwritten(b);
+        reserve(b.offset + alignDown(b.written) + b.iov.iov_len);
+        io_uring_sqe* sqe = ring->next();
+        if (!sqe) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) &b.iov;
+        sqe->len = 1;
+        sqe->off = b.offset + alignDown(b.written);
+        sqe->user_data = i;
+        b.pending = true;
+        inFlight++;
+        return ring->submit();
+    }
+
+    bool submitSync() {
+        io_uring_sqe* sqe = ring->next();
+        if (!sqe) {
+            return false;
+        }
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        // only starts once the writes submitted before it are done
+        sqe->flags = IOSQE_IO_DRAIN;
+        sqe->user_data = kSyncTag;
+        inFlight++;
+        return ring->submit();
+    }
+
+    // Collect completions until until() holds or nothing is in flight
+    template <class Until>
+    bool waitFor(Until until) {
+        while (inFlight > 0 && !until()) {
+            uint64_t tag;
+            int res;
+            while (!ring->reap(tag, res)) {
+                if (!ring->submit(1)) {
+                    std::cerr << "io_uring_enter failed: " << strerror(errno) << "\n";
+                    failed = true;
+                    return false;
+                }
+            }
+            inFlight--;
+            if (tag == kSyncTag) {
+                if (res < 0) {
+                    std::cerr << "fdatasync failed: " << strerror(-res) << "\n";
+                    failed = true;
+                }
+                continue;
+            }
+            Buffer& b = buffers[tag];
+            if (res != (int) b.iov.iov_len) {
+                std::cerr << "Log write of " << b.iov.iov_len << " bytes at offset "
+                          << b.offset + alignDown(b.written) << " failed: "
+                          << (res < 0 ? strerror(-res) : "short write") << "\n";
+                failed = true;
+            }
+            b.written = b.size;
+            b.pending = false;
+        }
+        return !failed;
+    }
+#endif
+
+    // Hand out the buffer after the current one, once its old contents are written
+    bool advance() {
+        Buffer& full = buffers[current];
+        int next = (current + 1) % kNumBuffers;
+#ifdef KV_HAVE_IO_URING
+        if (ring) {
+            if (!submitWrite(current) ||
+                    !waitFor([this, next] { return !buffers[next].pending; })) {
+                return false;
+            }
+        } else
+#endif
+        {
+            // Once every buffer is queued, write them all, the full one last
+            full.pending = true;
+            if (buffers[next].pending && !writeQueued(true)) {
+                return false;
+            }
+        }
+        Buffer& b = buffers[next];
+        b.offset = full.offset + kBufferSize;
+        b.size = b.written = 0;
+        current = next;
+        return true;
+    }
+
+    bool write(bool datasync) {
+        if (failed) {
+            return false;
+        }
+#ifdef KV_HAVE_IO_URING
+        if (ring) {
+            Buffer& b = buffers[current];
+            if (b.size > b.written && !submitWrite(current)) {
+                return false;
+            }
+            if (datasync && !submitSync()) {
+                return false;
+            }
+            return waitFor([] { return false; });
+        }
+#endif
+        if (!writeQueued(true)) {
+            return false;
+        }
+        if (datasync && fdatasync(fd) != 0) {
+            std::cerr << "fdatasync failed!\n";
+            return false;
+        }
+        return true;
+    }
+
+public:
+    DirectAppender(bool useRing, uint64_t preallocateBytes)
+        : preallocateBytes(std::max<uint64_t>((uint64_t) kAlignment,
+                                              std::min<uint64_t>(preallocateBytes,
+                                                                 (uint64_t) kMaxPreallocateBytes))),
+          useRing(useRing) {
+        for (auto& b : buffers) {
+            if (posix_memalign((void**) &b.data, kAlignment, kBufferSize) != 0) {
+                std::cerr << "Allocating log buffers failed\n";
+                exit(1);
+            }
+        }
+#ifdef KV_HAVE_IO_URING
+        if (useRing) {
+            ring.reset(new IoUring());
+            // every buffer, the fsync and the tail can be in flight
+            if (!ring->init(2 * kNumBuffers)) {
+                ring.reset();
+            }
+        }
+#endif
+    }
+
+    ~DirectAppender() {
+        close();
+        for (auto& b : buffers) {
+            free(b.data);
+        }
+    }
+
+    bool open(const std::string& path, uint64_t size) override {
+        fd = ::open(path.c_str(), O_RDWR | O_DIRECT);
+        if (fd < 0 && errno == EINVAL) {
+            fd = ::open(path.c_str(), O_RDWR);
+        }
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        reserved = fstat(fd, &st) == 0 ? st.st_size : size;
+        canPreallocate = true;
+        failed = false;
+        current = 0;
+        for (auto& b : buffers) {
+            b.pending = false;
+        }
+        // The partial block at the end is written again with the next records
+        Buffer& b = buffers[0];
+        b.offset = alignDown(size);
+        b.size = b.written = size - b.offset;
+        if (b.size > 0 && pread(fd, b.data, kAlignment, b.offset) < (ssize_t) b.size) {
+            return false;
+        }
+        return true;
+    }
+
+    bool append(const char* data, size_t n) override {
+        while (n > 0) {
+            Buffer& b = buffers[current];
+            size_t k = std::min(n, kBufferSize - b.size);
+            memcpy(b.data + b.size, data, k);
+            b.size += k;
+            data += k;
+            n -= k;
+            if (b.size == kBufferSize && !advance()) {
+                return false;
+            }
+        }
+        return !failed;
+    }
+
+    bool flush() override {
+        return write(false);
+    }
+
+    bool sync() override {
+        return write(true);
+    }
+
+    void close() override {
+        if (fd < 0) {
+            return;
+        }
+        flush();
+        // Durable before the next segment is created, so that only the last
+        // segment can end in reserved space after a crash
+        struct stat st;
+        if (fstat(fd, &st) == 0 && (uint64_t) st.st_size > end()) {
+            if (ftruncate(fd, end()) != 0 || fsync(fd) != 0) {
+                std::cerr << "Trimming the log to " << end() << " bytes failed\n";
+            }
+        }
+        ::close(fd);
+        fd = -1;
+    }
+
+    LogIo io() const override {
+#ifdef KV_HAVE_IO_URING
+        if (ring) {
+            return LogIo::kUring;
+        }
+#endif
+        return LogIo::kPwritev;
+    }
+};
+
+/*
+ * Appender for io; kUring without io_uring support gives kPwritev
+ * Direct appenders reserve file space preallocateBytes at a time.
+ */
+inline std::unique_ptr<LogAppender> makeLogAppender(LogIo io, uint64_t preallocateBytes) {
+    if (io == LogIo::kStream) {
+        return std::unique_ptr<LogAppender>(new StreamAppender());
+    }
+    std::unique_ptr<LogAppender> appender(
+            new DirectAppender(io == LogIo::kUring, preallocateBytes));
+    if (appender->io() != io) {
+        static std::atomic<bool> warned{false};
+        if (!warned.exchange(true)) {
+            std::cerr << "io_uring is not available, writing the log with pwritev\n";
+        }
+    }
+    return appender;
+}
@@ -0,0 +1,215 @@
+#include <chrono>
+#include <cstdlib>
+#include <experimental/filesystem>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unistd.h> // getopt
+#include <vector>
+
+#include "histogram.h"
+#include "logstorage.h"
+
+using namespace std;
+
+/*
+ * Compares the ways LogStorage can write the log (-o of kvserver)
+ * Appends num_records records with LogStorage::write and syncs every
+ * records_per_sync of them, like the group-commit writer does with a batch.
+ * Reports appends/s and MB/s, the latency of a single write() call and of a
+ * commit (the batch's writes plus its sync, which is what a client waits for).
+ * Best of runs by throughput. After every run the log is recovered with
+ * LogStorage::readAll and every record is checked, so a way of writing that
+ * loses or corrupts records fails instead of reporting its throughput.
+ */
+
+struct ConfigOptions {
+    uint64_t num_records = 1000000;
+    int key_size = 128;
+    int value_size = 512;
+    int records_per_sync = 32;
+    uint64_t segment_size_mb = 64;
+    int runs = 3;
+    vector<LogIo> ios = {LogIo::kStream, LogIo::kPwritev, LogIo::kUring};
+    string dir = "/tmp/logio_bench";
+};
+
+void PrintUsage () {
+    cerr << "Usage: ./logio_bench [-n num_records=1000000] [-k key_size=128] "
+        << "[-v val_size=512] [-b records_per_sync=32] [-s segment_size_mb=64] "
+        << "[-r runs=3] [-o log_io,...=stream,pwritev,uring] "
+        << "[-d dir=/tmp/logio_bench]" << endl;
+}
+
+void GeneratePaddedStr(string& s, uint64_t i, int padding) {
+    string i_str = to_string(i);
+    s.clear();
+    if ((int) i_str.size() < padding) {
+        s.append(padding-i_str.size(), '0');
+    }
+    s.append(i_str.data(), i_str.size());
+}
+
+bool GetInputArgs(int argc, char **argv, ConfigOptions& options) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:k:v:b:s:r:o:d:")) != -1) {
+        switch (opt) {
+            case 'n':
+                options.num_records = atoll(optarg);
+                break;
+            case 'k':
+                options.key_size = atoi(optarg);
+                break;
+            case 'v':
+                options.value_size = atoi(optarg);
+                break;
+            case 'b':
+                options.records_per_sync = atoi(optarg);
+                break;
+            case 's':
+                options.segment_size_mb = atoll(optarg);
+                break;
+            case 'r':
+                options.runs = atoi(optarg);
+                break;
+            case 'o': {
+                options.ios.clear();
+                stringstream ios(optarg);
+                string name;
+                while (getline(ios, name, ',')) {
+                    LogIo io;
+                    if (!parseLogIo(name, io)) {
+                        return false;
+                    }
+                    options.ios.push_back(io);
+                }
+                break;
+            }
+            case 'd':
+                options.dir = string(optarg);
+                break;
+            default:
+                return false;
+        }
+    }
+    return options.num_records > 0 && options.runs > 0 && options.records_per_sync > 0 &&
+           options.segment_size_mb > 0 && !options.ios.empty();
+}
+
+struct RunResult {
+    double seconds;
+    // ns per write() call and per commit
+    LatencyHistogram writes;
+    LatencyHistogram commits;
+};
+
+RunResult Append(const ConfigOptions& options, LogStorage& log) {
+    RunResult result;
+    string key, value;
+    value_location loc;
+    auto start = chrono::steady_clock::now();
+    auto commitStart = start;
+    for (uint64_t i = 0; i < options.num_records; i++) {
+        GeneratePaddedStr(key, i, options.key_size);
+        GeneratePaddedStr(value, i, options.value_size);
+        auto writeStart = chrono::steady_clock::now();
+        if (!log.write(key, value, loc)) {
+            cerr << "Write failed!" << endl;
+            exit(1);
+        }
+        auto now = chrono::steady_clock::now();
+        result.writes.record(chrono::duration_cast<chrono::nanoseconds>(now - writeStart).count());
+        if (i % options.records_per_sync == (uint64_t) options.records_per_sync - 1 ||
+                i == options.num_records - 1) {
+            if (!log.sync()) {
+                cerr << "Sync failed!" << endl;
+                exit(1);
+            }
+            now = chrono::steady_clock::now();
+            result.commits.record(
+                    chrono::duration_cast<chrono::nanoseconds>(now - commitStart).count());
+            commitStart = now;
+        }
+    }
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+// Recover the log at path and check that it holds every record Append wrote
+bool Verify(const ConfigOptions& options, const string& path) {
+    tbb::concurrent_hash_map<string, kv_pair> kvStore;
+    LogStorage log(path, options.segment_size_mb << 20);
+    // readAll reports on cout, which would break up the table
+    ostringstream report;
+    streambuf* out = cout.rdbuf(report.rdbuf());
+    log.readAll(kvStore);
+    cout.rdbuf(out);
+    if (kvStore.size() != options.num_records) {
+        cerr << "Read back " << kvStore.size() << " of " << options.num_records
+             << " records" << endl;
+        return false;
+    }
+    string key, value;
+    for (uint64_t i = 0; i < options.num_records; i++) {
+        GeneratePaddedStr(key, i, options.key_size);
+        GeneratePaddedStr(value, i, options.value_size);
+        tbb::concurrent_hash_map<string, kv_pair>::const_accessor a;
+        if (!kvStore.find(a, key) || a->second.value != value) {
+            cerr << "Read back a wrong value for key " << key << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main (int argc, char **argv)
+{
+    ConfigOptions options;
+    if (!GetInputArgs(argc, argv, options)) {
+        PrintUsage();
+        return 1;
+    }
+
+    namespace fs = std::experimental::filesystem;
+    double mb = options.num_records *
+                LogStorage::recordSize(options.key_size, options.value_size) / 1e6;
+    cout << "Append of " << options.num_records << " records of "
+         << LogStorage::recordSize(options.key_size, options.value_size)
+         << " bytes, sync every " << options.records_per_sync << " records, best of "
+         << options.runs << " runs:" << endl;
+    cout << "log_io\tMB/s\tappends/s\twrite p50/p99 us\tcommit p50/p99/max us" << endl;
+    for (LogIo io : options.ios) {
+        RunResult best;
+        best.seconds = 1e30;
+        LogIo used = io;
+        for (int run = 0; run < options.runs; run++) {
+            fs::remove_all(options.dir);
+            fs::create_directories(options.dir);
+            RunResult result;
+            {
+                LogStorage log(options.dir + "/log", options.segment_size_mb << 20, io);
+                used = log.io();
+                result = Append(options, log);
+            }
+            if (!Verify(options, options.dir + "/log")) {
+                cerr << logIoName(io) << ": the log does not read back as written" << endl;
+                return 1;
+            }
+            if (result.seconds < best.seconds) {
+                best = result;
+            }
+        }
+        cout << logIoName(io);
+        if (used != io) {
+            cout << " (" << logIoName(used) << ")";
+        }
+        cout << "\t" << mb / best.seconds << "\t" << (uint64_t) (options.num_records / best.seconds)
+             << "\t" << best.writes.percentile(0.5) / 1000.0
+             << " / " << best.writes.percentile(0.99) / 1000.0
+             << "\t" << best.commits.percentile(0.5) / 1000.0
+             << " / " << best.commits.percentile(0.99) / 1000.0
+             << " / " << best.commits.max() / 1000.0 << endl;
+    }
+    fs::remove_all(options.dir);
+    return 0;
+}
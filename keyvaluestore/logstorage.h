@@ -1,143 +1,995 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cstdio>
+#include <cstring>
 #include <experimental/filesystem>
+#include <fcntl.h>
 #include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
 #include <memory>
 #include <map>
+#include <mutex>
+#include <shared_mutex>
+#include <sstream>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <vector>
 
 #include "common.h"
+#include "crc32c.h"
+#include "logappender.h"
+#include "tbb/blocked_range.h"
 #include "tbb/concurrent_hash_map.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/parallel_for.h"
+
+/*
+ * On-disk layout of log segments
+ *
+ * A segment starts with a 16 byte header: the magic "KVLOGSEG" and the format
+ * version as a little-endian u32 (plus 4 reserved bytes). Every record is
+ *
+ *   u32 crc | u32 keySize | u32 valueSize | u32 flags | [u64 expiresAt] |
+ *   [u64 version] | key | value
+ *
+ * with all integers little-endian. The CRC32C covers everything after the crc
+ * field: the rest of the header, the key and the value. The flags describe
+ * how the value is stored (RecordFlags); expiresAt is only there for records
+ * with kExpires and version for records with kVersioned. Format 3 is format 4
+ * without versions, format 2 is format 3 without deletes and expiry.
+ *
+ * Segments written before the header was introduced (format 1) have no
+ * header and records of size_t keySize | size_t valueSize | key | value in
+ * host byte order, without a checksum. They are still read, but never
+ * appended to; compaction rewrites them in the current format.
+ */
+struct LogFormat {
+    static const uint32_t kLegacyVersion = 1;
+    static const uint32_t kVersion = 4;
+    static const uint64_t kSegmentHeaderSize = 16;
+    // The same for all formats, without the expiry time and version
+    static const uint64_t kRecordHeaderSize = 16;
+    static const uint64_t kMaxRecordHeaderSize = kRecordHeaderSize + 16;
+
+    enum RecordFlags : uint32_t {
+        // value is compressed with ValueCompressor
+        kCompressed = 1,
+        // the key was deleted; the value is empty
+        kTombstone = 2,
+        // the header is followed by the expiry time, wall_clock_ms()
+        kExpires = 4,
+        // the header is followed by the key's version (after the expiry time)
+        kVersioned = 8,
+    };
+
+    static constexpr const char* kMagic = "KVLOGSEG";
+    static const size_t kMagicSize = 8;
+
+    static void putFixed32(char* p, uint32_t v) {
+        for (int i = 0; i < 4; i++) {
+            p[i] = (char) (v >> (8 * i));
+        }
+    }
+
+    static uint32_t getFixed32(const char* p) {
+        const uint8_t* u = (const uint8_t*) p;
+        return u[0] | u[1] << 8 | u[2] << 16 | (uint32_t) u[3] << 24;
+    }
+
+    static void putFixed64(char* p, uint64_t v) {
+        putFixed32(p, (uint32_t) v);
+        putFixed32(p + 4, (uint32_t) (v >> 32));
+    }
+
+    static uint64_t getFixed64(const char* p) {
+        return getFixed32(p) | (uint64_t) getFixed32(p + 4) << 32;
+    }
+
+    // Size of the header of a record with flags
+    static uint64_t headerSize(uint32_t flags) {
+        return kRecordHeaderSize + (flags & kExpires ? 8 : 0) + (flags & kVersioned ? 8 : 0);
+    }
+
+    static void encodeSegmentHeader(char* header) {
+        memcpy(header, kMagic, kMagicSize);
+        putFixed32(header + kMagicSize, kVersion);
+        putFixed32(header + kMagicSize + 4, 0);
+    }
+
+    /*
+     * Format of a segment that starts with the first n bytes of data
+     * An empty segment, or one whose header was torn before its first
+     * record, is in the current format
+     */
+    static uint32_t detect(const char* data, size_t n) {
+        if (memcmp(data, kMagic, std::min(n, kMagicSize)) != 0) {
+            return kLegacyVersion;
+        }
+        return n < kSegmentHeaderSize ? kVersion : getFixed32(data + kMagicSize);
+    }
+
+    /*
+     * Record header for key and value, headerSize(flags) bytes
+     * expiresAt is only stored with kExpires and version with kVersioned
+     * Returns false if key or value are too large
+     */
+    static bool encodeRecordHeader(char* header, const std::string& key,
+                                   const std::string& value, uint32_t flags = 0,
+                                   uint64_t expiresAt = 0, uint64_t version = 0) {
+        if (key.size() > UINT32_MAX || value.size() > UINT32_MAX) {
+            return false;
+        }
+        putFixed32(header + 4, key.size());
+        putFixed32(header + 8, value.size());
+        putFixed32(header + 12, flags);
+        if (flags & kExpires) {
+            putFixed64(header + kRecordHeaderSize, expiresAt);
+        }
+        if (flags & kVersioned) {
+            putFixed64(header + headerSize(flags) - 8, version);
+        }
+        uint32_t crc = Crc32c::value(header + 4, headerSize(flags) - 4);
+        crc = Crc32c::extend(crc, key.data(), key.size());
+        crc = Crc32c::extend(crc, value.data(), value.size());
+        putFixed32(header, crc);
+        return true;
+    }
+};
+
+/*
+ * One file of the log
+ * Segments are named <log path>.<seq>[.<gen>] and a higher seq holds newer
+ * records. Compacting a segment writes the next generation of the same seq.
+ * ids are only unique within this process: a compacted copy of a segment keeps
+ * its seq but gets a new id, so a value_location never points into the wrong
+ * version of a file.
+ */
+struct LogSegment {
+    uint32_t id;
+    uint64_t seq;
+    uint64_t gen;
+    std::string path;
+    // descriptor for pread, stays valid after the file is replaced or removed
+    int fd;
+    std::atomic<uint64_t> size;
+    // bytes of records still referenced from the in-memory map
+    std::atomic<int64_t> liveBytes;
+    // LogFormat version, and offset of the first record
+    uint32_t format;
+    uint64_t dataOffset;
+
+    LogSegment(uint32_t id, uint64_t seq, uint64_t gen, const std::string& path)
+        : id(id), seq(seq), gen(gen), path(path), size(0), liveBytes(0) {
+        fd = open(path.c_str(), O_RDONLY);
+        assert(fd >= 0);
+        size = std::experimental::filesystem::file_size(path);
+        char header[LogFormat::kSegmentHeaderSize];
+        ssize_t n = pread(fd, header, sizeof(header), 0);
+        setFormat(LogFormat::detect(header, std::max<ssize_t>(n, 0)));
+    }
+
+    void setFormat(uint32_t version) {
+        format = version;
+        dataOffset = version == LogFormat::kLegacyVersion ? 0 : LogFormat::kSegmentHeaderSize;
+    }
+
+    ~LogSegment() {
+        close(fd);
+    }
+};
+
+/*
+ * Read-only mapping of a whole segment, used for recovery and compaction
+ */
+struct MappedSegment {
+    const char* data = nullptr;
+    uint64_t size;
+    uint32_t format;
+    uint64_t dataOffset;
+
+    MappedSegment(const LogSegment& segment)
+        : size(segment.size), format(segment.format), dataOffset(segment.dataOffset) {
+        if (size > 0) {
+            void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, segment.fd, 0);
+            assert(p != MAP_FAILED);
+            madvise(p, size, MADV_WILLNEED);
+            data = (const char*) p;
+        }
+    }
+
+    ~MappedSegment() {
+        if (data) {
+            munmap((void*) data, size);
+        }
+    }
+};
+
+struct RecoveryStats {
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    // keys that were deleted or had expired
+    uint64_t removedKeys = 0;
+    double seconds = 0;
+};
 
 class LogStorage {
+public:
+    typedef std::function<void(std::string& key, std::string& value,
+                               const value_location& loc)> RecordFn;
+
+    static uint64_t recordSize(size_t keySize, size_t valueSize, uint32_t flags = 0) {
+        return LogFormat::headerSize(flags) + keySize + valueSize;
+    }
+
+    // Layout of one record in a mapped segment
+    struct RecordInfo {
+        uint64_t keyOffset;
+        uint64_t keySize;
+        uint64_t valueOffset;
+        uint64_t valueSize;
+        uint64_t end;
+        uint32_t flags;
+        uint64_t expiresAt;
+        uint64_t version;
+    };
+
+    /*
+     * Parse the header of the record at offset, and with verify also check
+     * the record's checksum
+     * Returns false at the end of the segment or if the record is incomplete,
+     * garbage or fails its checksum
+     */
+    static bool parseRecord(const MappedSegment& m, uint64_t offset, RecordInfo& r,
+                            bool verify = false) {
+        if (m.format == LogFormat::kLegacyVersion) {
+            return parseLegacyRecord(m, offset, r);
+        }
+        if (offset >= m.size || m.size - offset < LogFormat::kRecordHeaderSize) {
+            return false;
+        }
+        const char* header = m.data + offset;
+        uint32_t keySize = LogFormat::getFixed32(header + 4);
+        uint32_t valueSize = LogFormat::getFixed32(header + 8);
+        uint32_t flags = LogFormat::getFixed32(header + 12);
+        if (LogFormat::getFixed32(header) == 0 && keySize == 0 && valueSize == 0 &&
+                flags == 0) {
+            // Never a record (its crc would not be 0): space reserved past the
+            // end of the log
+            return false;
+        }
+        uint64_t headerSize = LogFormat::headerSize(flags);
+        if (m.size - offset < headerSize) {
+            return false;
+        }
+        uint64_t remaining = m.size - offset - headerSize;
+        if (keySize > remaining || valueSize > remaining - keySize) {
+            return false;
+        }
+        r.keyOffset = offset + headerSize;
+        r.keySize = keySize;
+        r.valueOffset = r.keyOffset + keySize;
+        r.valueSize = valueSize;
+        r.end = r.valueOffset + valueSize;
+        r.flags = flags;
+        r.expiresAt = flags & LogFormat::kExpires ?
+                      LogFormat::getFixed64(header + LogFormat::kRecordHeaderSize) : 0;
+        r.version = flags & LogFormat::kVersioned ?
+                    LogFormat::getFixed64(header + headerSize - 8) : 0;
+        // header, key and value are contiguous
+        return !verify || Crc32c::value(header + 4, r.end - offset - 4) ==
+                          LogFormat::getFixed32(header);
+    }
+
+    // Whether m holds only zeros from offset on: space reserved for appends
+    static bool unwrittenFrom(const MappedSegment& m, uint64_t offset) {
+        for (uint64_t i = offset; i < m.size; i++) {
+            if (m.data[i] != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool parseLegacyRecord(const MappedSegment& m, uint64_t offset, RecordInfo& r) {
+        if (offset >= m.size || m.size - offset < 2*sizeof(size_t)) {
+            return false;
+        }
+        size_t keySize = 0;
+        size_t valueSize = 0;
+        memcpy(&keySize, m.data + offset, sizeof(size_t));
+        memcpy(&valueSize, m.data + offset + sizeof(size_t), sizeof(size_t));
+
+        uint64_t remaining = m.size - offset - 2*sizeof(size_t);
+        if (keySize > remaining || valueSize > remaining - keySize ||
+                valueSize > UINT32_MAX) {
+            return false;
+        }
+        r.keyOffset = offset + 2*sizeof(size_t);
+        r.keySize = keySize;
+        r.valueOffset = r.keyOffset + keySize;
+        r.valueSize = valueSize;
+        r.end = r.valueOffset + valueSize;
+        r.flags = 0;
+        r.expiresAt = 0;
+        r.version = 0;
+        return true;
+    }
+
 private:
-    // output stream for append-only log
-    std::shared_ptr<std::ofstream> outLog;
-    // input stream to read all contents of log at once on startup
-    std::shared_ptr<std::ifstream> inLog;
+    // appends to the active (last) segment of the append-only log
+    std::unique_ptr<LogAppender> outLog;
     std::experimental::filesystem::path logPath;
+    // size of the active segment, i.e. offset at which the next record is
+    // appended. The appender buffers and may reserve space past it, so the
+    // file size is not it
+    uint64_t writeOffset = 0;
+    // segments are rotated once they grow past this size
+    uint64_t segmentSize;
+
+    // all readable segments by id, guarded by segmentsMtx
+    std::shared_mutex segmentsMtx;
+    std::map<uint32_t, std::shared_ptr<LogSegment>> segments;
+    std::shared_ptr<LogSegment> active;
+    uint32_t nextId = 0;
+
+    // Held by background jobs (compaction, checkpoints) that must not see
+    // sealed segments change under them
+    std::mutex maintenanceMtx;
+    // cut seq of the newest checkpoint written or loaded, 0 without one
+    std::atomic<uint64_t> checkpointSeq{0};
+    // bytes appended by write() and rewritten by compaction since startup
+    std::atomic<uint64_t> appendedBytes{0};
+    std::atomic<uint64_t> rewrittenBytes{0};
+    // highest version written or recovered; only used by the writer
+    uint64_t lastVersion = 0;
+
+    // Range of complete records of one segment, replayed by one recovery task
+    struct RecoveryChunk {
+        size_t segment;
+        uint64_t begin;
+        uint64_t end;
+        uint64_t records;
+    };
+
+    std::string segmentPath(uint64_t seq, uint64_t gen = 0) {
+        std::ostringstream os;
+        os << logPath.string() << "." << std::setw(6) << std::setfill('0') << seq;
+        if (gen > 0) {
+            os << "." << gen;
+        }
+        return os.str();
+    }
+
+    std::shared_ptr<LogSegment> addSegment(uint64_t seq, uint64_t gen) {
+        std::unique_lock<std::shared_mutex> lk(segmentsMtx);
+        auto segment = std::make_shared<LogSegment>(nextId++, seq, gen,
+                                                    segmentPath(seq, gen));
+        segments[segment->id] = segment;
+        return segment;
+    }
 
 public:
-    LogStorage(const std::string& filePath) {
+    std::shared_ptr<LogSegment> findSegment(uint32_t id) {
+        std::shared_lock<std::shared_mutex> lk(segmentsMtx);
+        auto it = segments.find(id);
+        return it == segments.end() ? nullptr : it->second;
+    }
 
-        logPath = filePath;
-        outLog = std::shared_ptr<std::ofstream>(new std::ofstream (
-                    filePath,
-                    std::ofstream::out | std::ofstream::app | std::ofstream::binary));
-        inLog = std::shared_ptr<std::ifstream>(new std::ifstream (
-                    filePath, std::ifstream::in | std::ofstream::binary));
-        assert(outLog->good());
-        assert(inLog->good());
+    std::shared_ptr<LogSegment> findSegmentBySeq(uint64_t seq) {
+        std::shared_lock<std::shared_mutex> lk(segmentsMtx);
+        for (auto& s : segments) {
+            if (s.second->seq == seq) {
+                return s.second;
+            }
+        }
+        return nullptr;
+    }
+
+    std::vector<std::shared_ptr<LogSegment>> segmentsBySeq() {
+        std::vector<std::shared_ptr<LogSegment>> result;
+        {
+            std::shared_lock<std::shared_mutex> lk(segmentsMtx);
+            for (auto& s : segments) {
+                result.push_back(s.second);
+            }
+        }
+        std::sort(result.begin(), result.end(),
+                  [](const std::shared_ptr<LogSegment>& a,
+                     const std::shared_ptr<LogSegment>& b) {
+                      return a->seq < b->seq;
+                  });
+        return result;
+    }
+
+private:
+    // Create an empty segment file for seq
+    std::shared_ptr<LogSegment> createSegment(uint64_t seq) {
+        std::ofstream(segmentPath(seq), std::ofstream::out | std::ofstream::binary);
+        syncDir(logPath);
+        return addSegment(seq, 0);
+    }
+
+    // Start appending to segment, or to a new segment after it if segment is
+    // in an older format
+    void openActive(std::shared_ptr<LogSegment> segment) {
+        if (segment->format != LogFormat::kVersion && segment->size > 0) {
+            segment = createSegment(segment->seq + 1);
+        }
+        outLog->close();
+        bool opened = outLog->open(segment->path, segment->size);
+        assert(opened);
+        if (segment->size == 0) {
+            // Flushed right away so that the file can be mapped for recovery
+            char header[LogFormat::kSegmentHeaderSize];
+            LogFormat::encodeSegmentHeader(header);
+            outLog->append(header, sizeof(header));
+            outLog->flush();
+            segment->setFormat(LogFormat::kVersion);
+            segment->size = sizeof(header);
+        }
+        writeOffset = segment->size;
+        std::unique_lock<std::shared_mutex> lk(segmentsMtx);
+        active = segment;
     }
 
-    uint64_t write(const std::string& key, const std::string& value) {
+    // Seal the active segment and continue in a new one
+    bool rotate() {
+        if (!sync()) {
+            return false;
+        }
+        // Gives back the space reserved past the end of the sealed segment
+        outLog->close();
+        openActive(createSegment(active->seq + 1));
+        return true;
+    }
+
+public:
+    LogStorage(const std::string& filePath, uint64_t segmentSize = 64 << 20,
+               LogIo io = LogIo::kStream)
+        : outLog(makeLogAppender(io, segmentSize)), logPath(filePath),
+          segmentSize(segmentSize) {
+        namespace fs = std::experimental::filesystem;
 
-        // Write key size and value size
+        // A log written before segmentation becomes the first segment
+        if (fs::is_regular_file(logPath) && !fs::exists(segmentPath(0))) {
+            fs::rename(logPath, segmentPath(0));
+        }
+
+        // Find existing segments; drop leftovers of an interrupted compaction
+        // and generations that have been superseded by a compacted copy
+        std::string prefix = logPath.filename().string() + ".";
+        auto dir = logPath.parent_path().empty() ? fs::path(".") : logPath.parent_path();
+        std::map<uint64_t, uint64_t> gens;
+        for (auto& entry : fs::directory_iterator(dir)) {
+            std::string name = entry.path().filename().string();
+            if (name.compare(0, prefix.size(), prefix) != 0) {
+                continue;
+            }
+            std::string suffix = name.substr(prefix.size());
+            if (suffix.size() > 8 && suffix.compare(suffix.size() - 8, 8, ".compact") == 0) {
+                fs::remove(entry.path());
+                continue;
+            }
+            std::string seqStr = suffix.substr(0, suffix.find('.'));
+            std::string genStr = seqStr.size() < suffix.size() ?
+                                 suffix.substr(seqStr.size() + 1) : "0";
+            if (seqStr.empty() || genStr.empty() ||
+                    seqStr.find_first_not_of("0123456789") != std::string::npos ||
+                    genStr.find_first_not_of("0123456789") != std::string::npos) {
+                continue;
+            }
+            uint64_t seq = std::stoull(seqStr);
+            uint64_t gen = std::stoull(genStr);
+            auto it = gens.find(seq);
+            if (it == gens.end()) {
+                gens[seq] = gen;
+            } else {
+                fs::remove(segmentPath(seq, std::min(gen, it->second)));
+                it->second = std::max(gen, it->second);
+            }
+        }
+
+        if (gens.empty()) {
+            std::ofstream(segmentPath(1), std::ofstream::out | std::ofstream::binary);
+            gens[1] = 0;
+        }
+        std::shared_ptr<LogSegment> last;
+        for (auto& g : gens) {
+            last = addSegment(g.first, g.second);
+            if (last->format > LogFormat::kVersion) {
+                std::cerr << "Log segment " << last->path << " has format version "
+                          << last->format << ", this build reads up to "
+                          << LogFormat::kVersion << "\n";
+                exit(1);
+            }
+        }
+        openActive(last);
+    }
+
+    ~LogStorage() {
+        outLog->close();
+    }
+
+    /*
+     * Append a record, rotating to a new segment if the active one is full
+     * (unless mayRotate is false, which keeps a group of records contiguous)
+     * loc is set to the location of the value; flags are RecordFlags,
+     * expiresAt is stored if they include kExpires and version if they
+     * include kVersioned
+     */
+    bool write(const std::string& key, const std::string& value,
+               value_location& loc, bool mayRotate = true, uint32_t flags = 0,
+               uint64_t expiresAt = 0, uint64_t version = 0) {
+
+        if (mayRotate && writeOffset >= segmentSize && !rotate()) {
+            return false;
+        }
+
+        // Write the header with the sizes and checksum
         size_t keySize = key.size();
         size_t valueSize = value.size();
-        
-        if (!(outLog->write((char *)(&keySize), sizeof(size_t)))) {
-            std::cerr << "Write key size failed!\n";
-            return -1;
+        char header[LogFormat::kMaxRecordHeaderSize];
+        uint64_t headerSize = LogFormat::headerSize(flags);
+
+        if (!LogFormat::encodeRecordHeader(header, key, value, flags, expiresAt, version)) {
+            std::cerr << "Record too large!\n";
+            return false;
         }
-        if (!(outLog->write((char *)(&valueSize), sizeof(size_t)))) {
-            std::cerr << "Write value size failed!\n";
-            return -1;
+        if (!outLog->append(header, headerSize)) {
+            std::cerr << "Write record header failed!\n";
+            return false;
         }
 
         // write key and get starting offset for value
-        if (!(outLog->write(key.data(), keySize))) {
+        if (!outLog->append(key.data(), keySize)) {
             std::cerr << "Write key failed!\n";
-            return -1;
+            return false;
         }
-        uint64_t offset = (uint64_t) outLog->tellp();
+        uint64_t offset = writeOffset + headerSize + keySize;
 
         // write value
-        if (!(outLog->write(value.data(), valueSize))) {
+        if (!outLog->append(value.data(), valueSize)) {
             std::cerr << "Write value failed!\n";
-            return -1;
+            return false;
         }
-        return offset;
+        appendedBytes += offset + valueSize - writeOffset;
+        writeOffset = offset + valueSize;
+        active->size = writeOffset;
+        loc = {active->id, offset, (uint32_t) valueSize, flags,
+               flags & LogFormat::kExpires ? expiresAt : 0,
+               flags & LogFormat::kVersioned ? version : 0};
+        lastVersion = std::max(lastVersion, loc.version);
+        return true;
     }
 
     /*
-     * Read all key-value pairs from disk
-     * Used to re-construct map in memory after crash
+     * Version for a new record of the writer: higher than that of any record
+     * written or recovered so far and not below the wall clock in
+     * microseconds, so that versions keep growing across restarts even for
+     * keys whose older records are gone (only in a checkpoint, or deleted
+     * and compacted away)
      */
-    void readAll(tbb::concurrent_hash_map<std::string, kv_pair>& kvStore) {
-        std::cout << "[readAll]" << std::endl;
+    uint64_t nextVersion() {
+        lastVersion = std::max(lastVersion + 1, wall_clock_us());
+        return lastVersion;
+    }
 
-        // Seek to beginning if not already there
-        inLog->seekg(0, inLog->beg);
+    // Let nextVersion() know of a version recovered from elsewhere
+    void noteVersion(uint64_t version) {
+        lastVersion = std::max(lastVersion, version);
+    }
 
-        // Marks offset until which the contents of log are consistent and not corrupt
-        uint64_t consistentOffset = 0;
-        bool corruptBytes = false;
+    /*
+     * Read the value stored at loc into value
+     * Only valid for records that have been flushed by sync()
+     * Returns false if the segment has since been compacted, in which case the
+     * caller should look up the new location
+     */
+    bool read(const value_location& loc, std::string& value) {
+        auto segment = findSegment(loc.segment);
+        if (!segment) {
+            return false;
+        }
+        value.resize(loc.length);
+        size_t done = 0;
+        while (done < loc.length) {
+            ssize_t n = pread(segment->fd, &value[done], loc.length - done,
+                              loc.offset + done);
+            if (n <= 0) {
+                std::cerr << "Read value at offset " << loc.offset
+                          << " failed!\n";
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    /*
+     * Flush buffered appends and force them to the device
+     * Returns false if either step fails
+     */
+    bool sync() {
+        return outLog->sync();
+    }
 
-        while (inLog->peek() != EOF) {
+    // How the active segment is written
+    LogIo io() const {
+        return outLog->io();
+    }
 
-            // Read key and value size
-            size_t keySize = 0;
-            size_t valueSize = 0;
+    /*
+     * Track how many bytes of a segment are referenced from the map
+     * The writer calls addLive for a new record and removeLive for the record
+     * it replaces; compaction uses this to find segments worth rewriting
+     */
+    void addLive(const value_location& loc, size_t keySize) {
+        auto segment = findSegment(loc.segment);
+        if (segment) {
+            segment->liveBytes += recordSize(keySize, loc.length, loc.flags);
+        }
+    }
+    void removeLive(const value_location& loc, size_t keySize) {
+        auto segment = findSegment(loc.segment);
+        if (segment) {
+            segment->liveBytes -= recordSize(keySize, loc.length, loc.flags);
+        }
+    }
 
-            if (!(inLog->read((char *)(&keySize), sizeof(size_t)))) {
-                // TODO: Currently this will occur on every startup
-                std::cerr << "Read key size failed!\n";
-                corruptBytes = true;
-                break;
+    // Delete sealed segments older than seq, once nothing needs them anymore
+    void dropSegmentsBefore(uint64_t seq) {
+        for (auto& segment : sealedSegments()) {
+            if (segment->seq < seq) {
+                dropSegment(segment, true);
             }
-            if (!(inLog->read((char *)(&valueSize), sizeof(size_t)))) {
-                std::cerr << "Read value size failed!\n";
-                corruptBytes = true;
-                break;
+        }
+    }
+
+    std::mutex& maintenanceMutex() {
+        return maintenanceMtx;
+    }
+
+    /*
+     * Note that a checkpoint holds the map as of the segments before seq
+     * Tombstones from seq on mask keys of that checkpoint, so compaction has
+     * to keep them until a checkpoint with a later cut replaces it
+     */
+    void setCheckpointSeq(uint64_t seq) {
+        checkpointSeq = seq;
+    }
+    uint64_t lastCheckpointSeq() const {
+        return checkpointSeq;
+    }
+
+    // Make a create, rename or remove of path durable
+    static void syncDir(const std::experimental::filesystem::path& path) {
+        auto dir = path.parent_path();
+        int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            fsync(fd);
+            close(fd);
+        }
+    }
+
+    // Path the segment names are derived from
+    std::string path() {
+        return logPath.string();
+    }
+
+    // Bytes appended to or rewritten in the log since startup
+    uint64_t bytesWritten() {
+        return appendedBytes + rewrittenBytes;
+    }
+
+    // All segments except the one being appended to, oldest first
+    std::vector<std::shared_ptr<LogSegment>> sealedSegments() {
+        auto result = segmentsBySeq();
+        std::shared_lock<std::shared_mutex> lk(segmentsMtx);
+        result.erase(std::remove(result.begin(), result.end(), active),
+                     result.end());
+        return result;
+    }
+
+    /*
+     * Seal the active segment so that every later record goes to a segment
+     * with a higher seq. Must be called from the thread that calls write().
+     * Returns the seq of the new active segment.
+     */
+    uint64_t sealActive() {
+        if (writeOffset > active->dataOffset) {
+            rotate();
+        }
+        return active->seq;
+    }
+
+    /*
+     * Install the compacted copy of a sealed segment at compactedPath as the
+     * next generation of its seq. Readers that still hold a location in the
+     * old segment keep reading the old file until dropSegment is called.
+     */
+    std::shared_ptr<LogSegment> replaceSegment(std::shared_ptr<LogSegment> old,
+                                               const std::string& compactedPath) {
+        std::experimental::filesystem::rename(compactedPath,
+                                              segmentPath(old->seq, old->gen + 1));
+        syncDir(logPath);
+        auto segment = addSegment(old->seq, old->gen + 1);
+        rewrittenBytes += segment->size;
+        return segment;
+    }
+
+    // Stop serving reads from segment, optionally deleting its file
+    void dropSegment(std::shared_ptr<LogSegment> segment, bool removeFile) {
+        {
+            std::unique_lock<std::shared_mutex> lk(segmentsMtx);
+            segments.erase(segment->id);
+        }
+        if (removeFile) {
+            std::experimental::filesystem::remove(segment->path);
+            syncDir(logPath);
+        }
+    }
+
+    /*
+     * Parse the records of one segment in order, calling fn for each one
+     * value is only filled in if loadValues is set
+     * Returns the offset up to which the segment holds complete records
+     */
+    static uint64_t scanSegment(const LogSegment& segment, bool loadValues,
+                                const RecordFn& fn) {
+        MappedSegment m(segment);
+
+        // Marks offset until which the contents of log are consistent and not corrupt
+        uint64_t consistentOffset = m.dataOffset;
+        RecordInfo r;
+        std::string key, value;
+
+        while (parseRecord(m, consistentOffset, r, true)) {
+            key.assign(m.data + r.keyOffset, r.keySize);
+            if (loadValues) {
+                value.assign(m.data + r.valueOffset, r.valueSize);
             }
+            consistentOffset = r.end;
+            fn(key, value, {segment.id, r.valueOffset, (uint32_t) r.valueSize, r.flags,
+                            r.expiresAt, r.version});
+        }
+        return consistentOffset;
+    }
+
+    /*
+     * Read all key-value pairs from disk
+     * Used to re-construct map in memory after crash
+     * If loadValues is false only the location of each value is indexed and
+     * the value bytes are skipped
+     *
+     * Segments are mapped into memory and a first pass hops over the record
+     * headers to find where the log ends and to cut it into chunks at record
+     * boundaries. The checksums of all chunks are then verified on all cores,
+     * and the log is cut at the first record that is incomplete or fails its
+     * checksum. Finally the chunks are parsed and inserted on all cores; when
+     * a key shows up more than once the record later in the log wins. Keys
+     * whose last record is a delete or has expired are removed at the end.
+     */
+    RecoveryStats readAll(tbb::concurrent_hash_map<std::string, kv_pair>& kvStore,
+                          bool loadValues = true, uint64_t fromSeq = 0,
+                          uint64_t chunkSize = 4 << 20) {
+        auto startTime = std::chrono::steady_clock::now();
+        RecoveryStats stats;
 
-            // std::cout << "key size: " << keySize
-            //           << ", value size: " << valueSize << std::endl;
+        // Segments before fromSeq are covered by a checkpoint already loaded
+        // into kvStore
+        auto bySeq = segmentsBySeq();
+        bySeq.erase(std::remove_if(bySeq.begin(), bySeq.end(),
+                                   [fromSeq](const std::shared_ptr<LogSegment>& s) {
+                                       return s->seq < fromSeq;
+                                   }),
+                    bySeq.end());
+        std::vector<std::unique_ptr<MappedSegment>> maps;
+        std::vector<RecoveryChunk> chunks;
+        // Where the log has to be cut, if anywhere
+        size_t cutSegment = bySeq.size();
+        uint64_t cutOffset = 0;
 
-            // Now read key and value
-            char *key = new char[keySize+1];
-            char *value = new char[valueSize+1];
+        for (size_t i = 0; i < bySeq.size(); i++) {
+            auto& segment = bySeq[i];
+            maps.emplace_back(new MappedSegment(*segment));
+            const MappedSegment& m = *maps.back();
 
-            if (!(inLog->read(key, keySize))) {
-                std::cerr << "Read key size failed!\n";
-                corruptBytes = true;
+            // A segment shorter than its header lost the header in a crash
+            bool tornHeader = m.size < m.dataOffset;
+            uint64_t offset = tornHeader ? 0 : m.dataOffset;
+            uint64_t chunkBegin = offset;
+            uint64_t records = 0;
+            RecordInfo r;
+            while (!tornHeader && parseRecord(m, offset, r)) {
+                offset = r.end;
+                records++;
+                if (offset - chunkBegin >= chunkSize) {
+                    chunks.push_back({i, chunkBegin, offset, records});
+                    chunkBegin = offset;
+                    records = 0;
+                }
+            }
+            if (offset > chunkBegin) {
+                chunks.push_back({i, chunkBegin, offset, records});
+            }
+            if (offset < segment->size) {
+                cutSegment = i;
+                cutOffset = offset;
                 break;
             }
-            key[keySize] = 0; // read does not add null character at the end
-            if (!(inLog->read(value, valueSize))) {
-                std::cerr << "Read key size failed!\n";
-                corruptBytes = true;
+        }
+
+        // Verify checksums before anything is inserted, so that recovery stops
+        // exactly at the first bad record
+        std::vector<uint64_t> badAt(chunks.size(), UINT64_MAX);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, chunks.size(), 1),
+                [&](const tbb::blocked_range<size_t>& range) {
+            RecordInfo r;
+            for (size_t c = range.begin(); c != range.end(); c++) {
+                const MappedSegment& m = *maps[chunks[c].segment];
+                for (uint64_t offset = chunks[c].begin; offset < chunks[c].end;
+                        offset = r.end) {
+                    if (!parseRecord(m, offset, r, true)) {
+                        badAt[c] = offset;
+                        break;
+                    }
+                }
+            }
+        });
+        for (size_t c = 0; c < chunks.size(); c++) {
+            if (badAt[c] != UINT64_MAX) {
+                cutSegment = chunks[c].segment;
+                cutOffset = badAt[c];
                 break;
             }
-            value[valueSize] = 0;
+        }
+
+        if (cutSegment < bySeq.size()) {
+            // Everything from the first corrupt record on is dropped
+            auto& segment = bySeq[cutSegment];
+            if (!unwrittenFrom(*maps[cutSegment], cutOffset)) {
+                std::cerr << "Truncating log segment " << segment->path
+                          << " to " << cutOffset << " bytes\n";
+            }
+            std::experimental::filesystem::resize_file(segment->path, cutOffset);
+            segment->size = cutOffset;
+            for (size_t j = cutSegment + 1; j < bySeq.size(); j++) {
+                std::cerr << "Removing log segment " << bySeq[j]->path << "\n";
+                dropSegment(bySeq[j], true);
+            }
+            bySeq.resize(cutSegment + 1);
+            while (!chunks.empty() && (chunks.back().segment > cutSegment ||
+                                       chunks.back().begin >= cutOffset)) {
+                chunks.pop_back();
+            }
+            if (!chunks.empty() && chunks.back().end > cutOffset) {
+                RecoveryChunk& last = chunks.back();
+                const MappedSegment& m = *maps[last.segment];
+                RecordInfo r;
+                last.records = 0;
+                for (uint64_t offset = last.begin; offset < cutOffset; offset = r.end) {
+                    parseRecord(m, offset, r);
+                    last.records++;
+                }
+                last.end = cutOffset;
+            }
+            openActive(segment);
+        }
+        for (auto& chunk : chunks) {
+            stats.records += chunk.records;
+            stats.bytes += chunk.end - chunk.begin;
+        }
+
+        // Segment ids are handed out in log order on startup, so comparing
+        // (id, offset) tells which of two records is newer. Entries loaded from
+        // a checkpoint without a segment are older than anything replayed.
+        kvStore.rehash(kvStore.size() + stats.records);
+        tbb::enumerable_thread_specific<std::vector<int64_t>> liveBytes(
+                std::vector<int64_t>(nextId, 0));
+        tbb::enumerable_thread_specific<uint64_t> maxVersions(0);
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, chunks.size(), 1),
+                [&](const tbb::blocked_range<size_t>& range) {
+            std::vector<int64_t>& live = liveBytes.local();
+            uint64_t& maxVersion = maxVersions.local();
+            // reused for every record so that lookups do not allocate
+            std::string key;
+            RecordInfo r = {};
 
-            consistentOffset += 2*sizeof(size_t) + keySize + valueSize;
+            for (size_t c = range.begin(); c != range.end(); c++) {
+                const RecoveryChunk& chunk = chunks[c];
+                const MappedSegment& m = *maps[chunk.segment];
+                uint32_t id = bySeq[chunk.segment]->id;
 
-            // std::cout << "key: " << key
-            //           << ", value: " << value << std::endl;
+                for (uint64_t offset = chunk.begin; offset < chunk.end; offset = r.end) {
+                    parseRecord(m, offset, r);
+                    key.assign(m.data + r.keyOffset, r.keySize);
+                    value_location loc = {id, r.valueOffset, (uint32_t) r.valueSize, r.flags,
+                                          r.expiresAt, r.version};
+                    // including records that are overwritten or deletes
+                    maxVersion = std::max(maxVersion, r.version);
 
-            // TODO: convert char * -> string each time
-            // Is there a way to use char * everywhere?
-            std::string keyStr = std::string(key);
-            tbb::concurrent_hash_map<std::string, kv_pair>::accessor a;
-            kvStore.insert(a, keyStr);
-            a->second = {keyStr, std::string(value)};
-            a.release();
+                    tbb::concurrent_hash_map<std::string, kv_pair>::accessor a;
+                    if (!kvStore.insert(a, key)) {
+                        const value_location& old = a->second.loc;
+                        if (old.segment != kNoSegment && (old.segment > id ||
+                                (old.segment == id && old.offset > loc.offset))) {
+                            continue; // already have a newer record
+                        }
+                        if (old.segment < live.size() && !(old.flags & LogFormat::kTombstone)) {
+                            live[old.segment] -= recordSize(r.keySize, old.length, old.flags);
+                        }
+                    }
+                    if (loadValues) {
+                        a->second.value.assign(m.data + r.valueOffset, r.valueSize);
+                    }
+                    a->second.loc = loc;
+                    // a tombstone is garbage as soon as nothing older is left
+                    if (!(r.flags & LogFormat::kTombstone)) {
+                        live[id] += recordSize(r.keySize, r.valueSize, r.flags);
+                    }
+                }
+            }
+        });
+
+        // Deleted and expired keys stay in the map until every record has
+        // been replayed, so that an older record cannot bring them back
+        tbb::enumerable_thread_specific<std::vector<std::string>> dead;
+        tbb::parallel_for(kvStore.range(),
+                [&](const tbb::concurrent_hash_map<std::string, kv_pair>::range_type& range) {
+            std::vector<int64_t>& live = liveBytes.local();
+            for (auto it = range.begin(); it != range.end(); it++) {
+                const value_location& loc = it->second.loc;
+                if (loc.flags & LogFormat::kTombstone) {
+                    dead.local().push_back(it->first);
+                } else if (expired(loc)) {
+                    if (loc.segment < live.size()) {
+                        live[loc.segment] -= recordSize(it->first.size(), loc.length, loc.flags);
+                    }
+                    dead.local().push_back(it->first);
+                }
+            }
+        });
+        for (auto& keys : dead) {
+            for (auto& key : keys) {
+                kvStore.erase(key);
+                stats.removedKeys++;
+            }
         }
 
-        if (corruptBytes) {
-            std::cerr << "Truncating log to " << consistentOffset << " bytes\n";
-            std::experimental::filesystem::resize_file(logPath, consistentOffset);
+        for (uint64_t maxVersion : maxVersions) {
+            noteVersion(maxVersion);
+        }
+        for (uint32_t id = 0; id < nextId; id++) {
+            auto segment = findSegment(id);
+            for (auto& live : liveBytes) {
+                if (segment) {
+                    segment->liveBytes += live[id];
+                }
+            }
         }
-        std::cout << "Read " << kvStore.size() << " kv pairs" << std::endl;
-    }
 
-    std::shared_ptr<std::ofstream> getOutStream() {
-        return outLog;
-    }
-    std::shared_ptr<std::ifstream> getInStream() {
-        return inLog;
+        stats.seconds = std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - startTime).count();
+        // One write, so that shards recovering in parallel do not interleave
+        std::ostringstream os;
+        os << "[readAll] " << path() << ": recovered " << stats.records << " records ("
+           << stats.bytes / 1e6 << " MB) from " << bySeq.size()
+           << " segments in " << stats.seconds * 1000 << " ms: "
+           << stats.bytes / 1e6 / stats.seconds << " MB/s, "
+           << stats.records / stats.seconds << " records/s\n"
+           << "Read " << kvStore.size() << " kv pairs";
+        if (stats.removedKeys > 0) {
+            os << ", dropped " << stats.removedKeys << " deleted or expired keys";
+        }
+        os << "\n";
+        std::cout << os.str() << std::flush;
+        return stats;
     }
 };
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "histogram.h"
+#include "tracing.h"
+#include "tbb/enumerable_thread_specific.h"
+
+/*
+ * Server-side latency histograms and counters
+ *
+ * Every thread records into its own shard, so recording is a clock read, an
+ * uncontended lock and a bucket increment, and recording threads never write
+ * to the same cache lines. snapshot() merges all shards; its lock only ever
+ * competes with the owner of one shard at a time.
+ *
+ * With a Tracer set, what a thread records while it serves a traced request
+ * (see TraceScope) also becomes a span of that request's trace.
+ */
+class ServerMetrics {
+public:
+    enum Histogram {
+        // RPCs, from arrival of the request until the handler returns (sync
+        // server) or the response has been sent (async server)
+        kGetRpc,
+        kSetRpc,
+        kGetPrefixRpc,
+        kScanRpc,
+        kMultiGetRpc,
+        kMultiSetRpc,
+        kStatsRpc,
+        kDeleteRpc,
+        // lifetime of Subscribe and Replicate streams
+        kSubscribeRpc,
+        kReplicateRpc,
+        kPromoteRpc,
+        kCompareAndSetRpc,
+        kIncrementRpc,
+        kAppendRpc,
+        kSetIfAbsentRpc,
+        kSetTraceSamplingRpc,
+        // lifetime of BulkLoad streams
+        kBulkLoadRpc,
+        // lookup of a key in the hash map, including the wait for its bucket lock
+        kMapLookup,
+        // wait of the log writer for the exclusive lock on a key it applies
+        kMapLockWait,
+        // value reads from the log (values on disk)
+        kLogRead,
+        // time a Set spends queued before the log writer picks up its batch
+        kCommitQueueWait,
+        // appending all records of a batch to the log
+        kLogAppend,
+        // syncing a batch to disk
+        kLogSync,
+        // applying a durable batch to the hash map
+        kApply,
+        kNumHistograms
+    };
+
+    enum Counter {
+        kLogAppendBytes,
+        kLogAppendRecords,
+        kGetMisses,
+        kRpcErrors,
+        // values stored compressed, with their size before and after
+        kCompressedValues,
+        kCompressInputBytes,
+        kCompressOutputBytes,
+        // values above the compression threshold that did not compress
+        kIncompressibleValues,
+        // keys dropped because their TTL ran out
+        kExpiredKeys,
+        // records a follower applied from its primary
+        kReplicatedRecords,
+        // snapshots a primary sent to followers
+        kReplicationSnapshots,
+        // RPCs a follower refused: writes, and reads while too stale
+        kRejectedWrites,
+        kStaleReads,
+        // CompareAndSets and SetIfAbsents whose condition did not hold
+        kFailedConditions,
+        // requests admission control turned away with RESOURCE_EXHAUSTED
+        kShedReads,
+        kShedWrites,
+        // pairs BulkLoad streams committed
+        kBulkLoadedPairs,
+        kNumCounters
+    };
+
+    struct Snapshot {
+        std::vector<LatencyHistogram> histograms;
+        std::vector<uint64_t> counters;
+    };
+
+    static const char* name(Histogram h) {
+        static const char* names[kNumHistograms] = {
+            "get_rpc", "set_rpc", "get_prefix_rpc", "scan_rpc", "multi_get_rpc",
+            "multi_set_rpc", "stats_rpc", "delete_rpc", "subscribe_rpc", "replicate_rpc",
+            "promote_rpc", "compare_and_set_rpc", "increment_rpc", "append_rpc",
+            "set_if_absent_rpc", "set_trace_sampling_rpc", "bulk_load_rpc", "map_lookup",
+            "map_lock_wait",
+            "log_read", "commit_queue_wait", "log_append", "log_sync", "apply",
+        };
+        return names[h];
+    }
+
+    static const char* name(Counter c) {
+        static const char* names[kNumCounters] = {
+            "log_append_bytes", "log_append_records", "get_misses", "rpc_errors",
+            "compressed_values", "compress_input_bytes", "compress_output_bytes",
+            "incompressible_values", "expired_keys", "replicated_records",
+            "replication_snapshots", "rejected_writes", "stale_reads", "failed_conditions",
+            "shed_reads", "shed_writes", "bulk_loaded_pairs",
+        };
+        return names[c];
+    }
+
+    // Monotonic time in ns, for the start of an interval passed to record()
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Record the time from start (a now() value) until now
+    void record(Histogram h, uint64_t start) {
+        record(h, start, tracer ? Tracer::current() : 0);
+    }
+
+    // Like record(), as a span of trace traceId unless it is 0
+    void record(Histogram h, uint64_t start, uint64_t traceId) {
+        uint64_t end = now();
+        {
+            Shard& shard = shards.local();
+            std::lock_guard<std::mutex> lk(shard.mtx);
+            shard.histograms[h].record(end - start);
+        }
+        if (traceId && tracer) {
+            tracer->record(name(h), traceId, start, end);
+        }
+    }
+
+    /*
+     * Only a span of trace traceId from start until now, for time that is
+     * recorded once but spent on behalf of several requests, like a batch
+     */
+    void trace(Histogram h, uint64_t traceId, uint64_t start, const char* argName = nullptr,
+               uint64_t arg = 0) {
+        if (traceId && tracer) {
+            tracer->record(name(h), traceId, start, now(), argName, arg);
+        }
+    }
+
+    // Set before recording starts; null turns tracing off
+    void setTracer(Tracer* t) {
+        tracer = t;
+    }
+
+    void add(Counter c, uint64_t n = 1) {
+        Shard& shard = shards.local();
+        std::lock_guard<std::mutex> lk(shard.mtx);
+        shard.counters[c] += n;
+    }
+
+    // Totals of all threads since startup
+    Snapshot snapshot() {
+        Snapshot result;
+        result.histograms.resize(kNumHistograms);
+        result.counters.assign(kNumCounters, 0);
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lk(shard.mtx);
+            for (int h = 0; h < kNumHistograms; h++) {
+                result.histograms[h].merge(shard.histograms[h]);
+            }
+            for (int c = 0; c < kNumCounters; c++) {
+                result.counters[c] += shard.counters[c];
+            }
+        }
+        return result;
+    }
+
+private:
+    struct Shard {
+        std::mutex mtx;
+        std::vector<LatencyHistogram> histograms;
+        std::vector<uint64_t> counters;
+
+        Shard() : histograms(kNumHistograms), counters(kNumCounters, 0) {}
+    };
+
+    tbb::enumerable_thread_specific<Shard, tbb::cache_aligned_allocator<Shard>,
+                                    tbb::ets_key_per_instance> shards;
+    Tracer* tracer = nullptr;
+};
+
+/*
+ * Records the lifetime of the timer into a histogram; a null metrics pointer
+ * disables it
+ */
+class ScopedTimer {
+private:
+    ServerMetrics* metrics;
+    ServerMetrics::Histogram histogram;
+    uint64_t start;
+
+public:
+    ScopedTimer(ServerMetrics* metrics, ServerMetrics::Histogram histogram)
+        : metrics(metrics), histogram(histogram),
+          start(metrics ? ServerMetrics::now() : 0) {}
+
+    ~ScopedTimer() {
+        if (metrics) {
+            metrics->record(histogram, start);
+        }
+    }
+};
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * Bounded in-process cache of values read from the store
+ *
+ * Entries are spread over kNumShards shards by key hash, each with its own
+ * lock and an equal share of the memory budget, and are evicted with CLOCK: a
+ * hit only sets the entry's reference bit, and the clock hand clears bits
+ * until it finds an entry that was not read since its last pass.
+ *
+ * Entries are kept coherent by the caller invalidating keys (its own writes
+ * and the server's invalidation stream) and optionally by a lease: with
+ * leaseMs > 0 an entry is dropped that long after it was read. A value may be
+ * read before a write and arrive after the write's invalidation, so a reader
+ * takes version(key) before its request and passes it to insert(), which
+ * drops the value if the key's shard saw an invalidation in between.
+ */
+class ReadCache {
+public:
+    static const size_t kNumShards = 64;
+    // bytes charged per entry on top of its key (twice) and value
+    static const size_t kEntryOverhead = 96;
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t inserts = 0;
+        // inserts dropped because the key was invalidated during the read
+        uint64_t raced = 0;
+        uint64_t evictions = 0;
+        uint64_t invalidations = 0;
+        // lookups that found an entry past its lease or TTL
+        uint64_t expirations = 0;
+        uint64_t entries = 0;
+        uint64_t bytes = 0;
+    };
+
+private:
+    struct Entry {
+        std::string key;
+        std::string value;
+        // steady clock ms after which the entry is stale, 0 for never
+        uint64_t expiresAt = 0;
+        bool used = false;
+        bool referenced = false;
+    };
+
+    struct Shard {
+        std::mutex mtx;
+        std::unordered_map<std::string, size_t> index;
+        // swept by the clock hand; unused slots are on freeSlots
+        std::vector<Entry> slots;
+        std::vector<size_t> freeSlots;
+        size_t hand = 0;
+        size_t bytes = 0;
+        // bumped by every invalidation in the shard
+        uint64_t generation = 0;
+    };
+
+    const size_t shardBudget;
+    const uint64_t leaseMs;
+    std::vector<Shard> shards;
+    std::atomic<bool> accepting{true};
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> inserts{0};
+    std::atomic<uint64_t> raced{0};
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> invalidations{0};
+    std::atomic<uint64_t> expirations{0};
+
+    static uint64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static size_t cost(const std::string& key, const std::string& value) {
+        return 2 * key.size() + value.size() + kEntryOverhead;
+    }
+
+    Shard& shardOf(const std::string& key) {
+        return shards[std::hash<std::string>()(key) % kNumShards];
+    }
+
+    // With the shard locked
+    void remove(Shard& shard, size_t slot) {
+        Entry& e = shard.slots[slot];
+        shard.bytes -= cost(e.key, e.value);
+        shard.index.erase(e.key);
+        std::string().swap(e.key);
+        std::string().swap(e.value);
+        e.used = false;
+        shard.freeSlots.push_back(slot);
+    }
+
+    // Evict until needed more bytes fit; with the shard locked
+    void evict(Shard& shard, size_t needed) {
+        while (shard.bytes + needed > shardBudget && !shard.index.empty()) {
+            size_t slot = shard.hand;
+            shard.hand = (shard.hand + 1) % shard.slots.size();
+            Entry& e = shard.slots[slot];
+            if (!e.used) {
+                continue;
+            }
+            if (e.referenced) {
+                e.referenced = false;
+                continue;
+            }
+            remove(shard, slot);
+            evictions++;
+        }
+    }
+
+public:
+    ReadCache(size_t budgetBytes, uint64_t leaseMs)
+        : shardBudget(budgetBytes / kNumShards), leaseMs(leaseMs), shards(kNumShards) {}
+
+    // Token for insert(), taken before the value is requested
+    uint64_t version(const std::string& key) {
+        Shard& shard = shardOf(key);
+        std::lock_guard<std::mutex> lk(shard.mtx);
+        return shard.generation;
+    }
+
+    bool lookup(const std::string& key, std::string& value) {
+        Shard& shard = shardOf(key);
+        std::lock_guard<std::mutex> lk(shard.mtx);
+        auto it = shard.index.find(key);
+        if (it == shard.index.end()) {
+            misses++;
+            return false;
+        }
+        Entry& e = shard.slots[it->second];
+        if (e.expiresAt != 0 && nowMs() >= e.expiresAt) {
+            remove(shard, it->second);
+            expirations++;
+            misses++;
+            return false;
+        }
+        e.referenced = true;
+        value = e.value;
+        hits++;
+        return true;
+    }
+
+    /*
+     * Cache value of key, read from the server after version(key) returned
+     * token; ttlMs > 0 is the value's remaining time to live on the server
+     */
+    void insert(const std::string& key, const std::string& value, uint64_t token,
+                uint64_t ttlMs = 0) {
+        size_t bytes = cost(key, value);
+        if (bytes > shardBudget) {
+            return;
+        }
+        uint64_t lifetime = leaseMs;
+        if (ttlMs > 0 && (lifetime == 0 || ttlMs < lifetime)) {
+            lifetime = ttlMs;
+        }
+        Shard& shard = shardOf(key);
+        std::lock_guard<std::mutex> lk(shard.mtx);
+        if (!accepting || shard.generation != token) {
+            raced++;
+            return;
+        }
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            remove(shard, it->second);
+        }
+        evict(shard, bytes);
+        size_t slot;
+        if (!shard.freeSlots.empty()) {
+            slot = shard.freeSlots.back();
+            shard.freeSlots.pop_back();
+        } else {
+            slot = shard.slots.size();
+            shard.slots.emplace_back();
+        }
+        Entry& e = shard.slots[slot];
+        e.key = key;
+        e.value = value;
+        e.expiresAt = lifetime > 0 ? nowMs() + lifetime : 0;
+        e.used = true;
+        e.referenced = false;
+        shard.index.emplace(key, slot);
+        shard.bytes += bytes;
+        inserts++;
+    }
+
+    void invalidate(const std::string& key) {
+        Shard& shard = shardOf(key);
+        std::lock_guard<std::mutex> lk(shard.mtx);
+        shard.generation++;
+        auto it = shard.index.find(key);
+        if (it != shard.index.end()) {
+            remove(shard, it->second);
+            invalidations++;
+        }
+    }
+
+    /*
+     * Drop every entry, e.g. when invalidations may have been missed
+     * With accept false, inserts are refused until the next clear(true).
+     */
+    void clear(bool accept = true) {
+        accepting = false;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lk(shard.mtx);
+            shard.generation++;
+            shard.index.clear();
+            std::vector<Entry>().swap(shard.slots);
+            shard.freeSlots.clear();
+            shard.hand = 0;
+            shard.bytes = 0;
+        }
+        accepting = accept;
+    }
+
+    Stats stats() {
+        Stats s;
+        s.hits = hits;
+        s.misses = misses;
+        s.inserts = inserts;
+        s.raced = raced;
+        s.evictions = evictions;
+        s.invalidations = invalidations;
+        s.expirations = expirations;
+        for (auto& shard : shards) {
+            std::lock_guard<std::mutex> lk(shard.mtx);
+            s.entries += shard.index.size();
+            s.bytes += shard.bytes;
+        }
+        return s;
+    }
+
+    void resetStats() {
+        hits = misses = inserts = raced = evictions = invalidations = expirations = 0;
+    }
+};
@@ -0,0 +1,149 @@
+#include <chrono>
+#include <cstdlib>
+#include <experimental/filesystem>
+#include <iostream>
+#include <string>
+#include <unistd.h> // getopt
+
+#include "logstorage.h"
+
+using namespace std;
+
+/*
+ * Measures how fast LogStorage::readAll rebuilds the map from a log
+ * Writes a log of num_records records over num_keys distinct keys (so that
+ * num_records - num_keys of them are overwritten versions) and then recovers
+ * it runs times, reporting MB/s and records/s.
+ */
+
+struct ConfigOptions {
+    uint64_t num_records = 1000000;
+    uint64_t num_keys = 0;
+    int key_size = 128;
+    int value_size = 512;
+    uint64_t segment_size_mb = 64;
+    int runs = 3;
+    int load_values = 1;
+    int reuse = 0;
+    string dir = "/tmp/recovery_bench";
+};
+
+void PrintUsage () {
+    cerr << "Usage: ./recovery_bench [-n num_records=1000000] [-u num_keys=num_records] "
+        << "[-k key_size=128] [-v val_size=512] [-s segment_size_mb=64] [-r runs=3] "
+        << "[-m load_values=1] [-d dir=/tmp/recovery_bench] [-x reuse_log=0]" << endl;
+}
+
+void GeneratePaddedStr(string& s, uint64_t i, int padding) {
+    string i_str = to_string(i);
+    s.clear();
+    if ((int) i_str.size() < padding) {
+        s.append(padding-i_str.size(), '0');
+    }
+    s.append(i_str.data(), i_str.size());
+}
+
+bool GetInputArgs(int argc, char **argv, ConfigOptions& options) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:u:k:v:s:r:m:d:x:")) != -1) {
+        switch (opt) {
+            case 'n':
+                options.num_records = atoll(optarg);
+                break;
+            case 'u':
+                options.num_keys = atoll(optarg);
+                break;
+            case 'k':
+                options.key_size = atoi(optarg);
+                break;
+            case 'v':
+                options.value_size = atoi(optarg);
+                break;
+            case 's':
+                options.segment_size_mb = atoll(optarg);
+                break;
+            case 'r':
+                options.runs = atoi(optarg);
+                break;
+            case 'm':
+                options.load_values = atoi(optarg);
+                break;
+            case 'd':
+                options.dir = string(optarg);
+                break;
+            case 'x':
+                options.reuse = atoi(optarg);
+                break;
+            default:
+                PrintUsage();
+                return false;
+        }
+    }
+    if (options.num_keys == 0 || options.num_keys > options.num_records) {
+        options.num_keys = options.num_records;
+    }
+    return options.num_records > 0 && options.runs > 0;
+}
+
+void WriteLog(const ConfigOptions& options, const string& logFile) {
+    LogStorage log(logFile, options.segment_size_mb << 20);
+    string key, value;
+    value_location loc;
+
+    auto start = chrono::steady_clock::now();
+    for (uint64_t i = 0; i < options.num_records; i++) {
+        GeneratePaddedStr(key, i % options.num_keys, options.key_size);
+        GeneratePaddedStr(value, i, options.value_size);
+        if (!log.write(key, value, loc)) {
+            cerr << "Write failed!" << endl;
+            exit(1);
+        }
+        if (i % 4096 == 4095) {
+            log.sync();
+        }
+    }
+    log.sync();
+    auto secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Wrote " << options.num_records << " records in " << secs << " s" << endl;
+}
+
+int main (int argc, char **argv)
+{
+    ConfigOptions options;
+    if (!GetInputArgs(argc, argv, options)) {
+        PrintUsage();
+        return 1;
+    }
+
+    namespace fs = std::experimental::filesystem;
+    string logFile = options.dir + "/log";
+    if (!options.reuse) {
+        fs::remove_all(options.dir);
+    }
+    fs::create_directories(options.dir);
+    if (!options.reuse || !fs::exists(logFile + ".000001")) {
+        WriteLog(options, logFile);
+    }
+
+    double best_mbps = 0, best_rps = 0, total_secs = 0;
+    for (int run = 0; run < options.runs; run++) {
+        tbb::concurrent_hash_map<std::string, kv_pair> kv_store;
+        LogStorage log(logFile, options.segment_size_mb << 20);
+        RecoveryStats stats = log.readAll(kv_store, options.load_values);
+        if (kv_store.size() != options.num_keys) {
+            cerr << "Expected " << options.num_keys << " keys, got "
+                 << kv_store.size() << endl;
+            return 1;
+        }
+        best_mbps = max(best_mbps, stats.bytes / 1e6 / stats.seconds);
+        best_rps = max(best_rps, stats.records / stats.seconds);
+        total_secs += stats.seconds;
+    }
+
+    cout << "Recovery (" << (options.load_values ? "values in memory" : "index only")
+         << "), " << options.runs << " runs:" << endl;
+    cout << "Average time: " << total_secs / options.runs * 1000 << " ms" << endl;
+    cout << "Best throughput: " << best_mbps << " MB/s, "
+         << best_rps << " records/s" << endl;
+    return 0;
+}
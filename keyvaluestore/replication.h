@@ -0,0 +1,171 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+/*
+ * Recent writes of a primary, for followers that replicate it
+ *
+ * The log writers publish every record they apply, after it is durable, and
+ * each record gets the next log sequence number (LSN). Records are kept in
+ * memory up to a byte budget; a follower streams them from the LSN it has
+ * applied and must start over from a snapshot once the records it needs have
+ * been dropped. LSNs start over with every process, so they are qualified by
+ * a random id of the feed.
+ */
+class ReplicationFeed {
+public:
+    struct Entry {
+        uint64_t lsn;
+        std::string key;
+        // as stored in the log: possibly compressed, empty for a delete
+        std::string value;
+        // LogFormat::RecordFlags
+        uint32_t flags;
+        uint64_t expiresAt;
+        uint64_t version;
+    };
+
+    // bytes charged per entry on top of its key and value
+    static const size_t kEntryOverhead = 64;
+
+    // Wakes up a reader once records are published after it found none
+    class Waiter {
+    private:
+        friend class ReplicationFeed;
+        std::function<void()> notify;
+        bool armed = false;
+    };
+
+private:
+    const uint64_t feedId;
+    const size_t budgetBytes;
+
+    std::mutex mtx;
+    std::condition_variable published;
+    std::deque<Entry> entries;
+    size_t bytes = 0;
+    // LSN of the last record published; entries hold the ones after firstLsn
+    uint64_t lastLsn = 0;
+    uint64_t firstLsn = 0;
+    std::vector<std::shared_ptr<Waiter>> waiters;
+
+    static uint64_t randomId() {
+        std::random_device rd;
+        return (uint64_t) rd() << 32 | rd();
+    }
+
+    static size_t cost(const Entry& e) {
+        return e.key.size() + e.value.size() + kEntryOverhead;
+    }
+
+public:
+    ReplicationFeed(size_t budgetBytes) : feedId(randomId()), budgetBytes(budgetBytes) {}
+
+    uint64_t id() const {
+        return feedId;
+    }
+
+    // Called by the log writers, in log order for every key
+    void publish(const std::string& key, const std::string& value, uint32_t flags,
+                 uint64_t expiresAt, uint64_t version) {
+        std::lock_guard<std::mutex> lk(mtx);
+        entries.push_back({++lastLsn, key, value, flags, expiresAt, version});
+        bytes += cost(entries.back());
+        while (bytes > budgetBytes && entries.size() > 1) {
+            bytes -= cost(entries.front());
+            firstLsn = entries.front().lsn;
+            entries.pop_front();
+        }
+        for (auto& waiter : waiters) {
+            if (waiter->armed) {
+                waiter->armed = false;
+                waiter->notify();
+            }
+        }
+        published.notify_all();
+    }
+
+    uint64_t lsn() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return lastLsn;
+    }
+
+    /*
+     * Copy the records after LSN after into out, up to maxBytes (at least one)
+     * Returns false if some of them have been dropped already.
+     */
+    bool read(uint64_t after, size_t maxBytes, std::vector<Entry>& out) {
+        out.clear();
+        std::lock_guard<std::mutex> lk(mtx);
+        if (after < firstLsn || after > lastLsn) {
+            return false;
+        }
+        size_t n = 0;
+        for (auto it = entries.begin() + (after - firstLsn);
+             it != entries.end() && (out.empty() || n < maxBytes); it++) {
+            out.push_back(*it);
+            n += cost(*it);
+        }
+        return true;
+    }
+
+    // Wait up to timeout for records after LSN after; true if there are some
+    bool wait(uint64_t after, std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lk(mtx);
+        return published.wait_for(lk, timeout, [this, after] { return lastLsn > after; });
+    }
+
+    // A waiter whose notify is called on the publishing thread
+    std::shared_ptr<Waiter> watch(std::function<void()> notify) {
+        auto waiter = std::make_shared<Waiter>();
+        waiter->notify = notify;
+        std::lock_guard<std::mutex> lk(mtx);
+        waiters.push_back(waiter);
+        return waiter;
+    }
+
+    void unwatch(const std::shared_ptr<Waiter>& waiter) {
+        std::lock_guard<std::mutex> lk(mtx);
+        waiters.erase(std::remove(waiters.begin(), waiters.end(), waiter), waiters.end());
+    }
+
+    /*
+     * Have the next publish notify waiter, unless there are records after
+     * LSN after already (then returns false). Once disarm() returns, notify
+     * is not running and will not be called.
+     */
+    bool arm(const std::shared_ptr<Waiter>& waiter, uint64_t after) {
+        std::lock_guard<std::mutex> lk(mtx);
+        if (lastLsn > after) {
+            return false;
+        }
+        waiter->armed = true;
+        return true;
+    }
+
+    void disarm(const std::shared_ptr<Waiter>& waiter) {
+        std::lock_guard<std::mutex> lk(mtx);
+        waiter->armed = false;
+    }
+
+    size_t followers() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return waiters.size();
+    }
+
+    size_t bufferedBytes() {
+        std::lock_guard<std::mutex> lk(mtx);
+        return bytes;
+    }
+};
@@ -0,0 +1,669 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <experimental/filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h> // getopt
+#include <utility>
+#include <vector>
+
+#include "checkpoint.h"
+#include "compactor.h"
+#include "groupcommit.h"
+#include "histogram.h"
+#include "keyindex.h"
+#include "logstorage.h"
+#include "workload.h"
+
+using namespace std;
+
+/*
+ * Benchmarks the storage engine in-process, without gRPC or a server
+ * write:   threads Set keys through GroupCommitLog, i.e. LogStorage::write
+ *          with one sync per batch, applying them to the map like the server
+ * recover: LogStorage::readAll of the written log into an empty map
+ * map:     threads run a mix of Gets and Sets on the recovered map, the way
+ *          find_value_in_map and set_value_in_map of kvserver do (-m 0 reads
+ *          the values from the log)
+ * checkpoint: Checkpointer writes a checkpoint of the recovered map. Then
+ *          every tenth key is deleted, the segment of the deletes compacted
+ *          and the store recovered again, which must not bring them back.
+ * Reports ops/s, MB/s and ns/op percentiles per phase, best of runs. -j saves
+ * the numbers, and -c compares them against those of an earlier run: a
+ * throughput that dropped or a latency that rose by more than the tolerance
+ * makes the benchmark exit with 2, so a storage change can be checked with
+ * ./storage_bench -j before.json on the old tree and
+ * ./storage_bench -c before.json on the new one.
+ */
+
+typedef tbb::concurrent_hash_map<std::string, kv_pair> hashtable;
+
+struct ConfigOptions {
+    // per phase, over all threads
+    uint64_t num_ops = 200000;
+    uint64_t num_keys = 100000;
+    int key_size = 128;
+    int value_size = 512;
+    int threads = 4;
+    // of the map phase
+    int percent_writes = 5;
+    // 0 picks keys uniformly
+    double zipf_theta = 0;
+    int values_in_memory = 1;
+    size_t max_batch = 128;
+    LogIo log_io = LogIo::kStream;
+    uint64_t segment_size_mb = 64;
+    int runs = 3;
+    vector<string> phases = {"write", "recover", "map", "checkpoint"};
+    string dir = "/tmp/storage_bench";
+    string output_file;
+    string baseline_file;
+    double tolerance_pct = 10;
+};
+
+void PrintUsage () {
+    cerr << "Usage: ./storage_bench [-n num_ops=200000] [-u num_keys=100000] [-k key_size=128] "
+        << "[-v val_size=512] [-t threads=4] [-w %_writes=5] [-z zipf_theta=0] "
+        << "[-m values_in_memory=1] [-b max_batch=128] [-o log_io=stream] "
+        << "[-s segment_size_mb=64] [-r runs=3] [-p phases=write,recover,map,checkpoint] "
+        << "[-d dir=/tmp/storage_bench] [-j json_output_file] [-c baseline_json_file] "
+        << "[-x tolerance_pct=10]" << endl;
+}
+
+void GeneratePaddedStr(string& s, uint64_t i, int padding) {
+    string i_str = to_string(i);
+    s.clear();
+    if ((int) i_str.size() < padding) {
+        s.append(padding-i_str.size(), '0');
+    }
+    s.append(i_str.data(), i_str.size());
+}
+
+bool GetInputArgs(int argc, char **argv, ConfigOptions& options) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:u:k:v:t:w:z:m:b:o:s:r:p:d:j:c:x:")) != -1) {
+        switch (opt) {
+            case 'n':
+                options.num_ops = atoll(optarg);
+                break;
+            case 'u':
+                options.num_keys = atoll(optarg);
+                break;
+            case 'k':
+                options.key_size = atoi(optarg);
+                break;
+            case 'v':
+                options.value_size = atoi(optarg);
+                break;
+            case 't':
+                options.threads = atoi(optarg);
+                break;
+            case 'w':
+                options.percent_writes = atoi(optarg);
+                break;
+            case 'z':
+                options.zipf_theta = atof(optarg);
+                break;
+            case 'm':
+                options.values_in_memory = atoi(optarg);
+                break;
+            case 'b':
+                options.max_batch = atol(optarg);
+                break;
+            case 'o':
+                if (!parseLogIo(optarg, options.log_io)) {
+                    return false;
+                }
+                break;
+            case 's':
+                options.segment_size_mb = atoll(optarg);
+                break;
+            case 'r':
+                options.runs = atoi(optarg);
+                break;
+            case 'p': {
+                options.phases.clear();
+                stringstream phases(optarg);
+                string phase;
+                while (getline(phases, phase, ',')) {
+                    if (phase != "write" && phase != "recover" && phase != "map" &&
+                            phase != "checkpoint") {
+                        return false;
+                    }
+                    options.phases.push_back(phase);
+                }
+                break;
+            }
+            case 'd':
+                options.dir = string(optarg);
+                break;
+            case 'j':
+                options.output_file = string(optarg);
+                break;
+            case 'c':
+                options.baseline_file = string(optarg);
+                break;
+            case 'x':
+                options.tolerance_pct = atof(optarg);
+                break;
+            default:
+                return false;
+        }
+    }
+    return options.num_ops > 0 && options.num_keys > 0 && options.threads > 0 &&
+           options.runs > 0 && options.segment_size_mb > 0 && !options.phases.empty() &&
+           options.percent_writes >= 0 && options.percent_writes <= 100 &&
+           options.zipf_theta >= 0 && options.zipf_theta < 1;
+}
+
+// Everything the numbers depend on; runs are only comparable if it matches
+string ConfigString(const ConfigOptions& options) {
+    stringstream ss;
+    ss << "n=" << options.num_ops << " u=" << options.num_keys
+       << " k=" << options.key_size << " v=" << options.value_size
+       << " t=" << options.threads << " w=" << options.percent_writes
+       << " z=" << options.zipf_theta << " m=" << options.values_in_memory
+       << " b=" << options.max_batch << " o=" << logIoName(options.log_io)
+       << " s=" << options.segment_size_mb;
+    return ss.str();
+}
+
+// The map of one shard of the server
+struct Store {
+    hashtable kv_store;
+    KeyIndex key_index;
+    unique_ptr<LogStorage> log;
+};
+
+// set_value_in_map of kvserver without metrics, invalidations and replication
+void SetInMap(Store& store, const string& key, const string& value,
+              const value_location& loc, bool in_memory) {
+    hashtable::accessor a;
+    if (loc.flags & LogFormat::kTombstone) {
+        if (store.kv_store.find(a, key)) {
+            store.log->removeLive(a->second.loc, key.size());
+            store.kv_store.erase(a);
+        }
+        return;
+    }
+    bool inserted = store.kv_store.insert(a, key);
+    if (!inserted) {
+        store.log->removeLive(a->second.loc, key.size());
+    }
+    if (in_memory) {
+        a->second.value = value;
+    }
+    a->second.loc = loc;
+    store.log->addLive(loc, key.size());
+    a.release();
+    if (inserted) {
+        store.key_index.insert(key);
+    }
+}
+
+// find_value_in_map of kvserver for uncompressed values
+bool GetFromMap(Store& store, const string& key, string& value, bool in_memory) {
+    hashtable::const_accessor a;
+    if (!store.kv_store.find(a, key) || expired(a->second.loc)) {
+        return false;
+    }
+    if (in_memory) {
+        value = a->second.value;
+        return true;
+    }
+    // Don't hold the bucket lock during the read
+    value_location loc = a->second.loc;
+    a.release();
+    return store.log->read(loc, value);
+}
+
+struct PhaseResult {
+    double seconds = 1e30;
+    uint64_t ops = 0;
+    double bytes = 0;
+    // ns per operation, by operation
+    vector<pair<string, LatencyHistogram>> latencies;
+};
+
+// Key of write op i: the first num_keys ops insert every key once
+uint64_t KeyFor(const ConfigOptions& options, uint64_t i) {
+    return i % options.num_keys;
+}
+
+PhaseResult WriteRun(const ConfigOptions& options, const string& logFile) {
+    namespace fs = std::experimental::filesystem;
+    fs::remove_all(options.dir);
+    fs::create_directories(options.dir);
+
+    Store store;
+    store.log.reset(new LogStorage(logFile, options.segment_size_mb << 20, options.log_io));
+    bool in_memory = options.values_in_memory;
+    GroupCommitLog writer(*store.log,
+                          [&store, in_memory](const string& key, const string& value,
+                                              const value_location& loc) {
+                              SetInMap(store, key, value, loc, in_memory);
+                          },
+                          options.max_batch, 0);
+
+    vector<LatencyHistogram> commits(options.threads);
+    vector<thread> threads;
+    auto start = chrono::steady_clock::now();
+    for (int t = 0; t < options.threads; t++) {
+        threads.emplace_back([&options, &writer, &commits, t] {
+            string key, value;
+            for (uint64_t i = t; i < options.num_ops; i += options.threads) {
+                GeneratePaddedStr(key, KeyFor(options, i), options.key_size);
+                GeneratePaddedStr(value, i, options.value_size);
+                GroupCommitLog::Record record = {&key, &value, 0, 0, 0};
+                auto opStart = chrono::steady_clock::now();
+                if (!writer.commit(record)) {
+                    cerr << "Commit failed!" << endl;
+                    exit(1);
+                }
+                commits[t].record(chrono::duration_cast<chrono::nanoseconds>(
+                        chrono::steady_clock::now() - opStart).count());
+            }
+        });
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+
+    PhaseResult result;
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    result.ops = options.num_ops;
+    result.bytes = (double) options.num_ops *
+                   LogStorage::recordSize(options.key_size, options.value_size);
+    result.latencies.emplace_back("commit", LatencyHistogram());
+    for (auto& h : commits) {
+        result.latencies.back().second.merge(h);
+    }
+    return result;
+}
+
+// Write every key once, for when the write phase is not run
+void Populate(const ConfigOptions& options, const string& logFile) {
+    namespace fs = std::experimental::filesystem;
+    fs::remove_all(options.dir);
+    fs::create_directories(options.dir);
+    LogStorage log(logFile, options.segment_size_mb << 20, options.log_io);
+    string key, value;
+    value_location loc;
+    for (uint64_t i = 0; i < options.num_keys; i++) {
+        GeneratePaddedStr(key, i, options.key_size);
+        GeneratePaddedStr(value, i, options.value_size);
+        if (!log.write(key, value, loc)) {
+            cerr << "Write failed!" << endl;
+            exit(1);
+        }
+    }
+    if (!log.sync()) {
+        cerr << "Sync failed!" << endl;
+        exit(1);
+    }
+}
+
+// Like recover_shard of kvserver: the newest checkpoint, if any, then the log
+unique_ptr<Store> Recover(const ConfigOptions& options, const string& logFile,
+                          RecoveryStats* stats = nullptr) {
+    unique_ptr<Store> store(new Store);
+    store->log.reset(new LogStorage(logFile, options.segment_size_mb << 20, options.log_io));
+    uint64_t replayFrom = Checkpointer::load(*store->log, store->kv_store,
+                                             !options.values_in_memory);
+    RecoveryStats s = store->log->readAll(store->kv_store, options.values_in_memory,
+                                          replayFrom);
+    if (stats) {
+        *stats = s;
+    }
+    for (hashtable::const_iterator it = store->kv_store.begin();
+            it != store->kv_store.end(); ++it) {
+        store->key_index.insert(it->first);
+    }
+    return store;
+}
+
+PhaseResult RecoverRun(const ConfigOptions& options, const string& logFile) {
+    RecoveryStats stats;
+    Recover(options, logFile, &stats);
+    PhaseResult result;
+    result.seconds = stats.seconds;
+    result.ops = stats.records;
+    result.bytes = stats.bytes;
+    return result;
+}
+
+PhaseResult MapRun(const ConfigOptions& options, Store& store,
+                   const vector<value_location>& locs) {
+    bool in_memory = options.values_in_memory;
+    uint64_t num_keys = min<uint64_t>(options.num_keys, options.num_ops);
+    unique_ptr<ZipfianGenerator> zipf;
+    if (options.zipf_theta > 0) {
+        zipf.reset(new ZipfianGenerator(num_keys, options.zipf_theta));
+    }
+
+    vector<LatencyHistogram> gets(options.threads), sets(options.threads);
+    vector<thread> threads;
+    auto start = chrono::steady_clock::now();
+    for (int t = 0; t < options.threads; t++) {
+        threads.emplace_back([&, t] {
+            mt19937_64 rng(t + 1);
+            string key, value;
+            for (uint64_t i = t; i < options.num_ops; i += options.threads) {
+                uint64_t k = zipf ? zipf->next(rng) :
+                             uniform_int_distribution<uint64_t>(0, num_keys - 1)(rng);
+                GeneratePaddedStr(key, k, options.key_size);
+                bool write = (int) uniform_int_distribution<int>(0, 99)(rng) <
+                             options.percent_writes;
+                if (write) {
+                    GeneratePaddedStr(value, i, options.value_size);
+                }
+                auto opStart = chrono::steady_clock::now();
+                if (write) {
+                    SetInMap(store, key, value, locs[k], in_memory);
+                } else if (!GetFromMap(store, key, value, in_memory)) {
+                    cerr << "Key " << key << " not found!" << endl;
+                    exit(1);
+                }
+                uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(
+                        chrono::steady_clock::now() - opStart).count();
+                (write ? sets : gets)[t].record(ns);
+            }
+        });
+    }
+    for (auto& th : threads) {
+        th.join();
+    }
+
+    PhaseResult result;
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    result.ops = options.num_ops;
+    result.bytes = (double) options.num_ops * (options.key_size + options.value_size);
+    result.latencies.emplace_back("get", LatencyHistogram());
+    result.latencies.emplace_back("set", LatencyHistogram());
+    for (int t = 0; t < options.threads; t++) {
+        result.latencies[0].second.merge(gets[t]);
+        result.latencies[1].second.merge(sets[t]);
+    }
+    return result;
+}
+
+// The writer and the checkpoints of a recovered store, without a background trigger
+struct CheckpointedStore {
+    unique_ptr<Store> store;
+    unique_ptr<GroupCommitLog> writer;
+    unique_ptr<Checkpointer> checkpointer;
+
+    CheckpointedStore(const ConfigOptions& options, const string& logFile)
+        : store(Recover(options, logFile)) {
+        Store* s = store.get();
+        bool in_memory = options.values_in_memory;
+        writer.reset(new GroupCommitLog(*s->log,
+                                        [s, in_memory](const string& key, const string& value,
+                                                       const value_location& loc) {
+                                            SetInMap(*s, key, value, loc, in_memory);
+                                        },
+                                        options.max_batch, 0));
+        checkpointer.reset(new Checkpointer(*s->log, *writer, s->kv_store, s->key_index,
+                                            !in_memory, numeric_limits<uint64_t>::max()));
+    }
+};
+
+PhaseResult CheckpointRun(const ConfigOptions& options, const string& logFile) {
+    CheckpointedStore cs(options, logFile);
+    auto start = chrono::steady_clock::now();
+    if (!cs.checkpointer->checkpoint()) {
+        cerr << "Checkpoint failed!" << endl;
+        exit(1);
+    }
+    PhaseResult result;
+    result.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    result.ops = cs.store->kv_store.size();
+    result.bytes = (double) result.ops * (options.key_size + options.value_size);
+    return result;
+}
+
+/*
+ * Delete every tenth key after a checkpoint, compact the segment that holds
+ * the tombstones and recover: the deleted keys must not come back from the
+ * checkpoint, and the others must all be there
+ */
+bool CheckDeletesAfterCheckpoint(const ConfigOptions& options, const string& logFile) {
+    uint64_t num_keys = min<uint64_t>(options.num_keys, options.num_ops);
+    string key;
+    const string empty;
+    {
+        CheckpointedStore cs(options, logFile);
+        Store* s = cs.store.get();
+        Compactor compactor(
+                *s->log,
+                [s](const string& key, const value_location& loc) {
+                    hashtable::const_accessor a;
+                    return s->kv_store.find(a, key) && a->second.loc.segment == loc.segment &&
+                           a->second.loc.offset == loc.offset;
+                },
+                [s](const string& key, const value_location& from, const value_location& to) {
+                    hashtable::accessor a;
+                    if (!s->kv_store.find(a, key) || a->second.loc.segment != from.segment ||
+                            a->second.loc.offset != from.offset) {
+                        return false;
+                    }
+                    a->second.loc = to;
+                    return true;
+                },
+                [s](const string& key) {
+                    hashtable::const_accessor a;
+                    return s->kv_store.find(a, key);
+                },
+                0.5, 0);
+        if (!cs.checkpointer->checkpoint()) {
+            cerr << "Checkpoint failed!" << endl;
+            return false;
+        }
+        for (uint64_t k = 0; k < num_keys; k += 10) {
+            GeneratePaddedStr(key, k, options.key_size);
+            if (!cs.writer->commit({&key, &empty, LogFormat::kTombstone, 0, 0})) {
+                cerr << "Commit failed!" << endl;
+                return false;
+            }
+        }
+        // The tombstones get a sealed segment of their own, after the cut
+        cs.writer->runExclusive([s] { s->log->sealActive(); });
+        while (compactor.compactOnce()) {
+        }
+    }
+
+    unique_ptr<Store> store = Recover(options, logFile);
+    for (uint64_t k = 0; k < num_keys; k++) {
+        GeneratePaddedStr(key, k, options.key_size);
+        hashtable::const_accessor a;
+        bool deleted = k % 10 == 0;
+        if (store->kv_store.find(a, key) == deleted) {
+            cerr << "Key " << key << (deleted ? " came back after its delete" : " was lost")
+                 << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Metrics in output order; names ending in _per_sec are better when higher
+typedef vector<pair<string, double>> Results;
+
+void Report(const string& phase, const PhaseResult& r, Results& results) {
+    cout << phase << ": " << (uint64_t) (r.ops / r.seconds) << " ops/s, "
+         << r.bytes / 1e6 / r.seconds << " MB/s, "
+         << r.seconds * 1e9 / r.ops << " ns/op" << endl;
+    results.emplace_back(phase + "_ops_per_sec", r.ops / r.seconds);
+    results.emplace_back(phase + "_mb_per_sec", r.bytes / 1e6 / r.seconds);
+    for (auto& l : r.latencies) {
+        const LatencyHistogram& h = l.second;
+        if (h.count() == 0) {
+            continue;
+        }
+        cout << "  " << l.first << " ns: count " << h.count()
+             << ", mean " << (uint64_t) h.mean()
+             << ", p50 " << h.percentile(0.5)
+             << ", p99 " << h.percentile(0.99)
+             << ", p999 " << h.percentile(0.999)
+             << ", max " << h.max() << endl;
+        string prefix = phase + "_" + l.first;
+        results.emplace_back(prefix + "_p50_ns", h.percentile(0.5));
+        results.emplace_back(prefix + "_p99_ns", h.percentile(0.99));
+        results.emplace_back(prefix + "_p999_ns", h.percentile(0.999));
+    }
+}
+
+template <class RunFn>
+void RunPhase(const ConfigOptions& options, const string& phase, RunFn run,
+              Results& results) {
+    PhaseResult best;
+    for (int i = 0; i < options.runs; i++) {
+        PhaseResult r = run();
+        if (r.seconds < best.seconds) {
+            best = std::move(r);
+        }
+    }
+    Report(phase, best, results);
+}
+
+void WriteResults(const string& path, const string& config, const Results& results) {
+    ofstream out(path);
+    out.precision(12);
+    out << "{" << endl;
+    out << "  \"config\": \"" << config << "\"";
+    for (auto& r : results) {
+        out << "," << endl << "  \"" << r.first << "\": " << r.second;
+    }
+    out << endl << "}" << endl;
+}
+
+// Reads back what WriteResults wrote
+bool ReadResults(const string& path, string& config, map<string, double>& results) {
+    ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    string line;
+    while (getline(in, line)) {
+        size_t nameBegin = line.find('"');
+        size_t nameEnd = line.find('"', nameBegin + 1);
+        size_t colon = line.find(':', nameEnd);
+        if (nameBegin == string::npos || nameEnd == string::npos || colon == string::npos) {
+            continue;
+        }
+        string name = line.substr(nameBegin + 1, nameEnd - nameBegin - 1);
+        string value = line.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(' '));
+        if (name == "config") {
+            config = value.substr(1, value.rfind('"') - 1);
+        } else {
+            results[name] = atof(value.c_str());
+        }
+    }
+    return true;
+}
+
+/*
+ * Print how every metric moved against the baseline
+ * Returns false if one got worse by more than tolerance_pct
+ */
+bool Compare(const ConfigOptions& options, const string& config, const Results& results) {
+    string baseConfig;
+    map<string, double> base;
+    if (!ReadResults(options.baseline_file, baseConfig, base)) {
+        cerr << "Cannot read " << options.baseline_file << endl;
+        exit(1);
+    }
+    if (baseConfig != config) {
+        cout << "Warning: baseline ran with \"" << baseConfig << "\", this run with \""
+             << config << "\"" << endl;
+    }
+    cout << "Against " << options.baseline_file << " (tolerance "
+         << options.tolerance_pct << "%):" << endl;
+    cout << "metric\tbefore\tafter\tchange %" << endl;
+    bool ok = true;
+    for (auto& r : results) {
+        auto it = base.find(r.first);
+        if (it == base.end() || it->second == 0) {
+            continue;
+        }
+        double change = (r.second - it->second) / it->second * 100;
+        bool higherIsBetter = r.first.size() > 8 &&
+                              r.first.compare(r.first.size() - 8, 8, "_per_sec") == 0;
+        bool worse = higherIsBetter ? change < -options.tolerance_pct :
+                                      change > options.tolerance_pct;
+        cout << r.first << "\t" << it->second << "\t" << r.second << "\t"
+             << (change >= 0 ? "+" : "") << change << (worse ? "\tREGRESSION" : "") << endl;
+        ok = ok && !worse;
+    }
+    return ok;
+}
+
+int main (int argc, char **argv)
+{
+    ConfigOptions options;
+    if (!GetInputArgs(argc, argv, options)) {
+        PrintUsage();
+        return 1;
+    }
+
+    namespace fs = std::experimental::filesystem;
+    string logFile = options.dir + "/log";
+    auto runs = [&options](const string& phase) {
+        return find(options.phases.begin(), options.phases.end(), phase) !=
+               options.phases.end();
+    };
+    string config = ConfigString(options);
+    cout << "Storage benchmark (" << config << "), best of " << options.runs
+         << " runs:" << endl;
+
+    Results results;
+    if (runs("write")) {
+        RunPhase(options, "write", [&] { return WriteRun(options, logFile); }, results);
+    } else {
+        Populate(options, logFile);
+    }
+    if (runs("recover")) {
+        RunPhase(options, "recover", [&] { return RecoverRun(options, logFile); }, results);
+    }
+    if (runs("map")) {
+        unique_ptr<Store> store = Recover(options, logFile);
+        uint64_t num_keys = min<uint64_t>(options.num_keys, options.num_ops);
+        vector<value_location> locs(num_keys);
+        string key;
+        for (uint64_t k = 0; k < num_keys; k++) {
+            GeneratePaddedStr(key, k, options.key_size);
+            hashtable::const_accessor a;
+            if (!store->kv_store.find(a, key)) {
+                cerr << "Key " << key << " not recovered!" << endl;
+                return 1;
+            }
+            locs[k] = a->second.loc;
+        }
+        RunPhase(options, "map", [&] { return MapRun(options, *store, locs); }, results);
+    }
+    if (runs("checkpoint")) {
+        RunPhase(options, "checkpoint", [&] { return CheckpointRun(options, logFile); },
+                 results);
+        if (!CheckDeletesAfterCheckpoint(options, logFile)) {
+            return 1;
+        }
+    }
+    fs::remove_all(options.dir);
+
+    if (!options.output_file.empty()) {
+        WriteResults(options.output_file, config, results);
+    }
+    if (!options.baseline_file.empty() && !Compare(options, config, results)) {
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "keyindex.h"
+
+/*
+ * Background sweep of deleted and expired keys
+ *
+ * Deletes take a key out of the map right away and Gets drop keys that they
+ * find expired, but keys that are never read again would stay around, and the
+ * key index cannot erase concurrently. The sweeper walks the key index in
+ * small steps, keysPerSecond spread over kStepsPerSecond steps, wrapping
+ * around at the end. Every step drops the values that have expired from the
+ * map and then erases the keys that are gone from the index, which stops
+ * inserts into the index for that step's erases only.
+ */
+class ExpirySweeper {
+public:
+    // Drop key from the map if its value has expired; true if the key is not
+    // in the map (anymore)
+    typedef std::function<bool(const std::string& key)> SweepFn;
+
+    static const int kStepsPerSecond = 10;
+
+private:
+    KeyIndex& index;
+    SweepFn sweep;
+    size_t keysPerStep;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping = false;
+    std::thread sweeperThread;
+
+    std::atomic<uint64_t> numPasses{0};
+    std::atomic<uint64_t> numRemoved{0};
+
+    void run() {
+        KeyIndex::Cursor cursor(index);
+        std::vector<std::string> gone;
+        std::string key;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lk(mtx);
+                cv.wait_for(lk, std::chrono::milliseconds(1000 / kStepsPerSecond),
+                            [this] { return stopping; });
+                if (stopping) {
+                    return;
+                }
+            }
+            gone.clear();
+            for (size_t i = 0; i < keysPerStep; i++) {
+                if (!cursor.next(key)) {
+                    numPasses++;
+                    cursor.seek(std::string());
+                    break;
+                }
+                if (sweep(key)) {
+                    gone.push_back(key);
+                }
+            }
+            numRemoved += index.eraseIf(gone, sweep);
+        }
+    }
+
+public:
+    ExpirySweeper(KeyIndex& index, SweepFn sweep, size_t keysPerSecond)
+        : index(index), sweep(sweep),
+          keysPerStep(std::max<size_t>(1, keysPerSecond / kStepsPerSecond)) {
+        sweeperThread = std::thread(&ExpirySweeper::run, this);
+    }
+
+    ~ExpirySweeper() {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            stopping = true;
+        }
+        cv.notify_one();
+        sweeperThread.join();
+    }
+
+    // Complete walks over the key index
+    uint64_t passes() const {
+        return numPasses;
+    }
+
+    // Keys erased from the index
+    uint64_t removed() const {
+        return numRemoved;
+    }
+};
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h> // getpid
+
+#include "tbb/enumerable_thread_specific.h"
+
+/*
+ * Sampled request tracing
+ *
+ * One in every sampleEvery() requests gets a trace id, and the spans recorded
+ * while it is served (see TraceScope) go into a ring of the recording thread:
+ * the owner only writes its slot and bumps the head, the flusher thread only
+ * copies out what is between tail and head and bumps the tail, so neither
+ * takes a lock. A full ring drops spans rather than waiting. Every flush
+ * appends the spans to a file in Chrome's trace event format, which
+ * chrome://tracing and ui.perfetto.dev load as is.
+ *
+ * Span times are ServerMetrics::now()-style steady clock ns and are written as
+ * wall clock µs, so the traces of a client and a server line up once the two
+ * files are put together (clients tag the requests they trace with
+ * kTraceIdHeader). The file is a JSON array that is never closed, which those
+ * viewers accept; a second trace can be appended to it without its "[" line.
+ */
+class Tracer {
+public:
+    // Metadata a client tags a traced request with: its trace id, and the
+    // wall clock µs at which it was sent
+    static constexpr const char* kTraceIdHeader = "kv-trace-id";
+    static constexpr const char* kSentAtHeader = "kv-trace-sent-us";
+
+    // Spans a thread can have recorded and not flushed yet
+    static const size_t kRingSize = 8192;
+
+    struct Span {
+        const char* name;
+        uint64_t traceId;
+        // steady clock ns
+        uint64_t start;
+        uint64_t end;
+        // optional argument, e.g. a batch size; left out without a name
+        const char* argName;
+        uint64_t arg;
+    };
+
+    // Trace of path, named processName in the viewer; sampleEvery 0 only
+    // traces requests that come with a trace id
+    Tracer(const std::string& path, const std::string& processName, uint32_t sampleEvery,
+           uint64_t flushIntervalMs = 500)
+        : out(path, std::ofstream::trunc), every(sampleEvery),
+          flushInterval(flushIntervalMs), pid(getpid()) {
+        std::random_device random;
+        nextId = ((uint64_t) random() << 32 | random()) & ~(uint64_t) 0xffffffff;
+        epochOffset = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count() - now();
+        out << "[" << std::endl
+            << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid
+            << ", \"args\": {\"name\": \"" << processName << "\"}}," << std::endl;
+        flusher = std::thread(&Tracer::run, this);
+    }
+
+    ~Tracer() {
+        {
+            std::lock_guard<std::mutex> lk(mtx);
+            stopping = true;
+        }
+        wake.notify_one();
+        flusher.join();
+        flush();
+    }
+
+    bool good() const {
+        return out.good();
+    }
+
+    uint32_t sampleEvery() const {
+        return every.load(std::memory_order_relaxed);
+    }
+
+    // Takes effect right away, on every thread
+    void setSampleEvery(uint32_t n) {
+        every.store(n, std::memory_order_relaxed);
+    }
+
+    // Trace id for a new request if it is sampled, 0 if it is not
+    uint64_t sample() {
+        uint32_t n = sampleEvery();
+        if (n == 0) {
+            return 0;
+        }
+        static thread_local uint32_t count = 0;
+        if (++count < n) {
+            return 0;
+        }
+        count = 0;
+        return newId();
+    }
+
+    uint64_t newId() {
+        return nextId.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    // The trace of the request the calling thread is serving, 0 for none
+    static uint64_t& current() {
+        static thread_local uint64_t traceId = 0;
+        return traceId;
+    }
+
+    // Steady clock ns, like ServerMetrics::now()
+    static uint64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // now() time of a wall clock time in µs, like the one of kSentAtHeader
+    uint64_t fromWallClockUs(uint64_t us) const {
+        return us * 1000 - epochOffset;
+    }
+
+    void record(const char* name, uint64_t traceId, uint64_t start, uint64_t end,
+                const char* argName = nullptr, uint64_t arg = 0) {
+        Ring& ring = rings.local();
+        if (ring.tid == 0) {
+            ring.tid = nextTid.fetch_add(1) + 1;
+        }
+        uint64_t head = ring.head.load(std::memory_order_relaxed);
+        if (head - ring.tail.load(std::memory_order_acquire) == kRingSize) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        ring.spans[head % kRingSize] = {name, traceId, start, end, argName, arg};
+        ring.head.store(head + 1, std::memory_order_release);
+    }
+
+    // Spans written to the file and spans dropped because a ring was full
+    uint64_t spans() const {
+        return written.load();
+    }
+
+    uint64_t droppedSpans() const {
+        return dropped.load();
+    }
+
+    // Write out the spans recorded so far
+    void flush() {
+        std::lock_guard<std::mutex> lk(flushMtx);
+        uint64_t n = 0;
+        for (auto& ring : rings) {
+            uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+            uint64_t head = ring.head.load(std::memory_order_acquire);
+            for (; tail < head; tail++, n++) {
+                write(ring.spans[tail % kRingSize], ring.tid);
+            }
+            ring.tail.store(tail, std::memory_order_release);
+        }
+        if (n > 0) {
+            out.flush();
+            written.fetch_add(n);
+            if (!out.good() && !failed) {
+                std::cerr << "Writing trace failed" << std::endl;
+                failed = true;
+            }
+        }
+    }
+
+private:
+    struct Ring {
+        // written by the owner thread only
+        std::atomic<uint64_t> head{0};
+        // written by the flusher only
+        std::atomic<uint64_t> tail{0};
+        uint32_t tid = 0;
+        std::unique_ptr<Span[]> spans{new Span[kRingSize]};
+    };
+
+    std::ofstream out;
+    std::atomic<uint32_t> every;
+    std::chrono::milliseconds flushInterval;
+    int pid;
+    // system clock ns - steady clock ns
+    uint64_t epochOffset;
+    std::atomic<uint64_t> nextId;
+    std::atomic<uint32_t> nextTid{0};
+    std::atomic<uint64_t> written{0};
+    std::atomic<uint64_t> dropped{0};
+    bool failed = false;
+
+    tbb::enumerable_thread_specific<Ring, tbb::cache_aligned_allocator<Ring>,
+                                    tbb::ets_key_per_instance> rings;
+    // serializes flushes: the flusher thread's and the final one
+    std::mutex flushMtx;
+
+    std::mutex mtx;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread flusher;
+
+    // One complete event ("X"), times in µs with ns precision
+    void write(const Span& span, uint32_t tid) {
+        uint64_t ts = span.start + epochOffset;
+        uint64_t dur = span.end > span.start ? span.end - span.start : 0;
+        char fraction[8];
+        out << "{\"name\": \"" << span.name << "\", \"ph\": \"X\", \"pid\": " << pid
+            << ", \"tid\": " << tid << ", \"ts\": " << ts / 1000;
+        snprintf(fraction, sizeof(fraction), ".%03u", (unsigned) (ts % 1000));
+        out << fraction << ", \"dur\": " << dur / 1000;
+        snprintf(fraction, sizeof(fraction), ".%03u", (unsigned) (dur % 1000));
+        // as a string, since JSON numbers lose precision above 2^53
+        out << fraction << ", \"args\": {\"trace_id\": \"" << std::hex << span.traceId
+            << std::dec << "\"";
+        if (span.argName) {
+            out << ", \"" << span.argName << "\": " << span.arg;
+        }
+        out << "}}," << '\n';
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lk(mtx);
+        while (!stopping) {
+            wake.wait_for(lk, flushInterval, [this] { return stopping; });
+            lk.unlock();
+            flush();
+            lk.lock();
+        }
+    }
+};
+
+/*
+ * Makes traceId the calling thread's current trace for the lifetime of the
+ * scope; a scope with trace id 0 leaves the thread untraced
+ */
+class TraceScope {
+private:
+    uint64_t previous;
+
+public:
+    explicit TraceScope(uint64_t traceId) : previous(Tracer::current()) {
+        Tracer::current() = traceId;
+    }
+
+    ~TraceScope() {
+        Tracer::current() = previous;
+    }
+};
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+ * YCSB-style workload generator for kvclient
+ *
+ * Operations are generated lazily, one at a time, from an operation mix and a
+ * key distribution, so nothing proportional to the number of keys or ops is
+ * kept in memory. Key i is the zero-padded decimal i; keys [0, numKeys) are
+ * loaded before the run and inserts append keys after them. Values are
+ * zero-padded too, with a tunable share of random characters in front.
+ */
+
+enum OpType : char {
+    kRead = 'r',
+    kUpdate = 'u',
+    kInsert = 'i',
+    kScan = 's',
+    kReadModifyWrite = 'm',
+};
+
+struct Operation {
+    OpType type;
+    uint64_t key;
+    // value size for writes, number of keys for scans
+    uint32_t size;
+};
+
+struct WorkloadOptions {
+    // operation mix, normalized by Workload
+    double read = 1;
+    double update = 0;
+    double insert = 0;
+    double scan = 0;
+    double readModifyWrite = 0;
+    // uniform, zipfian, latest or hotspot
+    std::string distribution = "uniform";
+    double zipfTheta = 0.99;
+    // hotspot: hotOps of the requests go to the first hotKeys of the keys
+    double hotKeys = 0.2;
+    double hotOps = 0.8;
+    uint64_t numKeys = 0;
+    int keySize = 128;
+    // value sizes are uniform in [minValueSize, maxValueSize]
+    int minValueSize = 512;
+    int maxValueSize = 512;
+    int maxScanLength = 100;
+    // share of each value that compresses well (zero padding); the rest is
+    // random characters
+    double compressibility = 1;
+
+    /*
+     * Apply one of the standard YCSB core workloads A-F
+     * Returns false for an unknown name
+     */
+    bool setPreset(char name) {
+        read = update = insert = scan = readModifyWrite = 0;
+        distribution = "zipfian";
+        switch (name) {
+            case 'a': // update heavy
+                read = 0.5;
+                update = 0.5;
+                break;
+            case 'b': // read mostly
+                read = 0.95;
+                update = 0.05;
+                break;
+            case 'c': // read only
+                read = 1;
+                break;
+            case 'd': // read latest
+                read = 0.95;
+                insert = 0.05;
+                distribution = "latest";
+                break;
+            case 'e': // short ranges
+                scan = 0.95;
+                insert = 0.05;
+                break;
+            case 'f': // read-modify-write
+                read = 0.5;
+                readModifyWrite = 0.5;
+                break;
+            default:
+                return false;
+        }
+        return true;
+    }
+};
+
+/*
+ * Zipfian ranks in [0, n) with P(rank) proportional to 1 / (rank+1)^theta,
+ * using the rejection-free method of Gray et al. as in YCSB
+ */
+class ZipfianGenerator {
+private:
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetaN;
+    double eta;
+    double zeta2;
+
+public:
+    ZipfianGenerator(uint64_t n, double theta) : n(std::max<uint64_t>(n, 1)), theta(theta) {
+        zeta2 = 1 + std::pow(0.5, theta);
+        zetaN = 0;
+        for (uint64_t i = 1; i <= this->n; i++) {
+            zetaN += 1 / std::pow((double) i, theta);
+        }
+        alpha = 1 / (1 - theta);
+        eta = (1 - std::pow(2.0 / this->n, 1 - theta)) / (1 - zeta2 / zetaN);
+    }
+
+    uint64_t next(std::mt19937_64& rng) {
+        double u = std::uniform_real_distribution<double>(0, 1)(rng);
+        double uz = u * zetaN;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < zeta2) {
+            return 1;
+        }
+        uint64_t rank = n * std::pow(eta * u - eta + 1, alpha);
+        return std::min(rank, n - 1);
+    }
+};
+
+class Workload {
+private:
+    WorkloadOptions options;
+    // cumulative operation mix
+    double readUpTo, updateUpTo, insertUpTo, scanUpTo;
+    ZipfianGenerator zipfian;
+    // keys handed out for insertion so far (loaded keys included)
+    std::atomic<uint64_t> numInserted;
+
+    // Inserts complete out of order; the latest distribution only picks keys
+    // below the oldest insert that is still in flight
+    static const uint64_t kAckWindow = 1 << 16;
+    std::vector<uint8_t> acked;
+    std::mutex ackMtx;
+    std::atomic<uint64_t> ackedUpTo;
+
+    static uint64_t fnvHash(uint64_t v) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (int i = 0; i < 8; i++) {
+            hash ^= v & 0xff;
+            hash *= 1099511628211ULL;
+            v >>= 8;
+        }
+        return hash;
+    }
+
+    static uint64_t splitmix64(uint64_t& state) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t uniform(std::mt19937_64& rng, uint64_t n) {
+        return std::uniform_int_distribution<uint64_t>(0, n - 1)(rng);
+    }
+
+    uint64_t nextKey(std::mt19937_64& rng) {
+        uint64_t n = std::max<uint64_t>(options.numKeys, 1);
+        if (options.distribution == "zipfian") {
+            // scatter the popular keys over the key space
+            return fnvHash(zipfian.next(rng)) % n;
+        }
+        if (options.distribution == "latest") {
+            uint64_t inserted = std::max<uint64_t>(ackedUpTo, 1);
+            return inserted - 1 - std::min(zipfian.next(rng), inserted - 1);
+        }
+        if (options.distribution == "hotspot") {
+            uint64_t hot = std::max<uint64_t>(1, n * options.hotKeys);
+            if (std::uniform_real_distribution<double>(0, 1)(rng) < options.hotOps ||
+                    hot == n) {
+                return uniform(rng, hot);
+            }
+            return hot + uniform(rng, n - hot);
+        }
+        return uniform(rng, n);
+    }
+
+public:
+    Workload(const WorkloadOptions& options)
+        : options(options),
+          zipfian(options.numKeys, options.zipfTheta),
+          numInserted(options.numKeys), acked(kAckWindow, 0),
+          ackedUpTo(options.numKeys) {
+        double total = options.read + options.update + options.insert
+                       + options.scan + options.readModifyWrite;
+        readUpTo = options.read / total;
+        updateUpTo = readUpTo + options.update / total;
+        insertUpTo = updateUpTo + options.insert / total;
+        scanUpTo = insertUpTo + options.scan / total;
+    }
+
+    // Next operation; safe to call from several threads with their own rng
+    Operation next(std::mt19937_64& rng) {
+        double p = std::uniform_real_distribution<double>(0, 1)(rng);
+        Operation op;
+        op.size = valueSize(rng);
+        if (p < readUpTo) {
+            op.type = kRead;
+        } else if (p < updateUpTo) {
+            op.type = kUpdate;
+        } else if (p < insertUpTo) {
+            op.type = kInsert;
+            op.key = numInserted++;
+            return op;
+        } else if (p < scanUpTo) {
+            op.type = kScan;
+            op.size = 1 + uniform(rng, options.maxScanLength);
+        } else {
+            op.type = kReadModifyWrite;
+        }
+        op.key = nextKey(rng);
+        return op;
+    }
+
+    // An insert handed out by next() has completed
+    void acknowledge(uint64_t key) {
+        std::lock_guard<std::mutex> lk(ackMtx);
+        acked[key % kAckWindow] = 1;
+        while (acked[ackedUpTo % kAckWindow]) {
+            acked[ackedUpTo % kAckWindow] = 0;
+            ackedUpTo++;
+        }
+    }
+
+    uint32_t valueSize(std::mt19937_64& rng) {
+        return std::uniform_int_distribution<int>(options.minValueSize,
+                                                  options.maxValueSize)(rng);
+    }
+
+    void key(uint64_t i, std::string& s) const {
+        paddedNumber(i, options.keySize, s);
+    }
+
+    // Value of size bytes for key i; the same for the same i and size
+    void value(uint64_t i, uint32_t size, std::string& s) const {
+        static const char kChars[] =
+            "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ-_";
+        uint32_t random = size * (1 - options.compressibility);
+        paddedNumber(i, size - random, s);
+        // 6 random bits per character; printable, so values stay valid UTF-8
+        // for the proto string field
+        s.insert(0, random, ' ');
+        uint64_t state = i, bits = 0;
+        for (uint32_t j = 0; j < random; j++) {
+            if (j % 10 == 0) {
+                bits = splitmix64(state);
+            }
+            s[j] = kChars[bits & 63];
+            bits >>= 6;
+        }
+    }
+
+    static void paddedNumber(uint64_t i, int padding, std::string& s) {
+        std::string i_str = std::to_string(i);
+        s.clear();
+        if ((int) i_str.size() < padding) {
+            s.append(padding - i_str.size(), '0');
+        }
+        s.append(i_str);
+    }
+};
+
+/*
+ * Operation trace: one "<op> <key> <size>" line per operation, e.g. "u 42 512"
+ * Writes from several threads are serialized; each replaying thread reads
+ * every threads-th line starting at its id.
+ */
+class TraceWriter {
+private:
+    std::ofstream out;
+    std::mutex mtx;
+
+public:
+    TraceWriter(const std::string& path) : out(path) {}
+
+    bool good() {
+        return out.good();
+    }
+
+    void write(const Operation& op) {
+        std::lock_guard<std::mutex> lk(mtx);
+        out << (char) op.type << " " << op.key << " " << op.size << "\n";
+    }
+};
+
+class TraceReader {
+private:
+    std::ifstream in;
+    int stride;
+    bool first = true;
+
+public:
+    TraceReader(const std::string& path, int threadId, int numThreads)
+        : in(path), stride(numThreads) {
+        std::string line;
+        for (int i = 0; i < threadId && std::getline(in, line); i++) {
+        }
+    }
+
+    bool good() {
+        return in.good();
+    }
+
+    bool next(Operation& op) {
+        std::string line;
+        if (!first) {
+            for (int i = 0; i < stride - 1 && std::getline(in, line); i++) {
+            }
+        }
+        first = false;
+        char type;
+        if (!std::getline(in, line) ||
+                !(std::istringstream(line) >> type >> op.key >> op.size)) {
+            return false;
+        }
+        op.type = (OpType) type;
+        return true;
+    }
+};